@@ -0,0 +1,537 @@
+/*
+ * BlueALSA - a2dp-policy.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "a2dp-policy.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <glib.h>
+
+#include "a2dp-codecs.h"
+#include "ba-device.h"
+#include "bluealsa.h"
+#include "hfp.h"
+#include "utils.h"
+#include "shared/defs.h"
+#include "shared/log.h"
+
+/* BT socket output buffer fill (in percent) above which the controller is
+ * considered to be saturated */
+#define A2DP_POLICY_PRESSURE_SATURATED 80
+
+/**
+ * Approximate cost of the codec with the stereo 48 kHz stream.
+ *
+ * The CPU usage is given in per-mille of a single core of a low-end ARM
+ * board (e.g. Raspberry Pi 3). These values are rough estimates based on
+ * the encoding speed of the codec libraries used by BlueALSA, so they are
+ * meant for comparing configurations, not for precise accounting. For codecs
+ * with variable bit-rate, the bit-rate is the average one for the default
+ * encoder configuration. */
+static const struct {
+	uint16_t codec_id;
+	unsigned int bitrate;
+	unsigned int cpu;
+} a2dp_policy_costs[] = {
+	{ A2DP_CODEC_SBC, 0 /* bitpool */, 20 },
+	{ A2DP_CODEC_MPEG12, 192, 120 },
+	{ A2DP_CODEC_MPEG24, 192, 80 },
+	{ A2DP_CODEC_VENDOR_APTX, 384, 30 },
+	{ A2DP_CODEC_VENDOR_LDAC, 660, 80 },
+};
+
+/**
+ * Calculate the SBC bit-rate for 16 blocks and 8 subbands.
+ *
+ * @return The bit-rate in kbps. */
+static unsigned int a2dp_policy_sbc_bitrate(unsigned int channels,
+		unsigned int frequency, unsigned int bitpool) {
+
+	const unsigned int blocks = 16;
+	const unsigned int subbands = 8;
+	size_t frame_len = 4 + (4 * subbands * channels) / 8;
+
+	/* assume joint stereo for two channels */
+	if (channels == 1)
+		frame_len += (blocks * bitpool + 7) / 8;
+	else
+		frame_len += (subbands + blocks * bitpool + 7) / 8;
+
+	return frame_len * 8 * frequency / (blocks * subbands) / 1000;
+}
+
+/**
+ * Estimate the cost of the A2DP stream.
+ *
+ * @param codec_id A2DP codec ID.
+ * @param channels The number of channels.
+ * @param frequency Sampling frequency.
+ * @param quality The SBC maximal bitpool or the LDAC EQMID. Ignored for
+ *   other codecs.
+ * @param cost Address where the estimated cost will be stored. */
+void a2dp_policy_estimate(
+		uint16_t codec_id,
+		unsigned int channels,
+		unsigned int frequency,
+		unsigned int quality,
+		struct a2dp_policy_load *cost) {
+
+	size_t i;
+
+	cost->bitrate = 0;
+	cost->cpu = 0;
+	cost->streams = 1;
+	cost->pressure = 0;
+
+	for (i = 0; i < ARRAYSIZE(a2dp_policy_costs); i++)
+		if (a2dp_policy_costs[i].codec_id == codec_id)
+			break;
+	if (i == ARRAYSIZE(a2dp_policy_costs))
+		return;
+
+	/* both CPU usage and bit-rate scale with the number of samples */
+	const uint64_t samples = (uint64_t)channels * frequency;
+	cost->cpu = a2dp_policy_costs[i].cpu * samples / (2 * 48000);
+
+	switch (codec_id) {
+	case A2DP_CODEC_SBC:
+		cost->bitrate = a2dp_policy_sbc_bitrate(channels, frequency, quality);
+		break;
+	case A2DP_CODEC_VENDOR_APTX:
+		/* fixed 4:1 compression of 16-bit samples */
+		cost->bitrate = samples * 16 / 4 / 1000;
+		break;
+	case A2DP_CODEC_VENDOR_LDAC: {
+		/* LDAC bit-rate does not depend on the number of channels */
+		static const unsigned int bitrates[] = { 990, 660, 330 };
+		cost->bitrate = bitrates[MIN(quality, ARRAYSIZE(bitrates) - 1)];
+		if (frequency % 44100 == 0)
+			cost->bitrate = cost->bitrate * 44100 / 48000;
+		break;
+	}
+	default:
+		cost->bitrate = a2dp_policy_costs[i].bitrate * samples / (2 * 48000);
+	}
+
+}
+
+/**
+ * Get the LDAC EQMID used by the encoder with the given limit. */
+static unsigned int a2dp_policy_ldac_eqmid(unsigned int limit) {
+#if ENABLE_LDAC
+	return MAX(config.ldac_eqmid, limit);
+#else
+	return MAX(1 /* SQ */, limit);
+#endif
+}
+
+/**
+ * Estimate the cost of the transport.
+ *
+ * For SCO transports, the cost of the synchronous link in both directions
+ * is returned, because the link occupies reserved slots regardless of the
+ * audio data being transferred or not.
+ *
+ * @param t A2DP or SCO transport.
+ * @param cost Address where the estimated cost will be stored. */
+void a2dp_policy_transport_cost(
+		const struct ba_transport *t,
+		struct a2dp_policy_load *cost) {
+
+	unsigned int quality = 0;
+
+	if (IS_BA_TRANSPORT_PROFILE_SCO(t->type.profile)) {
+		cost->bitrate = 2 * 64;
+		cost->cpu = t->type.codec == HFP_CODEC_MSBC ? 10 : 1;
+		cost->streams = 1;
+		cost->pressure = 0;
+		return;
+	}
+
+	switch (t->type.codec) {
+	case A2DP_CODEC_SBC:
+		if (t->a2dp.cconfig != NULL)
+			quality = ((const a2dp_sbc_t *)t->a2dp.cconfig)->max_bitpool;
+		if (t->a2dp.bitpool_limit != 0)
+			quality = MIN(quality, t->a2dp.bitpool_limit);
+		break;
+	case A2DP_CODEC_VENDOR_LDAC:
+		quality = a2dp_policy_ldac_eqmid(t->a2dp.eqmid_limit);
+		break;
+	}
+
+	a2dp_policy_estimate(t->type.codec, ba_transport_get_channels(t),
+			ba_transport_get_sampling(t), quality, cost);
+	cost->pressure = t->a2dp.coutq_fill;
+
+}
+
+/**
+ * Get resources consumed by audio transports of the adapter.
+ *
+ * Only A2DP transports which are not idle and SCO transports with the
+ * established link are accounted, because other transports do not use
+ * any Bluetooth airtime.
+ *
+ * @param a The adapter for which the load shall be calculated.
+ * @param exclude Transport which shall not be accounted. It might be NULL.
+ * @param load Address where the load will be stored. The pressure is the
+ *   highest BT socket output buffer fill percentage of all transports. */
+void a2dp_policy_adapter_load(
+		struct ba_adapter *a,
+		const struct ba_transport *exclude,
+		struct a2dp_policy_load *load) {
+
+	GHashTableIter iter_d, iter_t;
+	struct ba_device *d;
+	struct ba_transport *t;
+
+	load->bitrate = 0;
+	load->cpu = 0;
+	load->streams = 0;
+	load->pressure = 0;
+
+	pthread_mutex_lock(&a->devices_mutex);
+	g_hash_table_iter_init(&iter_d, a->devices);
+	while (g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d)) {
+
+		pthread_mutex_lock(&d->transports_mutex);
+		g_hash_table_iter_init(&iter_t, d->transports);
+		while (g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t)) {
+
+			if (t == exclude)
+				continue;
+			if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP) {
+				if (t->state == TRANSPORT_IDLE)
+					continue;
+			}
+			else if (!IS_BA_TRANSPORT_PROFILE_SCO(t->type.profile) ||
+					t->bt_fd == -1)
+				continue;
+
+			struct a2dp_policy_load cost;
+			a2dp_policy_transport_cost(t, &cost);
+
+			load->bitrate += cost.bitrate;
+			load->cpu += cost.cpu;
+			load->streams++;
+			load->pressure = MAX(load->pressure, cost.pressure);
+
+		}
+		pthread_mutex_unlock(&d->transports_mutex);
+
+	}
+	pthread_mutex_unlock(&a->devices_mutex);
+
+}
+
+/**
+ * Get the quality score of the configuration.
+ *
+ * The score is proportional to the amount of the audio information, so
+ * the stereo stream with reduced SBC bitpool might be preferred over the
+ * monophonic one with the full bitpool. */
+static unsigned int a2dp_policy_score(unsigned int channels,
+		unsigned int frequency, unsigned int bitpool, unsigned int bitpool_max) {
+	unsigned int score = channels * (frequency / 100);
+	if (bitpool_max != 0)
+		score = score * bitpool / bitpool_max;
+	return score;
+}
+
+/**
+ * Check whether the cost fits in the budget.
+ *
+ * Budget value of zero means that there is no limit. */
+static bool a2dp_policy_fits(unsigned int used, unsigned int cost,
+		unsigned int budget) {
+	return budget == 0 || used + cost <= budget;
+}
+
+/**
+ * Select A2DP configuration for the given capabilities.
+ *
+ * All combinations of channel modes and sampling frequencies supported by
+ * both sides (and SBC bitpools) are scored, and the one with the highest
+ * score which fits in the remaining CPU and bit-rate budget of the adapter
+ * is selected. If there is no such configuration, the cheapest one is used.
+ *
+ * @param codec A2DP codec of the local endpoint.
+ * @param cap_channel_mode Channel mode capabilities of the remote device.
+ * @param cap_sampling Sampling frequency capabilities of the remote device.
+ * @param load Resources already consumed by other streams of the adapter.
+ * @param selection Address where the selected configuration will be stored.
+ * @return On success this function returns 0. If there is no common
+ *   configuration, -1 is returned and errno is set to ENOTSUP. */
+int a2dp_policy_select(
+		const struct bluez_a2dp_codec *codec,
+		unsigned int cap_channel_mode,
+		unsigned int cap_sampling,
+		const struct a2dp_policy_load *load,
+		struct a2dp_policy_config *selection) {
+
+	const unsigned int cpu_budget = config.a2dp.cpu_budget;
+	const unsigned int bitrate_budget = config.a2dp.bitrate_budget;
+
+	struct a2dp_policy_config best = { 0 };
+	struct a2dp_policy_config cheapest = { 0 };
+	unsigned int best_score = 0;
+	bool found = false;
+	bool fits = false;
+	size_t i, ii;
+
+	/* If monophonic sound or 44.1 kHz sampling has been forced, limit the
+	 * candidates, but only if such a configuration is supported. Since mono
+	 * channel mode shall be stored at index 0 we can simply check for its
+	 * existence with a simple index lookup. */
+	if (config.a2dp.force_mono &&
+			codec->channels[0].mode == BLUEZ_A2DP_CHM_MONO &&
+			cap_channel_mode & codec->channels[0].value)
+		cap_channel_mode = codec->channels[0].value;
+	if (config.a2dp.force_44100)
+		for (i = 0; i < codec->samplings_size; i++)
+			if (codec->samplings[i].frequency == 44100) {
+				if (cap_sampling & codec->samplings[i].value)
+					cap_sampling = codec->samplings[i].value;
+				break;
+			}
+
+	/* Iterate from the most preferred channel mode and the highest sampling
+	 * frequency, so in case of equal scores the preferred one will win. */
+	for (i = codec->channels_size; i > 0; i--) {
+
+		const struct bluez_a2dp_channel_mode *chm = &codec->channels[i - 1];
+		if (!(cap_channel_mode & chm->value))
+			continue;
+
+		const unsigned int channels = chm->mode == BLUEZ_A2DP_CHM_MONO ? 1 : 2;
+
+		for (ii = codec->samplings_size; ii > 0; ii--) {
+
+			const struct bluez_a2dp_sampling_freq *freq = &codec->samplings[ii - 1];
+			if (!(cap_sampling & freq->value))
+				continue;
+
+			unsigned int bitpool_max = 0;
+			unsigned int bitpool_min = 0;
+			unsigned int bitpool;
+
+			/* For SBC, try the default bitpool and the one reduced by the
+			 * third, which corresponds to the middle quality profile. */
+			if (codec->id == A2DP_CODEC_SBC) {
+				bitpool_max = a2dp_sbc_default_bitpool(freq->value, chm->value);
+				bitpool_min = bitpool_max * 2 / 3;
+			}
+
+			for (bitpool = bitpool_max; ; bitpool = bitpool_min) {
+
+				struct a2dp_policy_config candidate = {
+					.channel_mode = chm->value,
+					.sampling = freq->value,
+					.channels = channels,
+					.frequency = freq->frequency,
+					.bitpool = bitpool,
+				};
+
+				a2dp_policy_estimate(codec->id, channels, freq->frequency,
+						codec->id == A2DP_CODEC_VENDOR_LDAC ? a2dp_policy_ldac_eqmid(0) : bitpool,
+						&candidate.cost);
+				const unsigned int score = a2dp_policy_score(channels,
+						freq->frequency, bitpool, bitpool_max);
+
+				if (!found ||
+						candidate.cost.bitrate < cheapest.cost.bitrate ||
+						(candidate.cost.bitrate == cheapest.cost.bitrate &&
+						 candidate.cost.cpu < cheapest.cost.cpu))
+					cheapest = candidate;
+				found = true;
+
+				if (a2dp_policy_fits(load->cpu, candidate.cost.cpu, cpu_budget) &&
+						a2dp_policy_fits(load->bitrate, candidate.cost.bitrate, bitrate_budget)) {
+					if (!fits || score > best_score) {
+						best = candidate;
+						best_score = score;
+						fits = true;
+					}
+				}
+				else
+					debug("Configuration over budget: channels: %u, sampling: %u, bitpool: %u, "
+							"bitrate: %u kbps, CPU: %u.%u%%", channels, freq->frequency, bitpool,
+							candidate.cost.bitrate, candidate.cost.cpu / 10, candidate.cost.cpu % 10);
+
+				if (bitpool == bitpool_min)
+					break;
+
+			}
+
+		}
+	}
+
+	if (!found) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	const char *reason = "best quality";
+	if (!fits) {
+		best = cheapest;
+		reason = "budget exceeded, lowest cost";
+	}
+	else if (cpu_budget != 0 || bitrate_budget != 0)
+		reason = "best quality within budget";
+
+	info("Selected %s configuration (%s): channels: %u, sampling: %u, bitpool: %u, "
+			"bitrate: %u kbps, CPU: %u.%u%%, adapter load: %u streams, %u kbps, CPU: %u.%u%%",
+			bluetooth_a2dp_codec_to_string(codec->id), reason,
+			best.channels, best.frequency, best.bitpool,
+			best.cost.bitrate, best.cost.cpu / 10, best.cost.cpu % 10,
+			load->streams, load->bitrate, load->cpu / 10, load->cpu % 10);
+
+	*selection = best;
+	return 0;
+}
+
+/**
+ * Signal the transport IO thread if encoder limits have changed.
+ *
+ * @param t Transport structure.
+ * @param bitpool_limit Previous SBC bitpool limit.
+ * @param eqmid_limit Previous LDAC EQMID limit. */
+static void a2dp_policy_update_limits(struct ba_transport *t,
+		unsigned int bitpool_limit, unsigned int eqmid_limit) {
+	if (t->a2dp.bitpool_limit == bitpool_limit &&
+			t->a2dp.eqmid_limit == eqmid_limit)
+		return;
+	debug("Updating encoder limits: bitpool: %u, EQMID: %u",
+			t->a2dp.bitpool_limit, t->a2dp.eqmid_limit);
+	ba_transport_send_signal(t, TRANSPORT_SET_CODEC_LIMITS);
+}
+
+/**
+ * Check whether the transport can be admitted on its adapter.
+ *
+ * Admission control is enabled only if the CPU or bit-rate budget has been
+ * configured. If the transport does not fit in the remaining budget, the
+ * SBC bitpool or LDAC EQMID of the A2DP source encoder is lowered. If that
+ * is not possible, the transport is rejected. When the BT socket output
+ * buffer of any other transport is nearly full, the controller is assumed
+ * to be saturated, so no bit-rate budget is left for the new transport.
+ *
+ * SCO transports are always admitted, because a voice call has priority
+ * over the audio streaming. However, they are accounted in the load of
+ * the adapter, so subsequent A2DP streams will be downgraded. The same
+ * applies to A2DP sink transports, because the bit-rate of the incoming
+ * stream is chosen by the remote device, so it can not be lowered here.
+ *
+ * If the encoder limits of the transport have changed, the transport IO
+ * thread is signaled, so the running encoder will apply new limits.
+ *
+ * This function shall be called before the BT transport is acquired.
+ *
+ * @param t Transport which is about to be acquired.
+ * @return If the transport has been admitted, this function returns 0.
+ *   Otherwise, -1 is returned and errno is set to EBUSY. */
+int a2dp_policy_admit(struct ba_transport *t) {
+
+	const unsigned int cpu_budget = config.a2dp.cpu_budget;
+	unsigned int bitrate_budget = config.a2dp.bitrate_budget;
+	const bool sco = IS_BA_TRANSPORT_PROFILE_SCO(t->type.profile);
+	const bool sink = t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SINK;
+	unsigned int bitpool_limit = 0;
+	unsigned int eqmid_limit = 0;
+
+	if (!sco) {
+		bitpool_limit = t->a2dp.bitpool_limit;
+		eqmid_limit = t->a2dp.eqmid_limit;
+		/* start with the configuration as it was negotiated */
+		t->a2dp.bitpool_limit = 0;
+		t->a2dp.eqmid_limit = 0;
+	}
+
+	if (cpu_budget == 0 && bitrate_budget == 0)
+		goto final;
+
+	struct a2dp_policy_load load;
+	struct a2dp_policy_load cost;
+
+	a2dp_policy_adapter_load(t->d->a, t, &load);
+	a2dp_policy_transport_cost(t, &cost);
+
+	if (load.pressure >= A2DP_POLICY_PRESSURE_SATURATED) {
+		debug("Adapter saturated: BT socket output buffer fill: %u%%", load.pressure);
+		/* there is no spare airtime left for the new transport */
+		bitrate_budget = MAX(1, load.bitrate);
+	}
+
+	if (a2dp_policy_fits(load.cpu, cost.cpu, cpu_budget) &&
+			a2dp_policy_fits(load.bitrate, cost.bitrate, bitrate_budget))
+		goto admitted;
+
+	if (sco || sink) {
+		warn("Admitting %s over budget: %u + %u kbps", ba_transport_type_to_string(t->type),
+				load.bitrate, cost.bitrate);
+		goto admitted;
+	}
+
+	if (t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SOURCE)
+		switch (t->type.codec) {
+		case A2DP_CODEC_SBC: {
+			const a2dp_sbc_t *cconfig = (const a2dp_sbc_t *)t->a2dp.cconfig;
+			const unsigned int bitpool_min = MAX(cconfig->min_bitpool, SBC_MIN_BITPOOL);
+			unsigned int bitpool;
+			for (bitpool = cconfig->max_bitpool - 1; bitpool >= bitpool_min; bitpool--) {
+				t->a2dp.bitpool_limit = bitpool;
+				a2dp_policy_transport_cost(t, &cost);
+				if (a2dp_policy_fits(load.cpu, cost.cpu, cpu_budget) &&
+						a2dp_policy_fits(load.bitrate, cost.bitrate, bitrate_budget)) {
+					info("Downgrading SBC bitpool: %u -> %u", cconfig->max_bitpool, bitpool);
+					goto admitted;
+				}
+			}
+			t->a2dp.bitpool_limit = 0;
+			break;
+		}
+		case A2DP_CODEC_VENDOR_LDAC: {
+			unsigned int eqmid;
+			for (eqmid = a2dp_policy_ldac_eqmid(0) + 1; eqmid <= 2 /* MQ */; eqmid++) {
+				t->a2dp.eqmid_limit = eqmid;
+				a2dp_policy_transport_cost(t, &cost);
+				if (a2dp_policy_fits(load.cpu, cost.cpu, cpu_budget) &&
+						a2dp_policy_fits(load.bitrate, cost.bitrate, bitrate_budget)) {
+					info("Downgrading LDAC encoder quality: EQMID %u", eqmid);
+					goto admitted;
+				}
+			}
+			t->a2dp.eqmid_limit = 0;
+			break;
+		}
+		}
+
+	warn("Rejecting %s: adapter load: %u streams, %u kbps, CPU: %u.%u%%, "
+			"required: %u kbps, CPU: %u.%u%%", ba_transport_type_to_string(t->type),
+			load.streams, load.bitrate, load.cpu / 10, load.cpu % 10,
+			cost.bitrate, cost.cpu / 10, cost.cpu % 10);
+	a2dp_policy_update_limits(t, bitpool_limit, eqmid_limit);
+	errno = EBUSY;
+	return -1;
+
+admitted:
+	debug("Admitted %s: adapter load: %u streams, %u kbps, CPU: %u.%u%%, "
+			"required: %u kbps, CPU: %u.%u%%", ba_transport_type_to_string(t->type),
+			load.streams, load.bitrate, load.cpu / 10, load.cpu % 10,
+			cost.bitrate, cost.cpu / 10, cost.cpu % 10);
+final:
+	if (!sco)
+		a2dp_policy_update_limits(t, bitpool_limit, eqmid_limit);
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * BlueALSA - a2dp-policy.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_A2DPPOLICY_H_
+#define BLUEALSA_A2DPPOLICY_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+
+#include "ba-adapter.h"
+#include "ba-transport.h"
+#include "bluez-a2dp.h"
+
+/**
+ * Resources consumed by A2DP streams. */
+struct a2dp_policy_load {
+	/* estimated Bluetooth bit-rate in kbps */
+	unsigned int bitrate;
+	/* estimated CPU usage in per-mille of a single core */
+	unsigned int cpu;
+	/* number of streams accounted */
+	unsigned int streams;
+	/* BT socket output buffer fill in percent */
+	unsigned int pressure;
+};
+
+/**
+ * Configuration selected by the policy. */
+struct a2dp_policy_config {
+	/* codec specific channel mode and sampling frequency values */
+	unsigned int channel_mode;
+	unsigned int sampling;
+	unsigned int channels;
+	unsigned int frequency;
+	/* SBC maximal bitpool, zero for other codecs */
+	unsigned int bitpool;
+	/* estimated cost of the configuration */
+	struct a2dp_policy_load cost;
+};
+
+void a2dp_policy_estimate(
+		uint16_t codec_id,
+		unsigned int channels,
+		unsigned int frequency,
+		unsigned int quality,
+		struct a2dp_policy_load *cost);
+
+void a2dp_policy_transport_cost(
+		const struct ba_transport *t,
+		struct a2dp_policy_load *cost);
+void a2dp_policy_adapter_load(
+		struct ba_adapter *a,
+		const struct ba_transport *exclude,
+		struct a2dp_policy_load *load);
+
+int a2dp_policy_select(
+		const struct bluez_a2dp_codec *codec,
+		unsigned int cap_channel_mode,
+		unsigned int cap_sampling,
+		const struct a2dp_policy_load *load,
+		struct a2dp_policy_config *selection);
+
+int a2dp_policy_admit(struct ba_transport *t);
+
+#endif
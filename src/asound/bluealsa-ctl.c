@@ -59,7 +59,9 @@ struct bluealsa_ctl {
 	/* D-Bus connection context */
 	struct ba_dbus_ctx dbus_ctx;
 
-	/* list of BT devices */
+	/* Cache of BT devices (sorted by the object path). It is populated
+	 * with a single BlueZ GetManagedObjects() call and then kept up to
+	 * date by the InterfacesAdded/Removed and PropertiesChanged signals. */
 	struct bt_dev **dev_list;
 	size_t dev_list_size;
 
@@ -164,42 +166,35 @@ static void bluealsa_dev_fetch_name(struct bluealsa_ctl *ctl, struct bt_dev *dev
 	dbus_message_unref(rep);
 }
 
-static void bluealsa_dev_fetch_battery(struct bluealsa_ctl *ctl, struct bt_dev *dev,
-		const char *sco_pcm_path) {
-
-	DBusMessage *rep;
-	if ((rep = bluealsa_dbus_get_property(ctl->dbus_ctx.conn, ctl->dbus_ctx.ba_service,
-					sco_pcm_path, BLUEALSA_INTERFACE_PCM, "Battery", NULL)) == NULL)
-		return;
-
-	DBusMessageIter iter;
-	DBusMessageIter iter_val;
+/**
+ * Find BT device in the device cache.
+ *
+ * @param ctl The BlueALSA controller context.
+ * @param path BlueZ D-Bus device path.
+ * @return The BT device, or NULL if device is not cached. */
+static struct bt_dev *bluealsa_dev_lookup(struct bluealsa_ctl *ctl, const char *path) {
 
-	dbus_message_iter_init(rep, &iter);
-	dbus_message_iter_recurse(&iter, &iter_val);
+	struct bt_dev key;
+	struct bt_dev *pkey = &key;
+	struct bt_dev **dev;
 
-	char battery;
-	dbus_message_iter_get_basic(&iter_val, &battery);
-	dev->battery_level = battery;
+	*stpncpy(key.device_path, path, sizeof(key.device_path) - 1) = '\0';
+	if ((dev = bsearch(&pkey, ctl->dev_list, ctl->dev_list_size,
+					sizeof(*ctl->dev_list), bluealsa_bt_dev_cmp)) == NULL)
+		return NULL;
 
-	dbus_message_unref(rep);
+	return *dev;
 }
 
 /**
- * Get BT device structure.
+ * Add new BT device to the device cache.
  *
  * @param ctl The BlueALSA controller context.
- * @param pcm BlueALSA PCM structure.
+ * @param path BlueZ D-Bus device path.
+ * @param sort If true, keep the device list sorted.
  * @return The BT device, or NULL upon error. */
-static struct bt_dev *bluealsa_dev_get(struct bluealsa_ctl *ctl, const struct ba_pcm *pcm) {
-
-	size_t i;
-	for (i = 0; i < ctl->dev_list_size; i++)
-		if (strcmp(ctl->dev_list[i]->device_path, pcm->device_path) == 0)
-			return ctl->dev_list[i];
-
-	/* If device is not cached yet, fetch data from
-	 * the BlueZ via the B-Bus interface. */
+static struct bt_dev *bluealsa_dev_add(struct bluealsa_ctl *ctl, const char *path,
+		bool sort) {
 
 	struct bt_dev **dev_list = ctl->dev_list;
 	size_t size = ctl->dev_list_size;
@@ -212,20 +207,147 @@ static struct bt_dev *bluealsa_dev_get(struct bluealsa_ctl *ctl, const struct ba
 		return NULL;
 	ctl->dev_list_size++;
 
-	strcpy(dev->device_path, pcm->device_path);
-	sprintf(dev->name, "%.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
-			pcm->addr.b[5], pcm->addr.b[4], pcm->addr.b[3],
-			pcm->addr.b[2], pcm->addr.b[1], pcm->addr.b[0]);
+	*stpncpy(dev->device_path, path, sizeof(dev->device_path) - 1) = '\0';
+	dev->name[0] = '\0';
 	dev->battery_level = -1;
+	dev->mask = 0;
 
 	/* Sort device list by an object path, so the bluealsa_dev_get_id() will
 	 * return consistent IDs ordering in case of name duplications. */
-	qsort(dev_list, ctl->dev_list_size, sizeof(*dev_list), bluealsa_bt_dev_cmp);
+	if (sort)
+		qsort(dev_list, ctl->dev_list_size, sizeof(*dev_list), bluealsa_bt_dev_cmp);
+
+	return dev;
+}
+
+static void bluealsa_dev_remove(struct bluealsa_ctl *ctl, struct bt_dev *dev) {
+	size_t i;
+	for (i = 0; i < ctl->dev_list_size; i++)
+		if (ctl->dev_list[i] == dev) {
+			memmove(&ctl->dev_list[i], &ctl->dev_list[i + 1],
+					(--ctl->dev_list_size - i) * sizeof(*ctl->dev_list));
+			free(dev);
+			break;
+		}
+}
+
+static dbus_bool_t bluealsa_dbus_msg_update_dev(const char *key,
+		DBusMessageIter *variant, void *userdata, DBusError *error);
+
+/**
+ * Populate BT device cache with all devices known by BlueZ.
+ *
+ * Instead of querying properties of every device separately, all BlueZ
+ * objects are fetched at once with the ObjectManager interface.
+ *
+ * @param ctl The BlueALSA controller context.
+ * @param error D-Bus error structure.
+ * @return On success this function returns true. */
+static bool bluealsa_dev_list_init(struct bluealsa_ctl *ctl, DBusError *error) {
+
+	DBusMessage *msg;
+	if ((msg = dbus_message_new_method_call("org.bluez", "/",
+					"org.freedesktop.DBus.ObjectManager", "GetManagedObjects")) == NULL) {
+		dbus_set_error(error, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+
+	DBusMessage *rep;
+	if ((rep = dbus_connection_send_with_reply_and_block(ctl->dbus_ctx.conn,
+					msg, DBUS_TIMEOUT_USE_DEFAULT, error)) == NULL) {
+		dbus_message_unref(msg);
+		return false;
+	}
+
+	DBusMessageIter iter;
+	DBusMessageIter iter_objects;
+
+	if (!dbus_message_iter_init(rep, &iter) ||
+			dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE, "Invalid managed objects");
+		goto final;
+	}
+
+	for (dbus_message_iter_recurse(&iter, &iter_objects);
+			dbus_message_iter_get_arg_type(&iter_objects) == DBUS_TYPE_DICT_ENTRY;
+			dbus_message_iter_next(&iter_objects)) {
+
+		DBusMessageIter iter_object;
+		DBusMessageIter iter_ifaces;
+		const char *path;
+
+		dbus_message_iter_recurse(&iter_objects, &iter_object);
+		dbus_message_iter_get_basic(&iter_object, &path);
+		dbus_message_iter_next(&iter_object);
+
+		for (dbus_message_iter_recurse(&iter_object, &iter_ifaces);
+				dbus_message_iter_get_arg_type(&iter_ifaces) == DBUS_TYPE_DICT_ENTRY;
+				dbus_message_iter_next(&iter_ifaces)) {
+
+			DBusMessageIter iter_iface;
+			const char *iface;
+
+			dbus_message_iter_recurse(&iter_ifaces, &iter_iface);
+			dbus_message_iter_get_basic(&iter_iface, &iface);
+			dbus_message_iter_next(&iter_iface);
+
+			if (strcmp(iface, "org.bluez.Device1") == 0) {
+				struct bt_dev *dev;
+				if ((dev = bluealsa_dev_add(ctl, path, false)) != NULL)
+					bluealsa_dbus_message_iter_dict(&iter_iface, NULL,
+							bluealsa_dbus_msg_update_dev, dev);
+			}
+
+		}
+
+	}
+
+	qsort(ctl->dev_list, ctl->dev_list_size, sizeof(*ctl->dev_list), bluealsa_bt_dev_cmp);
+
+final:
+	dbus_message_unref(rep);
+	dbus_message_unref(msg);
+	return !dbus_error_is_set(error);
+}
+
+/**
+ * Get BT device structure.
+ *
+ * @param ctl The BlueALSA controller context.
+ * @param pcm BlueALSA PCM structure.
+ * @return The BT device, or NULL upon error. */
+static struct bt_dev *bluealsa_dev_get(struct bluealsa_ctl *ctl, const struct ba_pcm *pcm) {
+
+	struct bt_dev *dev;
+	if ((dev = bluealsa_dev_lookup(ctl, pcm->device_path)) != NULL)
+		goto final;
+
+	/* If device is not cached yet (e.g. BlueZ has not been reachable during
+	 * the cache initialization), fetch data from the BlueZ via the D-Bus. */
+
+	if ((dev = bluealsa_dev_add(ctl, pcm->device_path, true)) == NULL)
+		return NULL;
 
 	bluealsa_dev_fetch_name(ctl, dev);
+
+final:
+	if (dev->name[0] == '\0')
+		sprintf(dev->name, "%.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
+				pcm->addr.b[5], pcm->addr.b[4], pcm->addr.b[3],
+				pcm->addr.b[2], pcm->addr.b[1], pcm->addr.b[0]);
 	return dev;
 }
 
+/**
+ * Check whether BT device is used by any control element. */
+static bool bluealsa_dev_is_used(struct bluealsa_ctl *ctl, const struct bt_dev *dev) {
+	size_t i;
+	for (i = 0; i < ctl->elem_list_size; i++)
+		if (ctl->elem_list[i].dev == dev)
+			return true;
+	return false;
+}
+
 static int bluealsa_pcm_add(struct bluealsa_ctl *ctl, struct ba_pcm *pcm) {
 	struct ba_pcm *tmp = ctl->pcm_list;
 	if ((tmp = realloc(tmp, (ctl->pcm_list_size + 1) * sizeof(*tmp))) == NULL)
@@ -387,8 +509,9 @@ static int bluealsa_create_elem_list(struct bluealsa_ctl *ctl) {
 			count++;
 
 			if (ctl->battery) {
-				/* Add special "battery" elements. */
-				bluealsa_dev_fetch_battery(ctl, dev, pcm->pcm_path);
+				/* Add special "battery" elements. Battery level is a part of
+				 * the PCM properties, so there is no need to query for it. */
+				dev->battery_level = pcm->battery_level;
 				if (dev->battery_level != -1) {
 					elem_list[count].type = CTL_ELEM_TYPE_BATTERY;
 					elem_list[count].dev = dev;
@@ -680,6 +803,10 @@ static void bluealsa_subscribe_events(snd_ctl_ext_t *ext, int subscribe) {
 				DBUS_INTERFACE_PROPERTIES, "PropertiesChanged", "arg0='"BLUEALSA_INTERFACE_PCM"'");
 		bluealsa_dbus_connection_signal_match_add(&ctl->dbus_ctx, "org.bluez", NULL,
 				DBUS_INTERFACE_PROPERTIES, "PropertiesChanged", "arg0='org.bluez.Device1'");
+		bluealsa_dbus_connection_signal_match_add(&ctl->dbus_ctx, "org.bluez", "/",
+				"org.freedesktop.DBus.ObjectManager", "InterfacesAdded", NULL);
+		bluealsa_dbus_connection_signal_match_add(&ctl->dbus_ctx, "org.bluez", "/",
+				"org.freedesktop.DBus.ObjectManager", "InterfacesRemoved", NULL);
 	}
 	else
 		bluealsa_dbus_connection_signal_match_clean(&ctl->dbus_ctx);
@@ -715,19 +842,15 @@ static dbus_bool_t bluealsa_dbus_msg_update_dev(const char *key,
 	(void)error;
 
 	struct bt_dev *dev = (struct bt_dev *)userdata;
-	dev->mask = 0;
 
-	if (strcmp(key, "Alias") == 0) {
+	if (strcmp(key, "Alias") == 0 &&
+			dbus_message_iter_get_arg_type(variant) == DBUS_TYPE_STRING) {
 		const char *alias;
 		dbus_message_iter_get_basic(variant, &alias);
-		*stpncpy(dev->name, alias, sizeof(dev->name) - 1) = '\0';
-		dev->mask = SND_CTL_EVENT_MASK_ADD;
-	}
-	if (strcmp(key, "Battery") == 0) {
-		char battery_level;
-		dbus_message_iter_get_basic(variant, &battery_level);
-		dev->mask = dev->battery_level == -1 ? SND_CTL_EVENT_MASK_ADD : SND_CTL_EVENT_MASK_VALUE;
-		dev->battery_level = battery_level;
+		if (strncmp(dev->name, alias, sizeof(dev->name) - 1) != 0) {
+			*stpncpy(dev->name, alias, sizeof(dev->name) - 1) = '\0';
+			dev->mask |= SND_CTL_EVENT_MASK_ADD;
+		}
 	}
 
 	return TRUE;
@@ -758,33 +881,98 @@ static DBusHandlerResult bluealsa_dbus_msg_filter(DBusConnection *conn,
 		dbus_message_iter_next(&iter);
 
 		/* handle BT device properties update */
-		if (strcmp(updated_interface, "org.bluez.Device1") == 0)
-			for (i = 0; i < ctl->elem_list_size; i++) {
-				struct bt_dev *dev = ctl->elem_list[i].dev;
-				if (strcmp(dev->device_path, path) == 0)
-					bluealsa_dbus_message_iter_dict(&iter, NULL,
-							bluealsa_dbus_msg_update_dev, dev);
-				if (dev->mask & SND_CTL_EVENT_MASK_ADD)
+		if (strcmp(updated_interface, "org.bluez.Device1") == 0) {
+			struct bt_dev *dev;
+			if ((dev = bluealsa_dev_lookup(ctl, path)) != NULL) {
+				dev->mask = 0;
+				bluealsa_dbus_message_iter_dict(&iter, NULL,
+						bluealsa_dbus_msg_update_dev, dev);
+				if (dev->mask & SND_CTL_EVENT_MASK_ADD &&
+						bluealsa_dev_is_used(ctl, dev))
 					goto remove_add;
 			}
+		}
 
 		/* handle BlueALSA PCM properties update */
 		if (strcmp(updated_interface, BLUEALSA_INTERFACE_PCM) == 0)
-			for (i = 0; i < ctl->elem_list_size; i++) {
-				struct ctl_elem *elem = &ctl->elem_list[i];
-				if (strcmp(elem->pcm->pcm_path, path) == 0) {
+			for (i = 0; i < ctl->pcm_list_size; i++) {
+				struct ba_pcm *pcm = &ctl->pcm_list[i];
+				if (strcmp(pcm->pcm_path, path) != 0)
+					continue;
+
+				int battery_level = pcm->battery_level;
+				bluealsa_dbus_message_iter_get_pcm_props(&iter, NULL, pcm);
+
+				/* battery level has been reported for the first time */
+				if (ctl->battery && battery_level == -1 && pcm->battery_level != -1)
+					goto remove_add;
+
+				size_t ii;
+				for (ii = 0; ii < ctl->elem_list_size; ii++) {
+					struct ctl_elem *elem = &ctl->elem_list[ii];
+					if (elem->pcm != pcm)
+						continue;
 					if (elem->type == CTL_ELEM_TYPE_BATTERY) {
-						bluealsa_dbus_message_iter_dict(&iter, NULL,
-								bluealsa_dbus_msg_update_dev, elem->dev);
-						if (elem->dev->mask & SND_CTL_EVENT_MASK_ADD)
-							goto remove_add;
-						if (elem->dev->mask & SND_CTL_EVENT_MASK_VALUE)
-							bluealsa_event_elem_updated(ctl, ctl->elem_list[i].name);
-					}
-					else {
-						bluealsa_dbus_message_iter_get_pcm_props(&iter, NULL, elem->pcm);
-						bluealsa_event_elem_updated(ctl, elem->name);
+						if (battery_level == pcm->battery_level)
+							continue;
+						elem->dev->battery_level = pcm->battery_level;
 					}
+					bluealsa_event_elem_updated(ctl, elem->name);
+				}
+
+			}
+
+	}
+
+	/* handle BlueZ device creation and removal */
+	if (strcmp(interface, "org.freedesktop.DBus.ObjectManager") == 0) {
+
+		const char *object_path;
+		dbus_message_iter_get_basic(&iter, &object_path);
+		dbus_message_iter_next(&iter);
+
+		struct bt_dev *dev = bluealsa_dev_lookup(ctl, object_path);
+		DBusMessageIter iter_ifaces;
+
+		if (strcmp(signal, "InterfacesAdded") == 0)
+			for (dbus_message_iter_recurse(&iter, &iter_ifaces);
+					dbus_message_iter_get_arg_type(&iter_ifaces) == DBUS_TYPE_DICT_ENTRY;
+					dbus_message_iter_next(&iter_ifaces)) {
+
+				DBusMessageIter iter_iface;
+				const char *iface;
+
+				dbus_message_iter_recurse(&iter_ifaces, &iter_iface);
+				dbus_message_iter_get_basic(&iter_iface, &iface);
+				dbus_message_iter_next(&iter_iface);
+
+				if (strcmp(iface, "org.bluez.Device1") != 0)
+					continue;
+				if (dev == NULL &&
+						(dev = bluealsa_dev_add(ctl, object_path, true)) == NULL)
+					break;
+
+				dev->mask = 0;
+				bluealsa_dbus_message_iter_dict(&iter_iface, NULL,
+						bluealsa_dbus_msg_update_dev, dev);
+				if (dev->mask & SND_CTL_EVENT_MASK_ADD &&
+						bluealsa_dev_is_used(ctl, dev))
+					goto remove_add;
+
+			}
+
+		if (strcmp(signal, "InterfacesRemoved") == 0 && dev != NULL)
+			for (dbus_message_iter_recurse(&iter, &iter_ifaces);
+					dbus_message_iter_get_arg_type(&iter_ifaces) == DBUS_TYPE_STRING;
+					dbus_message_iter_next(&iter_ifaces)) {
+				const char *iface;
+				dbus_message_iter_get_basic(&iter_ifaces, &iface);
+				/* device which is still in use by control elements
+				 * has to be kept in the cache */
+				if (strcmp(iface, "org.bluez.Device1") == 0 &&
+						!bluealsa_dev_is_used(ctl, dev)) {
+					bluealsa_dev_remove(ctl, dev);
+					break;
 				}
 			}
 
@@ -976,6 +1164,13 @@ SND_CTL_PLUGIN_DEFINE_FUNC(bluealsa) {
 		goto fail;
 	}
 
+	/* Failure to populate the device cache is not fatal - device
+	 * properties will be fetched on demand in such a case. */
+	if (!bluealsa_dev_list_init(ctl, &err)) {
+		SNDERR("Couldn't get BlueZ device list: %s", err.message);
+		dbus_error_free(&err);
+	}
+
 	if (!bluealsa_dbus_get_pcms(&ctl->dbus_ctx, &ctl->pcm_list, &ctl->pcm_list_size, &err)) {
 		SNDERR("Couldn't get BlueALSA PCM list: %s", err.message);
 		ret = -ENODEV;
@@ -1009,6 +1204,10 @@ SND_CTL_PLUGIN_DEFINE_FUNC(bluealsa) {
 fail:
 	bluealsa_dbus_connection_ctx_free(&ctl->dbus_ctx);
 	dbus_error_free(&err);
+	while (ctl->dev_list_size > 0)
+		free(ctl->dev_list[--ctl->dev_list_size]);
+	free(ctl->dev_list);
+	free(ctl->pcm_list);
 	free(ctl);
 	return ret;
 }
@@ -25,6 +25,8 @@
 #include <strings.h>
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <alsa/asoundlib.h>
@@ -35,6 +37,7 @@
 #include "shared/dbus-client.h"
 #include "shared/defs.h"
 #include "shared/log.h"
+#include "shared/pcm-pos.h"
 #include "shared/rt.h"
 
 
@@ -53,11 +56,29 @@ struct bluealsa_pcm {
 	/* event file descriptor */
 	int event_fd;
 
+	/* If true, playback data are written directly into the PCM FIFO from
+	 * the transfer callback, without the intermediate ring buffer and the
+	 * IO thread. In such a case, the playback is paced by the server. */
+	bool direct;
+	/* number of frames written to the FIFO (direct mode) */
+	snd_pcm_uframes_t direct_appl_ptr;
+
 	/* virtual hardware - ring buffer */
 	snd_pcm_uframes_t io_ptr;
 	pthread_t io_thread;
 	bool io_started;
 
+	/* IO thread control channel - the IO thread is woken up by writing to
+	 * this event file descriptor, e.g. after the state has been changed */
+	int io_ctrl_fd;
+	/* if true, IO thread shall terminate */
+	volatile bool io_stop;
+	/* time-stamp of the last resume request */
+	struct timespec io_resume_ts;
+
+	/* PCM position published by the server */
+	const struct ba_pcm_pos *pos;
+
 	/* communication and encoding/decoding delay */
 	snd_pcm_sframes_t delay;
 	/* user provided extra delay component */
@@ -111,19 +132,56 @@ static void io_thread_cleanup(struct bluealsa_pcm *pcm) {
 	pcm->io_started = false;
 }
 
+/**
+ * Wake up the IO thread.
+ *
+ * @param pcm The BlueALSA PCM structure.
+ * @param stop If true, request IO thread termination. */
+static void io_thread_wakeup(struct bluealsa_pcm *pcm, bool stop) {
+	if (stop)
+		pcm->io_stop = true;
+	else
+		gettimestamp(&pcm->io_resume_ts);
+	eventfd_write(pcm->io_ctrl_fd, 1);
+}
+
+/**
+ * Wait for the IO thread control event or the PCM FIFO readiness.
+ *
+ * @param pcm The BlueALSA PCM structure.
+ * @param events Requested PCM FIFO events. If zero, this function will
+ *   wait for the control event only.
+ * @return If the IO thread should terminate, this function returns false. */
+static bool io_thread_wait(struct bluealsa_pcm *pcm, short events) {
+
+	struct pollfd pfds[2] = {
+		{ pcm->io_ctrl_fd, POLLIN, 0 },
+		{ events != 0 ? pcm->ba_pcm_fd : -1, events, 0 },
+	};
+
+	while (poll(pfds, ARRAYSIZE(pfds), -1) == -1)
+		if (errno != EINTR) {
+			SNDERR("IO thread poll error: %s", strerror(errno));
+			return false;
+		}
+
+	if (pfds[0].revents & POLLIN) {
+		eventfd_t event;
+		eventfd_read(pcm->io_ctrl_fd, &event);
+	}
+
+	return !pcm->io_stop;
+}
+
 /**
  * IO thread, which facilitates ring buffer. */
 static void *io_thread(void *arg) {
 	snd_pcm_ioplug_t *io = (snd_pcm_ioplug_t *)arg;
-
 	struct bluealsa_pcm *pcm = io->private_data;
-	pthread_cleanup_push(PTHREAD_CLEANUP(io_thread_cleanup), pcm);
 
 	sigset_t sigset;
 	sigemptyset(&sigset);
 
-	/* Block signal, which will be used for pause/resume actions. */
-	sigaddset(&sigset, SIGIO);
 	/* Block SIGPIPE, so we could receive EPIPE while writing to the pipe
 	 * whose reading end has been closed. This will allow clean playback
 	 * termination. */
@@ -137,10 +195,12 @@ static void *io_thread(void *arg) {
 	struct asrsync asrs;
 	asrsync_init(&asrs, io->rate);
 
+	/* the first write after the start is measured like after a resume */
+	bool resumed = true;
+
 	debug2("Starting IO loop: %d", pcm->ba_pcm_fd);
-	for (;;) {
+	while (!pcm->io_stop) {
 
-		int tmp;
 		switch (io->state) {
 		case SND_PCM_STATE_RUNNING:
 		case SND_PCM_STATE_DRAINING:
@@ -149,9 +209,15 @@ static void *io_thread(void *arg) {
 			goto fail;
 		default:
 			debug2("IO thread paused: %d", io->state);
-			sigwait(&sigset, &tmp);
+			while (io->state != SND_PCM_STATE_RUNNING &&
+					io->state != SND_PCM_STATE_DRAINING &&
+					io->state != SND_PCM_STATE_DISCONNECTED)
+				if (!io_thread_wait(pcm, 0))
+					goto final;
 			asrsync_init(&asrs, io->rate);
+			resumed = true;
 			debug2("IO thread resumed: %d", io->state);
+			continue;
 		}
 
 		snd_pcm_uframes_t io_ptr = pcm->io_ptr;
@@ -187,20 +253,24 @@ static void *io_thread(void *arg) {
 
 			/* Read the whole period "atomically". This will assure, that frames
 			 * are not fragmented, so the pointer can be correctly updated. */
-			while (len != 0 && (ret = read(pcm->ba_pcm_fd, head, len)) != 0) {
-				if (ret == -1) {
+			while (len != 0) {
+				if ((ret = read(pcm->ba_pcm_fd, head, len)) == -1) {
 					if (errno == EINTR)
 						continue;
+					if (errno == EAGAIN) {
+						if (!io_thread_wait(pcm, POLLIN))
+							goto final;
+						continue;
+					}
 					SNDERR("PCM FIFO read error: %s", strerror(errno));
 					goto fail;
 				}
+				if (ret == 0)
+					goto fail;
 				head += ret;
 				len -= ret;
 			}
 
-			if (ret == 0)
-				goto fail;
-
 		}
 		else {
 
@@ -212,16 +282,31 @@ static void *io_thread(void *arg) {
 			}
 
 			/* Perform atomic write - see the explanation above. */
-			do {
+			while (len != 0) {
 				if ((ret = write(pcm->ba_pcm_fd, head, len)) == -1) {
 					if (errno == EINTR)
 						continue;
+					if (errno == EAGAIN) {
+						if (!io_thread_wait(pcm, POLLOUT))
+							goto final;
+						continue;
+					}
 					SNDERR("PCM FIFO write error: %s", strerror(errno));
 					goto fail;
 				}
 				head += ret;
 				len -= ret;
-			} while (len != 0);
+			}
+
+			if (resumed) {
+				struct timespec now;
+				struct timespec diff;
+				gettimestamp(&now);
+				difftimespec(&now, &pcm->io_resume_ts, &diff);
+				debug2("Resume-to-first-write latency: %ld.%06ld s",
+						(long)diff.tv_sec, diff.tv_nsec / 1000);
+				resumed = false;
+			}
 
 			// Stash current levels & time
 			{
@@ -252,14 +337,55 @@ sync:
 		eventfd_write(pcm->event_fd, 1);
 	}
 
+final:
+	io_thread_cleanup(pcm);
+	return NULL;
+
 fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(1);
+	io_thread_cleanup(pcm);
 	close_transport(pcm);
 	eventfd_write(pcm->event_fd, 0xDEAD0000);
 	return NULL;
 }
 
+/**
+ * Get the server side delay based on the published PCM position.
+ *
+ * The buffered delay published by the server is valid at the time of the
+ * update. If the PCM is running, frames which have been played since then
+ * are not the part of the delay any more. The constant part of the delay
+ * (e.g. reported by the device) is added as it is.
+ *
+ * @return The number of frames, or -1 if the position is not available. */
+static snd_pcm_sframes_t bluealsa_get_server_delay(snd_pcm_ioplug_t *io) {
+	struct bluealsa_pcm *pcm = io->private_data;
+
+	if (pcm->pos == NULL)
+		return -1;
+
+	struct ba_pcm_pos pos;
+	if (ba_pcm_pos_read(pcm->pos, &pos) == -1)
+		return -1;
+
+	snd_pcm_sframes_t delay = pos.delay;
+	if (io->state == SND_PCM_STATE_RUNNING ||
+			io->state == SND_PCM_STATE_DRAINING) {
+
+		struct timespec ts = { pos.ts_sec, pos.ts_nsec };
+		struct timespec now;
+		struct timespec diff;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		difftimespec(&now, &ts, &diff);
+
+		snd_pcm_sframes_t elapsed = diff.tv_sec * io->rate +
+			(uint64_t)diff.tv_nsec * io->rate / 1000000000;
+		delay = delay > elapsed ? delay - elapsed : 0;
+
+	}
+
+	return delay + pos.delay_fixed;
+}
+
 static int bluealsa_start(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
 	debug2("Starting");
@@ -269,7 +395,7 @@ static int bluealsa_start(snd_pcm_ioplug_t *io) {
 	 * same FIFO simultaneously. Instead, just send resume signal. */
 	if (pcm->io_started) {
 		io->state = SND_PCM_STATE_RUNNING;
-		pthread_kill(pcm->io_thread, SIGIO);
+		io_thread_wakeup(pcm, false);
 		return 0;
 	}
 
@@ -289,6 +415,9 @@ static int bluealsa_start(snd_pcm_ioplug_t *io) {
 	snd_pcm_state_t prev_state = io->state;
 	io->state = SND_PCM_STATE_RUNNING;
 
+	pcm->io_stop = false;
+	gettimestamp(&pcm->io_resume_ts);
+
 	pcm->io_started = true;
 	if ((errno = pthread_create(&pcm->io_thread, NULL, io_thread, io)) != 0) {
 		debug2("Couldn't create IO thread: %s", strerror(errno));
@@ -306,9 +435,12 @@ static int bluealsa_stop(snd_pcm_ioplug_t *io) {
 	debug2("Stopping");
 
 	if (pcm->io_started) {
-		pcm->io_started = false;
-		pthread_cancel(pcm->io_thread);
+		/* The IO thread might be blocked on the PCM FIFO, or it might be
+		 * suspended waiting for the resume. In both cases, the stop request
+		 * delivered via the control channel will terminate it promptly. */
+		io_thread_wakeup(pcm, true);
 		pthread_join(pcm->io_thread, NULL);
+		pcm->io_started = false;
 	}
 	pcm->delay_valid = false;
 
@@ -334,8 +466,11 @@ static snd_pcm_sframes_t bluealsa_pointer(snd_pcm_ioplug_t *io) {
 static int bluealsa_close(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
 	debug2("Closing");
+	if (pcm->pos != NULL)
+		munmap((void *)pcm->pos, sizeof(*pcm->pos));
 	bluealsa_dbus_connection_ctx_free(&pcm->dbus_ctx);
 	close(pcm->event_fd);
+	close(pcm->io_ctrl_fd);
 	pthread_mutex_destroy(&pcm->lock);
 	free(pcm);
 	return 0;
@@ -357,6 +492,17 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 		return -EBUSY;
 	}
 
+	/* Map the PCM position published by the server. If it is not available
+	 * (e.g. older server), the delay will be approximated by ourself. */
+	int pos_fd;
+	if (io->stream == SND_PCM_STREAM_PLAYBACK &&
+			bluealsa_dbus_pcm_ctrl_get_pos(pcm->ba_pcm_ctrl_fd, &pos_fd, NULL)) {
+		void *pos;
+		if ((pos = mmap(NULL, sizeof(*pcm->pos), PROT_READ, MAP_SHARED, pos_fd, 0)) != MAP_FAILED)
+			pcm->pos = pos;
+		close(pos_fd);
+	}
+
 	/* Indicate that our PCM is ready for writing, even though is is not 100%
 	 * true - IO thread is not running yet. Some weird implementations might
 	 * require PCM to be writable before the snd_pcm_start() call. */
@@ -369,9 +515,37 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 		 * the playback mode might contribute to an unnecessary audio delay. Since
 		 * it is possible to modify the size of this buffer we will set is to some
 		 * low value, but big enough to prevent audio tearing. Note, that the size
-		 * will be rounded up to the page size (typically 4096 bytes). */
-		pcm->ba_pcm_buffer_size = fcntl(pcm->ba_pcm_fd, F_SETPIPE_SZ, 2048);
-		debug2("FIFO buffer size: %zd", pcm->ba_pcm_buffer_size);
+		 * will be rounded up to the page size (typically 4096 bytes).
+		 *
+		 * In the direct mode the FIFO is the only buffer, so it has to be able
+		 * to hold the whole HW buffer. Otherwise, the pointer callback would
+		 * report frames which were never written as consumed. */
+		const size_t size = pcm->direct ? io->buffer_size * pcm->frame_size : 2048;
+		int ret;
+		if ((ret = fcntl(pcm->ba_pcm_fd, F_SETPIPE_SZ, size)) == -1)
+			ret = fcntl(pcm->ba_pcm_fd, F_GETPIPE_SZ);
+		pcm->ba_pcm_buffer_size = ret > 0 ? ret : 0;
+		debug2("FIFO buffer size: %zu", pcm->ba_pcm_buffer_size);
+		if (pcm->direct && pcm->ba_pcm_buffer_size < size) {
+			SNDERR("Couldn't set FIFO buffer size: %zu < %zu", pcm->ba_pcm_buffer_size, size);
+			if (pcm->pos != NULL) {
+				munmap((void *)pcm->pos, sizeof(*pcm->pos));
+				pcm->pos = NULL;
+			}
+			close_transport(pcm);
+			return -EINVAL;
+		}
+	}
+
+	/* The IO thread waits for the FIFO readiness together with the control
+	 * events, so it requires non-blocking FIFO. In the direct mode the FIFO
+	 * is written by the application thread, so it has to honor the blocking
+	 * mode requested by the application. */
+	if ((!pcm->direct || io->nonblock) &&
+			fcntl(pcm->ba_pcm_fd, F_SETFL, fcntl(pcm->ba_pcm_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		debug2("Couldn't set non-blocking mode: %s", strerror(errno));
+		close_transport(pcm);
+		return -errno;
 	}
 
 	debug2("Selected HW buffer: %zd periods x %zd bytes %c= %zd bytes",
@@ -385,6 +559,10 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 static int bluealsa_hw_free(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
 	debug2("Freeing HW");
+	if (pcm->pos != NULL) {
+		munmap((void *)pcm->pos, sizeof(*pcm->pos));
+		pcm->pos = NULL;
+	}
 	if (close_transport(pcm) == -1)
 		return -errno;
 	return 0;
@@ -407,6 +585,7 @@ static int bluealsa_prepare(snd_pcm_ioplug_t *io) {
 	/* initialize ring buffer */
 	pcm->io_hw_ptr = 0;
 	pcm->io_ptr = 0;
+	pcm->direct_appl_ptr = 0;
 
 	/* Indicate that our PCM is ready for i/o, even though is is not 100%
 	 * true - the IO thread is not running yet. Applications using
@@ -432,9 +611,9 @@ static int bluealsa_pause(snd_pcm_ioplug_t *io, int enable) {
 				enable ? "Pause" : "Resume", NULL))
 		return -errno;
 
-	if (enable == 0) {
+	if (enable == 0 && !pcm->direct) {
 		io->state = SND_PCM_STATE_RUNNING;
-		pthread_kill(pcm->io_thread, SIGIO);
+		io_thread_wakeup(pcm, false);
 	}
 
 	/* Even though PCM transport is paused, our IO thread is still running. If
@@ -466,6 +645,25 @@ static int bluealsa_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) {
 	 * latency and the time required by the device to decode and play audio. */
 
 	snd_pcm_sframes_t delay = 0;
+	snd_pcm_sframes_t server_delay;
+
+	/* If the server publishes its PCM position, the delay is a sum of frames
+	 * in our ring buffer, frames in the FIFO and the server side delay. */
+	if ((server_delay = bluealsa_get_server_delay(io)) != -1) {
+
+		snd_pcm_uframes_t io_hw_ptr = pcm->io_hw_ptr;
+		if (io->appl_ptr >= io_hw_ptr)
+			delay = io->appl_ptr - io_hw_ptr;
+		else
+			delay = io->appl_ptr + pcm->io_hw_boundary - io_hw_ptr;
+
+		int nread = 0;
+		ioctl(pcm->ba_pcm_fd, FIONREAD, &nread);
+		delay += nread / pcm->frame_size;
+
+		*delayp = delay + server_delay + pcm->delay_ex;
+		return 0;
+	}
 
 	struct timespec now;
 	gettimestamp(&now);
@@ -577,6 +775,203 @@ fail:
 	return -ENODEV;
 }
 
+/**
+ * Get the number of frames queued in the PCM FIFO. */
+static snd_pcm_sframes_t bluealsa_direct_fifo_level(struct bluealsa_pcm *pcm) {
+	int nread = 0;
+	if (ioctl(pcm->ba_pcm_fd, FIONREAD, &nread) == -1)
+		return -errno;
+	return nread / pcm->frame_size;
+}
+
+static int bluealsa_direct_start(snd_pcm_ioplug_t *io) {
+	struct bluealsa_pcm *pcm = io->private_data;
+	debug2("Starting (direct)");
+
+	if (!bluealsa_dbus_pcm_ctrl_send_resume(pcm->ba_pcm_ctrl_fd, NULL)) {
+		debug2("Couldn't start PCM: %s", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int bluealsa_direct_stop(snd_pcm_ioplug_t *io) {
+	struct bluealsa_pcm *pcm = io->private_data;
+	debug2("Stopping (direct)");
+
+	if (!bluealsa_dbus_pcm_ctrl_send_drop(pcm->ba_pcm_ctrl_fd, NULL))
+		return -errno;
+
+	return 0;
+}
+
+static snd_pcm_sframes_t bluealsa_direct_pointer(snd_pcm_ioplug_t *io) {
+	struct bluealsa_pcm *pcm = io->private_data;
+
+	if (pcm->ba_pcm_fd == -1)
+		return -ENODEV;
+
+	/* In the direct mode there is no ring buffer. Frames which are not
+	 * queued in the FIFO any more, have been consumed by the server. */
+	snd_pcm_sframes_t level;
+	if ((level = bluealsa_direct_fifo_level(pcm)) < 0)
+		return level;
+
+	/* The FIFO is at least as big as the HW buffer (see hw_params), but it
+	 * might be bigger due to the page size rounding, so never report more
+	 * space than the HW buffer size. */
+	snd_pcm_uframes_t avail = 0;
+	if ((snd_pcm_uframes_t)level < io->buffer_size)
+		avail = io->buffer_size - level;
+
+	snd_pcm_uframes_t hw_ptr = pcm->direct_appl_ptr + avail;
+	return hw_ptr % io->buffer_size;
+}
+
+/**
+ * Write data to the PCM FIFO from the application thread.
+ *
+ * The SIGPIPE signal is blocked during the write, so the application will
+ * not be killed if the server closes the FIFO. Instead, EPIPE is returned
+ * and the signal generated by this write is discarded. */
+static ssize_t bluealsa_direct_write(struct bluealsa_pcm *pcm, const void *buffer,
+		size_t len) {
+
+	sigset_t sigset;
+	sigset_t oldset;
+	ssize_t ret;
+	int err;
+
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+
+	ret = write(pcm->ba_pcm_fd, buffer, len);
+	err = errno;
+
+	/* If SIGPIPE was blocked by the application, a pending
+	 * signal might not be ours, so leave it untouched. */
+	if (ret == -1 && err == EPIPE && !sigismember(&oldset, SIGPIPE)) {
+		const struct timespec timeout = { 0 };
+		while (sigtimedwait(&sigset, NULL, &timeout) == -1 && errno == EINTR)
+			continue;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	errno = err;
+	return ret;
+}
+
+static snd_pcm_sframes_t bluealsa_direct_transfer(snd_pcm_ioplug_t *io,
+		const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset,
+		snd_pcm_uframes_t size) {
+	struct bluealsa_pcm *pcm = io->private_data;
+
+	const char *buffer = (char *)areas->addr + (areas->first + areas->step * offset) / 8;
+	size_t len = size * pcm->frame_size;
+	ssize_t ret;
+
+	/* Write only whole frames, so the FIFO level can be translated
+	 * into the number of frames without any rounding error. */
+	while ((ret = bluealsa_direct_write(pcm, buffer, len)) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN)
+			return -EAGAIN;
+		SNDERR("PCM FIFO write error: %s", strerror(errno));
+		return errno == EPIPE ? -ENODEV : -errno;
+	}
+
+	size_t frames = ret / pcm->frame_size;
+	if ((size_t)ret % pcm->frame_size != 0) {
+		/* Partial frame has been written, so we have to complete it. The
+		 * remaining few bytes will not block the caller for too long. */
+		size_t rest = pcm->frame_size - ret % pcm->frame_size;
+		const char *head = buffer + ret;
+		while (rest != 0) {
+			if ((ret = bluealsa_direct_write(pcm, head, rest)) == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN) {
+					/* wait for the server to read some data */
+					struct pollfd pfd = { pcm->ba_pcm_fd, POLLOUT, 0 };
+					if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+						return -errno;
+					continue;
+				}
+				SNDERR("PCM FIFO write error: %s", strerror(errno));
+				return errno == EPIPE ? -ENODEV : -errno;
+			}
+			head += ret;
+			rest -= ret;
+		}
+		frames++;
+	}
+
+	pcm->direct_appl_ptr = (pcm->direct_appl_ptr + frames) % io->buffer_size;
+	return frames;
+}
+
+static int bluealsa_direct_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) {
+	struct bluealsa_pcm *pcm = io->private_data;
+
+	if (pcm->ba_pcm_fd == -1)
+		return -ENODEV;
+
+	snd_pcm_sframes_t level;
+	if ((level = bluealsa_direct_fifo_level(pcm)) < 0)
+		return level;
+
+	/* data transfer (communication) and encoding/decoding */
+	if ((pcm->delay = bluealsa_get_server_delay(io)) == -1)
+		pcm->delay = (io->rate / 100) * pcm->ba_pcm.delay / 100;
+
+	*delayp = level + pcm->delay + pcm->delay_ex;
+	return 0;
+}
+
+static int bluealsa_direct_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfd,
+		unsigned int nfds) {
+	struct bluealsa_pcm *pcm = io->private_data;
+
+	nfds_t dbus_nfds = nfds - 1;
+	if (!bluealsa_dbus_connection_poll_fds(&pcm->dbus_ctx, &pfd[1], &dbus_nfds))
+		return -EINVAL;
+
+	/* Writing readiness is reported by the PCM FIFO itself. */
+	pfd[0].fd = pcm->ba_pcm_fd;
+	pfd[0].events = POLLOUT;
+
+	return 1 + dbus_nfds;
+}
+
+static int bluealsa_direct_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
+		unsigned int nfds, unsigned short *revents) {
+	struct bluealsa_pcm *pcm = io->private_data;
+
+	if (bluealsa_dbus_connection_poll_dispatch(&pcm->dbus_ctx, &pfd[1], nfds - 1))
+		while (dbus_connection_dispatch(pcm->dbus_ctx.conn) == DBUS_DISPATCH_DATA_REMAINS)
+			continue;
+
+	if (pcm->ba_pcm_fd == -1)
+		return -ENODEV;
+
+	if (pfd[0].revents & (POLLERR | POLLHUP)) {
+		*revents = POLLERR | POLLHUP;
+		return -ENODEV;
+	}
+
+	*revents = pfd[0].revents & POLLOUT;
+	if (io->state != SND_PCM_STATE_PREPARED &&
+			io->state != SND_PCM_STATE_RUNNING &&
+			io->state != SND_PCM_STATE_DRAINING)
+		*revents |= POLLERR;
+
+	return 0;
+}
+
 static const snd_pcm_ioplug_callback_t bluealsa_callback = {
 	.start = bluealsa_start,
 	.stop = bluealsa_stop,
@@ -595,6 +990,25 @@ static const snd_pcm_ioplug_callback_t bluealsa_callback = {
 	.poll_revents = bluealsa_poll_revents,
 };
 
+static const snd_pcm_ioplug_callback_t bluealsa_callback_direct = {
+	.start = bluealsa_direct_start,
+	.stop = bluealsa_direct_stop,
+	.pointer = bluealsa_direct_pointer,
+	.transfer = bluealsa_direct_transfer,
+	.close = bluealsa_close,
+	.hw_params = bluealsa_hw_params,
+	.hw_free = bluealsa_hw_free,
+	.sw_params = bluealsa_sw_params,
+	.prepare = bluealsa_prepare,
+	.drain = bluealsa_drain,
+	.pause = bluealsa_pause,
+	.dump = bluealsa_dump,
+	.delay = bluealsa_direct_delay,
+	.poll_descriptors_count = bluealsa_poll_descriptors_count,
+	.poll_descriptors = bluealsa_direct_poll_descriptors,
+	.poll_revents = bluealsa_direct_poll_revents,
+};
+
 static int str2bdaddr(const char *str, bdaddr_t *ba) {
 
 	unsigned int x[6];
@@ -656,8 +1070,19 @@ static int bluealsa_set_hw_constraint(struct bluealsa_pcm *pcm) {
 					min_p, 1024 * 16)) < 0)
 		return err;
 
+	/* In the direct mode the HW buffer is the FIFO itself, so it can not be
+	 * bigger than the maximal pipe size allowed for unprivileged users. */
+	unsigned int max_b = 1024 * 1024 * 16;
+	FILE *f;
+	if (pcm->direct && (f = fopen("/proc/sys/fs/pipe-max-size", "r")) != NULL) {
+		unsigned int size;
+		if (fscanf(f, "%u", &size) == 1 && size >= min_b && size < max_b)
+			max_b = size;
+		fclose(f);
+	}
+
 	if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_BUFFER_BYTES,
-					min_b, 1024 * 1024 * 16)) < 0)
+					min_b, max_b)) < 0)
 		return err;
 
 	if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_CHANNELS,
@@ -680,6 +1105,7 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 	const char *profile = NULL;
 	struct bluealsa_pcm *pcm;
 	long delay = 0;
+	int direct = 0;
 	int ret;
 
 	snd_config_for_each(i, next, conf) {
@@ -722,6 +1148,13 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 			}
 			continue;
 		}
+		if (strcmp(id, "direct") == 0) {
+			if ((direct = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
 
 		SNDERR("Unknown field %s", id);
 		return -EINVAL;
@@ -743,9 +1176,12 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 		return -ENOMEM;
 
 	pcm->event_fd = -1;
+	pcm->io_ctrl_fd = -1;
 	pcm->ba_pcm_fd = -1;
 	pcm->ba_pcm_ctrl_fd = -1;
 	pcm->delay_ex = delay;
+	/* direct mode is supported for playback only */
+	pcm->direct = direct && stream == SND_PCM_STREAM_PLAYBACK;
 	pthread_mutex_init(&pcm->lock, NULL);
 
 	dbus_threads_init_default();
@@ -770,11 +1206,22 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 		goto fail;
 	}
 
+	if ((pcm->io_ctrl_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		ret = -errno;
+		goto fail;
+	}
+
 	pcm->io.version = SND_PCM_IOPLUG_VERSION;
 	pcm->io.name = "BlueALSA";
 	pcm->io.flags = SND_PCM_IOPLUG_FLAG_LISTED;
-	pcm->io.mmap_rw = 1;
-	pcm->io.callback = &bluealsa_callback;
+#ifdef SND_PCM_IOPLUG_FLAG_MONOTONIC
+	/* Report time-stamps with the same clock which is used by the server
+	 * for the PCM position, so the delay and the time-stamp returned by
+	 * the snd_pcm_htimestamp() are consistent. */
+	pcm->io.flags |= SND_PCM_IOPLUG_FLAG_MONOTONIC;
+#endif
+	pcm->io.mmap_rw = pcm->direct ? 0 : 1;
+	pcm->io.callback = pcm->direct ? &bluealsa_callback_direct : &bluealsa_callback;
 	pcm->io.private_data = pcm;
 
 	if ((ret = snd_pcm_ioplug_create(&pcm->io, name, stream, mode)) < 0)
@@ -793,6 +1240,8 @@ fail:
 	dbus_error_free(&err);
 	if (pcm->event_fd != -1)
 		close(pcm->event_fd);
+	if (pcm->io_ctrl_fd != -1)
+		close(pcm->io_ctrl_fd);
 	free(pcm);
 	return ret;
 }
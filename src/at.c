@@ -11,11 +11,10 @@
 
 #include "at.h"
 
-#include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
-#include <strings.h>
 
 #include "shared/defs.h"
 #include "shared/log.h"
@@ -63,49 +62,57 @@ char *at_build(char *buffer, enum bt_at_type type, const char *command,
 }
 
 /**
- * Parse AT message.
+ * Tokenize AT message in place.
  *
- * @param str String to parse.
+ * This function does not copy any data. Instead, the message terminators
+ * and separators within the given string are replaced with the null byte,
+ * so the command and the value of the AT structure point directly into the
+ * input string.
+ *
+ * @param str String to tokenize. It will be modified by this function.
  * @param at Address of the AT structure, where the parsed information will
  *   be stored.
  * @return On success this function returns a pointer to the next message
  *   within the input string. If the input string contains only one message,
  *   returned value will point to the end null byte. On error, this function
- *   returns NULL. */
-char *at_parse(const char *str, struct bt_at *at) {
+ *   returns NULL and errno is set to indicate the error. If the message is
+ *   not complete (the <CR> character was not found), errno is set to the
+ *   EAGAIN, so one might append more data to the string and try again. */
+char *at_tokenize(char *str, struct bt_at *at) {
 
-	char *command = at->command;
 	bool is_command = false;
-	const char *feed;
+	char *command;
+	char *feed;
 	char *tmp;
 
+	/* Consume empty messages. Also, skip the <LF> character of the previous
+	 * response, if the <CR><LF> sequence was split across the reads. */
+	while (str[0] == '\r' || (str[0] == '\n' && (str[1] == '\r' || str[1] == '\n')))
+		str++;
+
 	/* locate <CR> character, which indicates end of message */
-	if ((feed = strchr(str, '\r')) == NULL)
+	if ((feed = strchr(str, '\r')) == NULL) {
+		errno = EAGAIN;
 		return NULL;
-
-	/* consume empty message */
-	if (feed == str)
-		return at_parse(feed + 1, at);
+	}
 
 	/* check whether we are parsing AT command */
-	if (strncasecmp(str, "AT", 2) == 0) {
+	if ((str[0] == 'A' || str[0] == 'a') && (str[1] == 'T' || str[1] == 't')) {
 		is_command = true;
-		str += 2;
+		command = &str[2];
 	}
 	else {
 		/* response starts with <LF> sequence */
-		if (str[0] != '\n')
+		if (str[0] != '\n') {
+			errno = EBADMSG;
 			return NULL;
-		str += 1;
+		}
+		command = &str[1];
 	}
 
-	strncpy(command, str, sizeof(at->command) - 1);
+	*feed++ = '\0';
 	at->value = NULL;
 
-	/* check everything twice (we don't want to be hacked) */
-	if ((size_t)(feed - str) < sizeof(at->command))
-		command[feed - str] = '\0';
-
 	if (is_command) {
 
 		/* determine command type */
@@ -140,26 +147,58 @@ char *at_parse(const char *str, struct bt_at *at) {
 		}
 		else {
 			/* unsolicited (with empty command) result code */
-			at->value = memmove(command + 1, command, sizeof(at->command) - 1);
-			command[0] = command[sizeof(at->command) - 1] = '\0';
+			at->value = command;
+			command = &feed[-1];
 		}
 
 		/* consume <LF> from the end of the response */
-		if (feed[1] == '\n')
+		if (feed[0] == '\n')
 			feed++;
 
 	}
 
+	at->command = command;
+
 	/* In the BT specification, all AT commands are in uppercase letters.
 	 * However, if someone will not respect this "convention", we will make
 	 * life easier by converting received command to all uppercase. */
-	while (*command != '\0') {
-		*command = toupper(*command);
-		command++;
-	}
+	for (; *command != '\0'; command++)
+		if (*command >= 'a' && *command <= 'z')
+			*command -= 'a' - 'A';
 
 	debug("AT message: %s: command:%s, value:%s", at_type2str(at->type), at->command, at->value);
-	return (char *)&feed[1];
+	return feed;
+}
+
+/**
+ * Parse AT message.
+ *
+ * This function makes a copy of the input string in the buffer of the AT
+ * structure, and tokenizes it with the at_tokenize(). Hence, the maximal
+ * length of the message is limited by the size of this buffer.
+ *
+ * @param str String to parse.
+ * @param at Address of the AT structure, where the parsed information will
+ *   be stored.
+ * @return On success this function returns a pointer to the next message
+ *   within the input string. If the input string contains only one message,
+ *   returned value will point to the end null byte. On error, this function
+ *   returns NULL. */
+char *at_parse(const char *str, struct bt_at *at) {
+
+	size_t len = strlen(str);
+	char *next;
+
+	if (len > sizeof(at->buffer) - 1)
+		len = sizeof(at->buffer) - 1;
+
+	memcpy(at->buffer, str, len);
+	at->buffer[len] = '\0';
+
+	if ((next = at_tokenize(at->buffer, at)) == NULL)
+		return NULL;
+
+	return (char *)&str[next - at->buffer];
 }
 
 /**
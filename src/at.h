@@ -26,12 +26,15 @@ enum bt_at_type {
 
 struct bt_at {
 	enum bt_at_type type;
-	char command[256];
+	const char *command;
 	char *value;
+	/* storage for the message parsed with at_parse() */
+	char buffer[256];
 };
 
 char *at_build(char *buffer, enum bt_at_type type, const char *command,
 		const char *value);
+char *at_tokenize(char *str, struct bt_at *at);
 char *at_parse(const char *str, struct bt_at *at);
 int at_parse_cind(const char *str, enum hfp_ind map[20]);
 const char *at_type2str(enum bt_at_type type);
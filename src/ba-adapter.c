@@ -11,6 +11,7 @@
 #include "ba-adapter.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,6 +22,7 @@
 
 #include "ba-device.h"
 #include "bluealsa.h"
+#include "rcu.h"
 #include "utils.h"
 #include "shared/log.h"
 
@@ -54,7 +56,7 @@ struct ba_adapter *ba_adapter_new(int dev_id) {
 		a->hci.dev_id = dev_id;
 	}
 
-	a->ref_count = 1;
+	atomic_init(&a->ref_count, 1);
 
 	sprintf(a->ba_dbus_path, "/org/bluealsa/%s", a->hci.name);
 	g_variant_sanitize_object_path(a->ba_dbus_path);
@@ -63,9 +65,10 @@ struct ba_adapter *ba_adapter_new(int dev_id) {
 
 	pthread_mutex_init(&a->devices_mutex, NULL);
 	a->devices = g_hash_table_new_full(g_bdaddr_hash, g_bdaddr_equal, NULL, NULL);
+	rcu_array_publish(&a->devices_index, a->devices);
 
 	pthread_mutex_lock(&config.adapters_mutex);
-	config.adapters[a->hci.dev_id] = a;
+	atomic_store_explicit(&config.adapters[a->hci.dev_id], a, memory_order_release);
 	pthread_mutex_unlock(&config.adapters_mutex);
 
 	return a;
@@ -77,19 +80,19 @@ struct ba_adapter *ba_adapter_lookup(int dev_id) {
 		return NULL;
 
 	struct ba_adapter *a;
+	unsigned int rcu = rcu_read_lock();
 
-	pthread_mutex_lock(&config.adapters_mutex);
-	if ((a = config.adapters[dev_id]) != NULL)
-		a->ref_count++;
-	pthread_mutex_unlock(&config.adapters_mutex);
+	/* adapter with zero references is being freed, treat it as not found */
+	if ((a = atomic_load_explicit(&config.adapters[dev_id], memory_order_acquire)) != NULL &&
+			!rcu_ref_get_unless_zero(&a->ref_count))
+		a = NULL;
 
+	rcu_read_unlock(rcu);
 	return a;
 }
 
 struct ba_adapter *ba_adapter_ref(struct ba_adapter *a) {
-	pthread_mutex_lock(&config.adapters_mutex);
-	a->ref_count++;
-	pthread_mutex_unlock(&config.adapters_mutex);
+	atomic_fetch_add_explicit(&a->ref_count, 1, memory_order_relaxed);
 	return a;
 }
 
@@ -104,7 +107,9 @@ void ba_adapter_destroy(struct ba_adapter *a) {
 	for (;;) {
 
 		GHashTableIter iter;
+		struct rcu_array *index;
 		struct ba_device *d;
+		bool alive;
 
 		pthread_mutex_lock(&a->devices_mutex);
 
@@ -114,35 +119,47 @@ void ba_adapter_destroy(struct ba_adapter *a) {
 			break;
 		}
 
-		d->ref_count++;
+		/* Device which has already dropped its last reference is waiting
+		 * for this mutex in order to detach itself. Steal it anyway, so
+		 * the ba_device_unref() will not touch our hash table. */
+		alive = rcu_ref_get_unless_zero(&d->ref_count);
 		g_hash_table_iter_steal(&iter);
+		index = rcu_array_publish(&a->devices_index, a->devices);
 
 		pthread_mutex_unlock(&a->devices_mutex);
 
-		ba_device_destroy(d);
+		rcu_array_free(index);
+
+		if (alive)
+			ba_device_destroy(d);
 	}
 
 	ba_adapter_unref(a);
 }
 
+static void ba_adapter_free(struct rcu_head *head) {
+	free(rcu_container_of(head, struct ba_adapter, rcu));
+}
+
 void ba_adapter_unref(struct ba_adapter *a) {
 
-	int ref_count;
+	if (atomic_fetch_sub_explicit(&a->ref_count, 1, memory_order_acq_rel) > 1)
+		return;
 
 	pthread_mutex_lock(&config.adapters_mutex);
-	if ((ref_count = --a->ref_count) == 0)
-		/* detach adapter from global configuration */
-		config.adapters[a->hci.dev_id] = NULL;
+	/* detach adapter from global configuration */
+	if (atomic_load_explicit(&config.adapters[a->hci.dev_id], memory_order_relaxed) == a)
+		atomic_store_explicit(&config.adapters[a->hci.dev_id], NULL, memory_order_release);
 	pthread_mutex_unlock(&config.adapters_mutex);
 
-	if (ref_count > 0)
-		return;
-
 	debug("Freeing adapter: %s", a->hci.name);
 
+	free(atomic_load_explicit(&a->devices_index, memory_order_relaxed));
 	g_hash_table_unref(a->devices);
 	pthread_mutex_destroy(&a->devices_mutex);
-	free(a);
+
+	/* lock-free readers might still see this adapter */
+	rcu_call(&a->rcu, ba_adapter_free);
 }
 
 int ba_adapter_get_hfp_features_hf(struct ba_adapter *a) {
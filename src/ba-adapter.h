@@ -16,12 +16,15 @@
 #endif
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include <glib.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 
+#include "rcu.h"
+
 /* Data associated with BT adapter. */
 struct ba_adapter {
 
@@ -35,9 +38,12 @@ struct ba_adapter {
 	/* collection of connected devices */
 	pthread_mutex_t devices_mutex;
 	GHashTable *devices;
+	/* lock-free lookup index of devices */
+	struct rcu_array * _Atomic devices_index;
 
 	/* memory self-management */
-	int ref_count;
+	atomic_int ref_count;
+	struct rcu_head rcu;
 
 };
 
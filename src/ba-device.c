@@ -10,6 +10,7 @@
 
 #include "ba-device.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -28,7 +29,7 @@ struct ba_device *ba_device_new(
 
 	d->a = ba_adapter_ref(adapter);
 	bacpy(&d->addr, addr);
-	d->ref_count = 1;
+	atomic_init(&d->ref_count, 1);
 
 	char tmp[sizeof("dev_XX:XX:XX:XX:XX:XX")];
 	sprintf(tmp, "dev_%.2X_%.2X_%.2X_%.2X_%.2X_%.2X",
@@ -40,11 +41,17 @@ struct ba_device *ba_device_new(
 
 	pthread_mutex_init(&d->transports_mutex, NULL);
 	d->transports = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+	rcu_array_publish(&d->transports_index, d->transports);
+
+	struct rcu_array *index;
 
 	pthread_mutex_lock(&adapter->devices_mutex);
 	g_hash_table_insert(adapter->devices, &d->addr, d);
+	index = rcu_array_publish(&adapter->devices_index, adapter->devices);
 	pthread_mutex_unlock(&adapter->devices_mutex);
 
+	rcu_array_free(index);
+
 	return d;
 }
 
@@ -52,11 +59,30 @@ struct ba_device *ba_device_lookup(
 		struct ba_adapter *adapter,
 		const bdaddr_t *addr) {
 
-	struct ba_device *d;
+	struct ba_device *d = NULL;
+	struct rcu_array *index;
+	unsigned int rcu = rcu_read_lock();
+
+	if ((index = atomic_load_explicit(&adapter->devices_index, memory_order_acquire)) != NULL) {
+		size_t i;
+		for (i = 0; i < index->len; i++)
+			if (bacmp(&((struct ba_device *)index->items[i])->addr, addr) == 0) {
+				d = index->items[i];
+				break;
+			}
+		if (d != NULL && !rcu_ref_get_unless_zero(&d->ref_count))
+			d = NULL;
+		rcu_read_unlock(rcu);
+		return d;
+	}
+
+	rcu_read_unlock(rcu);
 
+	/* fall-back to the locked lookup if there is no index */
 	pthread_mutex_lock(&adapter->devices_mutex);
-	if ((d = g_hash_table_lookup(adapter->devices, addr)) != NULL)
-		d->ref_count++;
+	if ((d = g_hash_table_lookup(adapter->devices, addr)) != NULL &&
+			!rcu_ref_get_unless_zero(&d->ref_count))
+		d = NULL;
 	pthread_mutex_unlock(&adapter->devices_mutex);
 
 	return d;
@@ -64,13 +90,7 @@ struct ba_device *ba_device_lookup(
 
 struct ba_device *ba_device_ref(
 		struct ba_device *d) {
-
-	struct ba_adapter *a = d->a;
-
-	pthread_mutex_lock(&a->devices_mutex);
-	d->ref_count++;
-	pthread_mutex_unlock(&a->devices_mutex);
-
+	atomic_fetch_add_explicit(&d->ref_count, 1, memory_order_relaxed);
 	return d;
 }
 
@@ -93,7 +113,9 @@ void ba_device_destroy(struct ba_device *d) {
 	for (;;) {
 
 		GHashTableIter iter;
+		struct rcu_array *index;
 		struct ba_transport *t;
+		bool alive;
 
 		pthread_mutex_lock(&d->transports_mutex);
 
@@ -103,37 +125,52 @@ void ba_device_destroy(struct ba_device *d) {
 			break;
 		}
 
-		t->ref_count++;
+		alive = rcu_ref_get_unless_zero(&t->ref_count);
 		g_hash_table_iter_steal(&iter);
+		index = rcu_array_publish(&d->transports_index, d->transports);
 
 		pthread_mutex_unlock(&d->transports_mutex);
 
-		ba_transport_destroy(t);
+		rcu_array_free(index);
+
+		if (alive)
+			ba_transport_destroy(t);
 	}
 
 	ba_device_unref(d);
 }
 
+static void ba_device_free(struct rcu_head *head) {
+	free(rcu_container_of(head, struct ba_device, rcu));
+}
+
 void ba_device_unref(struct ba_device *d) {
 
-	int ref_count;
 	struct ba_adapter *a = d->a;
+	struct rcu_array *index = NULL;
+
+	if (atomic_fetch_sub_explicit(&d->ref_count, 1, memory_order_acq_rel) > 1)
+		return;
 
 	pthread_mutex_lock(&a->devices_mutex);
-	if ((ref_count = --d->ref_count) == 0)
-		/* detach device from the adapter */
+	/* detach device from the adapter (unless it was stolen already) */
+	if (g_hash_table_lookup(a->devices, &d->addr) == d) {
 		g_hash_table_steal(a->devices, &d->addr);
+		index = rcu_array_publish(&a->devices_index, a->devices);
+	}
 	pthread_mutex_unlock(&a->devices_mutex);
 
-	if (ref_count > 0)
-		return;
+	rcu_array_free(index);
 
 	debug("Freeing device: %s", batostr_(&d->addr));
 
 	ba_adapter_unref(a);
+	free(atomic_load_explicit(&d->transports_index, memory_order_relaxed));
 	g_hash_table_unref(d->transports);
 	pthread_mutex_destroy(&d->transports_mutex);
 	g_free(d->bluez_dbus_path);
 	g_free(d->ba_dbus_path);
-	free(d);
+
+	/* lock-free readers might still see this device */
+	rcu_call(&d->rcu, ba_device_free);
 }
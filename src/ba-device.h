@@ -16,12 +16,20 @@
 #endif
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 #include <bluetooth/bluetooth.h>
 #include <glib.h>
 
 #include "ba-adapter.h"
+#include "rcu.h"
+
+/* known device-specific deviations from the specification */
+enum ba_device_quirk {
+	/* AAC RTP payload with the marker bit used for fragmentation */
+	BA_DEVICE_QUIRK_AAC_MARKBIT = 1 << 0,
+};
 
 struct ba_device {
 
@@ -51,12 +59,23 @@ struct ba_device {
 
 	} xapl;
 
+	/* time (ms) of the last HFP service level connection establishment */
+	unsigned int hfp_slc_time;
+	/* time (ms) from the A2DP transport acquisition to the first audio data */
+	unsigned int a2dp_audio_time;
+
+	/* bitmask of detected device quirks */
+	atomic_uint quirks;
+
 	/* hash-map with connected transports */
 	pthread_mutex_t transports_mutex;
 	GHashTable *transports;
+	/* lock-free lookup index of transports */
+	struct rcu_array * _Atomic transports_index;
 
 	/* memory self-management */
-	int ref_count;
+	atomic_int ref_count;
+	struct rcu_head rcu;
 
 };
 
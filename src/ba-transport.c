@@ -11,11 +11,15 @@
 #include "ba-transport.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <bluetooth/bluetooth.h>
@@ -28,14 +32,34 @@
 #include <glib.h>
 
 #include "a2dp-codecs.h"
+#include "a2dp-policy.h"
 #include "ba-adapter.h"
 #include "bluealsa.h"
 #include "bluealsa-dbus.h"
 #include "bluez-iface.h"
 #include "hfp.h"
 #include "io.h"
+#include "rcu.h"
+#include "storage.h"
+#include "shared/defs.h"
 #include "utils.h"
 #include "shared/log.h"
+#include "shared/rt.h"
+
+/**
+ * Initialize transport signal queue. */
+static int ba_transport_sigq_init(struct ba_transport_sigq *q) {
+
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(q->ring); i++)
+		atomic_init(&q->ring[i].seq, i);
+
+	if ((q->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		return -1;
+
+	return 0;
+}
 
 /**
  * Create new transport.
@@ -62,29 +86,35 @@ struct ba_transport *ba_transport_new(
 
 	t->d = ba_device_ref(device);
 	t->type = type;
-	t->ref_count = 1;
+	atomic_init(&t->ref_count, 1);
 
 	pthread_mutex_init(&t->mutex, NULL);
+	pthread_cond_init(&t->thread_exited, NULL);
+	pthread_mutex_init(&t->drain_mtx, NULL);
 
 	t->state = TRANSPORT_IDLE;
 	t->thread = config.main_thread;
 
 	t->bt_fd = -1;
-	t->sig_fd[0] = -1;
-	t->sig_fd[1] = -1;
+	t->sigq.fd = -1;
 
 	if ((t->bluez_dbus_owner = strdup(dbus_owner)) == NULL)
 		goto fail;
 	if ((t->bluez_dbus_path = strdup(dbus_path)) == NULL)
 		goto fail;
 
-	if (pipe(t->sig_fd) == -1)
+	if (ba_transport_sigq_init(&t->sigq) == -1)
 		goto fail;
 
+	struct rcu_array *index;
+
 	pthread_mutex_lock(&device->transports_mutex);
 	g_hash_table_insert(device->transports, t->bluez_dbus_path, t);
+	index = rcu_array_publish(&device->transports_index, device->transports);
 	pthread_mutex_unlock(&device->transports_mutex);
 
+	rcu_array_free(index);
+
 	return t;
 
 fail:
@@ -127,8 +157,7 @@ struct ba_transport *ba_transport_new_a2dp(
 
 	t->a2dp.pcm.fd = -1;
 	t->a2dp.pcm.client = -1;
-	pthread_mutex_init(&t->a2dp.drained_mtx, NULL);
-	pthread_cond_init(&t->a2dp.drained, NULL);
+	t->a2dp.pcm.pos_fd = -1;
 
 	t->acquire = transport_acquire_bt_a2dp;
 	t->release = transport_release_bt_a2dp;
@@ -206,12 +235,12 @@ struct ba_transport *ba_transport_new_sco(
 
 	t->sco.spk_pcm.fd = -1;
 	t->sco.spk_pcm.client = -1;
+	t->sco.spk_pcm.pos_fd = -1;
 
 	t->sco.mic_pcm.fd = -1;
 	t->sco.mic_pcm.client = -1;
+	t->sco.mic_pcm.pos_fd = -1;
 
-	pthread_mutex_init(&t->sco.spk_drained_mtx, NULL);
-	pthread_cond_init(&t->sco.spk_drained, NULL);
 
 	t->acquire = transport_acquire_bt_sco;
 	t->release = transport_release_bt_sco;
@@ -226,11 +255,30 @@ struct ba_transport *ba_transport_lookup(
 		struct ba_device *device,
 		const char *dbus_path) {
 
-	struct ba_transport *t;
+	struct ba_transport *t = NULL;
+	struct rcu_array *index;
+	unsigned int rcu = rcu_read_lock();
+
+	if ((index = atomic_load_explicit(&device->transports_index, memory_order_acquire)) != NULL) {
+		size_t i;
+		for (i = 0; i < index->len; i++)
+			if (strcmp(((struct ba_transport *)index->items[i])->bluez_dbus_path, dbus_path) == 0) {
+				t = index->items[i];
+				break;
+			}
+		if (t != NULL && !rcu_ref_get_unless_zero(&t->ref_count))
+			t = NULL;
+		rcu_read_unlock(rcu);
+		return t;
+	}
+
+	rcu_read_unlock(rcu);
 
+	/* fall-back to the locked lookup if there is no index */
 	pthread_mutex_lock(&device->transports_mutex);
-	if ((t = g_hash_table_lookup(device->transports, dbus_path)) != NULL)
-		t->ref_count++;
+	if ((t = g_hash_table_lookup(device->transports, dbus_path)) != NULL &&
+			!rcu_ref_get_unless_zero(&t->ref_count))
+		t = NULL;
 	pthread_mutex_unlock(&device->transports_mutex);
 
 	return t;
@@ -238,56 +286,78 @@ struct ba_transport *ba_transport_lookup(
 
 struct ba_transport *ba_transport_ref(
 		struct ba_transport *t) {
-
-	struct ba_device *d = t->d;
-
-	pthread_mutex_lock(&d->transports_mutex);
-	t->ref_count++;
-	pthread_mutex_unlock(&d->transports_mutex);
-
+	atomic_fetch_add_explicit(&t->ref_count, 1, memory_order_relaxed);
 	return t;
 }
 
+/**
+ * Release PCM position shared memory. */
+static void ba_transport_free_pcm_pos(struct ba_pcm *pcm) {
+	if (pcm->pos != NULL)
+		munmap(pcm->pos, sizeof(*pcm->pos));
+	if (pcm->pos_fd != -1)
+		close(pcm->pos_fd);
+	pcm->pos = NULL;
+	pcm->pos_fd = -1;
+}
+
 void ba_transport_destroy(struct ba_transport *t) {
 
-	/* If the transport is active, prior to releasing resources, we have to
-	 * terminate the IO thread (or at least make sure it is not running any
-	 * more). Not doing so might result in an undefined behavior or even a
-	 * race condition (closed and reused file descriptor). */
-	ba_transport_pthread_cancel(t->thread);
+	/* If the transport is active, we have to terminate the IO thread prior
+	 * to releasing resources. The IO thread will release resources on its
+	 * own upon exit, and it will drop the reference it holds. Releasing
+	 * resources here might result in an undefined behavior or even a race
+	 * condition (closed and reused file descriptor). */
+	const bool running = ba_transport_pthread_stop(t);
+
+	/* Remember negotiation results for the next connection. The IO thread
+	 * updates the delay and volume, so wait for its termination first. */
+	ba_transport_pthread_join(t);
+	storage_transport_save(t);
 
 	/* remove D-Bus interface */
 	bluealsa_dbus_transport_unregister(t);
 
 	/* if possible, try to release resources gracefully */
-	if (t->release != NULL)
+	if (!running && t->release != NULL)
 		t->release(t);
 
 	ba_transport_unref(t);
 }
 
+static void ba_transport_free(struct rcu_head *head) {
+	struct ba_transport *t = rcu_container_of(head, struct ba_transport, rcu);
+	free(t->bluez_dbus_path);
+	free(t);
+}
+
 void ba_transport_unref(struct ba_transport *t) {
 
-	int ref_count;
 	struct ba_device *d = t->d;
+	struct rcu_array *index = NULL;
+
+	if (atomic_fetch_sub_explicit(&t->ref_count, 1, memory_order_acq_rel) > 1)
+		return;
 
 	pthread_mutex_lock(&d->transports_mutex);
-	if ((ref_count = --t->ref_count) == 0)
-		/* detach transport from the device */
+	/* detach transport from the device (unless it was stolen already) */
+	if (t->bluez_dbus_path != NULL &&
+			g_hash_table_lookup(d->transports, t->bluez_dbus_path) == t) {
 		g_hash_table_steal(d->transports, t->bluez_dbus_path);
+		index = rcu_array_publish(&d->transports_index, d->transports);
+	}
 	pthread_mutex_unlock(&d->transports_mutex);
 
-	if (ref_count > 0)
-		return;
+	rcu_array_free(index);
 
 	debug("Freeing transport: %s", ba_transport_type_to_string(t->type));
 
 	if (t->bt_fd != -1)
 		close(t->bt_fd);
-	if (t->sig_fd[0] != -1)
-		close(t->sig_fd[0]);
-	if (t->sig_fd[1] != -1)
-		close(t->sig_fd[1]);
+	if (t->sigq.fd != -1)
+		close(t->sigq.fd);
+
+	io_arena_free(t->arena);
 
 	ba_device_unref(d);
 
@@ -299,47 +369,170 @@ void ba_transport_unref(struct ba_transport *t) {
 		d->battery_level = -1;
 	}
 	else if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_SCO) {
-		pthread_mutex_destroy(&t->sco.spk_drained_mtx);
-		pthread_cond_destroy(&t->sco.spk_drained);
 		ba_transport_release_pcm(&t->sco.spk_pcm);
 		ba_transport_release_pcm(&t->sco.mic_pcm);
+		ba_transport_free_pcm_pos(&t->sco.spk_pcm);
+		ba_transport_free_pcm_pos(&t->sco.mic_pcm);
 		if (t->sco.rfcomm != NULL)
 			ba_transport_unref(t->sco.rfcomm);
 	}
 	else if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP) {
 		ba_transport_release_pcm(&t->a2dp.pcm);
-		pthread_mutex_destroy(&t->a2dp.drained_mtx);
-		pthread_cond_destroy(&t->a2dp.drained);
+		ba_transport_free_pcm_pos(&t->a2dp.pcm);
 		free(t->a2dp.cconfig);
 	}
 
+	pthread_mutex_destroy(&t->drain_mtx);
+	pthread_cond_destroy(&t->thread_exited);
 	pthread_mutex_destroy(&t->mutex);
 	if (t->ba_dbus_path != NULL)
 		g_free(t->ba_dbus_path);
 	free(t->bluez_dbus_owner);
-	free(t->bluez_dbus_path);
-	free(t);
+
+	/* Lock-free readers might still see this transport, and they compare
+	 * the D-Bus path, so it has to be released along with the structure. */
+	rcu_call(&t->rcu, ba_transport_free);
 }
 
-int ba_transport_send_signal(struct ba_transport *t, enum ba_transport_signal sig) {
-	return write(t->sig_fd[1], &sig, sizeof(sig));
+/**
+ * Check whether given signal can be coalesced with the pending one. */
+static bool ba_transport_signal_is_idempotent(enum ba_transport_signal sig) {
+	switch (sig) {
+	case TRANSPORT_PING:
+	case TRANSPORT_SET_VOLUME:
+	case TRANSPORT_SET_CODEC_LIMITS:
+	case TRANSPORT_STOP:
+		return true;
+	default:
+		return false;
+	}
 }
 
-enum ba_transport_signal ba_transport_recv_signal(struct ba_transport *t) {
+/**
+ * Send signal to the transport IO thread.
+ *
+ * This function is thread-safe and lock-free, hence it can be called from
+ * any thread, including other IO threads.
+ *
+ * @param t Transport structure.
+ * @param sig Signal to send.
+ * @param arg Signal specific payload. For coalesced signals only the
+ *   latest payload is delivered.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int ba_transport_send_signal_arg(struct ba_transport *t, enum ba_transport_signal sig,
+		uint32_t arg) {
+
+	struct ba_transport_sigq *q = &t->sigq;
+
+	if (ba_transport_signal_is_idempotent(sig)) {
+		atomic_store_explicit(&q->coalesced_arg[sig], arg, memory_order_relaxed);
+		if (atomic_fetch_or_explicit(&q->coalesced, 1 << sig, memory_order_release) & (1 << sig))
+			/* the same signal is already pending */
+			return 0;
+	}
+	else {
+
+		size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		size_t seq;
+
+		for (;;) {
+			seq = atomic_load_explicit(&q->ring[pos % ARRAYSIZE(q->ring)].seq,
+					memory_order_acquire);
+			if (seq == pos) {
+				if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+							memory_order_relaxed, memory_order_relaxed))
+					break;
+			}
+			else if ((ssize_t)(seq - pos) < 0) {
+				warn("Transport signal queue overflow: %d", sig);
+				errno = ENOBUFS;
+				return -1;
+			}
+			else
+				pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+
+		q->ring[pos % ARRAYSIZE(q->ring)].msg.sig = sig;
+		q->ring[pos % ARRAYSIZE(q->ring)].msg.arg = arg;
+		atomic_store_explicit(&q->ring[pos % ARRAYSIZE(q->ring)].seq, pos + 1,
+				memory_order_release);
+
+	}
+
+	/* ring the doorbell unless consumer has not acknowledged it yet */
+	if (!atomic_exchange(&q->doorbell, true)) {
+		const uint64_t one = 1;
+		if (write(q->fd, &one, sizeof(one)) == -1)
+			return -1;
+	}
 
-	enum ba_transport_signal sig;
-	ssize_t ret;
+	return 0;
+}
 
-	while ((ret = read(t->sig_fd[0], &sig, sizeof(sig))) == -1 &&
-			errno == EINTR)
-		continue;
+int ba_transport_send_signal(struct ba_transport *t, enum ba_transport_signal sig) {
+	return ba_transport_send_signal_arg(t, sig, 0);
+}
 
-	if (ret != sizeof(sig)) {
+/**
+ * Acknowledge transport signal queue doorbell.
+ *
+ * After this call, the next signal will ring the doorbell again. */
+static void ba_transport_sigq_ack(struct ba_transport_sigq *q) {
+
+	uint64_t tmp;
+	if (read(q->fd, &tmp, sizeof(tmp)) == -1 && errno != EAGAIN)
 		warn("Couldn't read transport signal: %s", strerror(errno));
-		return TRANSPORT_PING;
+
+	atomic_exchange(&q->doorbell, false);
+
+}
+
+/**
+ * Receive signal from the transport signal queue.
+ *
+ * This function shall be called by the transport IO thread only, when the
+ * queue file descriptor is readable. The caller shall drain the queue -
+ * call this function until it returns false - before polling again.
+ *
+ * @param t Transport structure.
+ * @param msg Address where the received signal shall be stored.
+ * @return This function returns true if the signal was received, or false
+ *   if there are no more pending signals. */
+bool ba_transport_recv_signal(struct ba_transport *t, struct ba_transport_msg *msg) {
+
+	struct ba_transport_sigq *q = &t->sigq;
+
+	if (!q->rx_active) {
+
+		/* acknowledge doorbell prior to draining the queue */
+		ba_transport_sigq_ack(q);
+
+		q->rx_coalesced = atomic_exchange_explicit(&q->coalesced, 0, memory_order_acquire);
+		q->rx_active = true;
+
+	}
+
+	if (q->rx_coalesced != 0) {
+		const enum ba_transport_signal sig = __builtin_ctz(q->rx_coalesced);
+		q->rx_coalesced &= ~(1 << sig);
+		msg->sig = sig;
+		msg->arg = atomic_load_explicit(&q->coalesced_arg[sig], memory_order_relaxed);
+		return true;
 	}
 
-	return sig;
+	const size_t pos = q->tail;
+	if (atomic_load_explicit(&q->ring[pos % ARRAYSIZE(q->ring)].seq,
+				memory_order_acquire) == pos + 1) {
+		*msg = q->ring[pos % ARRAYSIZE(q->ring)].msg;
+		atomic_store_explicit(&q->ring[pos % ARRAYSIZE(q->ring)].seq,
+				pos + ARRAYSIZE(q->ring), memory_order_release);
+		q->tail = pos + 1;
+		return true;
+	}
+
+	q->rx_active = false;
+	return false;
 }
 
 unsigned int ba_transport_get_channels(const struct ba_transport *t) {
@@ -587,7 +780,8 @@ int ba_transport_set_volume_packed(struct ba_transport *t, uint16_t value) {
 
 		if (t->sco.rfcomm != NULL)
 			/* notify associated RFCOMM transport */
-			ba_transport_send_signal(t->sco.rfcomm, TRANSPORT_SET_VOLUME);
+			ba_transport_send_signal_arg(t->sco.rfcomm, TRANSPORT_SET_VOLUME,
+					ba_transport_get_volume_packed(t));
 
 	}
 
@@ -615,7 +809,7 @@ int ba_transport_set_state(struct ba_transport *t, enum ba_transport_state state
 
 	switch (state) {
 	case TRANSPORT_IDLE:
-		ba_transport_pthread_cancel(t->thread);
+		ba_transport_pthread_stop(t);
 		break;
 	case TRANSPORT_PENDING:
 		/* When transport is marked as pending, try to acquire transport, but only
@@ -626,6 +820,9 @@ int ba_transport_set_state(struct ba_transport *t, enum ba_transport_state state
 		break;
 	case TRANSPORT_ACTIVE:
 	case TRANSPORT_PAUSED:
+		/* IO thread might be still terminating after the previous idle
+		 * state transition, in such case we have to wait for it */
+		ba_transport_pthread_join(t);
 		if (pthread_equal(t->thread, config.main_thread))
 			ret = io_thread_create(t);
 		break;
@@ -638,45 +835,98 @@ int ba_transport_set_state(struct ba_transport *t, enum ba_transport_state state
 	return ret;
 }
 
-int ba_transport_drain_pcm(struct ba_transport *t) {
+/**
+ * Request asynchronous playback drain.
+ *
+ * This function does not block. The IO thread is requested to send all
+ * queued data, and when it is done, the callback is called in the main
+ * loop context. If there is nothing to drain, the callback is called
+ * right away.
+ *
+ * @param t Transport structure.
+ * @param cb Function called when the drain is completed.
+ * @param userdata Data passed to the callback function.
+ * @return This function returns 0. */
+int ba_transport_drain_pcm(struct ba_transport *t,
+		void (*cb)(void *userdata), void *userdata) {
 
-	pthread_mutex_t *mutex = NULL;
-	pthread_cond_t *drained = NULL;
+	void (*prev_cb)(void *userdata);
+	void *prev_userdata;
 
 	switch (t->type.profile) {
 	case BA_TRANSPORT_PROFILE_A2DP_SOURCE:
-		mutex = &t->a2dp.drained_mtx;
-		drained = &t->a2dp.drained;
-		break;
 	case BA_TRANSPORT_PROFILE_HFP_AG:
 	case BA_TRANSPORT_PROFILE_HSP_AG:
-		mutex = &t->sco.spk_drained_mtx;
-		drained = &t->sco.spk_drained;
-		break;
+		if (t->state == TRANSPORT_ACTIVE)
+			break;
+		/* fall-through */
+	default:
+		cb(userdata);
+		return 0;
 	}
 
-	if (mutex == NULL || t->state != TRANSPORT_ACTIVE)
-		return 0;
+	pthread_mutex_lock(&t->drain_mtx);
+	prev_cb = t->drain_cb;
+	prev_userdata = t->drain_userdata;
+	t->drain_cb = cb;
+	t->drain_userdata = userdata;
+	pthread_mutex_unlock(&t->drain_mtx);
 
-	pthread_mutex_lock(mutex);
+	/* there can be only one drain pending at a time */
+	if (prev_cb != NULL)
+		prev_cb(prev_userdata);
 
 	ba_transport_send_signal(t, TRANSPORT_PCM_SYNC);
-	pthread_cond_wait(drained, mutex);
-
-	pthread_mutex_unlock(mutex);
+	return 0;
+}
 
-	/* TODO: Asynchronous transport release.
-	 *
-	 * Unfortunately, BlueZ does not provide API for internal buffer drain.
-	 * Also, there is no specification for Bluetooth playback drain. In order
-	 * to make sure, that all samples are played out, we have to wait some
-	 * arbitrary time before releasing transport. In order to make it right,
-	 * there is a requirement for an asynchronous release mechanism, which
-	 * is not implemented - it requires a little bit of refactoring. */
-	usleep(200000);
+struct ba_transport_drain_data {
+	void (*cb)(void *userdata);
+	void *userdata;
+};
 
+static gboolean ba_transport_drain_pcm_dispatch(void *userdata) {
+	struct ba_transport_drain_data *data = userdata;
 	debug("PCM drained");
-	return 0;
+	data->cb(data->userdata);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * Complete pending playback drain request.
+ *
+ * This function shall be called by the IO thread, when all queued data has
+ * been sent. It is also safe to call it when there is no pending request. */
+void ba_transport_drain_pcm_complete(struct ba_transport *t) {
+
+	struct ba_transport_drain_data *data;
+	unsigned int delay = 0;
+
+	pthread_mutex_lock(&t->drain_mtx);
+
+	if (t->drain_cb == NULL) {
+		pthread_mutex_unlock(&t->drain_mtx);
+		return;
+	}
+
+	data = g_new(struct ba_transport_drain_data, 1);
+	data->cb = t->drain_cb;
+	data->userdata = t->drain_userdata;
+	t->drain_cb = NULL;
+	t->drain_userdata = NULL;
+
+	pthread_mutex_unlock(&t->drain_mtx);
+
+	/* Unfortunately, BlueZ does not provide API for A2DP internal buffer
+	 * drain. Also, there is no specification for Bluetooth playback drain.
+	 * In order to make sure, that all samples are played out, we have to
+	 * wait some arbitrary time before reporting the drain. */
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP)
+		delay = 200;
+
+	g_timeout_add_full(G_PRIORITY_DEFAULT, delay,
+			ba_transport_drain_pcm_dispatch, data, g_free);
+
 }
 
 static int transport_acquire_bt_a2dp(struct ba_transport *t) {
@@ -685,12 +935,24 @@ static int transport_acquire_bt_a2dp(struct ba_transport *t) {
 	GUnixFDList *fd_list;
 	GError *err = NULL;
 
+	/* IO thread might be still terminating after the previous idle state
+	 * transition. Upon exit it releases the BT transport, so we have to wait
+	 * for it, otherwise the transport would be released right after being
+	 * reused in the keep-alive mode. */
+	ba_transport_pthread_join(t);
+
 	/* Check whether transport is already acquired - keep-alive mode. */
 	if (t->bt_fd != -1) {
 		debug("Reusing transport: %d", t->bt_fd);
 		goto final;
 	}
 
+	if (a2dp_policy_admit(t) == -1)
+		return -1;
+
+	/* measure the time from the acquisition to the first audio data */
+	gettimestamp(&t->acquire_ts);
+
 	msg = g_dbus_message_new_method_call(t->bluez_dbus_owner, t->bluez_dbus_path,
 			BLUEZ_IFACE_MEDIA_TRANSPORT, t->state == TRANSPORT_PENDING ? "TryAcquire" : "Acquire");
 
@@ -824,6 +1086,9 @@ static int transport_acquire_bt_sco(struct ba_transport *t) {
 	if (t->bt_fd != -1)
 		return t->bt_fd;
 
+	/* SCO link is always admitted, but it is accounted in the adapter load */
+	a2dp_policy_admit(t);
+
 	if (hci_devinfo(t->d->a->hci.dev_id, &di) == -1) {
 		error("Couldn't get HCI device info: %s", strerror(errno));
 		return -1;
@@ -869,48 +1134,183 @@ int ba_transport_release_pcm(struct ba_pcm *pcm) {
 	if (pcm->fd == -1)
 		return 0;
 
-	int oldstate;
-
-	/* Transport IO workers are managed using thread cancellation mechanism,
-	 * so we have to take into account a possibility of cancellation during the
-	 * execution. In this release function it is important to perform actions
-	 * atomically. Since close call is a cancellation point, it is required to
-	 * temporally disable cancellation. For a better understanding of what is
-	 * going on, see the io_thread_read_pcm() function. */
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-
 	debug("Closing PCM: %d", pcm->fd);
 	close(pcm->fd);
 	pcm->fd = -1;
 	pcm->client = -1;
 
-	pthread_setcancelstate(oldstate, NULL);
 	return 0;
 }
 
 /**
- * Synchronous transport thread cancellation. */
-void ba_transport_pthread_cancel(pthread_t thread) {
+ * Initialize PCM position shared memory.
+ *
+ * The shared memory is allocated when the PCM is opened for the first time
+ * and it is kept until the transport is freed. In such a way the IO thread
+ * can update it without any synchronization with the PCM controller. The
+ * IO thread is the only writer, so the position is reset by that thread
+ * upon the TRANSPORT_PCM_OPEN signal.
+ *
+ * @param pcm The PCM structure.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int ba_transport_init_pcm_pos(struct ba_pcm *pcm) {
+
+	if (pcm->pos == NULL) {
+
+		int fd;
+		void *pos;
+
+		if ((fd = syscall(SYS_memfd_create, "bluealsa-pcm-pos", 1 /* MFD_CLOEXEC */)) == -1)
+			return -1;
+		if (ftruncate(fd, sizeof(*pcm->pos)) == -1 ||
+				(pos = mmap(NULL, sizeof(*pcm->pos), PROT_READ | PROT_WRITE,
+						MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
 
-	if (pthread_equal(thread, pthread_self()))
-		return;
-	if (pthread_equal(thread, config.main_thread))
+		pcm->pos_fd = fd;
+		pcm->pos = pos;
+
+	}
+
+	return 0;
+}
+
+/**
+ * Request transport IO thread termination.
+ *
+ * This function does not wait for the IO thread to terminate. Upon exit,
+ * the IO thread releases the transport and drops its own reference, so it
+ * is safe to unref the transport right after this call. If synchronous
+ * termination is required, use the ba_transport_pthread_join() function.
+ *
+ * @param t Transport structure.
+ * @return This function returns true if the IO thread is running. */
+bool ba_transport_pthread_stop(struct ba_transport *t) {
+
+	/* the IO thread can not stop itself this way */
+	if (pthread_equal(t->thread, pthread_self()))
+		return false;
+
+	bool running;
+
+	pthread_mutex_lock(&t->mutex);
+
+	running = !pthread_equal(t->thread, config.main_thread);
+	if (running && !t->thread_stopping) {
+		t->thread_stopping = true;
+		gettimestamp(&t->thread_stop_ts);
+		ba_transport_send_signal(t, TRANSPORT_STOP);
+	}
+
+	pthread_mutex_unlock(&t->mutex);
+
+	return running;
+}
+
+/**
+ * Wait for the transport IO thread termination.
+ *
+ * This function returns immediately if the IO thread termination has not
+ * been requested with the ba_transport_pthread_stop() function. */
+void ba_transport_pthread_join(struct ba_transport *t) {
+
+	if (pthread_equal(t->thread, pthread_self()))
 		return;
 
-	int err;
-	if ((err = pthread_cancel(thread)) != 0)
-		warn("Couldn't cancel transport thread: %s", strerror(err));
-	if ((err = pthread_join(thread, NULL)) != 0)
-		warn("Couldn't join transport thread: %s", strerror(err));
+	pthread_mutex_lock(&t->mutex);
+	while (t->thread_stopping)
+		pthread_cond_wait(&t->thread_exited, &t->mutex);
+	pthread_mutex_unlock(&t->mutex);
+
+}
+
+/**
+ * Check whether the IO thread termination has been requested.
+ *
+ * This function does not consume any signal from the transport signal
+ * queue, so it can be used by the IO thread outside of its event loop. */
+bool ba_transport_pthread_stopping(struct ba_transport *t) {
+	return atomic_load_explicit(&t->sigq.coalesced, memory_order_acquire) &
+		(1 << TRANSPORT_STOP);
 }
 
 /**
- * Wrapper for release callback, which can be used by the pthread cleanup.
+ * Wait for an event on the given file descriptor.
  *
- * This function CAN be used with ba_transport_pthread_cleanup_lock() in order
- * to guard transport critical section during cleanup process. */
+ * This function shall be used by the IO thread for blocking operations
+ * outside of its event loop. Transport signals are not dispatched, however
+ * the wait is interrupted when the IO thread termination has been requested.
+ *
+ * @param t Transport structure.
+ * @param fd File descriptor to poll.
+ * @param events Requested poll events.
+ * @return On success this function returns 0. Otherwise, -1 is returned and
+ *   errno is set to indicate the error. If the IO thread termination has
+ *   been requested, errno is set to ECANCELED. */
+int ba_transport_pthread_wait(struct ba_transport *t, int fd, short events) {
+
+	struct ba_transport_sigq *q = &t->sigq;
+	struct pollfd pfds[] = {
+		{ fd, events, 0 },
+		{ q->fd, POLLIN, 0 },
+	};
+	bool acked = false;
+	int ret = 0;
+
+	for (;;) {
+
+		if (ba_transport_pthread_stopping(t)) {
+			errno = ECANCELED;
+			ret = -1;
+			break;
+		}
+
+		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			/* Acknowledge the doorbell, so we will be woken up by the next
+			 * signal. Pending signals are left for the IO thread loop. */
+			ba_transport_sigq_ack(q);
+			acked = true;
+		}
+
+		if (pfds[0].revents)
+			break;
+
+	}
+
+	/* make sure that pending signals will be dispatched by the IO loop */
+	if (acked && !atomic_exchange(&q->doorbell, true)) {
+		const uint64_t one = 1;
+		if (write(q->fd, &one, sizeof(one)) == -1)
+			warn("Couldn't ring transport signal doorbell: %s", strerror(errno));
+	}
+
+	return ret;
+}
+
+/**
+ * Release transport resources upon IO thread termination.
+ *
+ * This function shall be called by the IO thread as the last operation
+ * before exiting. It releases the transport, notifies threads waiting in
+ * the ba_transport_pthread_join() and drops the reference taken by the
+ * io_thread_create(). It can be called with the transport locked with
+ * the ba_transport_pthread_cleanup_lock(). */
 void ba_transport_pthread_cleanup(struct ba_transport *t) {
 
+	/* make sure that no one will modify critical section */
+	if (!t->cleanup_lock)
+		ba_transport_pthread_cleanup_lock(t);
+
 	/* During the normal operation mode, the release callback should not
 	 * be NULL. Hence, we will relay on this callback - file descriptors
 	 * are closed in it. */
@@ -921,10 +1321,24 @@ void ba_transport_pthread_cleanup(struct ba_transport *t) {
 	 * be used anymore. */
 	t->thread = config.main_thread;
 
+	if (t->thread_stopping) {
+		struct timespec now;
+		gettimestamp(&now);
+		difftimespec(&t->thread_stop_ts, &now, &now);
+		debug("IO thread termination latency: %ld.%06ld s",
+				(long)now.tv_sec, now.tv_nsec / 1000);
+		t->thread_stopping = false;
+	}
+
+	/* discard termination request, which might have not been consumed */
+	atomic_fetch_and(&t->sigq.coalesced, ~(1u << TRANSPORT_STOP));
+
+	/* there is no one left to complete the drain */
+	ba_transport_drain_pcm_complete(t);
+
+	pthread_cond_broadcast(&t->thread_exited);
 	ba_transport_pthread_cleanup_unlock(t);
 
-	/* XXX: If the order of the cleanup push is right, this function will
-	 *      indicate the end of the IO/RFCOMM thread. */
 	debug("Exiting IO thread: %s", ba_transport_type_to_string(t->type));
 
 	/* Remove reference which was taken by the io_thread_create(). */
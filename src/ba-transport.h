@@ -16,12 +16,15 @@
 #endif
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "ba-device.h"
 #include "hfp.h"
+#include "shared/pcm-pos.h"
 
 #define BA_TRANSPORT_PROFILE_A2DP_SOURCE (1 << 0)
 #define BA_TRANSPORT_PROFILE_A2DP_SINK   (2 << 0)
@@ -65,6 +68,46 @@ enum ba_transport_signal {
 	TRANSPORT_PCM_SYNC,
 	TRANSPORT_PCM_DROP,
 	TRANSPORT_SET_VOLUME,
+	TRANSPORT_SET_CODEC_LIMITS,
+	TRANSPORT_STOP,
+};
+
+/* Transport signal with an optional payload. */
+struct ba_transport_msg {
+	enum ba_transport_signal sig;
+	uint32_t arg;
+};
+
+/**
+ * Number of slots in the transport signal queue (power of 2). */
+#define BA_TRANSPORT_SIGQ_SIZE 32
+
+/* Lock-free multiple-producer single-consumer queue of transport signals.
+ * Consumer is woken up with an eventfd doorbell, which is rung only once
+ * per drain cycle. Idempotent signals (ping, volume update) are coalesced
+ * into a bit-mask, so bursts of such signals take one queue slot at most. */
+struct ba_transport_sigq {
+
+	/* eventfd doorbell */
+	int fd;
+	atomic_bool doorbell;
+
+	/* pending coalesced signals and their latest payloads */
+	atomic_uint coalesced;
+	atomic_uint_least32_t coalesced_arg[32];
+
+	/* ring buffer for signals which have to be delivered in order */
+	atomic_size_t head;
+	struct {
+		atomic_size_t seq;
+		struct ba_transport_msg msg;
+	} ring[BA_TRANSPORT_SIGQ_SIZE];
+
+	/* consumer state */
+	size_t tail;
+	unsigned int rx_coalesced;
+	bool rx_active;
+
 };
 
 struct ba_pcm {
@@ -72,6 +115,9 @@ struct ba_pcm {
 	int fd;
 	/* associated client */
 	int client;
+	/* PCM position shared with the client */
+	struct ba_pcm_pos *pos;
+	int pos_fd;
 };
 
 struct ba_transport {
@@ -97,6 +143,18 @@ struct ba_transport {
 	/* IO thread - actual transport layer */
 	enum ba_transport_state state;
 	pthread_t thread;
+	/* IO thread termination has been requested */
+	bool thread_stopping;
+	struct timespec thread_stop_ts;
+	/* time of the BT transport acquisition, cleared upon first audio data */
+	struct timespec acquire_ts;
+	/* signaled (with the mutex) upon IO thread termination */
+	pthread_cond_t thread_exited;
+
+	/* IO thread resources (codec state and data buffers) preserved across
+	 * IO thread restarts, and the number of bytes allocated for them */
+	struct io_arena *arena;
+	size_t arena_size;
 
 	/* This field stores a file descriptor (socket) associated with the BlueZ
 	 * side of the transport. The role of this socket depends on the transport
@@ -107,15 +165,22 @@ struct ba_transport {
 	size_t mtu_read;
 	size_t mtu_write;
 
-	/* PIPE used to notify thread about changes. If thread is based on loop with
-	 * an event wait syscall (e.g. poll), this file descriptor is used to send a
-	 * control event. */
-	int sig_fd[2];
+	/* Queue used to notify thread about changes. If thread is based on loop
+	 * with an event wait syscall (e.g. poll), the queue file descriptor shall
+	 * be polled for the POLLIN event. */
+	struct ba_transport_sigq sigq;
 
 	/* Overall delay in 1/10 of millisecond, caused by the data transfer and
 	 * the audio encoder or decoder. */
 	unsigned int delay;
 
+	/* Pending playback drain request. The callback is called in the main
+	 * loop context, after the IO thread has reported that all queued data
+	 * has been sent. */
+	pthread_mutex_t drain_mtx;
+	void (*drain_cb)(void *userdata);
+	void *drain_userdata;
+
 	union {
 
 		struct {
@@ -143,9 +208,21 @@ struct ba_transport {
 			 * subsequent ioctl() calls. */
 			int bt_fd_coutq_init;
 
-			/* playback synchronization */
-			pthread_mutex_t drained_mtx;
-			pthread_cond_t drained;
+			/* number of RTP packets sent per second */
+			unsigned int packet_rate;
+			/* number of system calls made by the IO thread per second */
+			unsigned int syscall_rate;
+			/* percentage of the writing MTU occupied by the payload */
+			unsigned int payload_efficiency;
+			/* percentage of the BT socket output buffer occupied by data */
+			unsigned int coutq_fill;
+			/* determine whether the IO thread uses the io_uring backend */
+			bool io_uring;
+
+			/* Encoder limits applied by the adapter admission control. The SBC
+			 * bitpool and LDAC EQMID limits are not applied if set to zero. */
+			uint8_t bitpool_limit;
+			uint8_t eqmid_limit;
 
 		} a2dp;
 
@@ -185,9 +262,10 @@ struct ba_transport {
 			struct ba_pcm spk_pcm;
 			struct ba_pcm mic_pcm;
 
-			/* playback synchronization */
-			pthread_mutex_t spk_drained_mtx;
-			pthread_cond_t spk_drained;
+			/* number of IO thread wake-ups per second */
+			unsigned int wakeup_rate;
+			/* number of mSBC frame synchronization losses */
+			unsigned int msbc_sync_losses;
 
 		} sco;
 
@@ -201,7 +279,8 @@ struct ba_transport {
 	int (*release)(struct ba_transport *);
 
 	/* memory self-management */
-	int ref_count;
+	atomic_int ref_count;
+	struct rcu_head rcu;
 
 };
 
@@ -239,7 +318,9 @@ void ba_transport_destroy(struct ba_transport *t);
 void ba_transport_unref(struct ba_transport *t);
 
 int ba_transport_send_signal(struct ba_transport *t, enum ba_transport_signal sig);
-enum ba_transport_signal ba_transport_recv_signal(struct ba_transport *t);
+int ba_transport_send_signal_arg(struct ba_transport *t, enum ba_transport_signal sig,
+		uint32_t arg);
+bool ba_transport_recv_signal(struct ba_transport *t, struct ba_transport_msg *msg);
 
 unsigned int ba_transport_get_channels(const struct ba_transport *t);
 unsigned int ba_transport_get_sampling(const struct ba_transport *t);
@@ -250,10 +331,16 @@ int ba_transport_set_volume_packed(struct ba_transport *t, uint16_t value);
 
 int ba_transport_set_state(struct ba_transport *t, enum ba_transport_state state);
 
-int ba_transport_drain_pcm(struct ba_transport *t);
+int ba_transport_drain_pcm(struct ba_transport *t,
+		void (*cb)(void *userdata), void *userdata);
+void ba_transport_drain_pcm_complete(struct ba_transport *t);
 int ba_transport_release_pcm(struct ba_pcm *pcm);
+int ba_transport_init_pcm_pos(struct ba_pcm *pcm);
 
-void ba_transport_pthread_cancel(pthread_t thread);
+bool ba_transport_pthread_stop(struct ba_transport *t);
+void ba_transport_pthread_join(struct ba_transport *t);
+bool ba_transport_pthread_stopping(struct ba_transport *t);
+int ba_transport_pthread_wait(struct ba_transport *t, int fd, short events);
 void ba_transport_pthread_cleanup(struct ba_transport *t);
 int ba_transport_pthread_cleanup_lock(struct ba_transport *t);
 int ba_transport_pthread_cleanup_unlock(struct ba_transport *t);
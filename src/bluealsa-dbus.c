@@ -14,10 +14,13 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 
 #include <gio/gio.h>
@@ -25,6 +28,7 @@
 #include <glib-object.h>
 #include <glib.h>
 
+#include "a2dp-policy.h"
 #include "ba-adapter.h"
 #include "ba-device.h"
 #include "bluealsa-iface.h"
@@ -65,6 +69,46 @@ static GVariant *ba_variant_new_delay(const struct ba_transport *t) {
 	return g_variant_new_uint16(ba_transport_get_delay(t));
 }
 
+static GVariant *ba_variant_new_packet_rate(const struct ba_transport *t) {
+	unsigned int rate = 0;
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP)
+		rate = t->a2dp.packet_rate;
+	return g_variant_new_uint16(rate > UINT16_MAX ? UINT16_MAX : rate);
+}
+
+static GVariant *ba_variant_new_payload_efficiency(const struct ba_transport *t) {
+	unsigned int efficiency = 0;
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP)
+		efficiency = t->a2dp.payload_efficiency;
+	return g_variant_new_byte(efficiency);
+}
+
+static GVariant *ba_variant_new_syscall_rate(const struct ba_transport *t) {
+	unsigned int rate = 0;
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP)
+		rate = t->a2dp.syscall_rate;
+	return g_variant_new_uint16(rate > UINT16_MAX ? UINT16_MAX : rate);
+}
+
+static GVariant *ba_variant_new_wakeup_rate(const struct ba_transport *t) {
+	unsigned int rate = 0;
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_SCO)
+		rate = t->sco.wakeup_rate;
+	return g_variant_new_uint16(rate > UINT16_MAX ? UINT16_MAX : rate);
+}
+
+static GVariant *ba_variant_new_sync_losses(const struct ba_transport *t) {
+	unsigned int losses = 0;
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_SCO)
+		losses = t->sco.msbc_sync_losses;
+	return g_variant_new_uint32(losses);
+}
+
+static GVariant *ba_variant_new_memory_usage(const struct ba_transport *t) {
+	size_t size = t->arena_size;
+	return g_variant_new_uint32(size > UINT32_MAX ? UINT32_MAX : size);
+}
+
 static GVariant *ba_variant_new_volume(const struct ba_transport *t) {
 	return g_variant_new_uint16(ba_transport_get_volume_packed(t));
 }
@@ -73,6 +117,26 @@ static GVariant *ba_variant_new_battery(const struct ba_transport *t) {
 	return g_variant_new_byte(t->d->battery_level);
 }
 
+/**
+ * Populate dictionary with BlueALSA PCM properties.
+ *
+ * @param props The GVariant builder for the "a{sv}" dictionary.
+ * @param t Transport associated with the PCM. */
+static void ba_variant_populate_pcm(GVariantBuilder *props, const struct ba_transport *t) {
+	g_variant_builder_add(props, "{sv}", "Device", ba_variant_new_device_path(t));
+	g_variant_builder_add(props, "{sv}", "Modes", ba_variant_new_pcm_modes(t));
+	g_variant_builder_add(props, "{sv}", "Channels", ba_variant_new_channels(t));
+	g_variant_builder_add(props, "{sv}", "Sampling", ba_variant_new_sampling(t));
+	g_variant_builder_add(props, "{sv}", "Codec", ba_variant_new_codec(t));
+	g_variant_builder_add(props, "{sv}", "Delay", ba_variant_new_delay(t));
+	g_variant_builder_add(props, "{sv}", "Volume", ba_variant_new_volume(t));
+	/* Battery level is reported via the HFP/HSP link, so it is available
+	 * for SCO PCMs only - and only if the device has provided it. */
+	if (IS_BA_TRANSPORT_PROFILE_SCO(t->type.profile) &&
+			t->d->battery_level != -1)
+		g_variant_builder_add(props, "{sv}", "Battery", ba_variant_new_battery(t));
+}
+
 static void bluealsa_manager_get_pcms(GDBusMethodInvocation *inv, void *userdata) {
 	(void)userdata;
 
@@ -104,13 +168,7 @@ static void bluealsa_manager_get_pcms(GDBusMethodInvocation *inv, void *userdata
 
 				GVariantBuilder props;
 				g_variant_builder_init(&props, G_VARIANT_TYPE("a{sv}"));
-				g_variant_builder_add(&props, "{sv}", "Device", ba_variant_new_device_path(t));
-				g_variant_builder_add(&props, "{sv}", "Modes", ba_variant_new_pcm_modes(t));
-				g_variant_builder_add(&props, "{sv}", "Channels", ba_variant_new_channels(t));
-				g_variant_builder_add(&props, "{sv}", "Sampling", ba_variant_new_sampling(t));
-				g_variant_builder_add(&props, "{sv}", "Codec", ba_variant_new_codec(t));
-				g_variant_builder_add(&props, "{sv}", "Delay", ba_variant_new_delay(t));
-				g_variant_builder_add(&props, "{sv}", "Volume", ba_variant_new_volume(t));
+				ba_variant_populate_pcm(&props, t);
 
 				g_variant_builder_add(&pcms, "{oa{sv}}", t->ba_dbus_path, &props);
 				g_variant_builder_clear(&props);
@@ -128,6 +186,135 @@ static void bluealsa_manager_get_pcms(GDBusMethodInvocation *inv, void *userdata
 	g_variant_builder_clear(&pcms);
 }
 
+static void bluealsa_manager_get_pcm(GDBusMethodInvocation *inv, void *userdata) {
+	(void)userdata;
+
+	GVariant *params = g_dbus_method_invocation_get_parameters(inv);
+	const char *address;
+	const char *profile;
+	const char *mode;
+	bdaddr_t addr;
+
+	g_variant_get(params, "(&s&s&s)", &address, &profile, &mode);
+
+	if (str2ba(address, &addr) != 0) {
+		g_dbus_method_invocation_return_error(inv, G_DBUS_ERROR,
+				G_DBUS_ERROR_INVALID_ARGS, "Invalid BT address: %s", address);
+		return;
+	}
+
+	uint32_t profile_mask = 0;
+	if (strcmp(profile, "a2dp") == 0)
+		profile_mask = BA_TRANSPORT_PROFILE_MASK_A2DP;
+	else if (strcmp(profile, "sco") == 0)
+		profile_mask = BA_TRANSPORT_PROFILE_MASK_SCO;
+	else {
+		g_dbus_method_invocation_return_error(inv, G_DBUS_ERROR,
+				G_DBUS_ERROR_INVALID_ARGS, "Invalid profile: %s", profile);
+		return;
+	}
+
+	/* SCO transport provides both operation modes */
+	uint32_t mode_mask = BA_TRANSPORT_PROFILE_MASK_SCO;
+	if (strcmp(mode, BLUEALSA_PCM_MODE_SOURCE) == 0)
+		mode_mask |= BA_TRANSPORT_PROFILE_A2DP_SOURCE;
+	else if (strcmp(mode, BLUEALSA_PCM_MODE_SINK) == 0)
+		mode_mask |= BA_TRANSPORT_PROFILE_A2DP_SINK;
+	else {
+		g_dbus_method_invocation_return_error(inv, G_DBUS_ERROR,
+				G_DBUS_ERROR_INVALID_ARGS, "Invalid operation mode: %s", mode);
+		return;
+	}
+
+	GVariant *rv = NULL;
+	size_t i;
+
+	/* Devices are indexed by the BT address, so there is no need to iterate
+	 * over all PCMs - check only transports of the requested device. */
+	for (i = 0; rv == NULL && i < HCI_MAX_DEV; i++) {
+
+		struct ba_adapter *a;
+		struct ba_device *d;
+
+		if ((a = ba_adapter_lookup(i)) == NULL)
+			continue;
+
+		if ((d = ba_device_lookup(a, &addr)) != NULL) {
+
+			GHashTableIter iter;
+			struct ba_transport *t;
+
+			pthread_mutex_lock(&d->transports_mutex);
+			g_hash_table_iter_init(&iter, d->transports);
+			while (g_hash_table_iter_next(&iter, NULL, (gpointer)&t)) {
+
+				if (!(t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP) &&
+						!IS_BA_TRANSPORT_PROFILE_SCO(t->type.profile))
+					continue;
+				if (!(t->type.profile & profile_mask) ||
+						!(t->type.profile & mode_mask))
+					continue;
+
+				GVariantBuilder props;
+				g_variant_builder_init(&props, G_VARIANT_TYPE("a{sv}"));
+				ba_variant_populate_pcm(&props, t);
+
+				rv = g_variant_new("(oa{sv})", t->ba_dbus_path, &props);
+				g_variant_builder_clear(&props);
+				break;
+			}
+
+			pthread_mutex_unlock(&d->transports_mutex);
+			ba_device_unref(d);
+		}
+
+		ba_adapter_unref(a);
+
+	}
+
+	if (rv == NULL) {
+		g_dbus_method_invocation_return_error(inv, G_DBUS_ERROR,
+				G_DBUS_ERROR_FILE_NOT_FOUND, "PCM not found");
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(inv, rv);
+}
+
+static void bluealsa_manager_get_utilization(GDBusMethodInvocation *inv, void *userdata) {
+	(void)userdata;
+
+	GVariant *params = g_dbus_method_invocation_get_parameters(inv);
+	const char *adapter;
+	struct ba_adapter *a;
+	int dev_id;
+
+	g_variant_get(params, "(&s)", &adapter);
+
+	if (sscanf(adapter, "hci%d", &dev_id) != 1 ||
+			(a = ba_adapter_lookup(dev_id)) == NULL) {
+		g_dbus_method_invocation_return_error(inv, G_DBUS_ERROR,
+				G_DBUS_ERROR_FILE_NOT_FOUND, "Adapter not found: %s", adapter);
+		return;
+	}
+
+	struct a2dp_policy_load load;
+	a2dp_policy_adapter_load(a, NULL, &load);
+	ba_adapter_unref(a);
+
+	GVariantBuilder props;
+	g_variant_builder_init(&props, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&props, "{sv}", "Streams", g_variant_new_uint32(load.streams));
+	g_variant_builder_add(&props, "{sv}", "Bitrate", g_variant_new_uint32(load.bitrate));
+	g_variant_builder_add(&props, "{sv}", "BitrateBudget", g_variant_new_uint32(config.a2dp.bitrate_budget));
+	g_variant_builder_add(&props, "{sv}", "CPU", g_variant_new_uint32(load.cpu));
+	g_variant_builder_add(&props, "{sv}", "CPUBudget", g_variant_new_uint32(config.a2dp.cpu_budget));
+	g_variant_builder_add(&props, "{sv}", "Pressure", g_variant_new_byte(load.pressure));
+
+	g_dbus_method_invocation_return_value(inv, g_variant_new("(a{sv})", &props));
+	g_variant_builder_clear(&props);
+}
+
 static void bluealsa_manager_method_call(GDBusConnection *conn, const char *sender,
 		const char *path, const char *interface, const char *method, GVariant *params,
 		GDBusMethodInvocation *invocation, void *userdata) {
@@ -139,6 +326,10 @@ static void bluealsa_manager_method_call(GDBusConnection *conn, const char *send
 
 	if (strcmp(method, "GetPCMs") == 0)
 		bluealsa_manager_get_pcms(invocation, userdata);
+	else if (strcmp(method, "GetPCM") == 0)
+		bluealsa_manager_get_pcm(invocation, userdata);
+	else if (strcmp(method, "GetUtilization") == 0)
+		bluealsa_manager_get_utilization(invocation, userdata);
 
 }
 
@@ -151,6 +342,28 @@ int bluealsa_dbus_manager_register(GError **error) {
 			(GDBusInterfaceInfo *)&bluealsa_iface_manager, &vtable, NULL, NULL, error);
 }
 
+/**
+ * Send controller reply with the PCM position shared memory attached. */
+static int bluealsa_pcm_controller_send_pos(GIOChannel *ch, const struct ba_pcm *pcm) {
+
+	char buffer[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct iovec io = { .iov_base = "OK", .iov_len = 2 };
+	struct msghdr msg = {
+		.msg_iov = &io,
+		.msg_iovlen = 1,
+		.msg_control = buffer,
+		.msg_controllen = sizeof(buffer),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &pcm->pos_fd, sizeof(int));
+
+	return sendmsg(g_io_channel_unix_get_fd(ch), &msg, 0);
+}
+
 /**
  * Data associated with a single PCM controller session. */
 struct bluealsa_ctrl_data {
@@ -158,6 +371,16 @@ struct bluealsa_ctrl_data {
 	struct ba_pcm *pcm;
 };
 
+/**
+ * Reply to the drain request - called when the PCM has been drained. */
+static void bluealsa_pcm_controller_drained(void *userdata) {
+	GIOChannel *ch = userdata;
+	size_t len;
+	g_io_channel_write_chars(ch, "OK", -1, &len, NULL);
+	g_io_channel_flush(ch, NULL);
+	g_io_channel_unref(ch);
+}
+
 static gboolean bluealsa_pcm_controller(GIOChannel *ch, GIOCondition condition,
 		void *userdata) {
 	(void)condition;
@@ -172,8 +395,9 @@ static gboolean bluealsa_pcm_controller(GIOChannel *ch, GIOCondition condition,
 		return TRUE;
 	case G_IO_STATUS_NORMAL:
 		if (strncmp(command, BLUEALSA_PCM_CTRL_DRAIN, len) == 0) {
-			ba_transport_drain_pcm(cdata->t);
-			g_io_channel_write_chars(ch, "OK", -1, &len, NULL);
+			/* reply will be sent when the drain is completed */
+			ba_transport_drain_pcm(cdata->t, bluealsa_pcm_controller_drained,
+					g_io_channel_ref(ch));
 		}
 		else if (strncmp(command, BLUEALSA_PCM_CTRL_DROP, len) == 0) {
 			ba_transport_send_signal(cdata->t, TRANSPORT_PCM_DROP);
@@ -189,6 +413,12 @@ static gboolean bluealsa_pcm_controller(GIOChannel *ch, GIOCondition condition,
 			ba_transport_send_signal(cdata->t, TRANSPORT_PCM_RESUME);
 			g_io_channel_write_chars(ch, "OK", -1, &len, NULL);
 		}
+		else if (strncmp(command, BLUEALSA_PCM_CTRL_POSITION, len) == 0) {
+			if (cdata->pcm->pos == NULL)
+				g_io_channel_write_chars(ch, "NotSupported", -1, &len, NULL);
+			else if (bluealsa_pcm_controller_send_pos(ch, cdata->pcm) == -1)
+				error("Couldn't send PCM position: %s", strerror(errno));
+		}
 		else {
 			warn("Invalid PCM control command: %*s", (int)len, command);
 			g_io_channel_write_chars(ch, "Invalid", -1, &len, NULL);
@@ -274,6 +504,12 @@ static void bluealsa_pcm_open(GDBusMethodInvocation *inv, void *userdata) {
 		goto fail;
 	}
 
+	/* Position is published for A2DP source only, where the delay
+	 * model covers the whole path from the FIFO to the device. */
+	if (t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SOURCE &&
+			ba_transport_init_pcm_pos(pcm) == -1)
+		warn("Couldn't create PCM position: %s", strerror(errno));
+
 	/* notify our IO thread that the FIFO has been created */
 	ba_transport_send_signal(t, TRANSPORT_PCM_OPEN);
 
@@ -387,6 +623,18 @@ static GVariant *bluealsa_pcm_get_property(GDBusConnection *conn,
 		return ba_variant_new_codec(t);
 	if (strcmp(property, "Delay") == 0)
 		return ba_variant_new_delay(t);
+	if (strcmp(property, "PacketRate") == 0)
+		return ba_variant_new_packet_rate(t);
+	if (strcmp(property, "PayloadEfficiency") == 0)
+		return ba_variant_new_payload_efficiency(t);
+	if (strcmp(property, "SyscallRate") == 0)
+		return ba_variant_new_syscall_rate(t);
+	if (strcmp(property, "WakeupRate") == 0)
+		return ba_variant_new_wakeup_rate(t);
+	if (strcmp(property, "SyncLosses") == 0)
+		return ba_variant_new_sync_losses(t);
+	if (strcmp(property, "MemoryUsage") == 0)
+		return ba_variant_new_memory_usage(t);
 	if (strcmp(property, "Volume") == 0)
 		return ba_variant_new_volume(t);
 	if (strcmp(property, "Battery") == 0)
@@ -476,13 +724,7 @@ int bluealsa_dbus_transport_register(struct ba_transport *t, GError **error) {
 
 	GVariantBuilder props;
 	g_variant_builder_init(&props, G_VARIANT_TYPE("a{sv}"));
-	g_variant_builder_add(&props, "{sv}", "Device", ba_variant_new_device_path(t));
-	g_variant_builder_add(&props, "{sv}", "Modes", ba_variant_new_pcm_modes(t));
-	g_variant_builder_add(&props, "{sv}", "Channels", ba_variant_new_channels(t));
-	g_variant_builder_add(&props, "{sv}", "Sampling", ba_variant_new_sampling(t));
-	g_variant_builder_add(&props, "{sv}", "Codec", ba_variant_new_codec(t));
-	g_variant_builder_add(&props, "{sv}", "Delay", ba_variant_new_delay(t));
-	g_variant_builder_add(&props, "{sv}", "Volume", ba_variant_new_volume(t));
+	ba_variant_populate_pcm(&props, t);
 
 	g_dbus_connection_emit_signal(config.dbus, NULL,
 			"/org/bluealsa", BLUEALSA_IFACE_MANAGER, "PCMAdded",
@@ -509,6 +751,14 @@ void bluealsa_dbus_transport_update(struct ba_transport *t, unsigned int mask) {
 		g_variant_builder_add(&props, "{sv}", "Volume", ba_variant_new_volume(t));
 	if (mask & BA_DBUS_TRANSPORT_UPDATE_BATTERY)
 		g_variant_builder_add(&props, "{sv}", "Battery", ba_variant_new_battery(t));
+	if (mask & BA_DBUS_TRANSPORT_UPDATE_PACKET_RATE)
+		g_variant_builder_add(&props, "{sv}", "PacketRate", ba_variant_new_packet_rate(t));
+	if (mask & BA_DBUS_TRANSPORT_UPDATE_PAYLOAD_EFFICIENCY)
+		g_variant_builder_add(&props, "{sv}", "PayloadEfficiency", ba_variant_new_payload_efficiency(t));
+	if (mask & BA_DBUS_TRANSPORT_UPDATE_WAKEUP_RATE)
+		g_variant_builder_add(&props, "{sv}", "WakeupRate", ba_variant_new_wakeup_rate(t));
+	if (mask & BA_DBUS_TRANSPORT_UPDATE_SYNC_LOSSES)
+		g_variant_builder_add(&props, "{sv}", "SyncLosses", ba_variant_new_sync_losses(t));
 
 	g_dbus_connection_emit_signal(config.dbus, NULL, t->ba_dbus_path,
 			"org.freedesktop.DBus.Properties", "PropertiesChanged",
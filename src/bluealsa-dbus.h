@@ -25,6 +25,10 @@
 #define BA_DBUS_TRANSPORT_UPDATE_DELAY    (1 << 3)
 #define BA_DBUS_TRANSPORT_UPDATE_VOLUME   (1 << 4)
 #define BA_DBUS_TRANSPORT_UPDATE_BATTERY  (1 << 5)
+#define BA_DBUS_TRANSPORT_UPDATE_PACKET_RATE (1 << 6)
+#define BA_DBUS_TRANSPORT_UPDATE_PAYLOAD_EFFICIENCY (1 << 7)
+#define BA_DBUS_TRANSPORT_UPDATE_SYNC_LOSSES (1 << 8)
+#define BA_DBUS_TRANSPORT_UPDATE_WAKEUP_RATE (1 << 9)
 
 int bluealsa_dbus_manager_register(GError **error);
 
@@ -10,6 +10,14 @@
 
 #include "bluealsa-iface.h"
 
+static const GDBusArgInfo arg_adapter = {
+	-1, "adapter", "s", NULL
+};
+
+static const GDBusArgInfo arg_address = {
+	-1, "address", "s", NULL
+};
+
 static const GDBusArgInfo arg_fd = {
 	-1, "fd", "h", NULL
 };
@@ -26,6 +34,10 @@ static const GDBusArgInfo arg_PCMs = {
 	-1, "PCMs", "a{oa{sv}}", NULL
 };
 
+static const GDBusArgInfo arg_profile = {
+	-1, "profile", "s", NULL
+};
+
 static const GDBusArgInfo arg_props = {
 	-1, "props", "a{sv}", NULL
 };
@@ -42,8 +54,47 @@ static const GDBusMethodInfo bluealsa_iface_manager_GetPCMs = {
 	NULL,
 };
 
+static const GDBusArgInfo *GetPCM_in[] = {
+	&arg_address,
+	&arg_profile,
+	&arg_mode,
+	NULL,
+};
+
+static const GDBusArgInfo *GetPCM_out[] = {
+	&arg_path,
+	&arg_props,
+	NULL,
+};
+
+static const GDBusMethodInfo bluealsa_iface_manager_GetPCM = {
+	-1, "GetPCM",
+	(GDBusArgInfo **)GetPCM_in,
+	(GDBusArgInfo **)GetPCM_out,
+	NULL,
+};
+
+static const GDBusArgInfo *GetUtilization_in[] = {
+	&arg_adapter,
+	NULL,
+};
+
+static const GDBusArgInfo *GetUtilization_out[] = {
+	&arg_props,
+	NULL,
+};
+
+static const GDBusMethodInfo bluealsa_iface_manager_GetUtilization = {
+	-1, "GetUtilization",
+	(GDBusArgInfo **)GetUtilization_in,
+	(GDBusArgInfo **)GetUtilization_out,
+	NULL,
+};
+
 static const GDBusMethodInfo *bluealsa_iface_manager_methods[] = {
 	&bluealsa_iface_manager_GetPCMs,
+	&bluealsa_iface_manager_GetPCM,
+	&bluealsa_iface_manager_GetUtilization,
 	NULL,
 };
 
@@ -123,6 +174,30 @@ static const GDBusPropertyInfo bluealsa_iface_pcm_Delay = {
 	-1, "Delay", "q", G_DBUS_PROPERTY_INFO_FLAGS_READABLE, NULL
 };
 
+static const GDBusPropertyInfo bluealsa_iface_pcm_PacketRate = {
+	-1, "PacketRate", "q", G_DBUS_PROPERTY_INFO_FLAGS_READABLE, NULL
+};
+
+static const GDBusPropertyInfo bluealsa_iface_pcm_PayloadEfficiency = {
+	-1, "PayloadEfficiency", "y", G_DBUS_PROPERTY_INFO_FLAGS_READABLE, NULL
+};
+
+static const GDBusPropertyInfo bluealsa_iface_pcm_SyscallRate = {
+	-1, "SyscallRate", "q", G_DBUS_PROPERTY_INFO_FLAGS_READABLE, NULL
+};
+
+static const GDBusPropertyInfo bluealsa_iface_pcm_WakeupRate = {
+	-1, "WakeupRate", "q", G_DBUS_PROPERTY_INFO_FLAGS_READABLE, NULL
+};
+
+static const GDBusPropertyInfo bluealsa_iface_pcm_SyncLosses = {
+	-1, "SyncLosses", "u", G_DBUS_PROPERTY_INFO_FLAGS_READABLE, NULL
+};
+
+static const GDBusPropertyInfo bluealsa_iface_pcm_MemoryUsage = {
+	-1, "MemoryUsage", "u", G_DBUS_PROPERTY_INFO_FLAGS_READABLE, NULL
+};
+
 static const GDBusPropertyInfo bluealsa_iface_pcm_Volume = {
 	-1, "Volume", "q",
 	G_DBUS_PROPERTY_INFO_FLAGS_READABLE |
@@ -141,6 +216,12 @@ static const GDBusPropertyInfo *bluealsa_iface_pcm_properties[] = {
 	&bluealsa_iface_pcm_Sampling,
 	&bluealsa_iface_pcm_Codec,
 	&bluealsa_iface_pcm_Delay,
+	&bluealsa_iface_pcm_PacketRate,
+	&bluealsa_iface_pcm_PayloadEfficiency,
+	&bluealsa_iface_pcm_SyscallRate,
+	&bluealsa_iface_pcm_WakeupRate,
+	&bluealsa_iface_pcm_SyncLosses,
+	&bluealsa_iface_pcm_MemoryUsage,
 	&bluealsa_iface_pcm_Volume,
 	&bluealsa_iface_pcm_Battery,
 	NULL,
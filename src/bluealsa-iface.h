@@ -23,6 +23,7 @@
 #define BLUEALSA_PCM_CTRL_DROP   "Drop"
 #define BLUEALSA_PCM_CTRL_PAUSE  "Pause"
 #define BLUEALSA_PCM_CTRL_RESUME "Resume"
+#define BLUEALSA_PCM_CTRL_POSITION "Position"
 
 #define BLUEALSA_PCM_MODE_SINK   "sink"
 #define BLUEALSA_PCM_MODE_SOURCE "source"
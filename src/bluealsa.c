@@ -31,6 +31,11 @@ struct ba_config config = {
 
 	.null_fd = -1,
 
+	.io_workers = 2,
+#if ENABLE_LIBURING
+	.io_uring = true,
+#endif
+
 	.hfp.features_sdp_hf =
 		SDP_HFP_HF_FEAT_CLI |
 		SDP_HFP_HF_FEAT_VOLUME |
@@ -56,6 +61,8 @@ struct ba_config config = {
 		HFP_AG_FEAT_EERC |
 		0,
 
+	.sco.latency = 4,
+
 	.a2dp.volume = false,
 	.a2dp.force_mono = false,
 	.a2dp.force_44100 = false,
@@ -16,6 +16,7 @@
 #endif
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -41,9 +42,10 @@ struct ba_config {
 	/* established D-Bus connection */
 	GDBusConnection *dbus;
 
-	/* adapters indexed by the HCI device ID */
+	/* Adapters indexed by the HCI device ID. The mutex serializes updates
+	 * only - lookups are lock-free and protected by the RCU grace period. */
 	pthread_mutex_t adapters_mutex;
-	struct ba_adapter *adapters[HCI_MAX_DEV];
+	struct ba_adapter * _Atomic adapters[HCI_MAX_DEV];
 
 	/* List of HCI names (or BT addresses) used for adapters filtering
 	 * during profile registration. Leave it empty to use any adapter. */
@@ -52,6 +54,14 @@ struct ba_config {
 	/* used for main thread identification */
 	pthread_t main_thread;
 
+	/* Number of IO worker threads spawned up front. Workers are reused for
+	 * consecutive IO threads, so transport state changes do not require
+	 * spawning new threads. */
+	unsigned int io_workers;
+	/* Use io_uring for the A2DP source IO if it is supported by the
+	 * running kernel, otherwise poll() based IO is used. */
+	bool io_uring;
+
 	/* opened null device */
 	int null_fd;
 
@@ -64,6 +74,12 @@ struct ba_config {
 		int features_rfcomm_ag;
 	} hfp;
 
+	struct {
+		/* The maximal number of SCO packets buffered in each direction. This
+		 * value bounds the latency of the speaker and the microphone. */
+		unsigned int latency;
+	} sco;
+
 	struct {
 
 		/* NULL-terminated list of available A2DP codecs */
@@ -82,6 +98,12 @@ struct ba_config {
 		 * to force lower sampling in order to save Bluetooth bandwidth. */
 		bool force_44100;
 
+		/* Per-adapter budget for the A2DP configuration selection policy. The
+		 * CPU budget is given in per-mille of a single core and the bit-rate
+		 * budget in kbps. Zero means that there is no limit. */
+		unsigned int cpu_budget;
+		unsigned int bitrate_budget;
+
 		/* The number of seconds for keeping A2DP transport alive after PCM has
 		 * been closed. One might set this value to negative number for infinite
 		 * time. This option applies for the source profile only. */
@@ -27,6 +27,7 @@
 #include <glib.h>
 
 #include "a2dp-codecs.h"
+#include "a2dp-policy.h"
 #include "ba-adapter.h"
 #include "ba-device.h"
 #include "ba-transport.h"
@@ -34,6 +35,8 @@
 #include "bluealsa-dbus.h"
 #include "bluez-a2dp.h"
 #include "bluez-iface.h"
+#include "codec-lib.h"
+#include "storage.h"
 #include "utils.h"
 #include "shared/log.h"
 
@@ -114,54 +117,6 @@ static bool bluez_a2dp_codec_check_sampling_freq(
 	return false;
 }
 
-/**
- * Select (best) channel mode configuration. */
-static unsigned int bluez_a2dp_codec_select_channel_mode(
-		const struct bluez_a2dp_codec *codec,
-		unsigned int capabilities) {
-
-	size_t i;
-
-	/* If monophonic sound has been forced, check whether given codec supports
-	 * such a channel mode. Since mono channel mode shall be stored at index 0
-	 * we can simply check for its existence with a simple index lookup. */
-	if (config.a2dp.force_mono &&
-			codec->channels[0].mode == BLUEZ_A2DP_CHM_MONO &&
-			capabilities & codec->channels[0].value)
-		return codec->channels[0].value;
-
-	/* favor higher number of channels */
-	for (i = codec->channels_size; i > 0; i--)
-		if (capabilities & codec->channels[i - 1].value)
-			return codec->channels[i - 1].value;
-
-	return 0;
-}
-
-/**
- * Select (best) sampling frequency configuration. */
-static unsigned int bluez_a2dp_codec_select_sampling_freq(
-		const struct bluez_a2dp_codec *codec,
-		unsigned int capabilities) {
-
-	size_t i;
-
-	if (config.a2dp.force_44100)
-		for (i = 0; i < codec->samplings_size; i++)
-			if (codec->samplings[i].frequency == 44100) {
-				if (capabilities & codec->samplings[i].value)
-					return codec->samplings[i].value;
-				break;
-			}
-
-	/* favor higher sampling frequencies */
-	for (i = codec->samplings_size; i > 0; i--)
-		if (capabilities & codec->samplings[i - 1].value)
-			return codec->samplings[i - 1].value;
-
-	return 0;
-}
-
 /**
  * Set transport state using BlueZ state string. */
 static int bluez_a2dp_set_transport_state(
@@ -199,22 +154,30 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 		goto fail;
 	}
 
+	/* resources already consumed by other streams of the adapter */
+	struct a2dp_policy_load load = { 0 };
+	struct a2dp_policy_config selection;
+	struct ba_adapter *a;
+
+	if ((a = ba_adapter_lookup(dbus_obj->hci_dev_id)) != NULL) {
+		a2dp_policy_adapter_load(a, NULL, &load);
+		ba_adapter_unref(a);
+	}
+
 	switch (codec->id) {
 	case A2DP_CODEC_SBC: {
 
 		a2dp_sbc_t *cap = capabilities;
-		unsigned int cap_chm = cap->channel_mode;
-		unsigned int cap_freq = cap->frequency;
 
-		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
-			error("No supported channel modes: %#x", cap_chm);
+		if (a2dp_policy_select(codec, cap->channel_mode, cap->frequency,
+					&load, &selection) == -1) {
+			error("No supported configuration: channel modes: %#x, sampling frequencies: %#x",
+					cap->channel_mode, cap->frequency);
 			goto fail;
 		}
 
-		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
-			error("No supported sampling frequencies: %#x", cap_freq);
-			goto fail;
-		}
+		cap->channel_mode = selection.channel_mode;
+		cap->frequency = selection.sampling;
 
 		if (cap->block_length & SBC_BLOCK_LENGTH_16)
 			cap->block_length = SBC_BLOCK_LENGTH_16;
@@ -247,9 +210,9 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 			goto fail;
 		}
 
-		int bitpool = a2dp_sbc_default_bitpool(cap->frequency, cap->channel_mode);
 		cap->min_bitpool = MAX(SBC_MIN_BITPOOL, cap->min_bitpool);
-		cap->max_bitpool = MIN(bitpool, cap->max_bitpool);
+		cap->max_bitpool = MIN(selection.bitpool, cap->max_bitpool);
+		cap->max_bitpool = MAX(cap->min_bitpool, cap->max_bitpool);
 
 		break;
 	}
@@ -258,8 +221,6 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 	case A2DP_CODEC_MPEG12: {
 
 		a2dp_mpeg_t *cap = capabilities;
-		unsigned int cap_chm = cap->channel_mode;
-		unsigned int cap_freq = cap->frequency;
 
 		if (cap->layer & MPEG_LAYER_MP3)
 			cap->layer = MPEG_LAYER_MP3;
@@ -268,15 +229,15 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 			goto fail;
 		}
 
-		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
-			error("No supported channel modes: %#x", cap_chm);
+		if (a2dp_policy_select(codec, cap->channel_mode, cap->frequency,
+					&load, &selection) == -1) {
+			error("No supported configuration: channel modes: %#x, sampling frequencies: %#x",
+					cap->channel_mode, cap->frequency);
 			goto fail;
 		}
 
-		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
-			error("No supported sampling frequencies: %#x", cap_freq);
-			goto fail;
-		}
+		cap->channel_mode = selection.channel_mode;
+		cap->frequency = selection.sampling;
 
 		/* do not waste bits for CRC protection */
 		cap->crc = 0;
@@ -307,18 +268,14 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 			goto fail;
 		}
 
-		if ((cap->channels = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
-			error("No supported channels: %#x", cap_chm);
+		if (a2dp_policy_select(codec, cap_chm, cap_freq, &load, &selection) == -1) {
+			error("No supported configuration: channels: %#x, sampling frequencies: %#x",
+					cap_chm, cap_freq);
 			goto fail;
 		}
 
-		unsigned int freq;
-		if ((freq = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) != 0)
-			AAC_SET_FREQUENCY(*cap, freq);
-		else {
-			error("No supported sampling frequencies: %#x", cap_freq);
-			goto fail;
-		}
+		cap->channels = selection.channel_mode;
+		AAC_SET_FREQUENCY(*cap, selection.sampling);
 
 		break;
 	}
@@ -328,18 +285,16 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 	case A2DP_CODEC_VENDOR_APTX: {
 
 		a2dp_aptx_t *cap = capabilities;
-		unsigned int cap_chm = cap->channel_mode;
-		unsigned int cap_freq = cap->frequency;
 
-		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
-			error("No supported channel modes: %#x", cap_chm);
+		if (a2dp_policy_select(codec, cap->channel_mode, cap->frequency,
+					&load, &selection) == -1) {
+			error("No supported configuration: channel modes: %#x, sampling frequencies: %#x",
+					cap->channel_mode, cap->frequency);
 			goto fail;
 		}
 
-		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
-			error("No supported sampling frequencies: %#x", cap_freq);
-			goto fail;
-		}
+		cap->channel_mode = selection.channel_mode;
+		cap->frequency = selection.sampling;
 
 		break;
 	}
@@ -349,18 +304,16 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 	case A2DP_CODEC_VENDOR_LDAC: {
 
 		a2dp_ldac_t *cap = capabilities;
-		unsigned int cap_chm = cap->channel_mode;
-		unsigned int cap_freq = cap->frequency;
 
-		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
-			error("No supported channel modes: %#x", cap_chm);
+		if (a2dp_policy_select(codec, cap->channel_mode, cap->frequency,
+					&load, &selection) == -1) {
+			error("No supported configuration: channel modes: %#x, sampling frequencies: %#x",
+					cap->channel_mode, cap->frequency);
 			goto fail;
 		}
 
-		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
-			error("No supported sampling frequencies: %#x", cap_freq);
-			goto fail;
-		}
+		cap->channel_mode = selection.channel_mode;
+		cap->frequency = selection.sampling;
 
 		break;
 	}
@@ -408,7 +361,7 @@ static void bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *u
 	char *state = NULL;
 	char *device_path = NULL;
 	void *capabilities = NULL;
-	uint16_t volume = 127;
+	int volume = -1;
 	uint16_t delay = 150;
 	size_t size = 0;
 
@@ -597,6 +550,13 @@ static void bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *u
 		value = NULL;
 	}
 
+	/* Codec libraries are not loaded until the first negotiation, so
+	 * the memory is not wasted for codecs which are never used. */
+	if (codec_lib_a2dp_load(codec) == -1) {
+		error("Couldn't load codec: %s", strerror(errno));
+		goto fail;
+	}
+
 	if ((a = ba_adapter_lookup(dbus_obj->hci_dev_id)) == NULL &&
 			(a = ba_adapter_new(dbus_obj->hci_dev_id)) == NULL) {
 		error("Couldn't create new adapter: %s", strerror(errno));
@@ -622,10 +582,19 @@ static void bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *u
 		goto fail;
 	}
 
-	t->a2dp.ch1_volume = volume;
-	t->a2dp.ch2_volume = volume;
+	t->a2dp.ch1_volume = 127;
+	t->a2dp.ch2_volume = 127;
 	t->a2dp.delay = delay;
 
+	/* restore settings from the previous connection */
+	storage_transport_load(t);
+
+	/* volume reported by BlueZ takes precedence over the stored one */
+	if (volume != -1) {
+		t->a2dp.ch1_volume = volume;
+		t->a2dp.ch2_volume = volume;
+	}
+
 	debug("%s configured for device %s",
 			ba_transport_type_to_string(t->type),
 			batostr_(&d->addr));
@@ -893,6 +862,9 @@ static void bluez_register_a2dp_all(struct ba_adapter *adapter) {
 
 	while (*cc != NULL) {
 		const struct bluez_a2dp_codec *c = *cc++;
+		/* advertise only codecs which are available in the system */
+		if (!codec_lib_a2dp_probe(c))
+			continue;
 		switch (c->dir) {
 		case BLUEZ_A2DP_SOURCE:
 			if (config.enable.a2dp_source)
@@ -955,6 +927,10 @@ static void bluez_profile_new_connection(GDBusMethodInvocation *inv, void *userd
 
 	t->bt_fd = fd;
 
+	/* SCO gains have to be restored before the RFCOMM thread starts */
+	storage_transport_load(t);
+	storage_transport_load(t->rfcomm.sco);
+
 	debug("%s configured for device %s",
 			ba_transport_type_to_string(t->type),
 			batostr_(&d->addr));
@@ -0,0 +1,393 @@
+/*
+ * BlueALSA - codec-lib.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "codec-lib.h"
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <link.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a2dp-codecs.h"
+#include "shared/defs.h"
+#include "shared/log.h"
+#include "shared/rt.h"
+
+#define CODEC_LIB_STR(s) #s
+#define CODEC_LIB_XSTR(s) CODEC_LIB_STR(s)
+
+struct codec_lib_sym {
+	const char *name;
+	size_t offset;
+};
+
+/* Symbol descriptor for the given library function table. */
+#define CODEC_LIB_SYM(type, sym) { CODEC_LIB_XSTR(sym), offsetof(type, sym) },
+
+struct codec_lib {
+
+	/* library name used for logging */
+	const char *name;
+	/* NULL-terminated list of library sonames */
+	const char * const *sonames;
+
+	/* function table and its symbols */
+	void *table;
+	const struct codec_lib_sym *syms;
+	size_t syms_len;
+
+	/* called once the library has been loaded */
+	void (*init)(void);
+
+	/* handle of the loaded library */
+	void *handle;
+	/* zero if not probed yet, positive if present */
+	int present;
+
+};
+
+#if ENABLE_AAC
+struct codec_lib_fdk_aac libfdk_aac;
+# define FDK_AAC_SYM(sym) CODEC_LIB_SYM(struct codec_lib_fdk_aac, sym)
+static const struct codec_lib_sym fdk_aac_syms[] = {
+	CODEC_LIB_FDK_AAC_SYMBOLS(FDK_AAC_SYM)
+};
+/* The ABI of the fdk-aac library has changed between major releases, so
+ * we have to load the one which matches headers used during the build. */
+static const char * const fdk_aac_sonames[] = {
+# if AACENCODER_LIB_VL0 >= 4
+	"libfdk-aac.so.2",
+# else
+	"libfdk-aac.so.1",
+# endif
+	NULL };
+#endif
+
+#if ENABLE_APTX
+struct codec_lib_openaptx libopenaptx;
+# define OPENAPTX_SYM(sym) CODEC_LIB_SYM(struct codec_lib_openaptx, sym)
+static const struct codec_lib_sym openaptx_syms[] = {
+	CODEC_LIB_OPENAPTX_SYMBOLS(OPENAPTX_SYM)
+};
+static const char * const openaptx_sonames[] = {
+	"libopenaptx.so.0", NULL };
+#endif
+
+#if ENABLE_LDAC
+struct codec_lib_ldac_enc libldac_enc;
+# define LDAC_ENC_SYM(sym) CODEC_LIB_SYM(struct codec_lib_ldac_enc, sym)
+static const struct codec_lib_sym ldac_enc_syms[] = {
+	CODEC_LIB_LDAC_ENC_SYMBOLS(LDAC_ENC_SYM)
+};
+static const char * const ldac_enc_sonames[] = {
+	"libldacBT_enc.so.2", NULL };
+struct codec_lib_ldac_abr libldac_abr;
+# define LDAC_ABR_SYM(sym) CODEC_LIB_SYM(struct codec_lib_ldac_abr, sym)
+static const struct codec_lib_sym ldac_abr_syms[] = {
+	CODEC_LIB_LDAC_ABR_SYMBOLS(LDAC_ABR_SYM)
+};
+static const char * const ldac_abr_sonames[] = {
+	"libldacBT_abr.so.2", NULL };
+#endif
+
+#if ENABLE_MP3LAME
+struct codec_lib_mp3lame libmp3lame;
+# define MP3LAME_SYM(sym) CODEC_LIB_SYM(struct codec_lib_mp3lame, sym)
+static const struct codec_lib_sym mp3lame_syms[] = {
+	CODEC_LIB_MP3LAME_SYMBOLS(MP3LAME_SYM)
+};
+static const char * const mp3lame_sonames[] = {
+	"libmp3lame.so.0", NULL };
+#endif
+
+#if ENABLE_MPG123
+struct codec_lib_mpg123 libmpg123;
+# define MPG123_SYM(sym) CODEC_LIB_SYM(struct codec_lib_mpg123, sym)
+static const struct codec_lib_sym mpg123_syms[] = {
+	CODEC_LIB_MPG123_SYMBOLS(MPG123_SYM)
+};
+static const char * const mpg123_sonames[] = {
+	"libmpg123.so.0", NULL };
+static void mpg123_lib_init(void) {
+	libmpg123.mpg123_init();
+}
+#endif
+
+static struct codec_lib codec_libs[CODEC_LIB_ID_MAX] = {
+#if ENABLE_AAC
+	[CODEC_LIB_FDK_AAC] = {
+		.name = "fdk-aac", .sonames = fdk_aac_sonames,
+		.table = &libfdk_aac, .syms = fdk_aac_syms,
+		.syms_len = ARRAYSIZE(fdk_aac_syms) },
+#endif
+#if ENABLE_APTX
+	[CODEC_LIB_OPENAPTX] = {
+		.name = "openaptx", .sonames = openaptx_sonames,
+		.table = &libopenaptx, .syms = openaptx_syms,
+		.syms_len = ARRAYSIZE(openaptx_syms) },
+#endif
+#if ENABLE_LDAC
+	[CODEC_LIB_LDAC_ENC] = {
+		.name = "ldacBT-enc", .sonames = ldac_enc_sonames,
+		.table = &libldac_enc, .syms = ldac_enc_syms,
+		.syms_len = ARRAYSIZE(ldac_enc_syms) },
+	[CODEC_LIB_LDAC_ABR] = {
+		.name = "ldacBT-abr", .sonames = ldac_abr_sonames,
+		.table = &libldac_abr, .syms = ldac_abr_syms,
+		.syms_len = ARRAYSIZE(ldac_abr_syms) },
+#endif
+#if ENABLE_MP3LAME
+	[CODEC_LIB_MP3LAME] = {
+		.name = "mp3lame", .sonames = mp3lame_sonames,
+		.table = &libmp3lame, .syms = mp3lame_syms,
+		.syms_len = ARRAYSIZE(mp3lame_syms) },
+#endif
+#if ENABLE_MPG123
+	[CODEC_LIB_MPG123] = {
+		.name = "mpg123", .sonames = mpg123_sonames,
+		.table = &libmpg123, .syms = mpg123_syms,
+		.syms_len = ARRAYSIZE(mpg123_syms),
+		.init = mpg123_lib_init },
+#endif
+};
+
+static pthread_mutex_t codec_libs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *codec_lib_dlopen(const struct codec_lib *lib, int flags) {
+
+	const char * const *soname;
+	void *handle = NULL;
+
+	for (soname = lib->sonames; *soname != NULL; soname++)
+		if ((handle = dlopen(*soname, flags)) != NULL)
+			break;
+
+	return handle;
+}
+
+struct codec_lib_mapping {
+	ElfW(Addr) addr;
+	size_t size;
+};
+
+static int codec_lib_mapping_callback(struct dl_phdr_info *info, size_t size, void *data) {
+	(void)size;
+
+	struct codec_lib_mapping *m = data;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	if (info->dlpi_addr != m->addr)
+		return 0;
+
+	for (i = 0; i < info->dlpi_phnum; i++)
+		if (info->dlpi_phdr[i].p_type == PT_LOAD)
+			m->size += (info->dlpi_phdr[i].p_memsz + page - 1) / page * page;
+
+	return 1;
+}
+
+/**
+ * Get the size of the memory mapped for the loaded library. */
+static size_t codec_lib_mapped_size(void *handle) {
+
+	struct codec_lib_mapping m = { 0 };
+	struct link_map *lm;
+
+	if (dlinfo(handle, RTLD_DI_LINKMAP, &lm) != 0)
+		return 0;
+
+	m.addr = lm->l_addr;
+	dl_iterate_phdr(codec_lib_mapping_callback, &m);
+
+	return m.size;
+}
+
+/**
+ * Check whether the codec library is present in the system.
+ *
+ * The library is loaded and unloaded right away (unless it has been loaded
+ * already), so it will not occupy memory until it is really needed. The
+ * result of this check is cached.
+ *
+ * @param id Codec library identifier.
+ * @return This function returns true if the library can be loaded. */
+bool codec_lib_probe(enum codec_lib_id id) {
+
+	struct codec_lib *lib = &codec_libs[id];
+	bool present;
+
+	if (lib->name == NULL)
+		return false;
+
+	pthread_mutex_lock(&codec_libs_mutex);
+
+	if (lib->present == 0) {
+		void *handle;
+		if (lib->handle != NULL)
+			lib->present = 1;
+		else if ((handle = codec_lib_dlopen(lib, RTLD_LAZY | RTLD_LOCAL)) != NULL) {
+			dlclose(handle);
+			lib->present = 1;
+		}
+		else {
+			debug("Codec library not available: %s: %s", lib->name, dlerror());
+			lib->present = -1;
+		}
+	}
+
+	present = lib->present > 0;
+
+	pthread_mutex_unlock(&codec_libs_mutex);
+	return present;
+}
+
+/**
+ * Load the codec library and resolve its symbols.
+ *
+ * This function is thread-safe. Once loaded, the library is never unloaded,
+ * so subsequent calls are cheap.
+ *
+ * @param id Codec library identifier.
+ * @return On success this function returns 0. Otherwise, -1 is returned and
+ *   errno is set to ENOENT. */
+int codec_lib_load(enum codec_lib_id id) {
+
+	struct codec_lib *lib = &codec_libs[id];
+	struct timespec ts0, ts;
+	void *handle = NULL;
+	size_t i;
+
+	if (lib->name == NULL)
+		goto fail;
+
+	pthread_mutex_lock(&codec_libs_mutex);
+
+	if (lib->handle != NULL)
+		goto final;
+
+	gettimestamp(&ts0);
+
+	if ((handle = codec_lib_dlopen(lib, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		error("Couldn't load codec library: %s: %s", lib->name, dlerror());
+		goto fail_unlock;
+	}
+
+	for (i = 0; i < lib->syms_len; i++) {
+		void *ptr;
+		if ((ptr = dlsym(handle, lib->syms[i].name)) == NULL) {
+			error("Couldn't resolve codec library symbol: %s: %s",
+					lib->name, lib->syms[i].name);
+			dlclose(handle);
+			goto fail_unlock;
+		}
+		memcpy((char *)lib->table + lib->syms[i].offset, &ptr, sizeof(ptr));
+	}
+
+	if (lib->init != NULL)
+		lib->init();
+
+	gettimestamp(&ts);
+	difftimespec(&ts0, &ts, &ts);
+
+	info("Loaded codec library: %s [%zu KiB in %ld.%03ld ms]", lib->name,
+			codec_lib_mapped_size(handle) / 1024,
+			(long)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000),
+			(long)(ts.tv_nsec / 1000 % 1000));
+
+	lib->handle = handle;
+	lib->present = 1;
+
+final:
+	pthread_mutex_unlock(&codec_libs_mutex);
+	return 0;
+
+fail_unlock:
+	lib->present = -1;
+	pthread_mutex_unlock(&codec_libs_mutex);
+fail:
+	errno = ENOENT;
+	return -1;
+}
+
+/**
+ * Get the list of libraries required by the given A2DP codec.
+ *
+ * @return The number of libraries stored in the ids array. */
+static size_t codec_lib_a2dp_ids(const struct bluez_a2dp_codec *codec,
+		enum codec_lib_id ids[2]) {
+	(void)ids;
+
+	switch (codec->id) {
+#if ENABLE_MPEG
+	case A2DP_CODEC_MPEG12:
+# if ENABLE_MPG123
+		if (codec->dir == BLUEZ_A2DP_SINK) {
+			ids[0] = CODEC_LIB_MPG123;
+			return 1;
+		}
+# endif
+		ids[0] = CODEC_LIB_MP3LAME;
+		return 1;
+#endif
+#if ENABLE_AAC
+	case A2DP_CODEC_MPEG24:
+		ids[0] = CODEC_LIB_FDK_AAC;
+		return 1;
+#endif
+#if ENABLE_APTX
+	case A2DP_CODEC_VENDOR_APTX:
+		ids[0] = CODEC_LIB_OPENAPTX;
+		return 1;
+#endif
+#if ENABLE_LDAC
+	case A2DP_CODEC_VENDOR_LDAC:
+		ids[0] = CODEC_LIB_LDAC_ENC;
+		ids[1] = CODEC_LIB_LDAC_ABR;
+		return 2;
+#endif
+	}
+
+	return 0;
+}
+
+/**
+ * Check whether libraries required by the A2DP codec are present. */
+bool codec_lib_a2dp_probe(const struct bluez_a2dp_codec *codec) {
+
+	enum codec_lib_id ids[2];
+	size_t i, n = codec_lib_a2dp_ids(codec, ids);
+
+	for (i = 0; i < n; i++)
+		if (!codec_lib_probe(ids[i]))
+			return false;
+
+	return true;
+}
+
+/**
+ * Load libraries required by the A2DP codec. */
+int codec_lib_a2dp_load(const struct bluez_a2dp_codec *codec) {
+
+	enum codec_lib_id ids[2];
+	size_t i, n = codec_lib_a2dp_ids(codec, ids);
+
+	for (i = 0; i < n; i++)
+		if (codec_lib_load(ids[i]) == -1)
+			return -1;
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * BlueALSA - codec-lib.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_CODECLIB_H_
+#define BLUEALSA_CODECLIB_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+
+#if ENABLE_AAC
+# include <fdk-aac/aacdecoder_lib.h>
+# include <fdk-aac/aacenc_lib.h>
+#endif
+#if ENABLE_APTX
+# include <openaptx.h>
+#endif
+#if ENABLE_LDAC
+# include <ldacBT.h>
+# include <ldacBT_abr.h>
+#endif
+#if ENABLE_MP3LAME
+# include <lame/lame.h>
+#endif
+#if ENABLE_MPG123
+# include <mpg123.h>
+#endif
+
+#include "bluez-a2dp.h"
+
+/**
+ * Codec libraries which are loaded on demand. */
+enum codec_lib_id {
+	CODEC_LIB_FDK_AAC,
+	CODEC_LIB_OPENAPTX,
+	CODEC_LIB_LDAC_ENC,
+	CODEC_LIB_LDAC_ABR,
+	CODEC_LIB_MP3LAME,
+	CODEC_LIB_MPG123,
+	CODEC_LIB_ID_MAX,
+};
+
+/* Declare pointer to the library function with the same name. */
+#define CODEC_LIB_SYM_PTR(sym) __typeof__(sym) *sym;
+
+#if ENABLE_AAC
+# define CODEC_LIB_FDK_AAC_SYMBOLS(X) \
+	X(aacDecoder_Close) \
+	X(aacDecoder_DecodeFrame) \
+	X(aacDecoder_Fill) \
+	X(aacDecoder_GetStreamInfo) \
+	X(aacDecoder_Open) \
+	X(aacDecoder_SetParam) \
+	X(aacEncClose) \
+	X(aacEncEncode) \
+	X(aacEncInfo) \
+	X(aacEncOpen) \
+	X(aacEncoder_SetParam)
+extern struct codec_lib_fdk_aac {
+	CODEC_LIB_FDK_AAC_SYMBOLS(CODEC_LIB_SYM_PTR)
+} libfdk_aac;
+#endif
+
+#if ENABLE_APTX
+# define CODEC_LIB_OPENAPTX_SYMBOLS(X) \
+	X(SizeofAptxbtenc) \
+	X(aptxbtenc_encodestereo) \
+	X(aptxbtenc_init)
+extern struct codec_lib_openaptx {
+	CODEC_LIB_OPENAPTX_SYMBOLS(CODEC_LIB_SYM_PTR)
+} libopenaptx;
+#endif
+
+#if ENABLE_LDAC
+# define CODEC_LIB_LDAC_ENC_SYMBOLS(X) \
+	X(ldacBT_encode) \
+	X(ldacBT_free_handle) \
+	X(ldacBT_get_error_code) \
+	X(ldacBT_get_handle) \
+	X(ldacBT_init_handle_encode) \
+	X(ldacBT_set_eqmid)
+extern struct codec_lib_ldac_enc {
+	CODEC_LIB_LDAC_ENC_SYMBOLS(CODEC_LIB_SYM_PTR)
+} libldac_enc;
+# define CODEC_LIB_LDAC_ABR_SYMBOLS(X) \
+	X(ldac_ABR_Init) \
+	X(ldac_ABR_Proc) \
+	X(ldac_ABR_free_handle) \
+	X(ldac_ABR_get_handle) \
+	X(ldac_ABR_set_thresholds)
+extern struct codec_lib_ldac_abr {
+	CODEC_LIB_LDAC_ABR_SYMBOLS(CODEC_LIB_SYM_PTR)
+} libldac_abr;
+#endif
+
+#if ENABLE_MP3LAME
+# define CODEC_LIB_MP3LAME_SYMBOLS(X) \
+	X(hip_decode) \
+	X(hip_decode_exit) \
+	X(hip_decode_init) \
+	X(lame_close) \
+	X(lame_encode_buffer_interleaved) \
+	X(lame_get_framesize) \
+	X(lame_init) \
+	X(lame_init_params) \
+	X(lame_set_VBR) \
+	X(lame_set_VBR_q) \
+	X(lame_set_bWriteVbrTag) \
+	X(lame_set_brate) \
+	X(lame_set_error_protection) \
+	X(lame_set_free_format) \
+	X(lame_set_in_samplerate) \
+	X(lame_set_mode) \
+	X(lame_set_num_channels) \
+	X(lame_set_quality)
+extern struct codec_lib_mp3lame {
+	CODEC_LIB_MP3LAME_SYMBOLS(CODEC_LIB_SYM_PTR)
+} libmp3lame;
+#endif
+
+#if ENABLE_MPG123
+# define CODEC_LIB_MPG123_SYMBOLS(X) \
+	X(mpg123_decode) \
+	X(mpg123_delete) \
+	X(mpg123_getformat) \
+	X(mpg123_init) \
+	X(mpg123_new) \
+	X(mpg123_open_feed) \
+	X(mpg123_plain_strerror) \
+	X(mpg123_strerror)
+extern struct codec_lib_mpg123 {
+	CODEC_LIB_MPG123_SYMBOLS(CODEC_LIB_SYM_PTR)
+} libmpg123;
+#endif
+
+bool codec_lib_probe(enum codec_lib_id id);
+int codec_lib_load(enum codec_lib_id id);
+
+bool codec_lib_a2dp_probe(const struct bluez_a2dp_codec *codec);
+int codec_lib_a2dp_load(const struct bluez_a2dp_codec *codec);
+
+#endif
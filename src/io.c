@@ -23,32 +23,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <sbc/sbc.h>
+#if ENABLE_LIBURING
+# include <liburing.h>
+#endif
 #if ENABLE_AAC
-# include <fdk-aac/aacdecoder_lib.h>
-# include <fdk-aac/aacenc_lib.h>
 # define AACENCODER_LIB_VERSION LIB_VERSION( \
 		AACENCODER_LIB_VL0, AACENCODER_LIB_VL1, AACENCODER_LIB_VL2)
 #endif
-#if ENABLE_APTX
-# include <openaptx.h>
-#endif
-#if ENABLE_MP3LAME
-# include <lame/lame.h>
-#endif
-#if ENABLE_MPG123
-# include <mpg123.h>
-#endif
-#if ENABLE_LDAC
-# include <ldacBT.h>
-# include <ldacBT_abr.h>
-#endif
 
 #include "a2dp-codecs.h"
 #include "a2dp-rtp.h"
 #include "bluealsa.h"
+#include "bluealsa-dbus.h"
+#include "codec-lib.h"
 #include "hfp.h"
 #include "msbc.h"
 #include "rfcomm.h"
@@ -69,8 +60,18 @@ struct io_thread_data {
 	struct asrsync asrs;
 	/* history of BT socket COUTQ bytes */
 	struct { int v[16]; size_t i; } coutq;
+	/* RTP transfer statistics */
+	struct { unsigned int frames; unsigned int packets; size_t bytes; unsigned int syscalls; } stats;
+	/* average number of BT payload bytes per PCM frame */
+	double bt_frame_bytes;
+	/* frames read from the PCM FIFO since it was opened */
+	uint64_t pcm_pos_frames;
 	/* determine whether transport is locked */
 	bool t_locked;
+#if ENABLE_LIBURING
+	/* io_uring IO backend, if NULL poll() is used */
+	struct io_ring *ring;
+#endif
 };
 
 /**
@@ -131,26 +132,25 @@ static ssize_t io_thread_read_pcm_flush(struct ba_pcm *pcm) {
  * Write PCM signal to the transport PCM FIFO.
  *
  * Note:
- * This function temporally re-enables thread cancellation! */
-static ssize_t io_thread_write_pcm(struct ba_pcm *pcm, const int16_t *buffer, size_t samples) {
+ * This function blocks until all data are written or the IO thread
+ * termination is requested - in such case errno is set to ECANCELED. */
+static ssize_t io_thread_write_pcm(struct ba_transport *t, struct ba_pcm *pcm,
+		const int16_t *buffer, size_t samples) {
 
-	struct pollfd pfd = { pcm->fd, POLLOUT, 0 };
 	const uint8_t *head = (uint8_t *)buffer;
 	size_t len = samples * sizeof(int16_t);
-	int oldstate;
 	ssize_t ret;
 
-	/* In order to provide a way of escaping from the infinite poll() we have
-	 * to temporally re-enable thread cancellation. */
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
-
 	do {
 		if ((ret = write(pcm->fd, head, len)) == -1)
 			switch (errno) {
 			case EINTR:
 				continue;
 			case EAGAIN:
-				poll(&pfd, 1, -1);
+				/* In order to provide a way of escaping from the infinite
+				 * wait, the IO thread termination request is checked. */
+				if (ba_transport_pthread_wait(t, pcm->fd, POLLOUT) == -1)
+					goto final;
 				continue;
 			case EPIPE:
 				/* This errno value will be received only, when the SIGPIPE
@@ -170,7 +170,6 @@ static ssize_t io_thread_write_pcm(struct ba_pcm *pcm, const int16_t *buffer, si
 	ret = samples;
 
 final:
-	pthread_setcancelstate(oldstate, NULL);
 	return ret;
 }
 
@@ -178,691 +177,958 @@ final:
  * Write data to the BT SEQPACKET socket.
  *
  * Note:
- * This function temporally re-enables thread cancellation! */
-static ssize_t io_thread_write_bt(const struct ba_transport *t,
+ * This function blocks until data are written or the IO thread termination
+ * is requested - in such case errno is set to ECANCELED. */
+static ssize_t io_thread_write_bt(struct ba_transport *t,
 		const uint8_t *buffer, size_t len, int *coutq) {
 
-	struct pollfd pfd = { t->bt_fd, POLLOUT, 0 };
-	int oldstate;
+	const int fd = t->bt_fd;
 	ssize_t ret;
 
-	/* BT socket is opened in the non-blocking mode. However, this function
-	 * forcefully operates in a blocking mode - it uses poll() when writing
-	 * to the BT socket would block. Hence, it is required to provide a way
-	 * of escaping from the poll() when the IO thread termination request
-	 * has been made by re-enabling thread cancellation. */
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
-
-	if (ioctl(pfd.fd, TIOCOUTQ, coutq) == -1)
+	if (ioctl(fd, TIOCOUTQ, coutq) == -1)
 		warn("Couldn't get BT queued bytes: %s", strerror(errno));
 	else
 		*coutq = abs(t->a2dp.bt_fd_coutq_init - *coutq);
 
+	/* BT socket is opened in the non-blocking mode. However, this function
+	 * forcefully operates in a blocking mode - it waits for the socket when
+	 * writing would block. Hence, it is required to provide a way of escaping
+	 * from the wait when the IO thread termination request has been made. */
 retry:
-	if ((ret = write(pfd.fd, buffer, len)) == -1)
+	if ((ret = write(fd, buffer, len)) == -1)
 		switch (errno) {
 		case EINTR:
 			goto retry;
 		case EAGAIN:
-			poll(&pfd, 1, -1);
+			if (ba_transport_pthread_wait(t, fd, POLLOUT) == -1)
+				break;
 			/* set coutq to some arbitrary big value */
 			*coutq = 1024 * 16;
 			goto retry;
 		}
 
-	pthread_setcancelstate(oldstate, NULL);
 	return ret;
 }
 
 /**
- * Initialize RTP headers.
+ * Get the smoothed number of bytes queued in the BT socket.
  *
- * @param s The memory area where the RTP headers will be initialized.
- * @param hdr The address where the pointer to the RTP header will be stored.
- * @param phdr The address where the pointer to the RTP payload header will
- *   be stored. This parameter might be NULL.
- * @param phdr_size The size of the RTP payload header.
- * @return This function returns the address of the RTP payload region. */
-static uint8_t *io_thread_init_rtp(void *s, rtp_header_t **hdr,
-		void **phdr, size_t phdr_size) {
+ * The estimation is based on the whole COUTQ history. Samples are weighted
+ * linearly, so the most recent one has the biggest impact on the result,
+ * but a single outlier will not cause a sudden jump of the estimated value. */
+static int io_thread_coutq_estimate(const struct io_thread_data *io) {
 
-	rtp_header_t *header = *hdr = (rtp_header_t *)s;
-	memset(header, 0, RTP_HEADER_LEN + phdr_size);
-	header->paytype = 96;
-	header->version = 2;
-	header->seq_number = random();
-	header->timestamp = random();
-
-	uint8_t *data = (uint8_t *)&header->csrc[header->cc];
+	const size_t n = ARRAYSIZE(io->coutq.v);
+	long long sum = 0;
+	long long weights = 0;
+	size_t i;
 
-	if (phdr != NULL)
-		*phdr = data;
+	for (i = 0; i < n; i++) {
+		const size_t weight = n - i;
+		sum += (long long)io->coutq.v[(io->coutq.i + n - i) % n] * weight;
+		weights += weight;
+	}
 
-	return data + phdr_size;
+	return sum / weights;
 }
 
-static void *io_thread_a2dp_sink_sbc(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
+#if ENABLE_LIBURING
 
-	/* Cancellation should be possible only in the carefully selected place
-	 * in order to prevent memory leaks and resources not being released. */
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
+/* number of BT packets which can be in flight */
+#define IO_RING_BT_SLOTS 8
 
-	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
-		.fds[1] = { -1, POLLIN, 0 },
-		/* Lock transport during initialization stage. This lock will ensure,
-		 * that no one will modify critical section until thread state can be
-		 * known - initialization has failed or succeeded. */
-		.t_locked = !ba_transport_pthread_cleanup_lock(t),
-	};
+#define IO_RING_DATA(op, slot) ((uint64_t)(op) | ((uint64_t)(slot) << 8))
+#define IO_RING_DATA_OP(data) ((data) & 0xFF)
+#define IO_RING_DATA_SLOT(data) ((data) >> 8)
 
-	if (t->bt_fd == -1) {
-		error("Invalid BT socket: %d", t->bt_fd);
-		goto fail_init;
-	}
+enum io_ring_op {
+	IO_RING_OP_SIG_POLL = 1,
+	IO_RING_OP_PCM_POLL,
+	IO_RING_OP_PCM_READ,
+	IO_RING_OP_BT_POLL,
+	IO_RING_OP_BT_WRITE,
+	IO_RING_OP_TIMEOUT,
+	IO_RING_OP_CANCEL,
+};
 
-	/* Check for invalid (e.g. not set) reading MTU. If buffer allocation does
-	 * not return NULL (allocating zero bytes might return NULL), we will read
-	 * zero bytes from the BT socket, which will be wrongly identified as a
-	 * "connection closed" action. */
-	if (t->mtu_read <= 0) {
-		error("Invalid reading MTU: %zu", t->mtu_read);
-		goto fail_init;
+/**
+ * The io_uring IO backend.
+ *
+ * Reads from the PCM FIFO and writes to the BT socket are submitted as
+ * poll requests linked with the read or write requests, so the operation
+ * is carried out by the kernel as soon as the non-blocking file becomes
+ * ready. New requests are not submitted on their own, but together with
+ * the wait for the next event or the transfer pacing timeout.
+ *
+ * The io_uring does not keep independent requests in order, so only one
+ * BT write is in flight at a time. Other RTP packets are queued in slots
+ * and submitted one after another upon completion of the previous write. */
+struct io_ring {
+	struct io_uring ring;
+	/* number of requests waiting for completion */
+	unsigned int inflight;
+	/* transport signal queue poll */
+	bool sig_armed;
+	bool sig_ready;
+	/* PCM FIFO read request and its result */
+	bool pcm_armed;
+	bool pcm_cancelled;
+	bool pcm_ready;
+	int pcm_fd;
+	int pcm_result;
+	/* pacing timeout */
+	bool timeout_armed;
+	struct __kernel_timespec timeout;
+	/* queue of BT packets, the first one might be in flight */
+	uint8_t *bt_slots;
+	size_t bt_slot_size;
+	size_t bt_slot_len[IO_RING_BT_SLOTS];
+	unsigned int bt_first;
+	unsigned int bt_queued;
+	bool bt_armed;
+	int bt_fd;
+	/* first error reported by the BT write request */
+	int bt_error;
+};
+
+static struct io_uring_sqe *io_ring_get_sqe(struct io_thread_data *io) {
+	struct io_ring *r = io->ring;
+	struct io_uring_sqe *sqe;
+	while ((sqe = io_uring_get_sqe(&r->ring)) == NULL) {
+		io_uring_submit(&r->ring);
+		io->stats.syscalls++;
 	}
+	return sqe;
+}
 
-	sbc_t sbc;
+/**
+ * Create io_uring IO backend.
+ *
+ * @param slot_size The maximal size of the BT packet.
+ * @return On success this function returns newly allocated backend. If the
+ *   io_uring is not enabled or it is not supported by the running kernel,
+ *   NULL is returned and errno is set to indicate the error. */
+static struct io_ring *io_ring_new(size_t slot_size) {
+
+	static const int ops[] = {
+		IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_WRITE,
+		IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL };
+	struct io_uring_probe *probe;
+	struct io_ring *r;
+	size_t i;
+	int err;
 
-	if ((errno = -sbc_init_a2dp(&sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
-		error("Couldn't initialize SBC codec: %s", strerror(errno));
-		goto fail_init;
+	/* The pacing timeout sleeps in the kernel, so it does not
+	 * work with a clock source other than the system one. */
+	if (!config.io_uring || rt_clock_get() != &rt_clock_monotonic) {
+		errno = ENOTSUP;
+		return NULL;
 	}
 
-	const unsigned int channels = ba_transport_get_channels(t);
-
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(sbc_finish), &sbc);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return NULL;
 
-	if (ffb_init(&pcm, sbc_get_codesize(&sbc)) == NULL ||
-			ffb_init(&bt, t->mtu_read) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
+	if ((err = io_uring_queue_init(32, &r->ring, 0)) < 0) {
+		free(r);
+		errno = -err;
+		return NULL;
 	}
 
-	/* Lock transport during thread cancellation. This handler shall be at
-	 * the top of the cleanup stack - lastly pushed. */
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup_lock), t);
-
-	uint16_t seq_number = -1;
+	err = ENOMEM;
+	if ((probe = io_uring_get_probe_ring(&r->ring)) == NULL)
+		goto fail;
 
-	ba_transport_pthread_cleanup_unlock(t);
-	io.t_locked = false;
+	for (i = 0; i < ARRAYSIZE(ops); i++)
+		if (!io_uring_opcode_supported(probe, ops[i])) {
+			io_uring_free_probe(probe);
+			err = ENOTSUP;
+			goto fail;
+		}
 
-	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	io_uring_free_probe(probe);
 
-		ssize_t len;
+	r->bt_slot_size = slot_size;
+	if ((r->bt_slots = malloc(IO_RING_BT_SLOTS * slot_size)) == NULL)
+		goto fail;
 
-		/* add BT socket to the poll if transport is active */
-		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
+	r->pcm_fd = -1;
+	r->bt_fd = -1;
+	return r;
 
-		if (poll(io.fds, ARRAYSIZE(io.fds), -1) == -1) {
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
-		}
+fail:
+	io_uring_queue_exit(&r->ring);
+	free(r);
+	errno = err;
+	return NULL;
+}
 
-		if (io.fds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			ba_transport_recv_signal(t);
-			continue;
-		}
+/**
+ * Submit write request for the first packet in the BT queue. */
+static void io_ring_submit_bt(struct io_thread_data *io) {
 
-		if ((len = read(io.fds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
-			debug("BT read error: %s", strerror(errno));
-			continue;
-		}
+	struct io_ring *r = io->ring;
+	struct io_uring_sqe *sqe;
+	const unsigned int slot = r->bt_first;
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	sqe = io_ring_get_sqe(io);
+	io_uring_prep_poll_add(sqe, r->bt_fd, POLLOUT);
+	io_uring_sqe_set_data64(sqe, IO_RING_DATA(IO_RING_OP_BT_POLL, slot));
+	io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+	sqe = io_ring_get_sqe(io);
+	io_uring_prep_write(sqe, r->bt_fd, r->bt_slots + slot * r->bt_slot_size,
+			r->bt_slot_len[slot], -1);
+	io_uring_sqe_set_data64(sqe, IO_RING_DATA(IO_RING_OP_BT_WRITE, slot));
 
-		/* it seems that zero is never returned... */
-		if (len == 0) {
-			debug("BT socket has been closed: %d", io.fds[1].fd);
-			/* Prevent sending the release request to the BlueZ. If the socket has
-			 * been closed, it means that BlueZ has already closed the connection. */
-			close(io.fds[1].fd);
-			t->bt_fd = -1;
-			goto fail;
-		}
+	r->bt_armed = true;
+	r->inflight += 2;
 
-		if (t->a2dp.pcm.fd == -1) {
-			seq_number = -1;
-			continue;
-		}
+}
 
-		const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
-		const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&rtp_header->csrc[rtp_header->cc];
-		const uint8_t *rtp_payload = (uint8_t *)(rtp_media_header + 1);
-		size_t rtp_payload_len = len - (rtp_payload - (uint8_t *)rtp_header);
+/**
+ * Process all completed requests. */
+static void io_ring_reap(struct io_thread_data *io) {
 
-#if ENABLE_PAYLOADCHECK
-		if (rtp_header->paytype < 96) {
-			warn("Unsupported RTP payload type: %u", rtp_header->paytype);
-			continue;
-		}
-#endif
+	struct io_ring *r = io->ring;
+	struct io_uring_cqe *cqe;
 
-		uint16_t _seq_number = ntohs(rtp_header->seq_number);
-		if (++seq_number != _seq_number) {
-			if (seq_number != 0)
-				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
-			seq_number = _seq_number;
-		}
+	while (io_uring_peek_cqe(&r->ring, &cqe) == 0) {
 
-		/* decode retrieved SBC frames */
-		size_t frames = rtp_media_header->frame_count;
-		while (frames--) {
+		const uint64_t data = io_uring_cqe_get_data64(cqe);
+		const int res = cqe->res;
 
-			ssize_t len;
-			size_t decoded;
+		io_uring_cqe_seen(&r->ring, cqe);
+		r->inflight--;
 
-			if ((len = sbc_decode(&sbc, rtp_payload, rtp_payload_len,
-							pcm.data, ffb_blen_in(&pcm), &decoded)) < 0) {
-				error("SBC decoding error: %s", strerror(-len));
+		switch (IO_RING_DATA_OP(data)) {
+		case IO_RING_OP_SIG_POLL:
+			r->sig_armed = false;
+			r->sig_ready = true;
+			break;
+		case IO_RING_OP_PCM_READ:
+			r->pcm_armed = false;
+			/* ignore result of the cancelled read request */
+			if (r->pcm_cancelled || res == -ECANCELED) {
+				r->pcm_cancelled = false;
 				break;
 			}
-
-			rtp_payload += len;
-			rtp_payload_len -= len;
-
-			const size_t samples = decoded / sizeof(int16_t);
-			io_thread_scale_pcm(t, pcm.data, samples, channels);
-			if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
-				error("FIFO write error: %s", strerror(errno));
-
+			r->pcm_ready = true;
+			r->pcm_result = res;
+			break;
+		case IO_RING_OP_BT_WRITE:
+			r->bt_armed = false;
+			r->bt_first = (r->bt_first + 1) % IO_RING_BT_SLOTS;
+			r->bt_queued--;
+			if (res < 0) {
+				if (r->bt_error == 0)
+					r->bt_error = -res;
+				/* drop packets queued after the failed one */
+				r->bt_queued = 0;
+			}
+			/* keep RTP packets in order by submitting them one by one */
+			if (r->bt_queued > 0)
+				io_ring_submit_bt(io);
+			break;
+		case IO_RING_OP_TIMEOUT:
+			r->timeout_armed = false;
+			break;
 		}
 
 	}
 
-fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!io.t_locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-	return NULL;
 }
 
-static void *io_thread_a2dp_source_sbc(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
-
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
-
-	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
-		.fds[1] = { -1, POLLIN, 0 },
-		.poll_timeout = -1,
-		/* Lock transport during initialization stage. This lock will ensure,
-		 * that no one will modify critical section until thread state can be
-		 * known - initialization has failed or succeeded. */
-		.t_locked = !ba_transport_pthread_cleanup_lock(t),
-	};
-
-	sbc_t sbc;
+/**
+ * Submit queued requests and wait for completion of other requests.
+ *
+ * @param io Pointer to the IO thread data structure.
+ * @param wait_nr The number of requests to wait for.
+ * @param timeout Timeout in milliseconds or -1 for infinite wait.
+ * @return This function returns the number of processed requests or -1
+ *   on error, in which case errno is set appropriately. */
+static int io_ring_submit_and_wait(struct io_thread_data *io, unsigned int wait_nr,
+		int timeout) {
+
+	struct io_ring *r = io->ring;
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (timeout % 1000) * 1000000 };
+	struct io_uring_cqe *cqe;
+	const unsigned int inflight = r->inflight;
+	int ret;
 
-	if ((errno = -sbc_init_a2dp(&sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
-		error("Couldn't initialize SBC codec: %s", strerror(errno));
-		goto fail_init;
+	io->stats.syscalls++;
+	if ((ret = io_uring_submit_and_wait_timeout(&r->ring, &cqe, wait_nr,
+					timeout >= 0 ? &ts : NULL, NULL)) < 0 && ret != -ETIME) {
+		errno = -ret;
+		return -1;
 	}
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
-	pthread_cleanup_push(PTHREAD_CLEANUP(sbc_finish), &sbc);
+	io_ring_reap(io);
+	return inflight - r->inflight;
+}
 
-	const size_t sbc_pcm_samples = sbc_get_codesize(&sbc) / sizeof(int16_t);
-	const size_t sbc_frame_len = sbc_get_frame_length(&sbc);
-	const unsigned int channels = ba_transport_get_channels(t);
-	const unsigned int samplerate = ba_transport_get_sampling(t);
+/**
+ * Cancel request identified by the given user data. */
+static void io_ring_cancel(struct io_thread_data *io, uint64_t data) {
+	struct io_uring_sqe *sqe = io_ring_get_sqe(io);
+	io_uring_prep_cancel64(sqe, data, 0);
+	io_uring_sqe_set_data64(sqe, IO_RING_DATA(IO_RING_OP_CANCEL, 0));
+	io->ring->inflight++;
+}
 
-	/* Writing MTU should be big enough to contain RTP header, SBC payload
-	 * header and at least one SBC frame. In general, there is no constraint
-	 * for the MTU value, but the speed might suffer significantly. */
-	const size_t mtu_write_payload = t->mtu_write - RTP_HEADER_LEN - sizeof(rtp_media_header_t);
-	if (mtu_write_payload < sbc_frame_len) {
-		warn("Writing MTU too small for one single SBC frame: %zu < %zu",
-				t->mtu_write, RTP_HEADER_LEN + sizeof(rtp_media_header_t) + sbc_frame_len);
-		t->mtu_write = RTP_HEADER_LEN + sizeof(rtp_media_header_t) + sbc_frame_len;
-	}
+/**
+ * Cancel pending PCM FIFO read request. */
+static void io_ring_cancel_pcm(struct io_thread_data *io) {
+	struct io_ring *r = io->ring;
+	if (r->pcm_armed && !r->pcm_cancelled) {
+		/* cancelling the poll request cancels the linked read as well */
+		io_ring_cancel(io, IO_RING_DATA(IO_RING_OP_PCM_POLL, 0));
+		io_ring_cancel(io, IO_RING_DATA(IO_RING_OP_PCM_READ, 0));
+		r->pcm_cancelled = true;
+	}
+	r->pcm_ready = false;
+}
 
-	if (ffb_init(&pcm, sbc_pcm_samples * (mtu_write_payload / sbc_frame_len)) == NULL ||
-			ffb_init(&bt, t->mtu_write) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
-	}
+/**
+ * Free io_uring IO backend.
+ *
+ * All pending requests are cancelled, so the kernel will not access
+ * buffers of the IO thread after this function returns. */
+static void io_ring_free(struct io_thread_data *io) {
+
+	struct io_ring *r;
+
+	if ((r = io->ring) == NULL)
+		return;
+
+	if (r->sig_armed)
+		io_ring_cancel(io, IO_RING_DATA(IO_RING_OP_SIG_POLL, 0));
+	if (r->timeout_armed)
+		io_ring_cancel(io, IO_RING_DATA(IO_RING_OP_TIMEOUT, 0));
+	io_ring_cancel_pcm(io);
+	/* do not submit queued packets upon cancellation */
+	r->bt_queued = MIN(r->bt_queued, 1);
+	if (r->bt_armed) {
+		io_ring_cancel(io, IO_RING_DATA(IO_RING_OP_BT_POLL, r->bt_first));
+		io_ring_cancel(io, IO_RING_DATA(IO_RING_OP_BT_WRITE, r->bt_first));
+	}
+
+	while (r->inflight > 0)
+		if (io_ring_submit_and_wait(io, r->inflight, 500) <= 0) {
+			warn("Couldn't cancel io_uring requests: %u", r->inflight);
+			break;
+		}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup_lock), t);
+	io_uring_queue_exit(&r->ring);
+	free(r->bt_slots);
+	free(r);
+	io->ring = NULL;
 
-	rtp_header_t *rtp_header;
-	rtp_media_header_t *rtp_media_header;
+}
 
-	/* initialize RTP headers and get anchor for payload */
-	uint8_t *rtp_payload = io_thread_init_rtp(bt.data, &rtp_header,
-			(void **)&rtp_media_header, sizeof(*rtp_media_header));
-	uint16_t seq_number = ntohs(rtp_header->seq_number);
-	uint32_t timestamp = ntohl(rtp_header->timestamp);
+/**
+ * Wait for the IO thread event.
+ *
+ * This function is the io_uring counterpart of the poll() call on the
+ * IO thread file descriptors. The PCM FIFO is not only polled, but the
+ * data are read into the given buffer as well.
+ *
+ * @return This function returns the same values as the poll(). */
+static int io_ring_poll(struct io_thread_data *io, void *buffer, size_t size, int timeout) {
 
-	ba_transport_pthread_cleanup_unlock(t);
-	io.t_locked = false;
+	struct io_ring *r = io->ring;
+	struct io_uring_sqe *sqe;
 
-	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
 	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-		ssize_t samples;
-
-		/* add PCM socket to the poll if transport is active */
-		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
-
-		switch (poll(io.fds, ARRAYSIZE(io.fds), io.poll_timeout)) {
-		case 0:
-			pthread_cond_signal(&t->a2dp.drained);
-			io.poll_timeout = -1;
-			io.t_locked = !ba_transport_pthread_cleanup_lock(t);
-			if (t->a2dp.pcm.fd == -1)
-				goto final;
-			ba_transport_pthread_cleanup_unlock(t);
-			io.t_locked = false;
-			continue;
-		case -1:
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
+		if (!r->sig_armed && !r->sig_ready) {
+			sqe = io_ring_get_sqe(io);
+			io_uring_prep_poll_add(sqe, io->fds[0].fd, POLLIN);
+			io_uring_sqe_set_data64(sqe, IO_RING_DATA(IO_RING_OP_SIG_POLL, 0));
+			r->sig_armed = true;
+			r->inflight++;
 		}
 
-		if (io.fds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			switch (ba_transport_recv_signal(t)) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				io.poll_timeout = -1;
-				io.asrs.frames = 0;
-				continue;
-			case TRANSPORT_PCM_CLOSE:
-				/* reuse PCM read disconnection logic */
-				break;
-			case TRANSPORT_PCM_SYNC:
-				io.poll_timeout = 100;
-				continue;
-			case TRANSPORT_PCM_DROP:
-				io_thread_read_pcm_flush(&t->a2dp.pcm);
-				continue;
-			default:
-				continue;
-			}
+		/* drop read request of the PCM which has been paused or replaced */
+		if (r->pcm_fd != io->fds[1].fd) {
+			io_ring_cancel_pcm(io);
+			r->pcm_fd = io->fds[1].fd;
 		}
 
-		switch (samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) {
-		case 0:
-			io.poll_timeout = config.a2dp.keep_alive * 1000;
-			debug("Keep-alive polling: %d", io.poll_timeout);
-			continue;
-		case -1:
-			if (errno == EAGAIN)
-				continue;
-			error("PCM read error: %s", strerror(errno));
-			goto fail;
+		if (!r->pcm_armed && !r->pcm_ready && io->fds[1].fd != -1) {
+			sqe = io_ring_get_sqe(io);
+			io_uring_prep_poll_add(sqe, io->fds[1].fd, POLLIN);
+			io_uring_sqe_set_data64(sqe, IO_RING_DATA(IO_RING_OP_PCM_POLL, 0));
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+			sqe = io_ring_get_sqe(io);
+			io_uring_prep_read(sqe, io->fds[1].fd, buffer, size, -1);
+			io_uring_sqe_set_data64(sqe, IO_RING_DATA(IO_RING_OP_PCM_READ, 0));
+			r->pcm_armed = true;
+			r->inflight += 2;
 		}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (r->sig_ready || r->pcm_ready)
+			break;
 
-		/* When the thread is created, there might be no data in the FIFO. In fact
-		 * there might be no data for a long time - until client starts playback.
-		 * In order to correctly calculate time drift, the zero time point has to
-		 * be obtained after the stream has started. */
-		if (io.asrs.frames == 0)
-			asrsync_init(&io.asrs, samplerate);
+		int ret;
+		if ((ret = io_ring_submit_and_wait(io, 1, timeout)) == -1)
+			return -1;
+		/* nothing has been completed before the timeout */
+		if (ret == 0)
+			break;
 
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+	}
 
-		/* get overall number of input samples */
-		ffb_seek(&pcm, samples);
-		samples = ffb_len_out(&pcm);
+	io->fds[0].revents = r->sig_ready ? POLLIN : 0;
+	io->fds[1].revents = r->pcm_ready ? POLLIN : 0;
+	r->sig_ready = false;
 
-		/* anchor for RTP payload */
-		bt.tail = rtp_payload;
+	return !!io->fds[0].revents + !!io->fds[1].revents;
+}
 
-		const int16_t *input = pcm.data;
-		size_t input_len = samples;
-		size_t output_len = ffb_len_in(&bt);
-		size_t pcm_frames = 0;
-		size_t sbc_frames = 0;
+/**
+ * Get the result of the PCM FIFO read request.
+ *
+ * @return This function returns the same values as the io_thread_read_pcm(). */
+static ssize_t io_ring_read_pcm(struct io_thread_data *io, struct ba_pcm *pcm) {
 
-		/* Generate as many SBC frames as possible to fill the output buffer
-		 * without overflowing it. The size of the output buffer is based on
-		 * the socket MTU, so such a transfer should be most efficient. */
-		while (input_len >= sbc_pcm_samples && output_len >= sbc_frame_len) {
+	struct io_ring *r = io->ring;
+	const int ret = r->pcm_result;
 
-			ssize_t len;
-			ssize_t encoded;
+	r->pcm_ready = false;
 
-			if ((len = sbc_encode(&sbc, input, input_len * sizeof(int16_t),
-							bt.tail, output_len, &encoded)) < 0) {
-				error("SBC encoding error: %s", strerror(-len));
-				break;
-			}
+	if (ret > 0)
+		return ret / sizeof(int16_t);
 
-			len = len / sizeof(int16_t);
-			input += len;
-			input_len -= len;
-			ffb_seek(&bt, encoded);
-			output_len -= encoded;
-			pcm_frames += len / channels;
-			sbc_frames++;
+	if (ret == 0 || ret == -EBADF) {
+		debug("PCM has been closed: %d", pcm->fd);
+		ba_transport_release_pcm(pcm);
+		return 0;
+	}
 
-		}
+	errno = -ret;
+	return -1;
+}
+
+/**
+ * Queue data for writing to the BT socket.
+ *
+ * Data are copied into the free slot, so the caller can reuse the buffer
+ * right after this function returns. If there is no free slot, this
+ * function waits for the completion of previous writes. Queued data are
+ * written in order, one write request at a time.
+ *
+ * @return On success this function returns the number of queued bytes.
+ *   If one of the previous writes has failed, -1 is returned and errno is
+ *   set to the error reported by the kernel. */
+static ssize_t io_ring_write_bt(struct io_thread_data *io, struct ba_transport *t,
+		const uint8_t *buffer, size_t len) {
 
-		rtp_header->seq_number = htons(++seq_number);
-		rtp_header->timestamp = htonl(timestamp);
-		rtp_media_header->frame_count = sbc_frames;
+	struct io_ring *r = io->ring;
 
-		io.coutq.i = (io.coutq.i + 1) % ARRAYSIZE(io.coutq.v);
-		if (io_thread_write_bt(t, bt.data, ffb_len_out(&bt), &io.coutq.v[io.coutq.i]) == -1) {
-			if (errno == ECONNRESET || errno == ENOTCONN) {
-				/* exit thread upon BT socket disconnection */
-				debug("BT socket disconnected: %d", t->bt_fd);
-				goto fail;
-			}
-			error("BT socket write error: %s", strerror(errno));
+	while (r->bt_error == 0 && r->bt_queued == IO_RING_BT_SLOTS) {
+		/* In order to provide a way of escaping from the wait when the BT
+		 * socket is stalled, the IO thread termination request is checked
+		 * periodically. Transport signals are left for the IO thread loop. */
+		if (ba_transport_pthread_stopping(t)) {
+			errno = ECANCELED;
+			return -1;
 		}
+		if (io_ring_submit_and_wait(io, 1, 100) == -1 && errno != EINTR)
+			return -1;
+	}
 
-		/* keep data transfer at a constant bit rate, also
-		 * get a timestamp for the next RTP frame */
-		asrsync_sync(&io.asrs, pcm_frames);
-		timestamp += pcm_frames * 10000 / samplerate;
+	if (r->bt_error != 0) {
+		errno = r->bt_error;
+		r->bt_error = 0;
+		return -1;
+	}
 
-		/* update busy delay (encoding overhead) */
-		t->delay = asrsync_get_busy_usec(&io.asrs) / 100;
+	const unsigned int slot = (r->bt_first + r->bt_queued) % IO_RING_BT_SLOTS;
+	memcpy(r->bt_slots + slot * r->bt_slot_size, buffer, len);
+	r->bt_slot_len[slot] = len;
+	r->bt_queued++;
 
-		/* If the input buffer was not consumed (due to codesize limit), we
-		 * have to append new data to the existing one. Since we do not use
-		 * ring buffer, we will simply move unprocessed data to the front
-		 * of our linear buffer. */
-		ffb_shift(&pcm, samples - input_len);
+	r->bt_fd = t->bt_fd;
+	if (!r->bt_armed)
+		io_ring_submit_bt(io);
+
+	return len;
+}
 
+/**
+ * Submit queued requests and sleep for the given time.
+ *
+ * Completions of other requests are processed during the sleep, but they
+ * do not wake up the IO thread. However, the sleep is interrupted when the
+ * IO thread termination has been requested.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+static int io_ring_sleep(struct io_thread_data *io, struct ba_transport *t,
+		const struct timespec *ts) {
+
+	struct io_ring *r = io->ring;
+	struct io_uring_sqe *sqe;
+
+	/* timeout of the interrupted sleep might be still pending */
+	if (!r->timeout_armed) {
+		r->timeout.tv_sec = ts->tv_sec;
+		r->timeout.tv_nsec = ts->tv_nsec;
+		sqe = io_ring_get_sqe(io);
+		io_uring_prep_timeout(sqe, &r->timeout, 0, 0);
+		io_uring_sqe_set_data64(sqe, IO_RING_DATA(IO_RING_OP_TIMEOUT, 0));
+		r->timeout_armed = true;
+		r->inflight++;
+	}
+
+	while (r->timeout_armed) {
+		/* Wait for any completion - BT writes are reaped on the way - but
+		 * check the termination request periodically, in the same way as
+		 * the io_ring_write_bt() does. */
+		if (ba_transport_pthread_stopping(t)) {
+			io_ring_cancel(io, IO_RING_DATA(IO_RING_OP_TIMEOUT, 0));
+			errno = ECANCELED;
+			return -1;
+		}
+		if (io_ring_submit_and_wait(io, 1, 100) == -1 && errno != EINTR)
+			return -1;
 	}
 
-fail:
-final:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!io.t_locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-	return NULL;
+	return 0;
 }
 
-#if ENABLE_MP3LAME || ENABLE_MPG123
-static void *io_thread_a2dp_sink_mpeg(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
+/**
+ * Sample the number of bytes queued in the BT socket. */
+static void io_ring_update_coutq(struct io_thread_data *io, const struct ba_transport *t) {
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
+	int coutq;
 
-	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
-		.fds[1] = { -1, POLLIN, 0 },
-		.t_locked = !ba_transport_pthread_cleanup_lock(t),
-	};
+	io->stats.syscalls++;
+	if (ioctl(t->bt_fd, TIOCOUTQ, &coutq) == -1)
+		return;
 
-	if (t->bt_fd == -1) {
-		error("Invalid BT socket: %d", t->bt_fd);
-		goto fail_init;
-	}
-	if (t->mtu_read <= 0) {
-		error("Invalid reading MTU: %zu", t->mtu_read);
-		goto fail_init;
-	}
+	io->coutq.i = (io->coutq.i + 1) % ARRAYSIZE(io->coutq.v);
+	io->coutq.v[io->coutq.i] = abs(t->a2dp.bt_fd_coutq_init - coutq);
 
-#if ENABLE_MPG123
+}
 
-	static pthread_once_t once = PTHREAD_ONCE_INIT;
-	pthread_once(&once, (void (*)(void))mpg123_init);
+#endif
 
-	int err;
-	mpg123_handle *handle;
-	if ((handle = mpg123_new(NULL, &err)) == NULL) {
-		error("Couldn't initialize MPG123 decoder: %s", mpg123_plain_strerror(err));
-		goto fail_init;
+/**
+ * Wait for the IO thread event.
+ *
+ * @param io Pointer to the IO thread data structure.
+ * @param buffer Buffer for the PCM data, used by the io_uring backend.
+ * @param size The size of the PCM buffer in bytes.
+ * @param timeout Timeout in milliseconds or -1 for infinite wait.
+ * @return This function returns the same values as the poll(). */
+static int io_thread_poll(struct io_thread_data *io, void *buffer, size_t size,
+		int timeout) {
+#if ENABLE_LIBURING
+	if (io->ring != NULL)
+		return io_ring_poll(io, buffer, size, timeout);
+#endif
+	(void)buffer;
+	(void)size;
+	io->stats.syscalls++;
+	return poll(io->fds, ARRAYSIZE(io->fds), timeout);
+}
+
+/**
+ * Keep data transfer at a constant bit rate. */
+static void io_thread_sync(struct io_thread_data *io, struct ba_transport *t,
+		unsigned int frames) {
+#if ENABLE_LIBURING
+	if (io->ring != NULL) {
+		if (asrsync_update(&io->asrs, frames) == 1)
+			io_ring_sleep(io, t, &io->asrs.ts_idle);
+		rt_clock_gettime(&io->asrs.ts);
+		return;
 	}
+#endif
+	(void)t;
+	if (asrsync_sync(&io->asrs, frames) == 1)
+		io->stats.syscalls++;
+}
+
+/**
+ * Initialize RTP headers.
+ *
+ * @param s The memory area where the RTP headers will be initialized.
+ * @param hdr The address where the pointer to the RTP header will be stored.
+ * @param phdr The address where the pointer to the RTP payload header will
+ *   be stored. This parameter might be NULL.
+ * @param phdr_size The size of the RTP payload header.
+ * @return This function returns the address of the RTP payload region. */
+static uint8_t *io_thread_init_rtp(void *s, rtp_header_t **hdr,
+		void **phdr, size_t phdr_size) {
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(mpg123_delete), handle);
+	rtp_header_t *header = *hdr = (rtp_header_t *)s;
+	memset(header, 0, RTP_HEADER_LEN + phdr_size);
+	header->paytype = 96;
+	header->version = 2;
+	header->seq_number = random();
+	header->timestamp = random();
 
-	if (mpg123_open_feed(handle) != MPG123_OK) {
-		error("Couldn't open MPG123 feed: %s", mpg123_strerror(handle));
-		goto fail_open;
-	}
+	uint8_t *data = (uint8_t *)&header->csrc[header->cc];
 
-	#define MPEG_PCM_DECODE_SAMPLES 4096
+	if (phdr != NULL)
+		*phdr = data;
 
-#else
+	return data + phdr_size;
+}
 
-	hip_t handle;
-	if ((handle = hip_decode_init()) == NULL) {
-		error("Couldn't initialize LAME decoder: %s", strerror(errno));
-		goto fail_init;
-	}
+/**
+ * Codec instance data used by the A2DP IO threads. */
+struct io_codec_data {
+
+	/* associated transport */
+	struct ba_transport *t;
+
+	unsigned int channels;
+	unsigned int samplerate;
 
-	const unsigned int channels = ba_transport_get_channels(t);
-	pthread_cleanup_push(PTHREAD_CLEANUP(hip_decode_exit), handle);
+	/* minimal number of PCM samples consumed by a single encoder call */
+	size_t pcm_codesize;
+	/* size of the PCM buffer in samples */
+	size_t pcm_size;
+	/* max size of the encoded payload in bytes */
+	size_t bt_size;
 
-	/* NOTE: Size of the output buffer is "hard-coded" in hip_decode(). What is
-	 *       even worse, the boundary check is so fucked-up that the hard-coded
-	 *       limit can very easily overflow. In order to mitigate crash, we are
-	 *       going to provide very big buffer - let's hope it will be enough. */
-	#define MPEG_PCM_DECODE_SAMPLES 4096 * 100
+	/* number of frames in the encoded or received RTP payload */
+	unsigned int frames;
 
+	union {
+
+		sbc_t sbc;
+
+#if ENABLE_MP3LAME
+		lame_t lame;
 #endif
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+#if ENABLE_MPG123
+		mpg123_handle *mpg123;
+#elif ENABLE_MP3LAME
+		struct {
+			hip_t handle;
+			ffb_int16_t pcm_l;
+			ffb_int16_t pcm_r;
+		} hip;
+#endif
 
-	if (ffb_init(&pcm, MPEG_PCM_DECODE_SAMPLES) == NULL ||
-			ffb_init(&bt, t->mtu_read) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
-	}
+#if ENABLE_AAC
+		struct {
+			HANDLE_AACENCODER handle;
+			AACENC_InfoStruct info;
+		} aac_enc;
+		struct {
+			HANDLE_AACDECODER handle;
+			/* buffer for LATM frame reassembly */
+			ffb_uint8_t latm;
+			int markbit_quirk;
+			bool markbit;
+		} aac_dec;
+#endif
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup_lock), t);
+#if ENABLE_APTX
+		struct {
+			APTXENC handle;
+			/* planar PCM buffers for the encoder */
+			int32_t *pcm_l;
+			int32_t *pcm_r;
+		} aptx;
+#endif
 
-	uint16_t seq_number = -1;
+#if ENABLE_LDAC
+		struct {
+			HANDLE_LDAC_BT handle;
+			HANDLE_LDAC_ABR handle_abr;
+		} ldac;
+#endif
 
-	ba_transport_pthread_cleanup_unlock(t);
-	io.t_locked = false;
+	};
 
-	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+};
 
-		ssize_t len;
+/**
+ * Codec operations used by the A2DP IO threads.
+ *
+ * Every codec shall provide the init and finish callbacks. Encoders shall
+ * provide the encode callback, decoders shall provide the decode one. */
+struct io_codec {
+
+	/* IO thread name */
+	const char *name;
+
+	/* if false, the payload is not encapsulated in RTP */
+	bool rtp;
+	/* size of the RTP payload header */
+	size_t rtp_phdr_size;
+	/* if true, encoded frames shall be aggregated into one RTP packet */
+	bool rtp_aggregate;
+	/* max number of frames in one RTP packet, zero means no limit */
+	unsigned int rtp_frames_max;
+
+	/* Initialize codec. Upon success, the frame geometry fields of the codec
+	 * data structure shall be set. Upon failure, this callback shall release
+	 * all resources allocated so far. */
+	int (*init)(struct io_codec_data *c);
+
+	/* Encode PCM samples. On input, the samples parameter shall contain the
+	 * number of available samples, on output the number of consumed ones.
+	 * Returns the number of encoded bytes or -1 on error. */
+	ssize_t (*encode)(struct io_codec_data *c, const int16_t *input,
+			size_t *samples, uint8_t *output, size_t output_len);
+
+	/* Decode RTP payload. Consumed data shall be removed from the input by
+	 * updating the input and input_len parameters. Returns the number of
+	 * decoded samples, zero if there is no more data or -1 on error. */
+	ssize_t (*decode)(struct io_codec_data *c, const uint8_t **input,
+			size_t *input_len, int16_t *output, size_t samples);
+
+	/* Fill the RTP header and payload header for the outgoing packet. The
+	 * offset is the position of the packet payload within the encoded data
+	 * and the last parameter determines the last fragment of that data. */
+	void (*rtp_pack)(struct io_codec_data *c, rtp_header_t *header,
+			void *phdr, size_t offset, bool last);
+	/* Process the RTP header and payload header of the incoming packet. */
+	void (*rtp_unpack)(struct io_codec_data *c, const rtp_header_t *header,
+			const void *phdr);
+
+	/* Feedback called after every encoder call with the smoothed number
+	 * of bytes queued in the BT socket. */
+	void (*feedback)(struct io_codec_data *c, int coutq);
+
+	/* Reset codec state for a new stream without releasing resources. This
+	 * callback is optional, if it is not provided, the codec will be fully
+	 * initialized every time the IO thread is started. */
+	int (*reset)(struct io_codec_data *c);
+
+	/* Apply encoder limits set by the adapter admission control while the
+	 * stream is running. This callback is optional, if it is not provided,
+	 * new limits will be applied by the next codec initialization. */
+	void (*limit)(struct io_codec_data *c);
+
+	/* Release codec resources. */
+	void (*finish)(struct io_codec_data *c);
 
-		/* add BT socket to the poll if transport is active */
-		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
+};
 
-		if (poll(io.fds, ARRAYSIZE(io.fds), -1) == -1) {
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
-		}
+/**
+ * Get the number of encoded frames which shall be aggregated in one RTP
+ * packet, based on the average frame length.
+ *
+ * The number of aggregated frames is limited, so the latency introduced
+ * by the aggregation will not grow unbounded for low bitrates. */
+static size_t io_codec_rtp_aggregate_frames(const struct ba_transport *t,
+		size_t rtp_phdr_size, size_t frame_len) {
 
-		if (io.fds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			ba_transport_recv_signal(t);
-			continue;
-		}
+	const size_t frames_max = 4;
+	size_t frames = 1;
 
-		if ((len = read(io.fds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
-			debug("BT read error: %s", strerror(errno));
-			continue;
-		}
+	if (frame_len > 0 && t->mtu_write > RTP_HEADER_LEN + rtp_phdr_size)
+		frames = (t->mtu_write - RTP_HEADER_LEN - rtp_phdr_size) / frame_len;
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (frames < 1)
+		frames = 1;
+	if (frames > frames_max)
+		frames = frames_max;
 
-		/* it seems that zero is never returned... */
-		if (len == 0) {
-			debug("BT socket has been closed: %d", io.fds[1].fd);
-			/* Prevent sending the release request to the BlueZ. If the socket has
-			 * been closed, it means that BlueZ has already closed the connection. */
-			close(io.fds[1].fd);
-			t->bt_fd = -1;
-			goto fail;
-		}
+	return frames;
+}
 
-		if (t->a2dp.pcm.fd == -1) {
-			seq_number = -1;
-			continue;
-		}
+/**
+ * Apply SBC bitpool limit set by the adapter admission control. */
+static void io_codec_sbc_limit_bitpool(struct io_codec_data *c) {
+	const unsigned int limit = c->t->a2dp.bitpool_limit;
+	if (limit != 0 && limit < c->sbc.bitpool)
+		c->sbc.bitpool = limit;
+}
 
-		const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
-		uint8_t *rtp_mpeg = (uint8_t *)&rtp_header->csrc[rtp_header->cc] + sizeof(rtp_mpeg_audio_header_t);
-		size_t rtp_mpeg_len = len - (rtp_mpeg - (uint8_t *)rtp_header);
+static int io_codec_sbc_encoder_init(struct io_codec_data *c) {
 
-#if ENABLE_PAYLOADCHECK
-		if (rtp_header->paytype < 96) {
-			warn("Unsupported RTP payload type: %u", rtp_header->paytype);
-			continue;
-		}
-#endif
+	struct ba_transport *t = c->t;
 
-		uint16_t _seq_number = ntohs(rtp_header->seq_number);
-		if (++seq_number != _seq_number) {
-			if (seq_number != 0)
-				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
-			seq_number = _seq_number;
-		}
+	if ((errno = -sbc_init_a2dp(&c->sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
+		error("Couldn't initialize SBC codec: %s", strerror(errno));
+		return -1;
+	}
 
-#if ENABLE_MPG123
+	io_codec_sbc_limit_bitpool(c);
 
-	long rate;
-	int channels;
-	int encoding;
+	const size_t sbc_pcm_samples = sbc_get_codesize(&c->sbc) / sizeof(int16_t);
+	const size_t sbc_frame_len = sbc_get_frame_length(&c->sbc);
+	const size_t rtp_headers_len = RTP_HEADER_LEN + sizeof(rtp_media_header_t);
 
-decode:
-		switch (mpg123_decode(handle, rtp_mpeg, rtp_mpeg_len,
-					(uint8_t *)pcm.data, ffb_blen_in(&pcm), (size_t *)&len)) {
-		case MPG123_DONE:
-		case MPG123_NEED_MORE:
-		case MPG123_OK:
-			break;
-		case MPG123_NEW_FORMAT:
-			mpg123_getformat(handle, &rate, &channels, &encoding);
-			debug("MPG123 new format detected: r:%ld, ch:%d, enc:%#x", rate, channels, encoding);
-			goto decode;
-		default:
-			error("MPG123 decoding error: %s", mpg123_strerror(handle));
-			continue;
-		}
+	/* Writing MTU should be big enough to contain RTP header, SBC payload
+	 * header and at least one SBC frame. In general, there is no constraint
+	 * for the MTU value, but the speed might suffer significantly. */
+	if (t->mtu_write < rtp_headers_len + sbc_frame_len) {
+		warn("Writing MTU too small for one single SBC frame: %zu < %zu",
+				t->mtu_write, rtp_headers_len + sbc_frame_len);
+		t->mtu_write = rtp_headers_len + sbc_frame_len;
+	}
 
-		if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, len / sizeof(int16_t)) == -1)
-			error("FIFO write error: %s", strerror(errno));
+	const size_t mtu_write_payload = t->mtu_write - rtp_headers_len;
 
-#else
+	c->pcm_codesize = sbc_pcm_samples;
+	c->pcm_size = sbc_pcm_samples * (mtu_write_payload / sbc_frame_len);
+	c->bt_size = mtu_write_payload;
 
-		int16_t pcm_l[MPEG_PCM_DECODE_SAMPLES];
-		int16_t pcm_r[MPEG_PCM_DECODE_SAMPLES];
-		ssize_t samples;
+	return 0;
+}
 
-		if ((samples = hip_decode(handle, rtp_mpeg, rtp_mpeg_len, pcm_l, pcm_r)) < 0) {
-			error("LAME decoding error: %zd", samples);
-			continue;
-		}
+static int io_codec_sbc_decoder_init(struct io_codec_data *c) {
 
-		if (channels == 1) {
-			if (io_thread_write_pcm(&t->a2dp.pcm, pcm_l, samples) == -1)
-				error("FIFO write error: %s", strerror(errno));
-		}
-		else {
+	struct ba_transport *t = c->t;
 
-			ssize_t i;
-			for (i = 0; i < samples; i++) {
-				pcm.data[i * 2 + 0] = pcm_l[i];
-				pcm.data[i * 2 + 1] = pcm_r[i];
-			}
+	if ((errno = -sbc_init_a2dp(&c->sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
+		error("Couldn't initialize SBC codec: %s", strerror(errno));
+		return -1;
+	}
 
-			if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
-				error("FIFO write error: %s", strerror(errno));
+	c->pcm_size = sbc_get_codesize(&c->sbc) / sizeof(int16_t);
+	return 0;
+}
+
+static ssize_t io_codec_sbc_encode(struct io_codec_data *c, const int16_t *input,
+		size_t *samples, uint8_t *output, size_t output_len) {
+
+	const size_t sbc_pcm_samples = c->pcm_codesize;
+	const size_t sbc_frame_len = sbc_get_frame_length(&c->sbc);
+	size_t input_len = *samples;
+	size_t encoded_len = 0;
+
+	c->frames = 0;
+
+	/* Generate as many SBC frames as possible to fill the output buffer
+	 * without overflowing it. The size of the output buffer is based on
+	 * the socket MTU, so such a transfer should be most efficient. */
+	while (input_len >= sbc_pcm_samples && output_len >= sbc_frame_len) {
+
+		ssize_t len;
+		ssize_t encoded;
 
+		if ((len = sbc_encode(&c->sbc, input, input_len * sizeof(int16_t),
+						output, output_len, &encoded)) < 0) {
+			error("SBC encoding error: %s", strerror(-len));
+			return -1;
 		}
 
-#endif
+		len = len / sizeof(int16_t);
+		input += len;
+		input_len -= len;
+		output += encoded;
+		output_len -= encoded;
+		encoded_len += encoded;
+		c->frames++;
 
 	}
 
-fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!io.t_locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-#if ENABLE_MPG123
-fail_open:
-#endif
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-	return NULL;
+	*samples -= input_len;
+	return encoded_len;
 }
-#endif
 
-#if ENABLE_MP3LAME
-static void *io_thread_a2dp_source_mp3(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
-	const a2dp_mpeg_t *cconfig = (a2dp_mpeg_t *)t->a2dp.cconfig;
+static ssize_t io_codec_sbc_decode(struct io_codec_data *c, const uint8_t **input,
+		size_t *input_len, int16_t *output, size_t samples) {
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
+	size_t decoded;
+	ssize_t len;
 
-	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
-		.fds[1] = { -1, POLLIN, 0 },
-		.poll_timeout = -1,
-		.t_locked = !ba_transport_pthread_cleanup_lock(t),
-	};
+	/* decode retrieved SBC frames */
+	if (c->frames == 0)
+		return 0;
+	c->frames--;
+
+	if ((len = sbc_decode(&c->sbc, *input, *input_len,
+					output, samples * sizeof(int16_t), &decoded)) < 0) {
+		error("SBC decoding error: %s", strerror(-len));
+		return -1;
+	}
+
+	*input += len;
+	*input_len -= len;
+
+	return decoded / sizeof(int16_t);
+}
+
+static void io_codec_sbc_rtp_pack(struct io_codec_data *c, rtp_header_t *header,
+		void *phdr, size_t offset, bool last) {
+	(void)header; (void)offset; (void)last;
+	((rtp_media_header_t *)phdr)->frame_count = c->frames;
+}
+
+static void io_codec_sbc_rtp_unpack(struct io_codec_data *c, const rtp_header_t *header,
+		const void *phdr) {
+	(void)header;
+	c->frames = ((const rtp_media_header_t *)phdr)->frame_count;
+}
+
+static int io_codec_sbc_reset(struct io_codec_data *c) {
+	struct ba_transport *t = c->t;
+	if ((errno = -sbc_reinit_a2dp(&c->sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
+		error("Couldn't reset SBC codec: %s", strerror(errno));
+		return -1;
+	}
+	io_codec_sbc_limit_bitpool(c);
+	return 0;
+}
+
+static void io_codec_sbc_limit(struct io_codec_data *c) {
+	/* The SBC encoder picks up the new bitpool with the next frame. Encoder
+	 * output is bounded by the output buffer length, so longer frames (when
+	 * the limit was relaxed) will not overflow the RTP payload. */
+	c->sbc.bitpool = ((const a2dp_sbc_t *)c->t->a2dp.cconfig)->max_bitpool;
+	io_codec_sbc_limit_bitpool(c);
+	debug("SBC bitpool: %u", c->sbc.bitpool);
+}
+
+static void io_codec_sbc_finish(struct io_codec_data *c) {
+	sbc_finish(&c->sbc);
+}
+
+static const struct io_codec io_codec_sbc_encoder = {
+	.name = "ba-io-sbc",
+	.rtp = true,
+	.rtp_phdr_size = sizeof(rtp_media_header_t),
+	.init = io_codec_sbc_encoder_init,
+	.encode = io_codec_sbc_encode,
+	.rtp_pack = io_codec_sbc_rtp_pack,
+	.reset = io_codec_sbc_reset,
+	.limit = io_codec_sbc_limit,
+	.finish = io_codec_sbc_finish,
+};
+
+static const struct io_codec io_codec_sbc_decoder = {
+	.name = "ba-io-sbc",
+	.rtp = true,
+	.rtp_phdr_size = sizeof(rtp_media_header_t),
+	.init = io_codec_sbc_decoder_init,
+	.decode = io_codec_sbc_decode,
+	.rtp_unpack = io_codec_sbc_rtp_unpack,
+	.reset = io_codec_sbc_reset,
+	.finish = io_codec_sbc_finish,
+};
+
+#if ENABLE_MP3LAME
+static int io_codec_mp3_encoder_init(struct io_codec_data *c) {
+
+	if (codec_lib_load(CODEC_LIB_MP3LAME) == -1)
+		return -1;
 
+	const a2dp_mpeg_t *cconfig = (a2dp_mpeg_t *)c->t->a2dp.cconfig;
 	lame_t handle;
-	if ((handle = lame_init()) == NULL) {
+
+	if ((handle = c->lame = libmp3lame.lame_init()) == NULL) {
 		error("Couldn't initialize LAME encoder: %s", strerror(errno));
-		goto fail_init;
+		return -1;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(lame_close), handle);
-
-	const unsigned int channels = ba_transport_get_channels(t);
-	const unsigned int samplerate = ba_transport_get_sampling(t);
 	MPEG_mode mode = NOT_SET;
 
-	lame_set_num_channels(handle, channels);
-	lame_set_in_samplerate(handle, samplerate);
+	libmp3lame.lame_set_num_channels(handle, c->channels);
+	libmp3lame.lame_set_in_samplerate(handle, c->samplerate);
 
 	switch (cconfig->channel_mode) {
 	case MPEG_CHANNEL_MODE_MONO:
@@ -879,478 +1145,293 @@ static void *io_thread_a2dp_source_mp3(void *arg) {
 		break;
 	}
 
-	if (lame_set_mode(handle, mode) != 0) {
+	if (libmp3lame.lame_set_mode(handle, mode) != 0) {
 		error("LAME: Couldn't set mode: %d", mode);
-		goto fail_setup;
+		goto fail;
 	}
-	if (lame_set_bWriteVbrTag(handle, 0) != 0) {
+	if (libmp3lame.lame_set_bWriteVbrTag(handle, 0) != 0) {
 		error("LAME: Couldn't disable VBR header");
-		goto fail_setup;
+		goto fail;
 	}
-	if (lame_set_error_protection(handle, cconfig->crc) != 0) {
+	if (libmp3lame.lame_set_error_protection(handle, cconfig->crc) != 0) {
 		error("LAME: Couldn't set CRC mode: %d", cconfig->crc);
-		goto fail_setup;
+		goto fail;
 	}
 	if (cconfig->vbr) {
-		if (lame_set_VBR(handle, vbr_default) != 0) {
+		if (libmp3lame.lame_set_VBR(handle, vbr_default) != 0) {
 			error("LAME: Couldn't set VBR mode: %d", vbr_default);
-			goto fail_setup;
+			goto fail;
 		}
-		if (lame_set_VBR_q(handle, config.lame_vbr_quality) != 0) {
+		if (libmp3lame.lame_set_VBR_q(handle, config.lame_vbr_quality) != 0) {
 			error("LAME: Couldn't set VBR quality: %d", config.lame_vbr_quality);
-			goto fail_setup;
+			goto fail;
 		}
 	}
 	else {
-		if (lame_set_VBR(handle, vbr_off) != 0) {
+		if (libmp3lame.lame_set_VBR(handle, vbr_off) != 0) {
 			error("LAME: Couldn't set CBR mode");
-			goto fail_setup;
+			goto fail;
 		}
 		int mpeg_bitrate = MPEG_GET_BITRATE(*cconfig);
 		int bitrate = a2dp_mpeg1_mp3_get_max_bitrate(mpeg_bitrate);
-		if (lame_set_brate(handle, bitrate) != 0) {
+		if (libmp3lame.lame_set_brate(handle, bitrate) != 0) {
 			error("LAME: Couldn't set CBR bitrate: %d", bitrate);
-			goto fail_setup;
+			goto fail;
 		}
 		if (mpeg_bitrate & MPEG_BIT_RATE_FREE &&
-				lame_set_free_format(handle, 1) != 0) {
+				libmp3lame.lame_set_free_format(handle, 1) != 0) {
 			error("LAME: Couldn't enable free format");
-			goto fail_setup;
+			goto fail;
 		}
 	}
-	if (lame_set_quality(handle, config.lame_quality) != 0) {
+	if (libmp3lame.lame_set_quality(handle, config.lame_quality) != 0) {
 		error("LAME: Couldn't set quality: %d", config.lame_quality);
-		goto fail_setup;
+		goto fail;
 	}
 
-	if (lame_init_params(handle) != 0) {
+	if (libmp3lame.lame_init_params(handle) != 0) {
 		error("LAME: Couldn't setup encoder");
-		goto fail_setup;
+		goto fail;
 	}
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+	/* average MPEG frame length for the maximal configured bitrate */
+	const size_t bitrate = a2dp_mpeg1_mp3_get_max_bitrate(MPEG_GET_BITRATE(*cconfig));
+	const size_t mpeg_frame_len = 144 * 1000 * bitrate / c->samplerate;
+	const size_t mpeg_pcm_samples = libmp3lame.lame_get_framesize(handle) * c->channels;
 
-	const size_t mpeg_pcm_samples = lame_get_framesize(handle);
+	c->pcm_codesize = c->channels;
+	c->pcm_size = mpeg_pcm_samples * io_codec_rtp_aggregate_frames(c->t,
+			sizeof(rtp_mpeg_audio_header_t), mpeg_frame_len);
 	/* It is hard to tell the size of the buffer required, but
 	 * empirical test shows that 2KB should be sufficient. */
-	const size_t mpeg_frame_len = 2048;
+	c->bt_size = 2048;
 
-	if (ffb_init(&pcm, mpeg_pcm_samples) == NULL ||
-			ffb_init(&bt, RTP_HEADER_LEN + sizeof(rtp_mpeg_audio_header_t) + mpeg_frame_len) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
-	}
+	return 0;
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup_lock), t);
+fail:
+	libmp3lame.lame_close(handle);
+	return -1;
+}
 
-	rtp_header_t *rtp_header;
-	rtp_mpeg_audio_header_t *rtp_mpeg_audio_header;
+static ssize_t io_codec_mp3_encode(struct io_codec_data *c, const int16_t *input,
+		size_t *samples, uint8_t *output, size_t output_len) {
 
-	/* initialize RTP headers and get anchor for payload */
-	uint8_t *rtp_payload = io_thread_init_rtp(bt.data, &rtp_header,
-			(void **)&rtp_mpeg_audio_header, sizeof(*rtp_mpeg_audio_header));
-	uint16_t seq_number = ntohs(rtp_header->seq_number);
-	uint32_t timestamp = ntohl(rtp_header->timestamp);
+	/* Encode at most one MPEG frame at once, otherwise the output buffer
+	 * might not be big enough to hold all encoded data. */
+	size_t pcm_frames = *samples / c->channels;
+	const size_t mpeg_pcm_frames = libmp3lame.lame_get_framesize(c->lame);
+	if (pcm_frames > mpeg_pcm_frames)
+		pcm_frames = mpeg_pcm_frames;
 
-	ba_transport_pthread_cleanup_unlock(t);
-	io.t_locked = false;
+	int len;
 
-	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	if ((len = libmp3lame.lame_encode_buffer_interleaved(c->lame, (short *)input,
+					pcm_frames, output, output_len)) < 0) {
+		error("LAME encoding error: %s", lame_encode_strerror(len));
+		return -1;
+	}
 
-		ssize_t samples;
+	*samples = pcm_frames * c->channels;
+	return len;
+}
 
-		/* add PCM socket to the poll if transport is active */
-		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
+static void io_codec_mp3_rtp_pack(struct io_codec_data *c, rtp_header_t *header,
+		void *phdr, size_t offset, bool last) {
+	(void)c;
+	header->markbit = last;
+	((rtp_mpeg_audio_header_t *)phdr)->offset = offset;
+}
 
-		switch (poll(io.fds, ARRAYSIZE(io.fds), io.poll_timeout)) {
-		case 0:
-			pthread_cond_signal(&t->a2dp.drained);
-			io.poll_timeout = -1;
-			io.t_locked = !ba_transport_pthread_cleanup_lock(t);
-			if (t->a2dp.pcm.fd == -1)
-				goto final;
-			ba_transport_pthread_cleanup_unlock(t);
-			io.t_locked = false;
-			continue;
-		case -1:
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
-		}
-
-		if (io.fds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			switch (ba_transport_recv_signal(t)) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				io.poll_timeout = -1;
-				io.asrs.frames = 0;
-				continue;
-			case TRANSPORT_PCM_CLOSE:
-				/* reuse PCM read disconnection logic */
-				break;
-			case TRANSPORT_PCM_SYNC:
-				io.poll_timeout = 100;
-				continue;
-			case TRANSPORT_PCM_DROP:
-				io_thread_read_pcm_flush(&t->a2dp.pcm);
-				continue;
-			default:
-				continue;
-			}
-		}
-
-		switch (samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) {
-		case 0:
-			io.poll_timeout = config.a2dp.keep_alive * 1000;
-			debug("Keep-alive polling: %d", io.poll_timeout);
-			continue;
-		case -1:
-			if (errno == EAGAIN)
-				continue;
-			error("PCM read error: %s", strerror(errno));
-			goto fail;
-		}
-
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
-		/* When the thread is created, there might be no data in the FIFO. In fact
-		 * there might be no data for a long time - until client starts playback.
-		 * In order to correctly calculate time drift, the zero time point has to
-		 * be obtained after the stream has started. */
-		if (io.asrs.frames == 0)
-			asrsync_init(&io.asrs, samplerate);
-
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
-
-		/* get overall number of input samples */
-		ffb_seek(&pcm, samples);
-		samples = ffb_len_out(&pcm);
-
-		/* anchor for RTP payload */
-		bt.tail = rtp_payload;
-
-		size_t pcm_frames = samples / channels;
-		ssize_t len;
-
-		if ((len = lame_encode_buffer_interleaved(handle, pcm.data,
-						pcm_frames, bt.tail, ffb_len_in(&bt))) < 0) {
-			error("LAME encoding error: %s", lame_encode_strerror(len));
-			continue;
-		}
-
-		if (len > 0) {
-
-			size_t payload_len_max = t->mtu_write - RTP_HEADER_LEN - sizeof(*rtp_mpeg_audio_header);
-			size_t payload_len_total = len;
-			size_t payload_len = len;
-			rtp_header->timestamp = htonl(timestamp);
-
-			for (;;) {
-
-				ssize_t ret;
-				size_t len;
+static void io_codec_mp3_encoder_finish(struct io_codec_data *c) {
+	libmp3lame.lame_close(c->lame);
+}
 
-				len = payload_len > payload_len_max ? payload_len_max : payload_len;
-				rtp_header->markbit = payload_len <= payload_len_max;
-				rtp_header->seq_number = htons(++seq_number);
-				rtp_mpeg_audio_header->offset = payload_len_total - payload_len;
+static const struct io_codec io_codec_mp3_encoder = {
+	.name = "ba-io-mp3",
+	.rtp = true,
+	.rtp_phdr_size = sizeof(rtp_mpeg_audio_header_t),
+	.rtp_aggregate = true,
+	.init = io_codec_mp3_encoder_init,
+	.encode = io_codec_mp3_encode,
+	.rtp_pack = io_codec_mp3_rtp_pack,
+	.finish = io_codec_mp3_encoder_finish,
+};
+#endif
 
-				io.coutq.i = (io.coutq.i + 1) % ARRAYSIZE(io.coutq.v);
-				if ((ret = io_thread_write_bt(t, bt.data, RTP_HEADER_LEN +
-								sizeof(*rtp_mpeg_audio_header) + len, &io.coutq.v[io.coutq.i])) == -1) {
-					if (errno == ECONNRESET || errno == ENOTCONN) {
-						/* exit thread upon BT socket disconnection */
-						debug("BT socket disconnected: %d", t->bt_fd);
-						goto fail;
-					}
-					error("BT socket write error: %s", strerror(errno));
-					break;
-				}
+#if ENABLE_MPG123
 
-				/* account written payload only */
-				ret -= RTP_HEADER_LEN + sizeof(*rtp_mpeg_audio_header);
+static int io_codec_mpeg_decoder_init(struct io_codec_data *c) {
 
-				/* break if the last part of the payload has been written */
-				if ((payload_len -= ret) == 0)
-					break;
+	if (codec_lib_load(CODEC_LIB_MPG123) == -1)
+		return -1;
 
-				/* move rest of data to the beginning of the payload */
-				debug("Payload fragmentation: extra %zd bytes", payload_len);
-				memmove(rtp_payload, rtp_payload + ret, payload_len);
+	int err;
+	if ((c->mpg123 = libmpg123.mpg123_new(NULL, &err)) == NULL) {
+		error("Couldn't initialize MPG123 decoder: %s", libmpg123.mpg123_plain_strerror(err));
+		return -1;
+	}
 
-			}
+	if (libmpg123.mpg123_open_feed(c->mpg123) != MPG123_OK) {
+		error("Couldn't open MPG123 feed: %s", libmpg123.mpg123_strerror(c->mpg123));
+		libmpg123.mpg123_delete(c->mpg123);
+		return -1;
+	}
 
-		}
+	c->pcm_size = 4096;
+	return 0;
+}
 
-		/* keep data transfer at a constant bit rate, also
-		 * get a timestamp for the next RTP frame */
-		asrsync_sync(&io.asrs, pcm_frames);
-		timestamp += pcm_frames * 10000 / samplerate;
+static ssize_t io_codec_mpeg_decode(struct io_codec_data *c, const uint8_t **input,
+		size_t *input_len, int16_t *output, size_t samples) {
 
-		/* update busy delay (encoding overhead) */
-		t->delay = asrsync_get_busy_usec(&io.asrs) / 100;
+	const uint8_t *data = *input;
+	size_t data_len = *input_len;
+	size_t len;
 
-		/* If the input buffer was not consumed (due to frame alignment), we
-		 * have to append new data to the existing one. Since we do not use
-		 * ring buffer, we will simply move unprocessed data to the front
-		 * of our linear buffer. */
-		ffb_shift(&pcm, pcm_frames * channels);
+	/* MPG123 buffers all fed data internally, so the
+	 * input can be marked as consumed right away. */
+	*input_len = 0;
 
+decode:
+	switch (libmpg123.mpg123_decode(c->mpg123, data, data_len,
+				(uint8_t *)output, samples * sizeof(int16_t), &len)) {
+	case MPG123_DONE:
+	case MPG123_NEED_MORE:
+	case MPG123_OK:
+		break;
+	case MPG123_NEW_FORMAT: {
+		long rate;
+		int channels;
+		int encoding;
+		libmpg123.mpg123_getformat(c->mpg123, &rate, &channels, &encoding);
+		debug("MPG123 new format detected: r:%ld, ch:%d, enc:%#x", rate, channels, encoding);
+		data_len = 0;
+		goto decode;
+	}
+	default:
+		error("MPG123 decoding error: %s", libmpg123.mpg123_strerror(c->mpg123));
+		return -1;
 	}
 
-fail:
-final:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!io.t_locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_setup:
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-	return NULL;
+	return len / sizeof(int16_t);
 }
-#endif
-
-#if ENABLE_AAC
-static void *io_thread_a2dp_sink_aac(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
+static void io_codec_mpeg_decoder_finish(struct io_codec_data *c) {
+	libmpg123.mpg123_delete(c->mpg123);
+}
 
-	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
-		.fds[1] = { -1, POLLIN, 0 },
-		.t_locked = !ba_transport_pthread_cleanup_lock(t),
-	};
+static const struct io_codec io_codec_mpeg_decoder = {
+	.name = "ba-io-mpeg",
+	.rtp = true,
+	.rtp_phdr_size = sizeof(rtp_mpeg_audio_header_t),
+	.init = io_codec_mpeg_decoder_init,
+	.decode = io_codec_mpeg_decode,
+	.finish = io_codec_mpeg_decoder_finish,
+};
 
-	if (t->bt_fd == -1) {
-		error("Invalid BT socket: %d", t->bt_fd);
-		goto fail_open;
-	}
-	if (t->mtu_read <= 0) {
-		error("Invalid reading MTU: %zu", t->mtu_read);
-		goto fail_open;
-	}
+#elif ENABLE_MP3LAME
 
-	HANDLE_AACDECODER handle;
-	AAC_DECODER_ERROR err;
+/* NOTE: Size of the output buffer is "hard-coded" in hip_decode(). What is
+ *       even worse, the boundary check is so fucked-up that the hard-coded
+ *       limit can very easily overflow. In order to mitigate crash, we are
+ *       going to provide very big buffer - let's hope it will be enough. */
+#define MPEG_PCM_DECODE_SAMPLES 4096 * 100
 
-	if ((handle = aacDecoder_Open(TT_MP4_LATM_MCP1, 1)) == NULL) {
-		error("Couldn't open AAC decoder");
-		goto fail_open;
-	}
+static int io_codec_mpeg_decoder_init(struct io_codec_data *c) {
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(aacDecoder_Close), handle);
+	if (codec_lib_load(CODEC_LIB_MP3LAME) == -1)
+		return -1;
 
-	const unsigned int channels = ba_transport_get_channels(t);
-#ifdef AACDECODER_LIB_VL0
-	if ((err = aacDecoder_SetParam(handle, AAC_PCM_MIN_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
-		error("Couldn't set min output channels: %s", aacdec_strerror(err));
-		goto fail_init;
-	}
-	if ((err = aacDecoder_SetParam(handle, AAC_PCM_MAX_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
-		error("Couldn't set max output channels: %s", aacdec_strerror(err));
-		goto fail_init;
-	}
-#else
-	if ((err = aacDecoder_SetParam(handle, AAC_PCM_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
-		error("Couldn't set output channels: %s", aacdec_strerror(err));
-		goto fail_init;
+	if ((c->hip.handle = libmp3lame.hip_decode_init()) == NULL) {
+		error("Couldn't initialize LAME decoder: %s", strerror(errno));
+		return -1;
 	}
-#endif
 
-	ffb_uint8_t bt = { 0 };
-	ffb_uint8_t latm = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &latm);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
-
-	if (ffb_init(&pcm, 2048 * channels) == NULL ||
-			ffb_init(&latm, t->mtu_read) == NULL ||
-			ffb_init(&bt, t->mtu_read) == NULL) {
+	c->hip.pcm_l.data = NULL;
+	c->hip.pcm_r.data = NULL;
+	if (ffb_init(&c->hip.pcm_l, MPEG_PCM_DECODE_SAMPLES) == NULL ||
+			ffb_init(&c->hip.pcm_r, MPEG_PCM_DECODE_SAMPLES) == NULL) {
 		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
+		ffb_int16_free(&c->hip.pcm_l);
+		ffb_int16_free(&c->hip.pcm_r);
+		libmp3lame.hip_decode_exit(c->hip.handle);
+		return -1;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup_lock), t);
-
-	uint16_t seq_number = -1;
-	int markbit_quirk = -3;
-
-	ba_transport_pthread_cleanup_unlock(t);
-	io.t_locked = false;
-
-	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-
-		CStreamInfo *aacinf;
-		ssize_t len;
-
-		/* add BT socket to the poll if transport is active */
-		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
-
-		if (poll(io.fds, ARRAYSIZE(io.fds), -1) == -1) {
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
-		}
-
-		if (io.fds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			ba_transport_recv_signal(t);
-			continue;
-		}
-
-		if ((len = read(io.fds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
-			debug("BT read error: %s", strerror(errno));
-			continue;
-		}
-
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
-		/* it seems that zero is never returned... */
-		if (len == 0) {
-			debug("BT socket has been closed: %d", io.fds[1].fd);
-			/* Prevent sending the release request to the BlueZ. If the socket has
-			 * been closed, it means that BlueZ has already closed the connection. */
-			close(io.fds[1].fd);
-			t->bt_fd = -1;
-			goto fail;
-		}
-
-		if (t->a2dp.pcm.fd == -1) {
-			seq_number = -1;
-			continue;
-		}
-
-		const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
-		uint8_t *rtp_latm = (uint8_t *)&rtp_header->csrc[rtp_header->cc];
-		size_t rtp_latm_len = len - (rtp_latm - (uint8_t *)rtp_header);
+	c->pcm_size = MPEG_PCM_DECODE_SAMPLES * c->channels;
+	return 0;
+}
 
-#if ENABLE_PAYLOADCHECK
-		if (rtp_header->paytype < 96) {
-			warn("Unsupported RTP payload type: %u", rtp_header->paytype);
-			continue;
-		}
-#endif
+static ssize_t io_codec_mpeg_decode(struct io_codec_data *c, const uint8_t **input,
+		size_t *input_len, int16_t *output, size_t samples) {
 
-		/* If in the first N packets mark bit is not set, it might mean, that
-		 * the mark bit will not be set at all. In such a case, activate mark
-		 * bit quirk workaround. */
-		if (markbit_quirk < 0) {
-			if (rtp_header->markbit)
-				markbit_quirk = 0;
-			else if (++markbit_quirk == 0) {
-				warn("Activating RTP mark bit quirk workaround");
-				markbit_quirk = 1;
-			}
-		}
+	int16_t *pcm_l = c->hip.pcm_l.data;
+	int16_t *pcm_r = c->hip.pcm_r.data;
+	ssize_t frames;
 
-		uint16_t _seq_number = ntohs(rtp_header->seq_number);
-		if (++seq_number != _seq_number) {
-			if (seq_number != 0)
-				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
-			seq_number = _seq_number;
-		}
+	if (*input_len == 0)
+		return 0;
 
-		if (ffb_len_in(&latm) < rtp_latm_len) {
-			debug("Resizing LATM buffer: %zd -> %zd", latm.size, latm.size + t->mtu_read);
-			size_t prev_len = ffb_len_out(&latm);
-			ffb_init(&latm, latm.size + t->mtu_read);
-			ffb_seek(&latm, prev_len);
-		}
+	frames = libmp3lame.hip_decode(c->hip.handle, (uint8_t *)*input, *input_len, pcm_l, pcm_r);
+	*input_len = 0;
 
-		memcpy(latm.tail, rtp_latm, rtp_latm_len);
-		ffb_seek(&latm, rtp_latm_len);
+	if (frames < 0) {
+		error("LAME decoding error: %zd", frames);
+		return -1;
+	}
 
-		if (markbit_quirk != 1 && !rtp_header->markbit) {
-			debug("Fragmented RTP packet [%u]: LATM len: %zd", seq_number, rtp_latm_len);
-			continue;
-		}
+	if (c->channels == 1) {
+		memcpy(output, pcm_l, frames * sizeof(int16_t));
+		return frames;
+	}
 
-		unsigned int data_len = ffb_len_out(&latm);
-		unsigned int valid = ffb_len_out(&latm);
+	ssize_t i;
+	for (i = 0; i < frames && (size_t)i * 2 < samples; i++) {
+		output[i * 2 + 0] = pcm_l[i];
+		output[i * 2 + 1] = pcm_r[i];
+	}
 
-		if ((err = aacDecoder_Fill(handle, &latm.data, &data_len, &valid)) != AAC_DEC_OK)
-			error("AAC buffer fill error: %s", aacdec_strerror(err));
-		else if ((err = aacDecoder_DecodeFrame(handle, pcm.tail, ffb_blen_in(&pcm), 0)) != AAC_DEC_OK)
-			error("AAC decode frame error: %s", aacdec_strerror(err));
-		else if ((aacinf = aacDecoder_GetStreamInfo(handle)) == NULL)
-			error("Couldn't get AAC stream info");
-		else {
-			const size_t samples = aacinf->frameSize * aacinf->numChannels;
-			io_thread_scale_pcm(t, pcm.data, samples, channels);
-			if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
-				error("FIFO write error: %s", strerror(errno));
-		}
+	return i * 2;
+}
 
-		/* make room for new LATM frame */
-		ffb_rewind(&latm);
+static void io_codec_mpeg_decoder_finish(struct io_codec_data *c) {
+	ffb_int16_free(&c->hip.pcm_l);
+	ffb_int16_free(&c->hip.pcm_r);
+	libmp3lame.hip_decode_exit(c->hip.handle);
+}
 
-	}
+static const struct io_codec io_codec_mpeg_decoder = {
+	.name = "ba-io-mp3",
+	.rtp = true,
+	.rtp_phdr_size = sizeof(rtp_mpeg_audio_header_t),
+	.init = io_codec_mpeg_decoder_init,
+	.decode = io_codec_mpeg_decode,
+	.finish = io_codec_mpeg_decoder_finish,
+};
 
-fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!io.t_locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-fail_open:
-	pthread_cleanup_pop(1);
-	return NULL;
-}
 #endif
 
 #if ENABLE_AAC
-static void *io_thread_a2dp_source_aac(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
-	const a2dp_aac_t *cconfig = (a2dp_aac_t *)t->a2dp.cconfig;
+static int io_codec_aac_encoder_init(struct io_codec_data *c) {
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
-
-	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
-		.fds[1] = { -1, POLLIN, 0 },
-		.poll_timeout = -1,
-		.t_locked = !ba_transport_pthread_cleanup_lock(t),
-	};
+	if (codec_lib_load(CODEC_LIB_FDK_AAC) == -1)
+		return -1;
 
+	const a2dp_aac_t *cconfig = (a2dp_aac_t *)c->t->a2dp.cconfig;
 	HANDLE_AACENCODER handle;
-	AACENC_InfoStruct aacinf;
 	AACENC_ERROR err;
 
 	/* create AAC encoder without the Meta Data module */
-	const unsigned int channels = ba_transport_get_channels(t);
-	if ((err = aacEncOpen(&handle, 0x07, channels)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncOpen(&c->aac_enc.handle, 0x07, c->channels)) != AACENC_OK) {
 		error("Couldn't open AAC encoder: %s", aacenc_strerror(err));
-		goto fail_open;
+		return -1;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(aacEncClose), &handle);
+	handle = c->aac_enc.handle;
 
 	unsigned int aot = AOT_NONE;
 	unsigned int bitrate = AAC_GET_BITRATE(*cconfig);
-	unsigned int samplerate = ba_transport_get_sampling(t);
-	unsigned int channelmode = channels == 1 ? MODE_1 : MODE_2;
+	unsigned int channelmode = c->channels == 1 ? MODE_1 : MODE_2;
 
 	switch (cconfig->object_type) {
 	case AAC_OBJECT_TYPE_MPEG2_AAC_LC:
@@ -1369,117 +1450,789 @@ static void *io_thread_a2dp_source_aac(void *arg) {
 		break;
 	}
 
-	if ((err = aacEncoder_SetParam(handle, AACENC_AOT, aot)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncoder_SetParam(handle, AACENC_AOT, aot)) != AACENC_OK) {
 		error("Couldn't set audio object type: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_BITRATE, bitrate)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncoder_SetParam(handle, AACENC_BITRATE, bitrate)) != AACENC_OK) {
 		error("Couldn't set bitrate: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_SAMPLERATE, samplerate)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncoder_SetParam(handle, AACENC_SAMPLERATE, c->samplerate)) != AACENC_OK) {
 		error("Couldn't set sampling rate: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_CHANNELMODE, channelmode)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncoder_SetParam(handle, AACENC_CHANNELMODE, channelmode)) != AACENC_OK) {
 		error("Couldn't set channel mode: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
 	if (cconfig->vbr) {
-		if ((err = aacEncoder_SetParam(handle, AACENC_BITRATEMODE, config.aac_vbr_mode)) != AACENC_OK) {
+		if ((err = libfdk_aac.aacEncoder_SetParam(handle, AACENC_BITRATEMODE, config.aac_vbr_mode)) != AACENC_OK) {
 			error("Couldn't set VBR bitrate mode %u: %s", config.aac_vbr_mode, aacenc_strerror(err));
-			goto fail_init;
+			goto fail;
 		}
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_AFTERBURNER, config.aac_afterburner)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncoder_SetParam(handle, AACENC_AFTERBURNER, config.aac_afterburner)) != AACENC_OK) {
 		error("Couldn't enable afterburner: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_TRANSMUX, TT_MP4_LATM_MCP1)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncoder_SetParam(handle, AACENC_TRANSMUX, TT_MP4_LATM_MCP1)) != AACENC_OK) {
 		error("Couldn't enable LATM transport type: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_HEADER_PERIOD, 1)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncoder_SetParam(handle, AACENC_HEADER_PERIOD, 1)) != AACENC_OK) {
 		error("Couldn't set LATM header period: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
 
-	if ((err = aacEncEncode(handle, NULL, NULL, NULL, NULL)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncEncode(handle, NULL, NULL, NULL, NULL)) != AACENC_OK) {
 		error("Couldn't initialize AAC encoder: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
-	if ((err = aacEncInfo(handle, &aacinf)) != AACENC_OK) {
+	if ((err = libfdk_aac.aacEncInfo(handle, &c->aac_enc.info)) != AACENC_OK) {
 		error("Couldn't get encoder info: %s", aacenc_strerror(err));
-		goto fail_init;
+		goto fail;
 	}
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+	/* average AAC frame length for the configured bitrate */
+	const size_t aac_frame_len = bitrate / 8 * c->aac_enc.info.frameLength / c->samplerate;
+	const size_t aac_pcm_samples = c->aac_enc.info.inputChannels * c->aac_enc.info.frameLength;
 
-	if (ffb_init(&pcm, aacinf.inputChannels * aacinf.frameLength) == NULL ||
-			ffb_init(&bt, RTP_HEADER_LEN + aacinf.maxOutBufBytes) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
-	}
+	c->pcm_codesize = c->channels;
+	c->pcm_size = aac_pcm_samples * io_codec_rtp_aggregate_frames(c->t, 0, aac_frame_len);
+	c->bt_size = c->aac_enc.info.maxOutBufBytes;
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup_lock), t);
+	return 0;
 
-	rtp_header_t *rtp_header;
+fail:
+	libfdk_aac.aacEncClose(&c->aac_enc.handle);
+	return -1;
+}
 
-	/* initialize RTP header and get anchor for payload */
-	uint8_t *rtp_payload = io_thread_init_rtp(bt.data, &rtp_header, NULL, 0);
-	uint16_t seq_number = ntohs(rtp_header->seq_number);
-	uint32_t timestamp = ntohl(rtp_header->timestamp);
+static ssize_t io_codec_aac_encode(struct io_codec_data *c, const int16_t *input,
+		size_t *samples, uint8_t *output, size_t output_len) {
 
 	int in_bufferIdentifiers[] = { IN_AUDIO_DATA };
 	int out_bufferIdentifiers[] = { OUT_BITSTREAM_DATA };
-	int in_bufSizes[] = { pcm.size * sizeof(*pcm.data) };
-	int out_bufSizes[] = { aacinf.maxOutBufBytes };
-	int in_bufElSizes[] = { sizeof(*pcm.data) };
-	int out_bufElSizes[] = { sizeof(*bt.data) };
+	int in_bufSizes[] = { *samples * sizeof(*input) };
+	int out_bufSizes[] = { output_len };
+	int in_bufElSizes[] = { sizeof(*input) };
+	int out_bufElSizes[] = { sizeof(*output) };
 
 	AACENC_BufDesc in_buf = {
 		.numBufs = 1,
-		.bufs = (void **)&pcm.data,
+		.bufs = (void **)&input,
 		.bufferIdentifiers = in_bufferIdentifiers,
 		.bufSizes = in_bufSizes,
 		.bufElSizes = in_bufElSizes,
 	};
 	AACENC_BufDesc out_buf = {
 		.numBufs = 1,
-		.bufs = (void **)&rtp_payload,
+		.bufs = (void **)&output,
 		.bufferIdentifiers = out_bufferIdentifiers,
 		.bufSizes = out_bufSizes,
 		.bufElSizes = out_bufElSizes,
 	};
-	AACENC_InArgs in_args = { 0 };
+	AACENC_InArgs in_args = { .numInSamples = *samples };
 	AACENC_OutArgs out_args = { 0 };
+	AACENC_ERROR err;
 
-	ba_transport_pthread_cleanup_unlock(t);
-	io.t_locked = false;
+	if ((err = libfdk_aac.aacEncEncode(c->aac_enc.handle, &in_buf, &out_buf, &in_args, &out_args)) != AACENC_OK) {
+		error("AAC encoding error: %s", aacenc_strerror(err));
+		return -1;
+	}
 
-	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	*samples = out_args.numInSamples;
+	return out_args.numOutBytes;
+}
 
-		ssize_t samples;
+static void io_codec_aac_rtp_pack(struct io_codec_data *c, rtp_header_t *header,
+		void *phdr, size_t offset, bool last) {
+	(void)c; (void)phdr; (void)offset;
+	/* According to the RFC 3016, fragmentation of the audioMuxElement requires
+	 * no extra header - the payload should be fragmented and spread across
+	 * multiple RTP packets. Also, more than one audioMuxElement can be put
+	 * into a single RTP packet. The mark bit indicates, that the packet
+	 * contains the end of the audioMuxElement. */
+	header->markbit = last;
+}
 
-		/* add PCM socket to the poll if transport is active */
-		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
+static void io_codec_aac_encoder_finish(struct io_codec_data *c) {
+	libfdk_aac.aacEncClose(&c->aac_enc.handle);
+}
 
-		switch (poll(io.fds, ARRAYSIZE(io.fds), io.poll_timeout)) {
-		case 0:
-			pthread_cond_signal(&t->a2dp.drained);
-			io.poll_timeout = -1;
-			io.t_locked = !ba_transport_pthread_cleanup_lock(t);
-			if (t->a2dp.pcm.fd == -1)
-				goto final;
-			ba_transport_pthread_cleanup_unlock(t);
-			io.t_locked = false;
-			continue;
-		case -1:
+static const struct io_codec io_codec_aac_encoder = {
+	.name = "ba-io-aac",
+	.rtp = true,
+	.rtp_aggregate = true,
+	.init = io_codec_aac_encoder_init,
+	.encode = io_codec_aac_encode,
+	.rtp_pack = io_codec_aac_rtp_pack,
+	.finish = io_codec_aac_encoder_finish,
+};
+
+static int io_codec_aac_decoder_init(struct io_codec_data *c) {
+
+	if (codec_lib_load(CODEC_LIB_FDK_AAC) == -1)
+		return -1;
+
+	HANDLE_AACDECODER handle;
+	AAC_DECODER_ERROR err;
+
+	if ((handle = c->aac_dec.handle = libfdk_aac.aacDecoder_Open(TT_MP4_LATM_MCP1, 1)) == NULL) {
+		error("Couldn't open AAC decoder");
+		return -1;
+	}
+
+#ifdef AACDECODER_LIB_VL0
+	if ((err = libfdk_aac.aacDecoder_SetParam(handle, AAC_PCM_MIN_OUTPUT_CHANNELS, c->channels)) != AAC_DEC_OK) {
+		error("Couldn't set min output channels: %s", aacdec_strerror(err));
+		goto fail;
+	}
+	if ((err = libfdk_aac.aacDecoder_SetParam(handle, AAC_PCM_MAX_OUTPUT_CHANNELS, c->channels)) != AAC_DEC_OK) {
+		error("Couldn't set max output channels: %s", aacdec_strerror(err));
+		goto fail;
+	}
+#else
+	if ((err = libfdk_aac.aacDecoder_SetParam(handle, AAC_PCM_OUTPUT_CHANNELS, c->channels)) != AAC_DEC_OK) {
+		error("Couldn't set output channels: %s", aacdec_strerror(err));
+		goto fail;
+	}
+#endif
+
+	c->aac_dec.latm.data = NULL;
+	if (ffb_init(&c->aac_dec.latm, c->t->mtu_read) == NULL) {
+		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+		goto fail;
+	}
+
+	/* skip detection if the quirk was found during previous connections */
+	c->aac_dec.markbit_quirk = -3;
+	if (atomic_load(&c->t->d->quirks) & BA_DEVICE_QUIRK_AAC_MARKBIT)
+		c->aac_dec.markbit_quirk = 1;
+	c->pcm_size = 2048 * c->channels;
+
+	return 0;
+
+fail:
+	libfdk_aac.aacDecoder_Close(handle);
+	return -1;
+}
+
+static ssize_t io_codec_aac_decode(struct io_codec_data *c, const uint8_t **input,
+		size_t *input_len, int16_t *output, size_t samples) {
+
+	AAC_DECODER_ERROR err;
+	CStreamInfo *aacinf;
+
+	if (*input_len > 0) {
+
+		ffb_uint8_t *latm = &c->aac_dec.latm;
+
+		if (ffb_len_in(latm) < *input_len) {
+			const size_t mtu_read = c->t->mtu_read;
+			debug("Resizing LATM buffer: %zd -> %zd", latm->size, latm->size + mtu_read);
+			size_t prev_len = ffb_len_out(latm);
+			ffb_init(latm, latm->size + mtu_read);
+			ffb_seek(latm, prev_len);
+		}
+
+		memcpy(latm->tail, *input, *input_len);
+		ffb_seek(latm, *input_len);
+		*input_len = 0;
+
+		if (c->aac_dec.markbit_quirk != 1 && !c->aac_dec.markbit) {
+			debug("Fragmented RTP packet: LATM len: %zd", ffb_len_out(latm));
+			return 0;
+		}
+
+		unsigned int data_len = ffb_len_out(latm);
+		unsigned int valid = ffb_len_out(latm);
+
+		err = libfdk_aac.aacDecoder_Fill(c->aac_dec.handle, &latm->data, &data_len, &valid);
+
+		/* make room for new LATM frame */
+		ffb_rewind(latm);
+
+		if (err != AAC_DEC_OK) {
+			error("AAC buffer fill error: %s", aacdec_strerror(err));
+			return -1;
+		}
+
+	}
+
+	/* The RTP packet might contain more than one audioMuxElement, so this
+	 * function shall be called until there is no more data to decode. */
+	if ((err = libfdk_aac.aacDecoder_DecodeFrame(c->aac_dec.handle, output, samples * sizeof(int16_t), 0)) != AAC_DEC_OK) {
+		if (err == AAC_DEC_NOT_ENOUGH_BITS)
+			return 0;
+		error("AAC decode frame error: %s", aacdec_strerror(err));
+		return -1;
+	}
+
+	if ((aacinf = libfdk_aac.aacDecoder_GetStreamInfo(c->aac_dec.handle)) == NULL) {
+		error("Couldn't get AAC stream info");
+		return -1;
+	}
+
+	return aacinf->frameSize * aacinf->numChannels;
+}
+
+static void io_codec_aac_rtp_unpack(struct io_codec_data *c, const rtp_header_t *header,
+		const void *phdr) {
+	(void)phdr;
+
+	/* If in the first N packets mark bit is not set, it might mean, that
+	 * the mark bit will not be set at all. In such a case, activate mark
+	 * bit quirk workaround. */
+	if (c->aac_dec.markbit_quirk < 0) {
+		if (header->markbit) {
+			c->aac_dec.markbit_quirk = 0;
+			atomic_fetch_and(&c->t->d->quirks, ~BA_DEVICE_QUIRK_AAC_MARKBIT);
+		}
+		else if (++c->aac_dec.markbit_quirk == 0) {
+			warn("Activating RTP mark bit quirk workaround");
+			c->aac_dec.markbit_quirk = 1;
+			atomic_fetch_or(&c->t->d->quirks, BA_DEVICE_QUIRK_AAC_MARKBIT);
+		}
+	}
+
+	c->aac_dec.markbit = header->markbit;
+}
+
+static void io_codec_aac_decoder_finish(struct io_codec_data *c) {
+	ffb_uint8_free(&c->aac_dec.latm);
+	libfdk_aac.aacDecoder_Close(c->aac_dec.handle);
+}
+
+static const struct io_codec io_codec_aac_decoder = {
+	.name = "ba-io-aac",
+	.rtp = true,
+	.init = io_codec_aac_decoder_init,
+	.decode = io_codec_aac_decode,
+	.rtp_unpack = io_codec_aac_rtp_unpack,
+	.finish = io_codec_aac_decoder_finish,
+};
+#endif
+
+#if ENABLE_APTX
+static int io_codec_aptx_encoder_init(struct io_codec_data *c) {
+
+	if (codec_lib_load(CODEC_LIB_OPENAPTX) == -1)
+		return -1;
+
+	if ((c->aptx.handle = malloc(libopenaptx.SizeofAptxbtenc())) == NULL ||
+			libopenaptx.aptxbtenc_init(c->aptx.handle, __BYTE_ORDER == __LITTLE_ENDIAN) != 0) {
+		error("Couldn't initialize apt-X encoder: %s", strerror(errno));
+		free(c->aptx.handle);
+		return -1;
+	}
+
+	const size_t aptx_code_len = 2 * sizeof(uint16_t);
+	const size_t aptx_pcm_frames = 4 * (c->t->mtu_write / aptx_code_len);
+
+	c->aptx.pcm_l = malloc(aptx_pcm_frames * sizeof(*c->aptx.pcm_l));
+	c->aptx.pcm_r = malloc(aptx_pcm_frames * sizeof(*c->aptx.pcm_r));
+	if (c->aptx.pcm_l == NULL || c->aptx.pcm_r == NULL) {
+		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+		free(c->aptx.pcm_l);
+		free(c->aptx.pcm_r);
+		free(c->aptx.handle);
+		return -1;
+	}
+
+	c->pcm_codesize = 4 * c->channels;
+	c->pcm_size = aptx_pcm_frames * c->channels;
+	c->bt_size = c->t->mtu_write;
+
+	return 0;
+}
+
+static ssize_t io_codec_aptx_encode(struct io_codec_data *c, const int16_t *input,
+		size_t *samples, uint8_t *output, size_t output_len) {
+
+	const size_t aptx_pcm_samples = c->pcm_codesize;
+	const size_t aptx_code_len = 2 * sizeof(uint16_t);
+	size_t blocks = *samples / aptx_pcm_samples;
+	size_t i;
+
+	/* Generate as many apt-X frames as possible to fill the output buffer
+	 * without overflowing it. The size of the output buffer is based on
+	 * the socket MTU, so such a transfer should be most efficient. */
+	if (blocks > output_len / aptx_code_len)
+		blocks = output_len / aptx_code_len;
+
+	/* Deinterleave all PCM frames in one pass, so the encoder can be
+	 * fed directly from the contiguous planar buffers. */
+	snd_pcm_deinterleave_s16le_s32(input, blocks * 4, c->aptx.pcm_l, c->aptx.pcm_r);
+
+	for (i = 0; i < blocks; i++)
+		if (libopenaptx.aptxbtenc_encodestereo(c->aptx.handle, &c->aptx.pcm_l[i * 4], &c->aptx.pcm_r[i * 4],
+					(uint16_t *)&output[i * aptx_code_len]) != 0) {
+			error("Apt-X encoding error: %s", strerror(errno));
+			return -1;
+		}
+
+	*samples = blocks * aptx_pcm_samples;
+	return blocks * aptx_code_len;
+}
+
+static void io_codec_aptx_encoder_finish(struct io_codec_data *c) {
+	free(c->aptx.pcm_l);
+	free(c->aptx.pcm_r);
+	free(c->aptx.handle);
+}
+
+static const struct io_codec io_codec_aptx_encoder = {
+	.name = "ba-io-aptx",
+	.rtp = false,
+	.init = io_codec_aptx_encoder_init,
+	.encode = io_codec_aptx_encode,
+	.finish = io_codec_aptx_encoder_finish,
+};
+#endif
+
+#if ENABLE_LDAC
+static int io_codec_ldac_encoder_init(struct io_codec_data *c) {
+
+	if (codec_lib_load(CODEC_LIB_LDAC_ENC) == -1 ||
+			codec_lib_load(CODEC_LIB_LDAC_ABR) == -1)
+		return -1;
+
+	const a2dp_ldac_t *cconfig = (a2dp_ldac_t *)c->t->a2dp.cconfig;
+	const size_t ldac_pcm_samples = LDACBT_ENC_LSU * c->channels;
+	const size_t mtu_write_payload = c->t->mtu_write - RTP_HEADER_LEN - sizeof(rtp_media_header_t);
+
+	if ((c->ldac.handle = libldac_enc.ldacBT_get_handle()) == NULL) {
+		error("Couldn't open LDAC encoder: %s", strerror(errno));
+		return -1;
+	}
+
+	if ((c->ldac.handle_abr = libldac_abr.ldac_ABR_get_handle()) == NULL) {
+		error("Couldn't open LDAC ABR: %s", strerror(errno));
+		goto fail_abr;
+	}
+
+	/* use lower quality if required by the adapter admission control */
+	const int eqmid = MAX(config.ldac_eqmid, c->t->a2dp.eqmid_limit);
+
+	if (libldac_enc.ldacBT_init_handle_encode(c->ldac.handle, mtu_write_payload, eqmid,
+				cconfig->channel_mode, LDACBT_SMPL_FMT_S16, c->samplerate) == -1) {
+		error("Couldn't initialize LDAC encoder: %s",
+				ldacBT_strerror(libldac_enc.ldacBT_get_error_code(c->ldac.handle)));
+		goto fail;
+	}
+
+	if (libldac_abr.ldac_ABR_Init(c->ldac.handle_abr, 1000 * ldac_pcm_samples / c->channels / c->samplerate) == -1) {
+		error("Couldn't initialize LDAC ABR");
+		goto fail;
+	}
+	if (libldac_abr.ldac_ABR_set_thresholds(c->ldac.handle_abr, 6, 4, 2) == -1) {
+		error("Couldn't set LDAC ABR thresholds");
+		goto fail;
+	}
+
+	/* Encoder outputs data every few LSUs, so in order to aggregate more
+	 * than one encoded chunk in the RTP packet, the PCM buffer has to be
+	 * able to hold a number of LSUs. */
+	c->pcm_codesize = ldac_pcm_samples;
+	c->pcm_size = ldac_pcm_samples * 8;
+	c->bt_size = mtu_write_payload;
+
+	return 0;
+
+fail:
+	libldac_abr.ldac_ABR_free_handle(c->ldac.handle_abr);
+fail_abr:
+	libldac_enc.ldacBT_free_handle(c->ldac.handle);
+	return -1;
+}
+
+static ssize_t io_codec_ldac_encode(struct io_codec_data *c, const int16_t *input,
+		size_t *samples, uint8_t *output, size_t output_len) {
+
+	int len;
+	int encoded;
+	int frames;
+
+	/* Encoder was initialized with the writing MTU, so it will never output
+	 * more than that at once. However, it does not know the size of our
+	 * buffer, so it is not possible to encode anything if there is no room
+	 * for the whole RTP payload. */
+	if (output_len < c->bt_size) {
+		*samples = 0;
+		return 0;
+	}
+
+	if (libldac_enc.ldacBT_encode(c->ldac.handle, (int16_t *)input, &len, output, &encoded, &frames) != 0) {
+		error("LDAC encoding error: %s", ldacBT_strerror(libldac_enc.ldacBT_get_error_code(c->ldac.handle)));
+		return -1;
+	}
+
+	*samples = len / sizeof(int16_t);
+	c->frames = frames;
+
+	return encoded;
+}
+
+static void io_codec_ldac_feedback(struct io_codec_data *c, int coutq) {
+	if (config.ldac_abr) {
+		/* number of packets queued in the BT socket (rounded) */
+		const size_t mtu_write = c->t->mtu_write;
+		const unsigned int queued = (coutq + mtu_write / 2) / mtu_write;
+		libldac_abr.ldac_ABR_Proc(c->ldac.handle, c->ldac.handle_abr, queued, 1);
+	}
+}
+
+static void io_codec_ldac_limit(struct io_codec_data *c) {
+	const int eqmid = MAX(config.ldac_eqmid, c->t->a2dp.eqmid_limit);
+	if (libldac_enc.ldacBT_set_eqmid(c->ldac.handle, eqmid) == -1)
+		warn("Couldn't set LDAC encoder quality: %s",
+				ldacBT_strerror(libldac_enc.ldacBT_get_error_code(c->ldac.handle)));
+}
+
+static void io_codec_ldac_encoder_finish(struct io_codec_data *c) {
+	libldac_abr.ldac_ABR_free_handle(c->ldac.handle_abr);
+	libldac_enc.ldacBT_free_handle(c->ldac.handle);
+}
+
+static const struct io_codec io_codec_ldac_encoder = {
+	.name = "ba-io-ldac",
+	.rtp = true,
+	.rtp_phdr_size = sizeof(rtp_media_header_t),
+	.rtp_aggregate = true,
+	/* frame count field of the RTP media header has 4 bits */
+	.rtp_frames_max = 15,
+	.init = io_codec_ldac_encoder_init,
+	.encode = io_codec_ldac_encode,
+	.rtp_pack = io_codec_sbc_rtp_pack,
+	.feedback = io_codec_ldac_feedback,
+	.limit = io_codec_ldac_limit,
+	.finish = io_codec_ldac_encoder_finish,
+};
+#endif
+
+/**
+ * Get codec operations for the given A2DP transport.
+ *
+ * @param t Pointer to the transport structure.
+ * @return On success this function returns the address of the codec
+ *   operations structure. If the codec is not supported, NULL is
+ *   returned. */
+static const struct io_codec *io_codec_lookup(const struct ba_transport *t) {
+
+	if (t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SOURCE)
+		switch (t->type.codec) {
+		case A2DP_CODEC_SBC:
+			return &io_codec_sbc_encoder;
+#if ENABLE_MPEG && ENABLE_MP3LAME
+		case A2DP_CODEC_MPEG12:
+			if (((a2dp_mpeg_t *)t->a2dp.cconfig)->layer == MPEG_LAYER_MP3)
+				return &io_codec_mp3_encoder;
+			break;
+#endif
+#if ENABLE_AAC
+		case A2DP_CODEC_MPEG24:
+			return &io_codec_aac_encoder;
+#endif
+#if ENABLE_APTX
+		case A2DP_CODEC_VENDOR_APTX:
+			return &io_codec_aptx_encoder;
+#endif
+#if ENABLE_LDAC
+		case A2DP_CODEC_VENDOR_LDAC:
+			return &io_codec_ldac_encoder;
+#endif
+		}
+
+	if (t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SINK)
+		switch (t->type.codec) {
+		case A2DP_CODEC_SBC:
+			return &io_codec_sbc_decoder;
+#if ENABLE_MPEG && ENABLE_MPG123
+		case A2DP_CODEC_MPEG12:
+			return &io_codec_mpeg_decoder;
+#elif ENABLE_MPEG && ENABLE_MP3LAME
+		case A2DP_CODEC_MPEG12:
+			if (((a2dp_mpeg_t *)t->a2dp.cconfig)->layer == MPEG_LAYER_MP3)
+				return &io_codec_mpeg_decoder;
+			break;
+#endif
+#if ENABLE_AAC
+		case A2DP_CODEC_MPEG24:
+			return &io_codec_aac_decoder;
+#endif
+		}
+
+	return NULL;
+}
+
+/**
+ * Initialize codec for the given transport.
+ *
+ * @param c Pointer to the codec data structure.
+ * @param codec Codec operations.
+ * @param t Pointer to the transport structure.
+ * @return On success this function returns 0. Otherwise -1 is returned. */
+static int io_codec_init(struct io_codec_data *c, const struct io_codec *codec,
+		struct ba_transport *t) {
+
+	memset(c, 0, sizeof(*c));
+	c->t = t;
+	c->channels = ba_transport_get_channels(t);
+	c->samplerate = ba_transport_get_sampling(t);
+
+	return codec->init(c);
+}
+
+/**
+ * IO thread resources preserved across IO thread restarts.
+ *
+ * Every transport has its own arena, which is allocated by the first IO
+ * thread and released together with the transport. Since there is at most
+ * one IO thread per transport, arena does not require any locking. */
+struct io_arena {
+
+	/* codec for which the codec data has been initialized */
+	const struct io_codec *codec;
+	struct io_codec_data c;
+
+	/* transport setup used for the codec initialization */
+	size_t mtu_read;
+	size_t mtu_write;
+	void *cconfig;
+	size_t cconfig_size;
+	unsigned int bitpool_limit;
+
+	/* data buffers sized from the transport MTU */
+	ffb_uint8_t bt;
+	ffb_uint8_t bt_out;
+	ffb_int16_t pcm;
+
+#if ENABLE_MSBC
+	struct esco_msbc msbc;
+#endif
+
+};
+
+/**
+ * Make sure that the arena buffer has the requested size. Data which might
+ * have been left in the buffer by the previous IO thread are discarded. */
+#define io_arena_ffb_init(p, s) \
+	((p)->data != NULL && (p)->size == (s) ? ((p)->tail = (p)->data) : ffb_init(p, s))
+
+/**
+ * Get the IO arena of the given transport.
+ *
+ * @param t Transport structure.
+ * @return On success this function returns the transport arena. Otherwise,
+ *   NULL is returned and errno is set to indicate the error. */
+static struct io_arena *io_arena_get(struct ba_transport *t) {
+	if (t->arena == NULL &&
+			(t->arena = calloc(1, sizeof(*t->arena))) != NULL)
+		t->arena_size = sizeof(*t->arena);
+	return t->arena;
+}
+
+/**
+ * Update memory accounting of the transport IO arena. */
+static void io_arena_update_size(struct ba_transport *t) {
+
+	const struct io_arena *a = t->arena;
+	size_t size = sizeof(*a) + a->cconfig_size;
+
+	size += a->bt.size * sizeof(*a->bt.data);
+	size += a->bt_out.size * sizeof(*a->bt_out.data);
+	size += a->pcm.size * sizeof(*a->pcm.data);
+#if ENABLE_MSBC
+	if (a->msbc.init) {
+		size += a->msbc.dec_data.size * sizeof(*a->msbc.dec_data.data);
+		size += a->msbc.dec_pcm.size * sizeof(*a->msbc.dec_pcm.data);
+		size += a->msbc.enc_data.size * sizeof(*a->msbc.enc_data.data);
+		size += a->msbc.enc_pcm.size * sizeof(*a->msbc.enc_pcm.data);
+	}
+#endif
+
+	if (size != t->arena_size)
+		debug("IO arena size: %zu -> %zu", t->arena_size, size);
+	t->arena_size = size;
+
+}
+
+/**
+ * Release codec resources held by the IO arena. */
+static void io_arena_codec_finish(struct io_arena *a) {
+	if (a->codec == NULL)
+		return;
+	a->codec->finish(&a->c);
+	a->codec = NULL;
+	free(a->cconfig);
+	a->cconfig = NULL;
+	a->cconfig_size = 0;
+}
+
+/**
+ * Initialize codec using the IO arena.
+ *
+ * If the codec has been initialized by the previous IO thread with the same
+ * transport setup and it supports the reset operation, the codec data will
+ * be reused. Otherwise, the codec will be initialized from scratch.
+ *
+ * @return On success this function returns the codec data. Otherwise, NULL
+ *   is returned. */
+static struct io_codec_data *io_arena_codec_init(struct ba_transport *t,
+		const struct io_codec *codec) {
+
+	struct io_arena *a = t->arena;
+
+	if (a->codec == codec &&
+			codec->reset != NULL &&
+			a->mtu_read == t->mtu_read &&
+			a->mtu_write == t->mtu_write &&
+			a->c.channels == ba_transport_get_channels(t) &&
+			a->c.samplerate == ba_transport_get_sampling(t) &&
+			a->cconfig_size == t->a2dp.cconfig_size &&
+			a->bitpool_limit == t->a2dp.bitpool_limit &&
+			memcmp(a->cconfig, t->a2dp.cconfig, a->cconfig_size) == 0) {
+		if (codec->reset(&a->c) == 0) {
+			debug("Reusing codec: %s", codec->name);
+			a->c.frames = 0;
+			return &a->c;
+		}
+	}
+
+	io_arena_codec_finish(a);
+
+	if (io_codec_init(&a->c, codec, t) != 0)
+		return NULL;
+
+	/* Store transport setup after the initialization, because some
+	 * codecs might adjust the MTU during their initialization. */
+	if ((a->cconfig = malloc(t->a2dp.cconfig_size)) != NULL) {
+		memcpy(a->cconfig, t->a2dp.cconfig, t->a2dp.cconfig_size);
+		a->cconfig_size = t->a2dp.cconfig_size;
+	}
+	a->mtu_read = t->mtu_read;
+	a->mtu_write = t->mtu_write;
+	a->bitpool_limit = t->a2dp.bitpool_limit;
+	a->codec = codec;
+
+	return &a->c;
+}
+
+/**
+ * Release codec resources which can not be reused by the next IO thread. */
+static void io_arena_codec_release(struct io_arena *a) {
+	if (a->codec != NULL && a->codec->reset == NULL)
+		io_arena_codec_finish(a);
+}
+
+/**
+ * Release transport IO arena.
+ *
+ * @param arena The IO arena of the transport. It might be NULL. */
+void io_arena_free(struct io_arena *arena) {
+
+	if (arena == NULL)
+		return;
+
+	io_arena_codec_finish(arena);
+	ffb_uint8_free(&arena->bt);
+	ffb_uint8_free(&arena->bt_out);
+	ffb_int16_free(&arena->pcm);
+#if ENABLE_MSBC
+	msbc_finish(&arena->msbc);
+#endif
+
+	free(arena);
+}
+
+/**
+ * Record the time from the transport acquisition to the first audio data. */
+static void io_thread_audio_started(struct ba_transport *t) {
+
+	if (t->acquire_ts.tv_sec == 0 && t->acquire_ts.tv_nsec == 0)
+		return;
+
+	struct timespec now;
+	gettimestamp(&now);
+	difftimespec(&t->acquire_ts, &now, &now);
+
+	t->d->a2dp_audio_time = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	debug("A2DP audio started in %u ms", t->d->a2dp_audio_time);
+
+	t->acquire_ts.tv_sec = 0;
+	t->acquire_ts.tv_nsec = 0;
+
+}
+
+static void *io_thread_a2dp_sink(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+	const struct io_codec *codec = io_codec_lookup(t);
+
+	struct io_thread_data io = {
+		.fds[0] = { t->sigq.fd, POLLIN, 0 },
+		.fds[1] = { -1, POLLIN, 0 },
+		/* Lock transport during initialization stage. This lock will ensure,
+		 * that no one will modify critical section until thread state can be
+		 * known - initialization has failed or succeeded. */
+		.t_locked = !ba_transport_pthread_cleanup_lock(t),
+	};
+
+	if (codec == NULL || codec->decode == NULL) {
+		error("Codec not supported: %u", t->type.codec);
+		goto fail_init;
+	}
+
+	if (t->bt_fd == -1) {
+		error("Invalid BT socket: %d", t->bt_fd);
+		goto fail_init;
+	}
+
+	/* Check for invalid (e.g. not set) reading MTU. If buffer allocation does
+	 * not return NULL (allocating zero bytes might return NULL), we will read
+	 * zero bytes from the BT socket, which will be wrongly identified as a
+	 * "connection closed" action. */
+	if (t->mtu_read <= 0) {
+		error("Invalid reading MTU: %zu", t->mtu_read);
+		goto fail_init;
+	}
+
+	struct io_arena *arena;
+	if ((arena = io_arena_get(t)) == NULL) {
+		error("Couldn't create IO arena: %s", strerror(errno));
+		goto fail_init;
+	}
+
+	struct io_codec_data *c;
+	if ((c = io_arena_codec_init(t, codec)) == NULL)
+		goto fail_init;
+
+	ffb_uint8_t *bt = &arena->bt;
+	ffb_int16_t *pcm = &arena->pcm;
+
+	if (io_arena_ffb_init(pcm, c->pcm_size) == NULL ||
+			io_arena_ffb_init(bt, t->mtu_read) == NULL) {
+		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+		goto fail_ffb;
+	}
+
+	io_arena_update_size(t);
+
+	uint16_t seq_number = -1;
+
+	ba_transport_pthread_cleanup_unlock(t);
+	io.t_locked = false;
+
+	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
+	for (;;) {
+
+		ssize_t len;
+
+		/* add BT socket to the poll if transport is active */
+		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
+
+		if (poll(io.fds, ARRAYSIZE(io.fds), -1) == -1) {
 			if (errno == EINTR)
 				continue;
 			error("Transport poll error: %s", strerror(errno));
@@ -1487,189 +2240,334 @@ static void *io_thread_a2dp_source_aac(void *arg) {
 		}
 
 		if (io.fds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			switch (ba_transport_recv_signal(t)) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				io.poll_timeout = -1;
-				io.asrs.frames = 0;
-				continue;
-			case TRANSPORT_PCM_CLOSE:
-				/* reuse PCM read disconnection logic */
-				break;
-			case TRANSPORT_PCM_SYNC:
-				io.poll_timeout = 100;
-				continue;
-			case TRANSPORT_PCM_DROP:
-				io_thread_read_pcm_flush(&t->a2dp.pcm);
-				continue;
-			default:
-				continue;
-			}
+			/* dispatch all incoming events */
+			struct ba_transport_msg msg;
+			while (ba_transport_recv_signal(t, &msg))
+				if (msg.sig == TRANSPORT_STOP)
+					goto final;
+			continue;
 		}
 
-		switch (samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) {
-		case 0:
-			io.poll_timeout = config.a2dp.keep_alive * 1000;
-			debug("Keep-alive polling: %d", io.poll_timeout);
+		if ((len = read(io.fds[1].fd, bt->tail, ffb_len_in(bt))) == -1) {
+			debug("BT read error: %s", strerror(errno));
+			continue;
+		}
+
+		/* it seems that zero is never returned... */
+		if (len == 0) {
+			debug("BT socket has been closed: %d", io.fds[1].fd);
+			/* Prevent sending the release request to the BlueZ. If the socket has
+			 * been closed, it means that BlueZ has already closed the connection. */
+			close(io.fds[1].fd);
+			t->bt_fd = -1;
+			goto fail;
+		}
+
+		io_thread_audio_started(t);
+
+		if (t->a2dp.pcm.fd == -1) {
+			seq_number = -1;
+			continue;
+		}
+
+		const rtp_header_t *rtp_header = (rtp_header_t *)bt->data;
+		const uint8_t *rtp_phdr = (uint8_t *)&rtp_header->csrc[rtp_header->cc];
+		const uint8_t *rtp_payload = rtp_phdr + codec->rtp_phdr_size;
+		size_t rtp_payload_len = len - (rtp_payload - (uint8_t *)rtp_header);
+
+		if (rtp_payload > bt->data + len) {
+			warn("Invalid RTP packet length: %zd", len);
+			continue;
+		}
+
+#if ENABLE_PAYLOADCHECK
+		if (rtp_header->paytype < 96) {
+			warn("Unsupported RTP payload type: %u", rtp_header->paytype);
 			continue;
-		case -1:
-			if (errno == EAGAIN)
-				continue;
-			error("PCM read error: %s", strerror(errno));
-			goto fail;
 		}
+#endif
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		uint16_t _seq_number = ntohs(rtp_header->seq_number);
+		if (++seq_number != _seq_number) {
+			if (seq_number != 0)
+				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
+			seq_number = _seq_number;
+		}
 
-		if (io.asrs.frames == 0)
-			asrsync_init(&io.asrs, samplerate);
+		if (codec->rtp_unpack != NULL)
+			codec->rtp_unpack(c, rtp_header, rtp_phdr);
 
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+		ssize_t samples;
+		while ((samples = codec->decode(c, &rtp_payload, &rtp_payload_len,
+						pcm->data, ffb_len_in(pcm))) > 0) {
+			io_thread_scale_pcm(t, pcm->data, samples, c->channels);
+			if (io_thread_write_pcm(t, &t->a2dp.pcm, pcm->data, samples) == -1) {
+				if (errno == ECANCELED)
+					goto final;
+				error("FIFO write error: %s", strerror(errno));
+			}
+		}
 
-		/* move tail pointer */
-		ffb_seek(&pcm, samples);
+	}
 
-		while ((in_args.numInSamples = ffb_len_out(&pcm)) > 0) {
+fail:
+final:
+fail_ffb:
+	io_arena_codec_release(arena);
+fail_init:
+	ba_transport_pthread_cleanup(t);
+	return NULL;
+}
 
-			if ((err = aacEncEncode(handle, &in_buf, &out_buf, &in_args, &out_args)) != AACENC_OK)
-				error("AAC encoding error: %s", aacenc_strerror(err));
+/**
+ * RTP stream state of the A2DP source IO thread. */
+struct io_thread_rtp {
+	rtp_header_t *header;
+	void *phdr;
+	uint8_t *payload;
+	uint16_t seq_number;
+	uint32_t timestamp;
+};
 
-			if (out_args.numOutBytes > 0) {
+/**
+ * Write RTP payload to the BT socket.
+ *
+ * If the size of the RTP packet exceeds writing MTU, the RTP payload will
+ * be fragmented and spread across multiple RTP packets.
+ *
+ * @param t Pointer to the transport structure.
+ * @param io Pointer to the IO thread data structure.
+ * @param codec Codec operations.
+ * @param c Pointer to the codec data structure.
+ * @param buffer The buffer with the RTP headers followed by the payload.
+ * @param rtp Pointer to the RTP stream state. If NULL, the payload is
+ *   written as it is, without RTP encapsulation.
+ * @param payload_len The length of the payload in bytes.
+ * @return On success this function returns 0. If the BT socket has been
+ *   disconnected or the IO thread termination has been requested, -1 is
+ *   returned. */
+static int io_thread_write_rtp(struct ba_transport *t, struct io_thread_data *io,
+		const struct io_codec *codec, struct io_codec_data *c, uint8_t *buffer,
+		struct io_thread_rtp *rtp, size_t payload_len) {
+
+	const size_t rtp_headers_len = rtp != NULL ? RTP_HEADER_LEN + codec->rtp_phdr_size : 0;
+	const size_t payload_len_max = t->mtu_write - rtp_headers_len;
+	const size_t payload_len_total = payload_len;
+	uint8_t *payload = buffer + rtp_headers_len;
 
-				size_t payload_len_max = t->mtu_write - RTP_HEADER_LEN;
-				size_t payload_len = out_args.numOutBytes;
-				rtp_header->timestamp = htonl(timestamp);
+	for (;;) {
 
-				/* If the size of the RTP packet exceeds writing MTU, the RTP payload
-				 * should be fragmented. According to the RFC 3016, fragmentation of
-				 * the audioMuxElement requires no extra header - the payload should
-				 * be fragmented and spread across multiple RTP packets. */
-				for (;;) {
+		ssize_t ret;
+		size_t len;
 
-					ssize_t ret;
-					size_t len;
+		len = payload_len > payload_len_max ? payload_len_max : payload_len;
 
-					len = payload_len > payload_len_max ? payload_len_max : payload_len;
-					rtp_header->markbit = payload_len <= payload_len_max;
-					rtp_header->seq_number = htons(++seq_number);
+		if (rtp != NULL) {
+			rtp->header->seq_number = htons(++rtp->seq_number);
+			rtp->header->timestamp = htonl(rtp->timestamp);
+			if (codec->rtp_pack != NULL)
+				codec->rtp_pack(c, rtp->header, rtp->phdr,
+						payload_len_total - payload_len, payload_len <= payload_len_max);
+		}
 
-					io.coutq.i = (io.coutq.i + 1) % ARRAYSIZE(io.coutq.v);
-					if ((ret = io_thread_write_bt(t, bt.data, RTP_HEADER_LEN + len, &io.coutq.v[io.coutq.i])) == -1) {
-						if (errno == ECONNRESET || errno == ENOTCONN) {
-							/* exit thread upon BT socket disconnection */
-							debug("BT socket disconnected: %d", t->bt_fd);
-							goto fail;
-						}
-						error("BT socket write error: %s", strerror(errno));
-						break;
-					}
+#if ENABLE_LIBURING
+		if (io->ring != NULL)
+			/* BT socket queue is sampled once per IO thread wake-up */
+			ret = io_ring_write_bt(io, t, buffer, rtp_headers_len + len);
+		else
+#endif
+		{
+			io->coutq.i = (io->coutq.i + 1) % ARRAYSIZE(io->coutq.v);
+			ret = io_thread_write_bt(t, buffer, rtp_headers_len + len,
+					&io->coutq.v[io->coutq.i]);
+			/* TIOCOUTQ ioctl() and write() */
+			io->stats.syscalls += 2;
+		}
+
+		if (ret == -1) {
+			if (errno == ECANCELED)
+				/* IO thread termination has been requested */
+				return -1;
+			if (errno == ECONNRESET || errno == ENOTCONN) {
+				/* exit thread upon BT socket disconnection */
+				debug("BT socket disconnected: %d", t->bt_fd);
+				return -1;
+			}
+			error("BT socket write error: %s", strerror(errno));
+			break;
+		}
 
-					/* account written payload only */
-					ret -= RTP_HEADER_LEN;
+		/* account written payload only */
+		ret -= rtp_headers_len;
 
-					/* break if the last part of the payload has been written */
-					if ((payload_len -= ret) == 0)
-						break;
+		io->stats.packets++;
+		io->stats.bytes += ret;
 
-					/* move rest of data to the beginning of the payload */
-					debug("Payload fragmentation: extra %zd bytes", payload_len);
-					memmove(rtp_payload, rtp_payload + ret, payload_len);
+		io_thread_audio_started(t);
 
-				}
+		/* break if the last part of the payload has been written */
+		if ((payload_len -= ret) == 0)
+			break;
 
-			}
+		/* move rest of data to the beginning of the payload */
+		debug("Payload fragmentation: extra %zd bytes", payload_len);
+		memmove(payload, payload + ret, payload_len);
 
-			/* keep data transfer at a constant bit rate, also
-			 * get a timestamp for the next RTP frame */
-			unsigned int frames = out_args.numInSamples / channels;
-			asrsync_sync(&io.asrs, frames);
-			timestamp += frames * 10000 / samplerate;
+	}
 
-			/* update busy delay (encoding overhead) */
-			t->delay = asrsync_get_busy_usec(&io.asrs) / 100;
+	return 0;
+}
 
-			/* If the input buffer was not consumed, we have to append new data to
-			 * the existing one. Since we do not use ring buffer, we will simply
-			 * move unprocessed data to the front of our linear buffer. */
-			ffb_shift(&pcm, out_args.numInSamples);
+/**
+ * Update RTP transfer statistics of the transport.
+ *
+ * Statistics are calculated over one second of the audio stream. */
+static void io_thread_update_stats(struct ba_transport *t,
+		struct io_thread_data *io, unsigned int frames, unsigned int samplerate) {
+
+	if ((io->stats.frames += frames) < samplerate)
+		return;
+
+	const unsigned int packet_rate = t->a2dp.packet_rate;
+	const unsigned int payload_efficiency = t->a2dp.payload_efficiency;
+	unsigned int update_mask = 0;
+
+	t->a2dp.packet_rate = (uint64_t)io->stats.packets * samplerate / io->stats.frames;
+	t->a2dp.syscall_rate = (uint64_t)io->stats.syscalls * samplerate / io->stats.frames;
+	t->a2dp.payload_efficiency = 0;
+	if (io->stats.packets > 0)
+		t->a2dp.payload_efficiency = 100 * io->stats.bytes / (io->stats.packets * t->mtu_write);
+
+	if (t->a2dp.packet_rate != packet_rate)
+		update_mask |= BA_DBUS_TRANSPORT_UPDATE_PACKET_RATE;
+	if (t->a2dp.payload_efficiency != payload_efficiency)
+		update_mask |= BA_DBUS_TRANSPORT_UPDATE_PAYLOAD_EFFICIENCY;
+	if (update_mask != 0)
+		bluealsa_dbus_transport_update(t, update_mask);
+	io->bt_frame_bytes = (double)io->stats.bytes / io->stats.frames;
+
+	/* BT socket output buffer is set to the tripled writing MTU */
+	const unsigned int coutq_fill = 100 * io_thread_coutq_estimate(io) / (3 * t->mtu_write);
+	t->a2dp.coutq_fill = MIN(coutq_fill, 100);
+
+	io->stats.frames = 0;
+	io->stats.packets = 0;
+	io->stats.bytes = 0;
+	io->stats.syscalls = 0;
 
-		}
+}
 
-	}
+/**
+ * Publish the PCM position of the A2DP source transport.
+ *
+ * The buffered delay is a sum of frames waiting for the encoder and frames
+ * queued in the BT socket (estimated from the average BT payload size per
+ * frame). The delay reported by the device via the AVDTP is published
+ * separately, because it does not decay with time. */
+static void io_thread_update_pcm_pos(struct ba_transport *t,
+		struct io_thread_data *io, unsigned int frames, unsigned int frames_queued,
+		unsigned int samplerate) {
+
+	struct ba_pcm_pos *pos;
+	if ((pos = t->a2dp.pcm.pos) == NULL)
+		return;
+
+	unsigned int delay = frames_queued;
+	if (io->bt_frame_bytes > 0)
+		delay += io_thread_coutq_estimate(io) / io->bt_frame_bytes;
+	unsigned int delay_fixed = (uint64_t)t->a2dp.delay * samplerate / 10000;
+
+	io->pcm_pos_frames += frames;
+	ba_pcm_pos_update(pos, io->pcm_pos_frames, delay, delay_fixed);
 
-fail:
-final:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!io.t_locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-fail_open:
-	pthread_cleanup_pop(1);
-	return NULL;
 }
-#endif
 
-#if ENABLE_APTX
-static void *io_thread_a2dp_source_aptx(void *arg) {
+static void *io_thread_a2dp_source(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
-
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
+	const struct io_codec *codec = io_codec_lookup(t);
 
 	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
+		.fds[0] = { t->sigq.fd, POLLIN, 0 },
 		.fds[1] = { -1, POLLIN, 0 },
 		.poll_timeout = -1,
+		/* Lock transport during initialization stage. This lock will ensure,
+		 * that no one will modify critical section until thread state can be
+		 * known - initialization has failed or succeeded. */
 		.t_locked = !ba_transport_pthread_cleanup_lock(t),
 	};
 
-	APTXENC handle = malloc(SizeofAptxbtenc());
-	pthread_cleanup_push(PTHREAD_CLEANUP(free), handle);
+	if (codec == NULL || codec->encode == NULL) {
+		error("Codec not supported: %u", t->type.codec);
+		goto fail_init;
+	}
 
-	if (handle == NULL || aptxbtenc_init(handle, __BYTE_ORDER == __LITTLE_ENDIAN) != 0) {
-		error("Couldn't initialize apt-X encoder: %s", strerror(errno));
+	struct io_arena *arena;
+	if ((arena = io_arena_get(t)) == NULL) {
+		error("Couldn't create IO arena: %s", strerror(errno));
 		goto fail_init;
 	}
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+	struct io_codec_data *c;
+	if ((c = io_arena_codec_init(t, codec)) == NULL)
+		goto fail_init;
 
-	const unsigned int channels = ba_transport_get_channels(t);
-	const size_t aptx_pcm_samples = 4 * channels;
-	const size_t aptx_code_len = 2 * sizeof(uint16_t);
-	const size_t mtu_write = t->mtu_write;
+	const unsigned int channels = c->channels;
+	const unsigned int samplerate = c->samplerate;
+	const size_t rtp_headers_len = codec->rtp ? RTP_HEADER_LEN + codec->rtp_phdr_size : 0;
+	const size_t payload_len_max = t->mtu_write - rtp_headers_len;
+
+	/* In the aggregation mode, the payload buffer has to be able to hold one
+	 * full RTP packet and one more encoded frame which did not fit into it. */
+	size_t payload_size = c->bt_size;
+	if (codec->rtp_aggregate)
+		payload_size += payload_len_max;
 
-	if (ffb_init(&pcm, aptx_pcm_samples * (mtu_write / aptx_code_len)) == NULL ||
-			ffb_init(&bt, mtu_write) == NULL) {
+	ffb_uint8_t *bt = &arena->bt;
+	ffb_int16_t *pcm = &arena->pcm;
+
+	if (io_arena_ffb_init(pcm, c->pcm_size) == NULL ||
+			io_arena_ffb_init(bt, rtp_headers_len + payload_size) == NULL) {
 		error("Couldn't create data buffers: %s", strerror(ENOMEM));
 		goto fail_ffb;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup_lock), t);
+	io_arena_update_size(t);
+
+#if ENABLE_LIBURING
+	if ((io.ring = io_ring_new(t->mtu_write)) != NULL)
+		debug("Using io_uring IO backend");
+	else if (errno != ENOTSUP || config.io_uring)
+		debug("Couldn't setup io_uring, using poll(): %s", strerror(errno));
+	t->a2dp.io_uring = io.ring != NULL;
+#endif
+
+	struct io_thread_rtp rtp = { .payload = bt->data };
+	struct io_thread_rtp *rtp_ptr = NULL;
+	uint32_t timestamp = 0;
+
+	if (codec->rtp) {
+		/* initialize RTP headers and get anchor for payload */
+		rtp.payload = io_thread_init_rtp(bt->data, &rtp.header, &rtp.phdr, codec->rtp_phdr_size);
+		rtp.seq_number = ntohs(rtp.header->seq_number);
+		timestamp = rtp.timestamp = ntohl(rtp.header->timestamp);
+		rtp_ptr = &rtp;
+	}
 
 	ba_transport_pthread_cleanup_unlock(t);
 	io.t_locked = false;
 
 	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
 	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
 		ssize_t samples;
 
 		/* add PCM socket to the poll if transport is active */
 		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
 
-		switch (poll(io.fds, ARRAYSIZE(io.fds), io.poll_timeout)) {
+		switch (io_thread_poll(&io, pcm->tail, ffb_len_in(pcm) * sizeof(int16_t),
+					io.poll_timeout)) {
 		case 0:
-			pthread_cond_signal(&t->a2dp.drained);
+			ba_transport_drain_pcm_complete(t);
 			io.poll_timeout = -1;
 			io.t_locked = !ba_transport_pthread_cleanup_lock(t);
 			if (t->a2dp.pcm.fd == -1)
@@ -1685,28 +2583,68 @@ static void *io_thread_a2dp_source_aptx(void *arg) {
 		}
 
 		if (io.fds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			switch (ba_transport_recv_signal(t)) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				io.poll_timeout = -1;
-				io.asrs.frames = 0;
-				continue;
-			case TRANSPORT_PCM_CLOSE:
-				/* reuse PCM read disconnection logic */
-				break;
-			case TRANSPORT_PCM_SYNC:
-				io.poll_timeout = 100;
-				continue;
-			case TRANSPORT_PCM_DROP:
-				io_thread_read_pcm_flush(&t->a2dp.pcm);
+			/* dispatch all incoming events */
+			struct ba_transport_msg msg;
+			bool pcm_close = false;
+			io.stats.syscalls++;
+			while (ba_transport_recv_signal(t, &msg))
+				switch (msg.sig) {
+				case TRANSPORT_PCM_OPEN:
+					io.pcm_pos_frames = 0;
+					if (t->a2dp.pcm.pos != NULL)
+						ba_pcm_pos_update(t->a2dp.pcm.pos, 0, 0, 0);
+					pcm_close = false;
+					/* fall-through */
+				case TRANSPORT_PCM_RESUME:
+					io.poll_timeout = -1;
+					io.asrs.frames = 0;
+					break;
+				case TRANSPORT_PCM_CLOSE:
+					pcm_close = true;
+					break;
+				case TRANSPORT_PCM_SYNC:
+					io.poll_timeout = 100;
+					break;
+				case TRANSPORT_PCM_DROP:
+#if ENABLE_LIBURING
+					/* data read by the pending request shall be dropped too */
+					if (io.ring != NULL)
+						io_ring_cancel_pcm(&io);
+#endif
+					io_thread_read_pcm_flush(&t->a2dp.pcm);
+					break;
+				case TRANSPORT_SET_CODEC_LIMITS:
+					if (codec->limit != NULL)
+						codec->limit(c);
+					break;
+				case TRANSPORT_STOP:
+					goto final;
+				default:
+					break;
+				}
+			/* reuse PCM read disconnection logic */
+			if (!pcm_close)
 				continue;
-			default:
+#if ENABLE_LIBURING
+			/* pending read request will report the disconnection */
+			if (io.ring != NULL && io.ring->pcm_armed && !io.ring->pcm_cancelled)
 				continue;
-			}
+#endif
+		}
+
+#if ENABLE_LIBURING
+		if (io.ring != NULL && io.ring->pcm_ready) {
+			samples = io_ring_read_pcm(&io, &t->a2dp.pcm);
+			io_ring_update_coutq(&io, t);
+		}
+		else
+#endif
+		{
+			samples = io_thread_read_pcm(&t->a2dp.pcm, pcm->tail, ffb_len_in(pcm));
+			io.stats.syscalls++;
 		}
 
-		switch (samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) {
+		switch (samples) {
 		case 0:
 			io.poll_timeout = config.a2dp.keep_alive * 1000;
 			debug("Keep-alive polling: %d", io.poll_timeout);
@@ -1718,391 +2656,522 @@ static void *io_thread_a2dp_source_aptx(void *arg) {
 			goto fail;
 		}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
+		/* When the thread is created, there might be no data in the FIFO. In fact
+		 * there might be no data for a long time - until client starts playback.
+		 * In order to correctly calculate time drift, the zero time point has to
+		 * be obtained after the stream has started. */
 		if (io.asrs.frames == 0)
-			asrsync_init(&io.asrs, ba_transport_get_sampling(t));
+			asrsync_init(&io.asrs, samplerate);
 
 		if (!config.a2dp.volume)
 			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+			io_thread_scale_pcm(t, pcm->tail, samples, channels);
+
+		const unsigned int pcm_read_frames = samples / channels;
 
 		/* get overall number of input samples */
-		ffb_seek(&pcm, samples);
-		samples = ffb_len_out(&pcm);
+		ffb_seek(pcm, samples);
+		samples = ffb_len_out(pcm);
 
-		int16_t *input = pcm.data;
+		const int16_t *input = pcm->data;
 		size_t input_len = samples;
 
+		/* encoded data (and the number of frames) waiting for transfer */
+		size_t payload_len = 0;
+		unsigned int payload_frames = 0;
+
 		/* encode and transfer obtained data */
-		while (input_len >= aptx_pcm_samples) {
+		while (input_len >= c->pcm_codesize) {
+
+			size_t consumed = input_len;
+			ssize_t len;
+
+			if ((len = codec->encode(c, input, &consumed,
+							rtp.payload + payload_len, payload_size - payload_len)) == -1) {
+				/* drop data which can not be encoded */
+				input_len = 0;
+				break;
+			}
 
-			size_t output_len = ffb_len_in(&bt);
-			size_t pcm_frames = 0;
+			if (consumed == 0 && len == 0)
+				break;
 
-			/* Generate as many apt-X frames as possible to fill the output buffer
-			 * without overflowing it. The size of the output buffer is based on
-			 * the socket MTU, so such a transfer should be most efficient. */
-			while (input_len >= aptx_pcm_samples && output_len >= aptx_code_len) {
+			input += consumed;
+			input_len -= consumed;
 
-				int32_t pcm_l[4];
-				int32_t pcm_r[4];
-				size_t i;
+			if (len > 0) {
 
-				for (i = 0; i < 4; i++) {
-					pcm_l[i] = input[2 * i];
-					pcm_r[i] = input[2 * i + 1];
+				/* If the newly encoded frame does not fit into the RTP packet
+				 * together with already aggregated ones, send what we have so
+				 * far and move the new frame to the beginning of the payload. */
+				if (payload_len > 0 && (payload_len + len > payload_len_max ||
+							(codec->rtp_frames_max != 0 &&
+							 payload_frames + c->frames > codec->rtp_frames_max))) {
+					const unsigned int frames = c->frames;
+					c->frames = payload_frames;
+					if (io_thread_write_rtp(t, &io, codec, c, bt->data, rtp_ptr, payload_len) == -1)
+						goto fail;
+					memmove(rtp.payload, rtp.payload + payload_len, len);
+					payload_len = 0;
+					c->frames = frames;
 				}
 
-				if (aptxbtenc_encodestereo(handle, pcm_l, pcm_r, (uint16_t *)bt.tail) != 0) {
-					error("Apt-X encoding error: %s", strerror(errno));
-					break;
+				if (payload_len == 0) {
+					/* RTP timestamp of the first frame in the packet */
+					rtp.timestamp = timestamp;
+					payload_frames = 0;
 				}
 
-				input += 4 * channels;
-				input_len -= 4 * channels;
-				ffb_seek(&bt, aptx_code_len);
-				output_len -= aptx_code_len;
-				pcm_frames += 4;
-
-			}
+				payload_len += len;
+				payload_frames += c->frames;
 
-			io.coutq.i = (io.coutq.i + 1) % ARRAYSIZE(io.coutq.v);
-			if (io_thread_write_bt(t, bt.data, ffb_len_out(&bt), &io.coutq.v[io.coutq.i]) == -1) {
-				if (errno == ECONNRESET || errno == ENOTCONN) {
-					/* exit thread upon BT socket disconnection */
-					debug("BT socket disconnected: %d", t->bt_fd);
-					goto fail;
+				if (!codec->rtp_aggregate || payload_len >= payload_len_max) {
+					c->frames = payload_frames;
+					if (io_thread_write_rtp(t, &io, codec, c, bt->data, rtp_ptr, payload_len) == -1)
+						goto fail;
+					payload_len = 0;
 				}
-				error("BT socket write error: %s", strerror(errno));
+
 			}
 
-			/* keep data transfer at a constant bit rate */
-			asrsync_sync(&io.asrs, pcm_frames);
+			if (codec->feedback != NULL)
+				codec->feedback(c, io_thread_coutq_estimate(&io));
+
+			/* keep data transfer at a constant bit rate, also
+			 * get a timestamp for the next RTP frame */
+			const unsigned int pcm_frames = consumed / channels;
+			io_thread_sync(&io, t, pcm_frames);
+			timestamp += pcm_frames * 10000 / samplerate;
 
 			/* update busy delay (encoding overhead) */
 			t->delay = asrsync_get_busy_usec(&io.asrs) / 100;
 
-			/* reinitialize output buffer */
-			ffb_rewind(&bt);
+			io_thread_update_stats(t, &io, pcm_frames, samplerate);
+
+		}
 
+		/* Do not hold aggregated frames until the next PCM read, because
+		 * it might not come at all (e.g. the end of the stream). */
+		if (payload_len > 0) {
+			c->frames = payload_frames;
+			if (io_thread_write_rtp(t, &io, codec, c, bt->data, rtp_ptr, payload_len) == -1)
+				goto fail;
 		}
 
+		io_thread_update_pcm_pos(t, &io, pcm_read_frames,
+				input_len / channels, samplerate);
+
 		/* If the input buffer was not consumed (due to codesize limit), we
 		 * have to append new data to the existing one. Since we do not use
 		 * ring buffer, we will simply move unprocessed data to the front
 		 * of our linear buffer. */
-		ffb_shift(&pcm, samples - input_len);
+		ffb_shift(pcm, samples - input_len);
 
 	}
 
 fail:
 final:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!io.t_locked);
+#if ENABLE_LIBURING
+	io_ring_free(&io);
+#endif
 fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
+	io_arena_codec_release(arena);
 fail_init:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
+	ba_transport_pthread_cleanup(t);
 	return NULL;
 }
-#endif
 
-#if ENABLE_LDAC
-static void *io_thread_a2dp_source_ldac(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
-	const a2dp_ldac_t *cconfig = (a2dp_ldac_t *)t->a2dp.cconfig;
+/**
+ * SCO scheduler.
+ *
+ * Outgoing SCO packets are clocked by the incoming ones, so the data flow
+ * follows the slot clock of the Bluetooth controller. If we are not reading
+ * from the SCO socket (microphone is not used), timer is used as a fallback
+ * clock source. */
+struct io_sco_sched {
+	/* timer used as a clock source when there is no incoming traffic */
+	int timer_fd;
+	bool timer_armed;
+	/* number of packets which can be written to the SCO socket */
+	unsigned int credits;
+	/* Number of packets transferred per wake-up. SCO socket is not polled
+	 * until this number of packets might have been queued. */
+	unsigned int batch;
+	struct timespec batch_ts;
+	/* number of wake-ups within the current statistics period */
+	unsigned int wakeups;
+	struct timespec wakeups_ts;
+};
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
+/**
+ * Get the number of audio samples carried by the SCO packet. */
+static size_t io_sco_packet_samples(const struct ba_transport *t, size_t mtu) {
+	switch (t->type.codec) {
+#if ENABLE_MSBC
+	case HFP_CODEC_MSBC:
+		/* every 60-byte eSCO frame carries single mSBC frame */
+		return mtu * MSBC_CODESAMPLES / sizeof(esco_msbc_frame_t);
+#endif
+	case HFP_CODEC_CVSD:
+	default:
+		return mtu / sizeof(int16_t);
+	}
+}
 
-	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
-		.fds[1] = { -1, POLLIN, 0 },
-		.poll_timeout = -1,
-		.t_locked = !ba_transport_pthread_cleanup_lock(t),
-	};
+/**
+ * Get the time period (in nanoseconds) of the outgoing SCO packets. */
+static long io_sco_packet_period(const struct ba_transport *t) {
+	const unsigned int sampling = ba_transport_get_sampling(t);
+	return 1000000000L / sampling * io_sco_packet_samples(t, t->mtu_write);
+}
 
-	HANDLE_LDAC_BT handle;
-	HANDLE_LDAC_ABR handle_abr;
+/**
+ * Get the size of the SCO data buffer for the given MTU.
+ *
+ * The buffer holds data for the configured latency plus one packet, so the
+ * transfer will not stall when the latency limit has been reached. */
+static size_t io_sco_buffer_size(size_t mtu) {
+	/* use typical CVSD MTU if the link has not been acquired yet */
+	if (mtu == 0)
+		mtu = 48;
+	return (config.sco.latency + 1) * mtu;
+}
 
-	if ((handle = ldacBT_get_handle()) == NULL) {
-		error("Couldn't open LDAC encoder: %s", strerror(errno));
-		goto fail_open_ldac;
-	}
+/**
+ * Adjust SCO data buffers to the current MTU of the SCO link.
+ *
+ * For mSBC, buffers of the codec are adjusted as well, so they can hold
+ * the same amount of eSCO frames as the CVSD buffers hold SCO data. */
+static int io_sco_buffers_init(struct ba_transport *t, struct io_arena *arena) {
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ldacBT_free_handle), handle);
+	const size_t size_in = io_sco_buffer_size(t->mtu_read);
+	const size_t size_out = io_sco_buffer_size(t->mtu_write);
 
-	if ((handle_abr = ldac_ABR_get_handle()) == NULL) {
-		error("Couldn't open LDAC ABR: %s", strerror(errno));
-		goto fail_open_ldac_abr;
-	}
+	if ((arena->bt.data == NULL || arena->bt.size != size_in) &&
+			ffb_init(&arena->bt, size_in) == NULL)
+		return -1;
+	if ((arena->bt_out.data == NULL || arena->bt_out.size != size_out) &&
+			ffb_init(&arena->bt_out, size_out) == NULL)
+		return -1;
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ldac_ABR_free_handle), handle_abr);
+#if ENABLE_MSBC
+	if (t->type.codec == HFP_CODEC_MSBC) {
+		const size_t size = size_in > size_out ? size_in : size_out;
+		const size_t frames = (size + sizeof(esco_msbc_frame_t) - 1) / sizeof(esco_msbc_frame_t);
+		if (msbc_resize(&arena->msbc, frames) == -1)
+			return -1;
+	}
+#endif
 
-	const unsigned int channels = ba_transport_get_channels(t);
-	const unsigned int samplerate = ba_transport_get_sampling(t);
-	const size_t ldac_pcm_samples = LDACBT_ENC_LSU * channels;
+	io_arena_update_size(t);
+	return 0;
+}
 
-	if (ldacBT_init_handle_encode(handle, t->mtu_write - RTP_HEADER_LEN - sizeof(rtp_media_header_t),
-				config.ldac_eqmid, cconfig->channel_mode, LDACBT_SMPL_FMT_S16, samplerate) == -1) {
-		error("Couldn't initialize LDAC encoder: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
-		goto fail_init;
-	}
+/**
+ * Arm or disarm the SCO scheduler fallback timer. */
+static int io_sco_sched_timer(struct io_sco_sched *sched,
+		const struct ba_transport *t, bool enable) {
 
-	if (ldac_ABR_Init(handle_abr, 1000 * ldac_pcm_samples / channels / samplerate) == -1) {
-		error("Couldn't initialize LDAC ABR");
-		goto fail_init;
-	}
-	if (ldac_ABR_set_thresholds(handle_abr, 6, 4, 2) == -1) {
-		error("Couldn't set LDAC ABR thresholds");
-		goto fail_init;
-	}
+	struct itimerspec ts = { 0 };
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+	if (enable == sched->timer_armed)
+		return 0;
 
-	if (ffb_init(&pcm, ldac_pcm_samples) == NULL ||
-			ffb_init(&bt, t->mtu_write) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
+	if (enable) {
+		/* timer expires once per batch of packets */
+		const long period = io_sco_packet_period(t) * sched->batch;
+		ts.it_interval.tv_sec = period / 1000000000L;
+		ts.it_interval.tv_nsec = period % 1000000000L;
+		ts.it_value = ts.it_interval;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup_lock), t);
+	debug("SCO scheduler clock: %s", enable ? "timer" : "SCO");
+	if (timerfd_settime(sched->timer_fd, 0, &ts, NULL) == -1)
+		return -1;
 
-	rtp_header_t *rtp_header;
-	rtp_media_header_t *rtp_media_header;
+	sched->timer_armed = enable;
+	return 0;
+}
 
-	/* initialize RTP headers and get anchor for payload */
-	bt.tail = io_thread_init_rtp(bt.data, &rtp_header,
-			(void **)&rtp_media_header, sizeof(*rtp_media_header));
-	uint16_t seq_number = ntohs(rtp_header->seq_number);
-	uint32_t timestamp = ntohl(rtp_header->timestamp);
-	size_t ts_frames = 0;
+/**
+ * Grant credits for writing to the SCO socket.
+ *
+ * The number of credits is bounded by the configured latency, so if we
+ * were not able to write data in time (e.g. speaker PCM underrun) packets
+ * are skipped rather than sent in a burst. */
+static void io_sco_sched_tick(struct io_sco_sched *sched, unsigned int ticks) {
+	sched->credits += ticks;
+	if (sched->credits > config.sco.latency)
+		sched->credits = config.sco.latency;
+}
 
-	ba_transport_pthread_cleanup_unlock(t);
-	io.t_locked = false;
+/**
+ * Defer SCO socket polling until the next batch of packets is due. */
+static void io_sco_sched_defer(struct io_sco_sched *sched,
+		const struct ba_transport *t) {
 
-	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	if (sched->batch <= 1)
+		return;
 
-		ssize_t samples;
+	const long delay = io_sco_packet_period(t) * (sched->batch - 1);
 
-		/* add PCM socket to the poll if transport is active */
-		io.fds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
+	gettimestamp(&sched->batch_ts);
+	sched->batch_ts.tv_sec += delay / 1000000000L;
+	if ((sched->batch_ts.tv_nsec += delay % 1000000000L) >= 1000000000L) {
+		sched->batch_ts.tv_nsec -= 1000000000L;
+		sched->batch_ts.tv_sec++;
+	}
 
-		switch (poll(io.fds, ARRAYSIZE(io.fds), io.poll_timeout)) {
-		case 0:
-			pthread_cond_signal(&t->a2dp.drained);
-			io.poll_timeout = -1;
-			io.t_locked = !ba_transport_pthread_cleanup_lock(t);
-			if (t->a2dp.pcm.fd == -1)
-				goto final;
-			ba_transport_pthread_cleanup_unlock(t);
-			io.t_locked = false;
-			continue;
-		case -1:
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
-		}
+}
 
-		if (io.fds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			switch (ba_transport_recv_signal(t)) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				io.poll_timeout = -1;
-				io.asrs.frames = 0;
-				continue;
-			case TRANSPORT_PCM_CLOSE:
-				/* reuse PCM read disconnection logic */
-				break;
-			case TRANSPORT_PCM_SYNC:
-				io.poll_timeout = 100;
-				continue;
-			case TRANSPORT_PCM_DROP:
-				io_thread_read_pcm_flush(&t->a2dp.pcm);
-				continue;
-			default:
-				continue;
-			}
-		}
+/**
+ * Get the time (in milliseconds) for which SCO socket polling is deferred.
+ *
+ * @return This function returns 0 if SCO socket shall be polled now. */
+static int io_sco_sched_deferred(const struct io_sco_sched *sched) {
 
-		switch (samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) {
-		case 0:
-			io.poll_timeout = config.a2dp.keep_alive * 1000;
-			debug("Keep-alive polling: %d", io.poll_timeout);
-			continue;
-		case -1:
-			if (errno == EAGAIN)
-				continue;
-			error("PCM read error: %s", strerror(errno));
-			goto fail;
-		}
+	struct timespec now, diff;
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (sched->batch <= 1)
+		return 0;
 
-		if (io.asrs.frames == 0)
-			asrsync_init(&io.asrs, samplerate);
+	gettimestamp(&now);
+	if (difftimespec(&now, &sched->batch_ts, &diff) <= 0)
+		return 0;
 
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+	/* round up to the nearest millisecond */
+	return diff.tv_sec * 1000 + (diff.tv_nsec + 999999) / 1000000;
+}
 
-		/* get overall number of input samples */
-		ffb_seek(&pcm, samples);
-		samples = ffb_len_out(&pcm);
+/**
+ * Update SCO wake-up statistics of the transport.
+ *
+ * Statistics are calculated over one second of the IO thread activity. The
+ * mSBC frame synchronization losses are moved to the transport counter at
+ * the same pace, so the PropertiesChanged signal is not flooded. */
+static void io_sco_update_stats(struct ba_transport *t, struct io_arena *arena,
+		struct io_sco_sched *sched) {
 
-		int16_t *input = pcm.data;
-		size_t input_len = samples;
+	const unsigned int wakeup_rate = t->sco.wakeup_rate;
+	struct timespec now, diff;
+	unsigned int update_mask = 0;
 
-		/* encode and transfer obtained data */
-		while (input_len >= ldac_pcm_samples) {
+	sched->wakeups++;
 
-			int len;
-			int encoded;
-			int frames;
+	gettimestamp(&now);
+	difftimespec(&sched->wakeups_ts, &now, &diff);
+	if (diff.tv_sec < 1)
+		return;
 
-			if (ldacBT_encode(handle, input, &len, bt.tail, &encoded, &frames) != 0) {
-				error("LDAC encoding error: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
-				break;
-			}
+	t->sco.wakeup_rate = (uint64_t)sched->wakeups * 1000000 /
+		(diff.tv_sec * 1000000 + diff.tv_nsec / 1000);
+	sched->wakeups_ts = now;
+	sched->wakeups = 0;
+
+	if (t->sco.wakeup_rate != wakeup_rate)
+		update_mask |= BA_DBUS_TRANSPORT_UPDATE_WAKEUP_RATE;
 
-			rtp_media_header->frame_count = frames;
+#if ENABLE_MSBC
+	if (arena->msbc.dec_sync_losses > 0) {
+		t->sco.msbc_sync_losses += arena->msbc.dec_sync_losses;
+		arena->msbc.dec_sync_losses = 0;
+		update_mask |= BA_DBUS_TRANSPORT_UPDATE_SYNC_LOSSES;
+	}
+#else
+	(void)arena;
+#endif
 
-			frames = len / sizeof(int16_t);
-			input += frames;
-			input_len -= frames;
+	if (update_mask != 0)
+		bluealsa_dbus_transport_update(t, update_mask);
 
-			if (encoded &&
-					io_thread_write_bt(t, bt.data, ffb_len_out(&bt) + encoded, &io.coutq.v[0]) == -1) {
-				if (errno == ECONNRESET || errno == ENOTCONN) {
-					/* exit thread upon BT socket disconnection */
-					debug("BT socket disconnected: %d", t->bt_fd);
-					goto fail;
-				}
-				error("BT socket write error: %s", strerror(errno));
-			}
+}
 
-			if (config.ldac_abr)
-				ldac_ABR_Proc(handle, handle_abr, io.coutq.v[0] / t->mtu_write, 1);
+/**
+ * Check whether the SCO speaker has been drained.
+ *
+ * The speaker is drained when there is no data in the PCM FIFO, in our
+ * internal buffers and in the SCO socket output queue. Data which does not
+ * fill the whole SCO packet is padded with silence, so it can be sent.
+ *
+ * @return This function returns true if there is nothing left to send. */
+static bool io_sco_spk_drained(struct ba_transport *t, struct io_arena *arena,
+		int coutq_init) {
 
-			/* keep data transfer at a constant bit rate */
-			asrsync_sync(&io.asrs, frames / channels);
-			ts_frames += frames;
+	ffb_uint8_t *bt_out = &arena->bt_out;
+#if ENABLE_MSBC
+	struct esco_msbc *msbc = &arena->msbc;
+#endif
+	int pending = 0;
+	size_t len;
 
-			/* update busy delay (encoding overhead) */
-			t->delay = asrsync_get_busy_usec(&io.asrs) / 100;
+	/* without SCO link, there is no way to send anything */
+	if (t->bt_fd == -1 || t->mtu_write == 0)
+		return true;
 
-			if (encoded) {
-				timestamp += ts_frames / channels * 10000 / samplerate;
-				rtp_header->timestamp = htonl(timestamp);
-				rtp_header->seq_number = htons(++seq_number);
-				ts_frames = 0;
-			}
+	if (t->sco.spk_pcm.fd != -1 &&
+			ioctl(t->sco.spk_pcm.fd, FIONREAD, &pending) == 0 &&
+			pending > 0)
+		return false;
 
+	switch (t->type.codec) {
+#if ENABLE_MSBC
+	case HFP_CODEC_MSBC:
+		if ((len = ffb_len_out(&msbc->enc_pcm)) > 0) {
+			if (len < MSBC_CODESAMPLES) {
+				memset(msbc->enc_pcm.tail, 0, (MSBC_CODESAMPLES - len) * sizeof(int16_t));
+				ffb_seek(&msbc->enc_pcm, MSBC_CODESAMPLES - len);
+			}
+			return false;
+		}
+		if ((len = ffb_len_out(&msbc->enc_data)) > 0) {
+			if (len % t->mtu_write != 0 &&
+					ffb_len_in(&msbc->enc_data) >= t->mtu_write - len % t->mtu_write) {
+				memset(msbc->enc_data.tail, 0, t->mtu_write - len % t->mtu_write);
+				ffb_seek(&msbc->enc_data, t->mtu_write - len % t->mtu_write);
+			}
+			return false;
+		}
+		break;
+#endif
+	case HFP_CODEC_CVSD:
+	default:
+		if ((len = ffb_len_out(bt_out)) > 0) {
+			if (len % t->mtu_write != 0 &&
+					ffb_len_in(bt_out) >= t->mtu_write - len % t->mtu_write) {
+				memset(bt_out->tail, 0, t->mtu_write - len % t->mtu_write);
+				ffb_seek(bt_out, t->mtu_write - len % t->mtu_write);
+			}
+			return false;
 		}
-
-		/* If the input buffer was not consumed (due to codesize limit), we
-		 * have to append new data to the existing one. Since we do not use
-		 * ring buffer, we will simply move unprocessed data to the front
-		 * of our linear buffer. */
-		ffb_shift(&pcm, samples - input_len);
-
 	}
 
-fail:
-final:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!io.t_locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-fail_open_ldac_abr:
-	pthread_cleanup_pop(1);
-fail_open_ldac:
-	pthread_cleanup_pop(1);
-	return NULL;
+	if (ioctl(t->bt_fd, TIOCOUTQ, &pending) == -1)
+		return true;
+	return pending >= coutq_init;
 }
-#endif
 
 static void *io_thread_sco(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
+	struct io_arena *arena;
+	if ((arena = io_arena_get(t)) == NULL) {
+		error("Couldn't create IO arena: %s", strerror(errno));
+		goto fail_init;
+	}
 
 	/* buffers for transferring data to and from SCO socket */
-	ffb_uint8_t bt_in = { 0 };
-	ffb_uint8_t bt_out = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt_in);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt_out);
+	ffb_uint8_t *bt_in = &arena->bt;
+	ffb_uint8_t *bt_out = &arena->bt_out;
 
 #if ENABLE_MSBC
-	struct esco_msbc msbc = { .init = false };
-	pthread_cleanup_push(PTHREAD_CLEANUP(msbc_finish), &msbc);
+	struct esco_msbc *msbc = &arena->msbc;
+	/* discard data left by the previous IO thread */
+	if (msbc->init && msbc_init(msbc) != 0) {
+		error("Couldn't initialize mSBC codec: %s", strerror(errno));
+		goto fail_init;
+	}
 #endif
 
-	/* these buffers shall be bigger than the SCO MTU */
-	if (ffb_init(&bt_in, 128) == NULL ||
-			ffb_init(&bt_out, 128) == NULL) {
+	/* discard data left by the previous IO thread */
+	ffb_rewind(bt_in);
+	ffb_rewind(bt_out);
+
+	if (io_sco_buffers_init(t, arena) == -1) {
 		error("Couldn't create data buffer: %s", strerror(ENOMEM));
-		goto fail_ffb;
+		goto fail_init;
+	}
+
+	/* Transfer several packets per wake-up, but use only half of the latency
+	 * budget, so there is still a room for the scheduling jitter. */
+	struct io_sco_sched sched = {
+		.timer_fd = -1,
+		.batch = config.sco.latency / 2 > 0 ? config.sco.latency / 2 : 1,
+	};
+
+	if ((sched.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		error("Couldn't create SCO scheduler timer: %s", strerror(errno));
+		goto fail_init;
 	}
 
+	gettimestamp(&sched.wakeups_ts);
+
+	/* SCO socket output queue size when empty (see io_sco_spk_drained) */
+	int bt_fd_coutq_init = 0;
+	int bt_fd_coutq_fd = -1;
+	bool spk_draining = false;
+
 	int poll_timeout = -1;
-	struct asrsync asrs = { .frames = 0 };
 	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
+		{ t->sigq.fd, POLLIN, 0 },
 		/* SCO socket */
 		{ -1, POLLIN, 0 },
 		{ -1, POLLOUT, 0 },
 		/* PCM FIFO */
 		{ -1, POLLIN, 0 },
 		{ -1, POLLOUT, 0 },
+		/* scheduler timer */
+		{ sched.timer_fd, POLLIN, 0 },
 	};
 
 	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
 	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
 		/* fresh-start for file descriptors polling */
 		pfds[1].fd = pfds[2].fd = -1;
 		pfds[3].fd = pfds[4].fd = -1;
 
+		/* Get the output queue size of the new SCO link, before anything
+		 * has been written to it. BT sockets report the free space. */
+		if (t->bt_fd != bt_fd_coutq_fd) {
+			bt_fd_coutq_fd = t->bt_fd;
+			if (t->bt_fd != -1)
+				ioctl(t->bt_fd, TIOCOUTQ, &bt_fd_coutq_init);
+		}
+
+		if (spk_draining) {
+			poll_timeout = -1;
+			if (io_sco_spk_drained(t, arena, bt_fd_coutq_init)) {
+				ba_transport_drain_pcm_complete(t);
+				spk_draining = false;
+			}
+			else if (t->bt_fd != -1)
+				/* data might be held in the socket queue only, so we have to
+				 * check the drain state periodically */
+				poll_timeout = (io_sco_packet_samples(t, t->mtu_write) * 1000 +
+						ba_transport_get_sampling(t) - 1) / ba_transport_get_sampling(t);
+		}
+
+		/* maximal amount of speaker data buffered for sending */
+		const size_t spk_limit = config.sco.latency * t->mtu_write;
+
 		switch (t->type.codec) {
 #if ENABLE_MSBC
 		case HFP_CODEC_MSBC:
-			msbc_encode(&msbc);
-			msbc_decode(&msbc);
-			if (t->mtu_read > 0 && ffb_blen_in(&msbc.dec_data) >= t->mtu_read)
+			msbc_encode(msbc);
+			msbc_decode(msbc);
+			if (t->mtu_read > 0 && ffb_blen_in(&msbc->dec_data) >= t->mtu_read)
 				pfds[1].fd = t->bt_fd;
-			if (t->mtu_write > 0 && ffb_blen_out(&msbc.enc_data) >= t->mtu_write)
+			if (t->mtu_write > 0 && ffb_blen_out(&msbc->enc_data) >= t->mtu_write &&
+					sched.credits > 0)
 				pfds[2].fd = t->bt_fd;
-			if (t->mtu_write > 0 && ffb_blen_in(&msbc.enc_pcm) >= t->mtu_write)
+			if (t->mtu_write > 0 && ffb_blen_in(&msbc->enc_pcm) >= t->mtu_write &&
+					ffb_blen_out(&msbc->enc_data) < spk_limit)
 				pfds[3].fd = t->sco.spk_pcm.fd;
-			if (ffb_blen_out(&msbc.dec_pcm) > 0)
+			if (ffb_blen_out(&msbc->dec_pcm) > 0)
 				pfds[4].fd = t->sco.mic_pcm.fd;
 			break;
 #endif
 		case HFP_CODEC_CVSD:
 		default:
-			if (t->mtu_read > 0 && ffb_len_in(&bt_in) >= t->mtu_read)
+			if (t->mtu_read > 0 && ffb_len_in(bt_in) >= t->mtu_read)
 				pfds[1].fd = t->bt_fd;
-			if (t->mtu_write > 0 && ffb_len_out(&bt_out) >= t->mtu_write)
+			if (t->mtu_write > 0 && ffb_len_out(bt_out) >= t->mtu_write &&
+					sched.credits > 0)
 				pfds[2].fd = t->bt_fd;
-			if (t->mtu_write > 0 && ffb_len_in(&bt_out) >= t->mtu_write)
+			if (t->mtu_write > 0 && ffb_len_in(bt_out) >= t->mtu_write &&
+					ffb_len_out(bt_out) < spk_limit)
 				pfds[3].fd = t->sco.spk_pcm.fd;
-			if (ffb_len_out(&bt_in) > 0)
+			if (ffb_len_out(bt_in) > 0)
 				pfds[4].fd = t->sco.mic_pcm.fd;
 		}
 
@@ -2112,10 +3181,28 @@ static void *io_thread_sco(void *arg) {
 		if (!t->sco.ofono && t->sco.mic_pcm.fd == -1)
 			pfds[1].fd = -1;
 
-		switch (poll(pfds, ARRAYSIZE(pfds), poll_timeout)) {
+		/* If incoming SCO packets are not consumed, they can not be used as
+		 * a clock source for the speaker. In such case use the timer. */
+		if (io_sco_sched_timer(&sched, t, t->bt_fd != -1 && pfds[1].fd == -1 &&
+					t->sco.spk_pcm.fd != -1) == -1) {
+			error("Couldn't set SCO scheduler timer: %s", strerror(errno));
+			goto fail;
+		}
+
+		int timeout = poll_timeout;
+		int deferred;
+
+		/* do not wake up for every single SCO packet */
+		if ((pfds[1].fd != -1 || pfds[2].fd != -1) &&
+				(deferred = io_sco_sched_deferred(&sched)) > 0) {
+			pfds[1].fd = pfds[2].fd = -1;
+			if (timeout == -1 || deferred < timeout)
+				timeout = deferred;
+		}
+
+		switch (poll(pfds, ARRAYSIZE(pfds), timeout)) {
 		case 0:
-			pthread_cond_signal(&t->sco.spk_drained);
-			poll_timeout = -1;
+			/* re-check speaker drain state or deferred SCO polling */
 			continue;
 		case -1:
 			if (errno == EINTR)
@@ -2124,36 +3211,40 @@ static void *io_thread_sco(void *arg) {
 			goto fail;
 		}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		io_sco_update_stats(t, arena, &sched);
 
 		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-
-			switch (ba_transport_recv_signal(t)) {
-			case TRANSPORT_PING:
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				poll_timeout = -1;
-				asrs.frames = 0;
-				break;
-			case TRANSPORT_PCM_SYNC:
-				/* FIXME: Drain functionality for speaker.
-				 * XXX: Right now it is not possible to drain speaker PCM (in a clean
-				 *      fashion), because poll() will not timeout if we've got incoming
-				 *      data from the microphone (BT SCO socket). In order not to hang
-				 *      forever in the transport_drain_pcm() function, we will signal
-				 *      PCM drain right now. */
-				pthread_cond_signal(&t->sco.spk_drained);
-				break;
-			case TRANSPORT_PCM_DROP:
-				io_thread_read_pcm_flush(&t->sco.spk_pcm);
-				continue;
-			default:
-				break;
-			}
+			/* dispatch all incoming events */
+
+			struct ba_transport_msg msg;
+			bool sync_link = false;
+
+			while (ba_transport_recv_signal(t, &msg))
+				switch (msg.sig) {
+				case TRANSPORT_PING:
+				case TRANSPORT_PCM_OPEN:
+				case TRANSPORT_PCM_RESUME:
+					poll_timeout = -1;
+					sched.credits = 0;
+					sync_link = true;
+					break;
+				case TRANSPORT_PCM_SYNC:
+					spk_draining = true;
+					sync_link = true;
+					break;
+				case TRANSPORT_PCM_DROP:
+					io_thread_read_pcm_flush(&t->sco.spk_pcm);
+					break;
+				case TRANSPORT_STOP:
+					goto final;
+				default:
+					sync_link = true;
+					break;
+				}
 
-			/* connection is managed by oFono */
-			if (t->sco.ofono)
+			/* Connection is managed by oFono. Also, there is no need to check
+			 * SCO link state if the only received event was the PCM drop. */
+			if (t->sco.ofono || !sync_link)
 				continue;
 
 			const enum hfp_ind *inds = t->sco.rfcomm->rfcomm.hfp_inds;
@@ -2175,74 +3266,116 @@ static void *io_thread_sco(void *arg) {
 
 			if (release) {
 				t->release(t);
-				asrs.frames = 0;
+				sched.credits = 0;
 			}
 			else {
 				t->acquire(t);
+				/* MTU might have changed, adjust our buffers */
+				if (io_sco_buffers_init(t, arena) == -1) {
+					error("Couldn't create data buffer: %s", strerror(ENOMEM));
+					goto fail;
+				}
 #if ENABLE_MSBC
 				/* this can be called again, make sure it is idempotent */
-				if (t->type.codec == HFP_CODEC_MSBC && msbc_init(&msbc) != 0) {
+				if (t->type.codec == HFP_CODEC_MSBC && msbc_init(msbc) != 0) {
 					error("Couldn't initialize mSBC codec: %s", strerror(errno));
 					goto fail;
 				}
+				io_arena_update_size(t);
 #endif
 			}
 
 			continue;
 		}
 
-		if (asrs.frames == 0)
-			asrsync_init(&asrs, ba_transport_get_sampling(t));
+		if (pfds[5].revents & POLLIN) {
+			/* scheduler timer expired */
+			uint64_t ticks;
+			if (read(sched.timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+				io_sco_sched_tick(&sched, ticks * sched.batch);
+		}
 
 		if (pfds[1].revents & POLLIN) {
 			/* dispatch incoming SCO data */
 
-			uint8_t *buffer;
-			size_t buffer_len;
-			ssize_t len;
+			/* In case when the microphone PCM reader is not able to keep up,
+			 * drop the oldest samples, so the latency will not grow. */
+			const size_t mic_limit = config.sco.latency *
+				io_sco_packet_samples(t, t->mtu_read);
 
-			switch (t->type.codec) {
+			unsigned int packets;
+			int flags = 0;
+
+			/* read all packets queued in the socket (within the limit of our
+			 * buffer), waiting only for the first one */
+			for (packets = 0; ; packets++, flags = MSG_DONTWAIT) {
+
+				uint8_t *buffer;
+				size_t buffer_len;
+				ssize_t len;
+
+				switch (t->type.codec) {
 #if ENABLE_MSBC
-			case HFP_CODEC_MSBC:
-				buffer = msbc.dec_data.tail;
-				buffer_len = ffb_len_in(&msbc.dec_data);
-				break;
+				case HFP_CODEC_MSBC:
+					buffer = msbc->dec_data.tail;
+					buffer_len = ffb_len_in(&msbc->dec_data);
+					break;
 #endif
-			case HFP_CODEC_CVSD:
-			default:
-				if (t->sco.mic_pcm.fd == -1)
-					ffb_rewind(&bt_in);
-				buffer = bt_in.tail;
-				buffer_len = ffb_len_in(&bt_in);
-			}
+				case HFP_CODEC_CVSD:
+				default:
+					if (t->sco.mic_pcm.fd == -1)
+						ffb_rewind(bt_in);
+					buffer = bt_in->tail;
+					buffer_len = ffb_len_in(bt_in);
+				}
+
+				if (buffer_len < t->mtu_read)
+					break;
 
 retry_sco_read:
-			errno = 0;
-			if ((len = read(pfds[1].fd, buffer, buffer_len)) <= 0)
-				switch (errno) {
-				case EINTR:
-					goto retry_sco_read;
-				case 0:
-				case ECONNABORTED:
-				case ECONNRESET:
-					t->release(t);
-					continue;
-				default:
-					error("SCO read error: %s", strerror(errno));
-					continue;
+				errno = 0;
+				if ((len = recv(t->bt_fd, buffer, buffer_len, flags)) <= 0) {
+					switch (errno) {
+					case EINTR:
+						goto retry_sco_read;
+					case EAGAIN:
+						break;
+					case 0:
+					case ECONNABORTED:
+					case ECONNRESET:
+						t->release(t);
+						break;
+					default:
+						error("SCO read error: %s", strerror(errno));
+					}
+					break;
 				}
 
-			switch (t->type.codec) {
+				/* every received packet allows us to send one */
+				io_sco_sched_tick(&sched, 1);
+
+				switch (t->type.codec) {
 #if ENABLE_MSBC
-			case HFP_CODEC_MSBC:
-				ffb_seek(&msbc.dec_data, len);
-				break;
+				case HFP_CODEC_MSBC:
+					ffb_seek(&msbc->dec_data, len);
+					/* decode now, so there will be a room for the next packet */
+					msbc_decode(msbc);
+					if (ffb_len_out(&msbc->dec_pcm) > mic_limit)
+						ffb_shift(&msbc->dec_pcm, ffb_len_out(&msbc->dec_pcm) - mic_limit);
+					break;
 #endif
-			case HFP_CODEC_CVSD:
-			default:
-				ffb_seek(&bt_in, len);
+				case HFP_CODEC_CVSD:
+				default:
+					ffb_seek(bt_in, len);
+					if (ffb_len_out(bt_in) > mic_limit * sizeof(int16_t))
+						ffb_shift(bt_in, ffb_len_out(bt_in) - mic_limit * sizeof(int16_t));
+				}
+
 			}
 
+			if (packets > 0)
+				io_sco_sched_defer(&sched, t);
+
 		}
 		else if (pfds[1].revents & (POLLERR | POLLHUP)) {
 			debug("SCO poll error status: %#x", pfds[1].revents);
@@ -2252,48 +3385,64 @@ retry_sco_read:
 		if (pfds[2].revents & POLLOUT) {
 			/* write-out SCO data */
 
-			uint8_t *buffer;
-			size_t buffer_len;
-			ssize_t len;
+			int flags = 0;
 
-			switch (t->type.codec) {
+			/* write as many packets as we are allowed to */
+			for (; sched.credits > 0 && t->bt_fd != -1; flags = MSG_DONTWAIT) {
+
+				uint8_t *buffer;
+				size_t buffer_len;
+				ssize_t len;
+
+				switch (t->type.codec) {
 #if ENABLE_MSBC
-			case HFP_CODEC_MSBC:
-				buffer = msbc.enc_data.data;
-				buffer_len = t->mtu_write;
-				break;
+				case HFP_CODEC_MSBC:
+					msbc_encode(msbc);
+					buffer = msbc->enc_data.data;
+					buffer_len = ffb_blen_out(&msbc->enc_data);
+					break;
 #endif
-			case HFP_CODEC_CVSD:
-			default:
-				buffer = bt_out.data;
-				buffer_len = t->mtu_write;
-			}
+				case HFP_CODEC_CVSD:
+				default:
+					buffer = bt_out->data;
+					buffer_len = ffb_len_out(bt_out);
+				}
+
+				if (buffer_len < t->mtu_write)
+					break;
 
 retry_sco_write:
-			errno = 0;
-			if ((len = write(pfds[2].fd, buffer, buffer_len)) <= 0)
-				switch (errno) {
-				case EINTR:
-					goto retry_sco_write;
-				case 0:
-				case ECONNABORTED:
-				case ECONNRESET:
-					t->release(t);
-					continue;
-				default:
-					error("SCO write error: %s", strerror(errno));
-					continue;
+				errno = 0;
+				if ((len = send(t->bt_fd, buffer, t->mtu_write, flags)) <= 0) {
+					switch (errno) {
+					case EINTR:
+						goto retry_sco_write;
+					case EAGAIN:
+						break;
+					case 0:
+					case ECONNABORTED:
+					case ECONNRESET:
+						t->release(t);
+						break;
+					default:
+						error("SCO write error: %s", strerror(errno));
+					}
+					break;
 				}
 
-			switch (t->type.codec) {
+				sched.credits--;
+
+				switch (t->type.codec) {
 #if ENABLE_MSBC
-			case HFP_CODEC_MSBC:
-				ffb_shift(&msbc.enc_data, len);
-				break;
+				case HFP_CODEC_MSBC:
+					ffb_shift(&msbc->enc_data, len);
+					break;
 #endif
-			case HFP_CODEC_CVSD:
-			default:
-				ffb_shift(&bt_out, len);
+				case HFP_CODEC_CVSD:
+				default:
+					ffb_shift(bt_out, len);
+				}
+
 			}
 
 		}
@@ -2307,14 +3456,14 @@ retry_sco_write:
 			switch (t->type.codec) {
 #if ENABLE_MSBC
 			case HFP_CODEC_MSBC:
-				buffer = msbc.enc_pcm.tail;
-				samples = ffb_len_in(&msbc.enc_pcm);
+				buffer = msbc->enc_pcm.tail;
+				samples = ffb_len_in(&msbc->enc_pcm);
 				break;
 #endif
 			case HFP_CODEC_CVSD:
 			default:
-				buffer = (int16_t *)bt_out.tail;
-				samples = ffb_len_in(&bt_out) / sizeof(int16_t);
+				buffer = (int16_t *)bt_out->tail;
+				samples = ffb_len_in(bt_out) / sizeof(int16_t);
 			}
 
 			if ((samples = io_thread_read_pcm(&t->sco.spk_pcm, buffer, samples)) <= 0) {
@@ -2331,12 +3480,12 @@ retry_sco_write:
 			switch (t->type.codec) {
 #if ENABLE_MSBC
 			case HFP_CODEC_MSBC:
-				ffb_seek(&msbc.enc_pcm, samples);
+				ffb_seek(&msbc->enc_pcm, samples);
 				break;
 #endif
 			case HFP_CODEC_CVSD:
 			default:
-				ffb_seek(&bt_out, samples * sizeof(int16_t));
+				ffb_seek(bt_out, samples * sizeof(int16_t));
 			}
 
 		}
@@ -2355,20 +3504,22 @@ retry_sco_write:
 			switch (t->type.codec) {
 #if ENABLE_MSBC
 			case HFP_CODEC_MSBC:
-				buffer = msbc.dec_pcm.data;
-				samples = ffb_len_out(&msbc.dec_pcm);
+				buffer = msbc->dec_pcm.data;
+				samples = ffb_len_out(&msbc->dec_pcm);
 				break;
 #endif
 			case HFP_CODEC_CVSD:
 			default:
-				buffer = (int16_t *)bt_in.data;
-				samples = ffb_len_out(&bt_in) / sizeof(int16_t);
+				buffer = (int16_t *)bt_in->data;
+				samples = ffb_len_out(bt_in) / sizeof(int16_t);
 			}
 
 			if (t->sco.mic_muted)
 				snd_pcm_scale_s16le(buffer, samples, 1, 0, 0);
 
-			if ((samples = io_thread_write_pcm(&t->sco.mic_pcm, buffer, samples)) <= 0) {
+			if ((samples = io_thread_write_pcm(t, &t->sco.mic_pcm, buffer, samples)) <= 0) {
+				if (samples == -1 && errno == ECANCELED)
+					goto final;
 				if (samples == -1)
 					error("FIFO write error: %s", strerror(errno));
 				if (samples == 0)
@@ -2378,32 +3529,40 @@ retry_sco_write:
 			switch (t->type.codec) {
 #if ENABLE_MSBC
 			case HFP_CODEC_MSBC:
-				ffb_shift(&msbc.dec_pcm, samples);
+				ffb_shift(&msbc->dec_pcm, samples);
 				break;
 #endif
 			case HFP_CODEC_CVSD:
 			default:
-				ffb_shift(&bt_in, samples * sizeof(int16_t));
+				ffb_shift(bt_in, samples * sizeof(int16_t));
 			}
 
 		}
 
-		/* keep data transfer at a constant bit rate */
-		asrsync_sync(&asrs, t->mtu_write / 2);
-		/* update busy delay (encoding overhead) */
-		t->delay = asrsync_get_busy_usec(&asrs) / 100;
+		/* update delay (data queued for sending) */
+		if (t->mtu_write > 0) {
+			size_t queued;
+			switch (t->type.codec) {
+#if ENABLE_MSBC
+			case HFP_CODEC_MSBC:
+				queued = ffb_len_out(&msbc->enc_pcm) +
+					io_sco_packet_samples(t, ffb_len_out(&msbc->enc_data));
+				break;
+#endif
+			case HFP_CODEC_CVSD:
+			default:
+				queued = ffb_len_out(bt_out) / sizeof(int16_t);
+			}
+			t->delay = queued * 10000 / ba_transport_get_sampling(t);
+		}
 
 	}
 
 fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-fail_ffb:
-#if ENABLE_MSBC
-	pthread_cleanup_pop(1);
-#endif
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
+final:
+	close(sched.timer_fd);
+fail_init:
+	ba_transport_pthread_cleanup(t);
 	return NULL;
 }
 
@@ -2412,11 +3571,8 @@ fail_ffb:
 static void *io_thread_a2dp_sink_dump(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
-
 	struct io_thread_data io = {
-		.fds[0] = { t->sig_fd[0], POLLIN, 0 },
+		.fds[0] = { t->sigq.fd, POLLIN, 0 },
 		.fds[1] = { t->bt_fd, POLLIN, 0 },
 	};
 
@@ -2438,16 +3594,12 @@ static void *io_thread_a2dp_sink_dump(void *arg) {
 		goto fail_open;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(fclose), f);
-
 	if (ffb_init(&bt, t->mtu_read) == NULL) {
 		error("Couldn't create data buffer: %s", strerror(ENOMEM));
 		goto fail_ffb;
 	}
 
 	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
 		ssize_t len;
 
@@ -2459,8 +3611,10 @@ static void *io_thread_a2dp_sink_dump(void *arg) {
 		}
 
 		if (io.fds[0].revents & POLLIN) {
-			if (read(io.fds[0].fd, bt.data, ffb_blen_in(&bt)) == -1)
-				warn("Couldn't read signal: %s", strerror(errno));
+			struct ba_transport_msg msg;
+			while (ba_transport_recv_signal(t, &msg))
+				if (msg.sig == TRANSPORT_STOP)
+					goto final;
 			continue;
 		}
 
@@ -2474,15 +3628,178 @@ static void *io_thread_a2dp_sink_dump(void *arg) {
 	}
 
 fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+final:
 fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
+	ffb_uint8_free(&bt);
+	fclose(f);
 fail_open:
-	pthread_cleanup_pop(1);
+	ba_transport_pthread_cleanup(t);
+	return NULL;
+}
+
+/**
+ * IO worker thread.
+ *
+ * Workers are parked on their condition variable until an IO routine is
+ * assigned by the io_pool_submit(). After the routine returns, the worker
+ * goes back to the pool, unless there are enough idle workers already. */
+struct io_worker {
+	pthread_t thread;
+	pthread_cond_t ready;
+	/* assigned IO routine and its argument */
+	void *(*routine)(void *);
+	void *arg;
+	const char *name;
+	/* next idle worker */
+	struct io_worker *next;
+};
+
+/* Pool of idle IO workers. */
+static struct {
+	pthread_mutex_t mutex;
+	struct io_worker *idle;
+	unsigned int idle_count;
+	/* max number of idle workers */
+	unsigned int idle_max;
+} io_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.idle = NULL,
+	.idle_count = 0,
+	.idle_max = 0,
+};
+
+static void *io_worker_routine(void *arg) {
+	struct io_worker *w = (struct io_worker *)arg;
+
+	pthread_mutex_lock(&io_pool.mutex);
+
+	for (;;) {
+
+		while (w->routine == NULL)
+			pthread_cond_wait(&w->ready, &io_pool.mutex);
+
+		void *(*routine)(void *) = w->routine;
+		void *routine_arg = w->arg;
+
+		pthread_mutex_unlock(&io_pool.mutex);
+
+		pthread_setname_np(pthread_self(), w->name);
+		routine(routine_arg);
+		pthread_setname_np(pthread_self(), "ba-io-idle");
+
+		pthread_mutex_lock(&io_pool.mutex);
+
+		w->routine = NULL;
+		w->arg = NULL;
+
+		if (io_pool.idle_count >= io_pool.idle_max)
+			break;
+
+		w->next = io_pool.idle;
+		io_pool.idle = w;
+		io_pool.idle_count++;
+
+	}
+
+	pthread_mutex_unlock(&io_pool.mutex);
+
+	pthread_cond_destroy(&w->ready);
+	free(w);
 	return NULL;
 }
 
+/**
+ * Spawn new IO worker. This function shall be called with the pool lock. */
+static struct io_worker *io_worker_new(void) {
+
+	struct io_worker *w;
+	int err;
+
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		return NULL;
+
+	pthread_cond_init(&w->ready, NULL);
+
+	if ((err = pthread_create(&w->thread, NULL, io_worker_routine, w)) != 0) {
+		pthread_cond_destroy(&w->ready);
+		free(w);
+		errno = err;
+		return NULL;
+	}
+
+	pthread_detach(w->thread);
+	return w;
+}
+
+/**
+ * Initialize IO worker pool.
+ *
+ * @param workers The number of IO workers which shall be spawned up front.
+ *   Up to this number of workers will be kept idle in the pool.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int io_pool_init(unsigned int workers) {
+
+	int ret = 0;
+
+	pthread_mutex_lock(&io_pool.mutex);
+
+	io_pool.idle_max = workers;
+
+	while (io_pool.idle_count < workers) {
+		struct io_worker *w;
+		if ((w = io_worker_new()) == NULL) {
+			ret = -1;
+			break;
+		}
+		pthread_setname_np(w->thread, "ba-io-idle");
+		w->next = io_pool.idle;
+		io_pool.idle = w;
+		io_pool.idle_count++;
+	}
+
+	pthread_mutex_unlock(&io_pool.mutex);
+
+	debug("IO worker pool: %u", io_pool.idle_count);
+	return ret;
+}
+
+/**
+ * Run IO routine using an idle worker from the pool.
+ *
+ * If there is no idle worker, a new one is spawned.
+ *
+ * @return On success this function returns 0. Otherwise, the error number
+ *   is returned. */
+static int io_pool_submit(void *(*routine)(void *), void *arg,
+		const char *name, pthread_t *thread) {
+
+	struct io_worker *w;
+	int ret = 0;
+
+	pthread_mutex_lock(&io_pool.mutex);
+
+	if ((w = io_pool.idle) != NULL) {
+		io_pool.idle = w->next;
+		io_pool.idle_count--;
+	}
+	else if ((w = io_worker_new()) == NULL) {
+		ret = errno;
+		goto final;
+	}
+
+	w->routine = routine;
+	w->arg = arg;
+	w->name = name;
+	*thread = w->thread;
+
+	pthread_cond_signal(&w->ready);
+
+final:
+	pthread_mutex_unlock(&io_pool.mutex);
+	return ret;
+}
+
 int io_thread_create(struct ba_transport *t) {
 
 	void *(*routine)(void *) = NULL;
@@ -2497,84 +3814,34 @@ int io_thread_create(struct ba_transport *t) {
 		routine = io_thread_sco;
 		name = "ba-io-sco";
 	}
-	else if (t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SOURCE)
-		switch (t->type.codec) {
-		case A2DP_CODEC_SBC:
-			routine = io_thread_a2dp_source_sbc;
-			name = "ba-io-sbc";
-			break;
-#if ENABLE_MPEG
-		case A2DP_CODEC_MPEG12:
-#if ENABLE_MPG123
-			routine = io_thread_a2dp_sink_mpeg;
-			name = "ba-io-mpeg";
-#elif ENABLE_MP3LAME
-			if (((a2dp_mpeg_t *)t->a2dp.cconfig)->layer == MPEG_LAYER_MP3) {
-				routine = io_thread_a2dp_sink_mpeg;
-				name = "ba-io-mp3";
-			}
-#endif
-			break;
-#endif
-#if ENABLE_AAC
-		case A2DP_CODEC_MPEG24:
-			routine = io_thread_a2dp_source_aac;
-			name = "ba-io-aac";
-			break;
-#endif
-#if ENABLE_APTX
-		case A2DP_CODEC_VENDOR_APTX:
-			routine = io_thread_a2dp_source_aptx;
-			name = "ba-io-aptx";
-			break;
-#endif
-#if ENABLE_LDAC
-		case A2DP_CODEC_VENDOR_LDAC:
-			routine = io_thread_a2dp_source_ldac;
-			name = "ba-io-ldac";
-			break;
-#endif
-		default:
-			warn("Codec not supported: %u", t->type.codec);
-		}
-	else if (t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SINK)
-		switch (t->type.codec) {
-		case A2DP_CODEC_SBC:
-			routine = io_thread_a2dp_sink_sbc;
-			name = "ba-io-sbc";
-			break;
-#if ENABLE_MPEG
-		case A2DP_CODEC_MPEG12:
-#if ENABLE_MP3LAME
-			if (((a2dp_mpeg_t *)t->a2dp.cconfig)->layer == MPEG_LAYER_MP3) {
-				routine = io_thread_a2dp_source_mp3;
-				name = "ba-io-mp3";
-			}
-#endif
-			break;
-#endif
-#if ENABLE_AAC
-		case A2DP_CODEC_MPEG24:
-			routine = io_thread_a2dp_sink_aac;
-			name = "ba-io-aac";
-			break;
-#endif
-		default:
+	else if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP) {
+		const struct io_codec *codec;
+		if ((codec = io_codec_lookup(t)) == NULL)
 			warn("Codec not supported: %u", t->type.codec);
+		else {
+			routine = t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SOURCE ?
+				io_thread_a2dp_source : io_thread_a2dp_sink;
+			name = codec->name;
 		}
+	}
 
 	if (routine == NULL)
 		return -1;
 
-	if ((ret = pthread_create(&t->thread, NULL, routine, ba_transport_ref(t))) != 0) {
+	/* Hold the transport lock until the thread identifier is stored, so the
+	 * IO routine will not be able to reset it prematurely. */
+	pthread_mutex_lock(&t->mutex);
+
+	if ((ret = io_pool_submit(routine, ba_transport_ref(t), name, &t->thread)) != 0) {
 		error("Couldn't create IO thread: %s", strerror(ret));
 		t->thread = config.main_thread;
+		pthread_mutex_unlock(&t->mutex);
 		ba_transport_unref(t);
 		return -1;
 	}
 
-	debug("Created new IO thread: %s", ba_transport_type_to_string(t->type));
-	pthread_setname_np(t->thread, name);
+	pthread_mutex_unlock(&t->mutex);
 
+	debug("Created new IO thread: %s", ba_transport_type_to_string(t->type));
 	return 0;
 }
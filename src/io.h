@@ -17,6 +17,9 @@
 
 #include "ba-transport.h"
 
+int io_pool_init(unsigned int workers);
 int io_thread_create(struct ba_transport *t);
 
+void io_arena_free(struct io_arena *arena);
+
 #endif
@@ -12,6 +12,7 @@
 # include <config.h>
 #endif
 
+#include <errno.h>
 #include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -33,9 +34,11 @@
 #include "bluealsa-iface.h"
 #include "bluez-a2dp.h"
 #include "bluez.h"
+#include "io.h"
 #if ENABLE_OFONO
 # include "ofono.h"
 #endif
+#include "storage.h"
 #include "utils.h"
 #include "shared/defs.h"
 #include "shared/log.h"
@@ -97,10 +100,17 @@ int main(int argc, char **argv) {
 		{ "syslog", no_argument, NULL, 'S' },
 		{ "device", required_argument, NULL, 'i' },
 		{ "profile", required_argument, NULL, 'p' },
+		{ "io-workers", required_argument, NULL, 14 },
+#if ENABLE_LIBURING
+		{ "io-poll", no_argument, NULL, 18 },
+#endif
+		{ "sco-latency", required_argument, NULL, 15 },
 		{ "a2dp-force-mono", no_argument, NULL, 6 },
 		{ "a2dp-force-audio-cd", no_argument, NULL, 7 },
 		{ "a2dp-keep-alive", required_argument, NULL, 8 },
 		{ "a2dp-volume", no_argument, NULL, 9 },
+		{ "a2dp-cpu-budget", required_argument, NULL, 16 },
+		{ "a2dp-bitrate-budget", required_argument, NULL, 17 },
 #if ENABLE_AAC
 		{ "aac-afterburner", no_argument, NULL, 4 },
 		{ "aac-vbr-mode", required_argument, NULL, 5 },
@@ -156,10 +166,17 @@ int main(int argc, char **argv) {
 					"  -S, --syslog\t\tsend output to syslog\n"
 					"  -i, --device=hciX\tHCI device to use\n"
 					"  -p, --profile=NAME\tenable BT profile\n"
+					"  --io-workers=NUM\tnumber of pre-spawned IO threads\n"
+#if ENABLE_LIBURING
+					"  --io-poll\t\tuse poll() instead of io_uring\n"
+#endif
+					"  --sco-latency=NUM\tmax number of buffered SCO packets\n"
 					"  --a2dp-force-mono\tforce monophonic sound\n"
 					"  --a2dp-force-audio-cd\tforce 44.1 kHz sampling\n"
 					"  --a2dp-keep-alive=SEC\tkeep A2DP transport alive\n"
 					"  --a2dp-volume\t\tcontrol volume natively\n"
+					"  --a2dp-cpu-budget=PCT\tCPU usage limit for A2DP codecs\n"
+					"  --a2dp-bitrate-budget=KBPS\tbit-rate limit for A2DP streams\n"
 #if ENABLE_AAC
 					"  --aac-afterburner\tenable afterburner\n"
 					"  --aac-vbr-mode=NB\tset VBR mode to NB\n"
@@ -239,6 +256,28 @@ int main(int argc, char **argv) {
 			break;
 		}
 
+		case 14 /* --io-workers=NUM */ :
+			config.io_workers = atoi(optarg);
+			if (config.io_workers > 32) {
+				error("Invalid number of IO workers [0, 32]: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+#if ENABLE_LIBURING
+		case 18 /* --io-poll */ :
+			config.io_uring = false;
+			break;
+#endif
+
+		case 15 /* --sco-latency=NUM */ :
+			config.sco.latency = atoi(optarg);
+			if (config.sco.latency < 1 || config.sco.latency > 16) {
+				error("Invalid number of SCO packets [1, 16]: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
 		case 6 /* --a2dp-force-mono */ :
 			config.a2dp.force_mono = true;
 			break;
@@ -251,6 +290,12 @@ int main(int argc, char **argv) {
 		case 9 /* --a2dp-volume */ :
 			config.a2dp.volume = true;
 			break;
+		case 16 /* --a2dp-cpu-budget=PCT */ :
+			config.a2dp.cpu_budget = atoi(optarg) * 10;
+			break;
+		case 17 /* --a2dp-bitrate-budget=KBPS */ :
+			config.a2dp.bitrate_budget = atoi(optarg);
+			break;
 
 #if ENABLE_AAC
 		case 4 /* --aac-afterburner */ :
@@ -330,6 +375,12 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	if (storage_init(BLUEALSA_STORAGE_DIR) == -1)
+		warn("Couldn't initialize persistent storage: %s", strerror(errno));
+
+	if (io_pool_init(config.io_workers) == -1)
+		warn("Couldn't spawn IO workers: %s", strerror(errno));
+
 	bluez_subscribe_signals();
 	bluez_register();
 
@@ -360,5 +411,7 @@ int main(int argc, char **argv) {
 	g_main_loop_run(loop);
 
 	debug("Exiting main loop");
+	storage_destroy();
+
 	return retval;
 }
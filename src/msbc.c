@@ -18,6 +18,14 @@
 #include "shared/log.h"
 
 
+/**
+ * Check whether given H2 synchronization header is valid. */
+static bool msbc_check_h2_header(const esco_h2_header_t *h2) {
+	return h2->sync == ESCO_H2_SYNCWORD &&
+		(bool)(h2->sn0 & 0x1) == (bool)(h2->sn0 & 0x2) &&
+		(bool)(h2->sn1 & 0x1) == (bool)(h2->sn1 & 0x2);
+}
+
 /**
  * Find H2 synchronization header within eSCO transparent data.
  *
@@ -34,12 +42,21 @@ static esco_h2_header_t *msbc_find_h2_header(const void *data, size_t *len) {
 	size_t _len = *len;
 
 	while (_len >= sizeof(esco_h2_header_t)) {
-		esco_h2_header_t *tmp = (esco_h2_header_t *)_data;
+		const uint8_t *tmp;
+
+		/* Look for the first byte of the sync word with memchr(), which is
+		 * usually optimized much better than a byte-by-byte loop. */
+		if ((tmp = memchr(_data, ESCO_H2_SYNCWORD & 0xFF, _len - 1)) == NULL) {
+			_data += _len - 1;
+			_len = 1;
+			break;
+		}
 
-		if (tmp->sync == ESCO_H2_SYNCWORD &&
-				(bool)(tmp->sn0 & 0x1) == (bool)(tmp->sn0 & 0x2) &&
-				(bool)(tmp->sn1 & 0x1) == (bool)(tmp->sn1 & 0x2)) {
-			h2 = tmp;
+		_len -= tmp - _data;
+		_data = tmp;
+
+		if (msbc_check_h2_header((esco_h2_header_t *)_data)) {
+			h2 = (esco_h2_header_t *)_data;
 			goto final;
 		}
 
@@ -93,21 +110,17 @@ int msbc_init(struct esco_msbc *msbc) {
 	}
 #endif
 
-	if (!msbc->init) {
-		if (ffb_init(&msbc->dec_data, sizeof(esco_msbc_frame_t) * 3) == NULL)
-			goto fail;
-		if (ffb_init(&msbc->dec_pcm, MSBC_CODESAMPLES * 2) == NULL)
-			goto fail;
-		if (ffb_init(&msbc->enc_data, sizeof(esco_msbc_frame_t) * 3) == NULL)
-			goto fail;
-		if (ffb_init(&msbc->enc_pcm, MSBC_CODESAMPLES * 2) == NULL)
-			goto fail;
-	}
+	/* keep buffers which have been sized by the msbc_resize() */
+	if (msbc->dec_data.data == NULL &&
+			msbc_resize(msbc, MSBC_MIN_FRAMES) == -1)
+		goto fail;
 
 	ffb_rewind(&msbc->dec_data);
 	ffb_rewind(&msbc->dec_pcm);
 	ffb_rewind(&msbc->enc_data);
 	ffb_rewind(&msbc->enc_pcm);
+	msbc->dec_data_offset = 0;
+	msbc->dec_synced = false;
 	msbc->enc_frames = 0;
 
 	msbc->init = true;
@@ -120,6 +133,53 @@ fail:
 	return -1;
 }
 
+/**
+ * Resize mSBC data buffers.
+ *
+ * Buffers for eSCO frames will hold the given number of frames, and buffers
+ * for PCM samples will hold samples of one frame less. Data which has not
+ * been processed yet is discarded.
+ *
+ * @param msbc Address of the mSBC structure.
+ * @param frames Number of eSCO frames. Values lower than MSBC_MIN_FRAMES
+ *   are rounded up.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int msbc_resize(struct esco_msbc *msbc, size_t frames) {
+
+	if (frames < MSBC_MIN_FRAMES)
+		frames = MSBC_MIN_FRAMES;
+
+	const size_t data_size = sizeof(esco_msbc_frame_t) * frames;
+	const size_t pcm_size = MSBC_CODESAMPLES * (frames - 1);
+
+	if (msbc->dec_data.size != data_size &&
+			ffb_init(&msbc->dec_data, data_size) == NULL)
+		goto fail;
+	if (msbc->dec_pcm.size != pcm_size &&
+			ffb_init(&msbc->dec_pcm, pcm_size) == NULL)
+		goto fail;
+	if (msbc->enc_data.size != data_size &&
+			ffb_init(&msbc->enc_data, data_size) == NULL)
+		goto fail;
+	if (msbc->enc_pcm.size != pcm_size &&
+			ffb_init(&msbc->enc_pcm, pcm_size) == NULL)
+		goto fail;
+
+	ffb_rewind(&msbc->dec_data);
+	ffb_rewind(&msbc->dec_pcm);
+	ffb_rewind(&msbc->enc_data);
+	ffb_rewind(&msbc->enc_pcm);
+	msbc->dec_data_offset = 0;
+	msbc->dec_synced = false;
+
+	return 0;
+
+fail:
+	errno = ENOMEM;
+	return -1;
+}
+
 void msbc_finish(struct esco_msbc *msbc) {
 
 	if (msbc == NULL)
@@ -135,23 +195,44 @@ void msbc_finish(struct esco_msbc *msbc) {
 
 }
 
+/**
+ * Decode eSCO frames from the incoming buffer.
+ *
+ * Once the H2 header is found, the decoder is locked onto the frame
+ * boundary, and only the header at the expected offset is verified. The
+ * buffer is searched for the header only when the synchronization is lost,
+ * e.g. due to a lost packet. */
 void msbc_decode(struct esco_msbc *msbc) {
 
-	uint8_t *input = msbc->dec_data.data;
-	size_t input_len = ffb_blen_out(&msbc->dec_data);
+	uint8_t *input = msbc->dec_data.data + msbc->dec_data_offset;
+	size_t input_len = ffb_blen_out(&msbc->dec_data) - msbc->dec_data_offset;
 	int16_t *output = msbc->dec_pcm.tail;
 	size_t output_len = ffb_blen_in(&msbc->dec_pcm);
 
-	for (;;) {
+	while (input_len >= sizeof(esco_msbc_frame_t) &&
+			output_len >= MSBC_CODESIZE) {
 
-		size_t tmp = input_len;
-		esco_h2_header_t *h2 = msbc_find_h2_header(input, &input_len);
-		esco_msbc_frame_t *frame = (esco_msbc_frame_t *)h2;
+		esco_msbc_frame_t *frame = (esco_msbc_frame_t *)input;
 		ssize_t len;
 
-		input += tmp - input_len;
-		if (frame == NULL || input_len < sizeof(*frame) || output_len < MSBC_CODESIZE)
-			break;
+		if (!msbc->dec_synced || !msbc_check_h2_header(&frame->header)) {
+
+			if (msbc->dec_synced) {
+				msbc->dec_synced = false;
+				msbc->dec_sync_losses++;
+				debug("mSBC frame sync lost: %u", msbc->dec_sync_losses);
+			}
+
+			size_t tmp = input_len;
+			esco_h2_header_t *h2 = msbc_find_h2_header(input, &input_len);
+			input += tmp - input_len;
+
+			if (h2 == NULL)
+				break;
+
+			msbc->dec_synced = true;
+			continue;
+		}
 
 		/* TODO: Check SEQ, implement PLC. */
 
@@ -169,8 +250,19 @@ void msbc_decode(struct esco_msbc *msbc) {
 
 	}
 
-	/* reshuffle remaining data to the beginning of the buffer */
-	ffb_shift(&msbc->dec_data, input - msbc->dec_data.data);
+	msbc->dec_data_offset = input - msbc->dec_data.data;
+
+	/* Move remaining data to the beginning of the buffer only if all data
+	 * has been consumed (no copy at all) or if the free space is running
+	 * low. In the latter case there is less than one frame to move. */
+	if (msbc->dec_data_offset == ffb_blen_out(&msbc->dec_data)) {
+		ffb_rewind(&msbc->dec_data);
+		msbc->dec_data_offset = 0;
+	}
+	else if (ffb_blen_in(&msbc->dec_data) < msbc->dec_data.size / 2) {
+		ffb_shift(&msbc->dec_data, msbc->dec_data_offset);
+		msbc->dec_data_offset = 0;
+	}
 
 }
 
@@ -30,6 +30,9 @@
 #define MSBC_CODESAMPLES (MSBC_CODESIZE / sizeof(int16_t))
 #define MSBC_FRAMELEN    57
 
+/* minimal number of eSCO frames in the data buffer */
+#define MSBC_MIN_FRAMES  3
+
 #define ESCO_H2_SYNCWORD 0x801
 
 /**
@@ -64,6 +67,16 @@ struct esco_msbc {
 	/* buffer for outgoing PCM samples */
 	ffb_int16_t dec_pcm;
 
+	/* Offset of the not yet decoded data in the incoming buffer. Frames are
+	 * decoded in place, and the buffer is compacted only when there is not
+	 * enough free space left at its end. */
+	size_t dec_data_offset;
+	/* decoder is locked onto the eSCO frame boundary */
+	bool dec_synced;
+	/* Number of frame synchronization losses. This counter is not reset by
+	 * the msbc_init(), so losses are not missed across re-initializations. */
+	unsigned int dec_sync_losses;
+
 	/* buffer for incoming PCM samples */
 	ffb_int16_t enc_pcm;
 	/* buffer for outgoing eSCO frames */
@@ -78,6 +91,7 @@ struct esco_msbc {
 };
 
 int msbc_init(struct esco_msbc *msbc);
+int msbc_resize(struct esco_msbc *msbc, size_t frames);
 void msbc_finish(struct esco_msbc *msbc);
 
 void msbc_decode(struct esco_msbc *msbc);
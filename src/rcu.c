@@ -0,0 +1,233 @@
+/*
+ * BlueALSA - rcu.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "rcu.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/log.h"
+
+/* Current grace period epoch. Only the least significant bit is used for
+ * selecting the readers counter, however the whole value is incremented,
+ * so it is possible to track the number of grace periods. */
+static atomic_uint rcu_epoch = 0;
+/* number of active readers in the given epoch parity */
+static atomic_uint rcu_readers[2] = { 0, 0 };
+/* serialize concurrent grace periods */
+static pthread_mutex_t rcu_gp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* guard the callbacks queue and the conditions below */
+static pthread_mutex_t rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when the last reader of the previous epoch has left */
+static pthread_cond_t rcu_gp_cond = PTHREAD_COND_INITIALIZER;
+/* signaled when a new callback has been queued */
+static pthread_cond_t rcu_queue_cond = PTHREAD_COND_INITIALIZER;
+/* callbacks waiting for the grace period */
+static struct rcu_head *rcu_callbacks = NULL;
+
+static pthread_once_t rcu_reclaimer_once = PTHREAD_ONCE_INIT;
+static bool rcu_reclaimer_running = false;
+
+/**
+ * Decrement readers counter of the given epoch parity.
+ *
+ * If we were the last reader of the epoch for which the grace period is
+ * pending, the grace period waiter has to be woken up. */
+static void rcu_readers_dec(unsigned int epoch) {
+	if (atomic_fetch_sub(&rcu_readers[epoch], 1) == 1 &&
+			(atomic_load(&rcu_epoch) & 1) != epoch) {
+		pthread_mutex_lock(&rcu_mutex);
+		pthread_cond_broadcast(&rcu_gp_cond);
+		pthread_mutex_unlock(&rcu_mutex);
+	}
+}
+
+/**
+ * Enter the RCU read-side critical section.
+ *
+ * The critical section shall be short and it must not call any function
+ * which might block.
+ *
+ * @return This function returns the epoch token, which shall be passed
+ *   to the rcu_read_unlock() function. */
+unsigned int rcu_read_lock(void) {
+
+	unsigned int epoch;
+
+	for (;;) {
+		epoch = atomic_load(&rcu_epoch) & 1;
+		atomic_fetch_add(&rcu_readers[epoch], 1);
+		/* Make sure, that the grace period has not been started between
+		 * the epoch load and the counter increment. Otherwise, the writer
+		 * might have missed us, so we have to retry with the new epoch. */
+		if ((atomic_load(&rcu_epoch) & 1) == epoch)
+			return epoch;
+		rcu_readers_dec(epoch);
+	}
+
+}
+
+/**
+ * Leave the RCU read-side critical section.
+ *
+ * @param epoch The epoch token returned by the rcu_read_lock(). */
+void rcu_read_unlock(unsigned int epoch) {
+	rcu_readers_dec(epoch);
+}
+
+/**
+ * Wait for the RCU grace period.
+ *
+ * Upon return from this function, all readers which might have seen data
+ * unpublished before this call have left their read-side critical section.
+ * Instead of spinning, the waiter sleeps until the last reader of the
+ * previous epoch wakes it up. */
+static void rcu_synchronize(void) {
+
+	pthread_mutex_lock(&rcu_gp_mutex);
+
+	unsigned int epoch = atomic_fetch_add(&rcu_epoch, 1) & 1;
+
+	pthread_mutex_lock(&rcu_mutex);
+	while (atomic_load(&rcu_readers[epoch]) != 0)
+		pthread_cond_wait(&rcu_gp_cond, &rcu_mutex);
+	pthread_mutex_unlock(&rcu_mutex);
+
+	pthread_mutex_unlock(&rcu_gp_mutex);
+
+}
+
+/**
+ * Reclaimer thread - invoke queued callbacks after the grace period.
+ *
+ * All callbacks queued before the grace period is started are processed in
+ * a single batch, so there is at most one grace period in flight. */
+static void *rcu_reclaimer(void *arg) {
+	(void)arg;
+
+	for (;;) {
+
+		struct rcu_head *head;
+
+		pthread_mutex_lock(&rcu_mutex);
+		while (rcu_callbacks == NULL)
+			pthread_cond_wait(&rcu_queue_cond, &rcu_mutex);
+		head = rcu_callbacks;
+		rcu_callbacks = NULL;
+		pthread_mutex_unlock(&rcu_mutex);
+
+		rcu_synchronize();
+
+		while (head != NULL) {
+			struct rcu_head *next = head->next;
+			head->func(head);
+			head = next;
+		}
+
+	}
+
+	return NULL;
+}
+
+static void rcu_reclaimer_init(void) {
+
+	pthread_t thread;
+	int err;
+
+	if ((err = pthread_create(&thread, NULL, rcu_reclaimer, NULL)) != 0) {
+		error("Couldn't create RCU reclaimer thread: %s", strerror(err));
+		return;
+	}
+
+	pthread_setname_np(thread, "ba-rcu");
+	pthread_detach(thread);
+	rcu_reclaimer_running = true;
+
+}
+
+/**
+ * Queue callback for invocation after the RCU grace period.
+ *
+ * This function does not wait for the grace period, so it is safe to call
+ * it from the main loop context. The callback is invoked from the context
+ * of the reclaimer thread, after all readers which might have seen given
+ * object have left their read-side critical section. If the reclaimer
+ * thread can not be created, this function falls back to the synchronous
+ * grace period wait.
+ *
+ * @param head Address of the callback handle embedded in the object.
+ * @param func Function which shall release the object. */
+void rcu_call(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+
+	head->func = func;
+
+	pthread_once(&rcu_reclaimer_once, rcu_reclaimer_init);
+	if (!rcu_reclaimer_running) {
+		rcu_synchronize();
+		func(head);
+		return;
+	}
+
+	pthread_mutex_lock(&rcu_mutex);
+	head->next = rcu_callbacks;
+	rcu_callbacks = head;
+	pthread_cond_signal(&rcu_queue_cond);
+	pthread_mutex_unlock(&rcu_mutex);
+
+}
+
+/**
+ * Publish new snapshot of the hash table values.
+ *
+ * This function shall be called with the lock guarding the hash table
+ * held. If the memory allocation fails, NULL is published, which shall
+ * be handled by readers by falling back to the locked hash table lookup.
+ *
+ * @param array Address of the published snapshot pointer.
+ * @param table Hash table from which the snapshot shall be created.
+ * @return This function returns the previous snapshot, which shall be freed
+ *   with the free() function after the RCU grace period. */
+struct rcu_array *rcu_array_publish(
+		struct rcu_array * _Atomic *array,
+		GHashTable *table) {
+
+	size_t len = g_hash_table_size(table);
+	struct rcu_array *tmp;
+
+	if ((tmp = malloc(sizeof(*tmp) + len * sizeof(*tmp->items))) != NULL) {
+
+		GHashTableIter iter;
+		gpointer value;
+
+		tmp->len = 0;
+		g_hash_table_iter_init(&iter, table);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			tmp->items[tmp->len++] = value;
+
+	}
+
+	return atomic_exchange_explicit(array, tmp, memory_order_acq_rel);
+}
+
+static void rcu_array_free_cb(struct rcu_head *head) {
+	free(rcu_container_of(head, struct rcu_array, rcu));
+}
+
+/**
+ * Free snapshot after the RCU grace period.
+ *
+ * @param array Snapshot returned by the rcu_array_publish(). It is safe to
+ *   pass NULL to this function. */
+void rcu_array_free(struct rcu_array *array) {
+	if (array != NULL)
+		rcu_call(&array->rcu, rcu_array_free_cb);
+}
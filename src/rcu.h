@@ -0,0 +1,76 @@
+/*
+ * BlueALSA - rcu.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_RCU_H_
+#define BLUEALSA_RCU_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <glib.h>
+
+/**
+ * Get the address of the structure which embeds given member. */
+#define rcu_container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+/**
+ * Deferred reclamation callback handle.
+ *
+ * This structure shall be embedded in the object which is accessed by the
+ * lock-free readers. See the rcu_call() function for details. */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+/**
+ * Immutable snapshot of hash table values.
+ *
+ * Such a snapshot can be traversed within the RCU read-side critical
+ * section without any locking. Writers shall publish a new snapshot
+ * after every modification of the source hash table. */
+struct rcu_array {
+	struct rcu_head rcu;
+	size_t len;
+	void *items[];
+};
+
+unsigned int rcu_read_lock(void);
+void rcu_read_unlock(unsigned int epoch);
+void rcu_call(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+struct rcu_array *rcu_array_publish(
+		struct rcu_array * _Atomic *array,
+		GHashTable *table);
+void rcu_array_free(struct rcu_array *array);
+
+/**
+ * Increment reference counter unless it has already dropped to zero.
+ *
+ * @param ref_count Address of the atomic reference counter.
+ * @return This function returns true if the reference was taken, otherwise
+ *   false is returned, which indicates that the object is being freed. */
+static inline bool rcu_ref_get_unless_zero(atomic_int *ref_count) {
+	int count = atomic_load_explicit(ref_count, memory_order_relaxed);
+	do {
+		if (count == 0)
+			return false;
+	} while (!atomic_compare_exchange_weak_explicit(ref_count, &count, count + 1,
+				memory_order_acquire, memory_order_relaxed));
+	return true;
+}
+
+#endif
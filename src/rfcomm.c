@@ -26,6 +26,7 @@
 #include "utils.h"
 #include "shared/defs.h"
 #include "shared/log.h"
+#include "shared/rt.h"
 
 
 /**
@@ -35,18 +36,25 @@ struct at_reader {
 	char buffer[256];
 	/* pointer to the next message within the buffer */
 	char *next;
+	/* length of the incomplete message at the beginning of the buffer */
+	size_t partial;
 };
 
 /**
  * Read AT message.
  *
+ * Messages are tokenized directly in the read buffer. If the last message
+ * in the buffer is not complete, it is kept and the next read appends the
+ * rest of it.
+ *
  * Upon error it is required to set the next pointer of the reader structure
  * to NULL. Otherwise, this function might fail indefinitely.
  *
  * @param fd RFCOMM socket file descriptor.
  * @param reader Pointer to initialized reader structure.
  * @return On success this function returns 0. Otherwise, -1 is returned and
- *   errno is set to indicate the error. */
+ *   errno is set to indicate the error. If more data is required to parse
+ *   the message, errno is set to EAGAIN. */
 static int rfcomm_read_at(int fd, struct at_reader *reader) {
 
 	char *buffer = reader->buffer;
@@ -57,10 +65,11 @@ static int rfcomm_read_at(int fd, struct at_reader *reader) {
 	 * parse all of them before we can read from the socket once more. */
 	if (msg == NULL) {
 
+		const size_t partial = reader->partial;
 		ssize_t len;
 
 retry:
-		if ((len = read(fd, buffer, sizeof(reader->buffer))) == -1) {
+		if ((len = read(fd, &buffer[partial], sizeof(reader->buffer) - 1 - partial)) == -1) {
 			if (errno == EINTR)
 				goto retry;
 			return -1;
@@ -71,12 +80,27 @@ retry:
 			return -1;
 		}
 
-		buffer[len] = '\0';
+		buffer[partial + len] = '\0';
+		reader->partial = 0;
 		msg = buffer;
 	}
 
 	/* parse AT message received from the RFCOMM */
-	if ((tmp = at_parse(msg, &reader->at)) == NULL) {
+	if ((tmp = at_tokenize(msg, &reader->at)) == NULL) {
+
+		size_t len;
+
+		/* Move the beginning of the message to the beginning of the buffer,
+		 * unless the message is longer than the buffer itself. */
+		if (errno == EAGAIN &&
+				(len = strlen(msg)) < sizeof(reader->buffer) - 1) {
+			memmove(buffer, msg, len);
+			reader->partial = len;
+			reader->next = NULL;
+			errno = EAGAIN;
+			return -1;
+		}
+
 		reader->next = msg;
 		errno = EBADMSG;
 		return -1;
@@ -122,6 +146,91 @@ retry:
 static void rfcomm_set_hfp_state(struct rfcomm_conn *c, enum hfp_state state) {
 	debug("HFP state transition: %d -> %d", c->state, state);
 	c->state = state;
+
+	if (state == HFP_CONNECTED) {
+		struct timespec now;
+		gettimestamp(&now);
+		difftimespec(&c->slc_ts, &now, &now);
+		c->t->d->hfp_slc_time = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+		debug("HFP connection established in %u ms", c->t->d->hfp_slc_time);
+	}
+
+}
+
+/**
+ * Register handler for the response of the AT command.
+ *
+ * This function shall be called for every response message (including the
+ * final result code) in the order in which responses are expected. */
+static void rfcomm_expect_resp(struct rfcomm_conn *c,
+		const struct rfcomm_handler *handler) {
+
+	if (c->handler == NULL) {
+		c->handler = handler;
+		gettimestamp(&c->handler_ts);
+		/* Round-trip time of retransmitted command is ambiguous, so do not
+		 * use it for the timeout estimation (Karn's algorithm). */
+		c->rtt_sample = c->retries == 0;
+		return;
+	}
+
+	if (c->handlers_len == ARRAYSIZE(c->handlers)) {
+		warn("AT response queue overflow: %s", handler->command);
+		return;
+	}
+
+	c->handlers[c->handlers_len++] = handler;
+}
+
+/**
+ * Advance to the next expected AT response.
+ *
+ * This function shall be called when the response for the current handler
+ * has been received. */
+static void rfcomm_next_resp(struct rfcomm_conn *c) {
+
+	struct timespec now, diff;
+	gettimestamp(&now);
+
+	if (c->rtt_sample) {
+		difftimespec(&c->handler_ts, &now, &diff);
+		const int rtt = diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+		/* estimate timeout in the same way as it is done in TCP */
+		if (c->rtt == 0) {
+			c->rtt = rtt;
+			c->rtt_var = rtt / 2;
+		}
+		else {
+			c->rtt_var = (3 * c->rtt_var + abs(c->rtt - rtt)) / 4;
+			c->rtt = (7 * c->rtt + rtt) / 8;
+		}
+		c->rto = MIN(MAX(c->rtt + 4 * c->rtt_var,
+					RFCOMM_SLC_TIMEOUT_MIN), RFCOMM_SLC_TIMEOUT);
+		c->rtt_sample = false;
+	}
+
+	if (c->handlers_len == 0) {
+		c->handler = NULL;
+		return;
+	}
+
+	c->handler = c->handlers[0];
+	memmove(c->handlers, &c->handlers[1], --c->handlers_len * sizeof(*c->handlers));
+	/* the remote device is responding, so restart the timeout */
+	c->handler_ts = now;
+
+}
+
+/**
+ * Get the time (in milliseconds) left for the expected AT response. */
+static int rfcomm_resp_timeout(const struct rfcomm_conn *c) {
+
+	struct timespec now;
+	gettimestamp(&now);
+	difftimespec(&c->handler_ts, &now, &now);
+
+	const int elapsed = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	return elapsed < c->rto ? c->rto - elapsed : 0;
 }
 
 /**
@@ -407,7 +516,7 @@ static int rfcomm_handler_bcs_resp_cb(struct rfcomm_conn *c, const struct bt_at
 	if (rfcomm_write_at(fd, AT_TYPE_CMD_SET, "+BCS", at->value) == -1)
 		return -1;
 
-	c->handler = &handler;
+	rfcomm_expect_resp(c, &handler);
 
 	if (c->state < HFP_CC_BCS_SET)
 		rfcomm_set_hfp_state(c, HFP_CC_BCS_SET);
@@ -538,58 +647,72 @@ static const struct rfcomm_handler rfcomm_handler_iphoneaccev_set = {
 static const struct rfcomm_handler rfcomm_handler_xapl_set = {
 	AT_TYPE_CMD_SET, "+XAPL", rfcomm_handler_xapl_set_cb };
 
+/**
+ * Handlers for AT messages which are not part of the synchronous exchange.
+ *
+ * This table is used for the binary search, so it shall be sorted by the
+ * message type and then by the command name (see rfcomm_handler_cmp). */
+static const struct rfcomm_handler *rfcomm_handlers[] = {
+	&rfcomm_handler_btrh_get,
+	&rfcomm_handler_cind_get,
+	&rfcomm_handler_bac_set,
+	&rfcomm_handler_bcs_set,
+	&rfcomm_handler_bia_set,
+	&rfcomm_handler_brsf_set,
+	&rfcomm_handler_cmer_set,
+	&rfcomm_handler_iphoneaccev_set,
+	&rfcomm_handler_vgm_set,
+	&rfcomm_handler_vgs_set,
+	&rfcomm_handler_xapl_set,
+	&rfcomm_handler_cind_test,
+	&rfcomm_handler_bcs_resp,
+	&rfcomm_handler_ciev_resp,
+};
+
+/**
+ * Compare two AT message handlers. */
+static int rfcomm_handler_cmp(const void *a, const void *b) {
+	const struct rfcomm_handler *h1 = *(const struct rfcomm_handler **)a;
+	const struct rfcomm_handler *h2 = *(const struct rfcomm_handler **)b;
+	if (h1->type != h2->type)
+		return h1->type < h2->type ? -1 : 1;
+	return strcmp(h1->command, h2->command);
+}
+
 /**
  * Get callback (if available) for given AT message. */
 static rfcomm_callback *rfcomm_get_callback(const struct bt_at *at) {
 
-	static const struct rfcomm_handler *handlers[] = {
-		&rfcomm_handler_cind_test,
-		&rfcomm_handler_cind_get,
-		&rfcomm_handler_cmer_set,
-		&rfcomm_handler_ciev_resp,
-		&rfcomm_handler_bia_set,
-		&rfcomm_handler_brsf_set,
-		&rfcomm_handler_vgm_set,
-		&rfcomm_handler_vgs_set,
-		&rfcomm_handler_btrh_get,
-		&rfcomm_handler_bcs_set,
-		&rfcomm_handler_bcs_resp,
-		&rfcomm_handler_bac_set,
-		&rfcomm_handler_iphoneaccev_set,
-		&rfcomm_handler_xapl_set,
-	};
+	const struct rfcomm_handler key = { at->type, at->command, NULL };
+	const struct rfcomm_handler *key_ptr = &key;
+	const struct rfcomm_handler **handler;
 
-	size_t i;
-
-	for (i = 0; i < ARRAYSIZE(handlers); i++) {
-		if (handlers[i]->type != at->type)
-			continue;
-		if (strcmp(handlers[i]->command, at->command) != 0)
-			continue;
-		return handlers[i]->callback;
-	}
+	if ((handler = bsearch(&key_ptr, rfcomm_handlers, ARRAYSIZE(rfcomm_handlers),
+					sizeof(*rfcomm_handlers), rfcomm_handler_cmp)) == NULL)
+		return NULL;
 
-	return NULL;
+	return (*handler)->callback;
 }
 
 void *rfcomm_thread(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
-
 	/* initialize structure used for synchronization */
 	struct rfcomm_conn conn = {
 		.state = HFP_DISCONNECTED,
 		.state_prev = HFP_DISCONNECTED,
+		.pipeline = true,
+		.rto = RFCOMM_SLC_TIMEOUT,
 		.mic_gain = t->rfcomm.sco->sco.mic_gain,
 		.spk_gain = t->rfcomm.sco->sco.spk_gain,
 		.t = t,
 	};
 
+	gettimestamp(&conn.slc_ts);
+
 	struct at_reader reader = { .next = NULL };
 	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
+		{ t->sigq.fd, POLLIN, 0 },
 		{ t->bt_fd, POLLIN, 0 },
 		{ -1, POLLIN, 0 },
 	};
@@ -602,7 +725,8 @@ void *rfcomm_thread(void *arg) {
 		 * by ourself. In order to do this reliably, we have to assume, that
 		 * AG might not receive our message and will not send proper response.
 		 * Hence, we will incorporate timeout, after which we will send our
-		 * AT command once more. */
+		 * AT command once more. The timeout is adjusted to the measured
+		 * round-trip time of AT commands. */
 		int timeout = -1;
 
 		rfcomm_callback *callback;
@@ -617,6 +741,19 @@ void *rfcomm_thread(void *arg) {
 				conn.retries = 0;
 			}
 
+			/* The response for our AT command has not been received on time.
+			 * Discard all pending responses and send the command once more. */
+			if (conn.handler != NULL && rfcomm_resp_timeout(&conn) == 0) {
+				debug("RFCOMM response timeout: %s", conn.handler->command);
+				conn.handler = NULL;
+				conn.handlers_len = 0;
+				/* The remote device might not be able to handle pipelined
+				 * commands, so fall back to the one-by-one mode. */
+				conn.pipeline = false;
+				conn.rto = MIN(conn.rto * 2, RFCOMM_SLC_TIMEOUT);
+				conn.retries++;
+			}
+
 			/* If the maximal number of retries has been reached, terminate the
 			 * connection. Trying indefinitely will only use up our resources. */
 			if (conn.retries > RFCOMM_SLC_RETRIES) {
@@ -624,16 +761,25 @@ void *rfcomm_thread(void *arg) {
 				goto ioerror;
 			}
 
-			if (t->type.profile & BA_TRANSPORT_PROFILE_HFP_HF)
+			/* Commands sent after the +BRSF exchange do not depend on each
+			 * other's results, so they are pipelined (unless the pipeline
+			 * mode has been disabled). Responses are dispatched in the order
+			 * in which they were registered with the rfcomm_expect_resp(). */
+			if (conn.handler == NULL &&
+					t->type.profile & BA_TRANSPORT_PROFILE_HFP_HF)
 				switch (conn.state) {
+				case HFP_SLC_BRSF_SET:
+				case HFP_SLC_CIND_TEST:
+				case HFP_SLC_CIND_GET:
+					/* wait for the final result code */
+					rfcomm_expect_resp(&conn, &rfcomm_handler_resp_ok);
+					break;
 				case HFP_DISCONNECTED:
 					sprintf(tmp, "%u", ba_adapter_get_hfp_features_hf(t->d->a));
 					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_CMD_SET, "+BRSF", tmp) == -1)
 						goto ioerror;
-					conn.handler = &rfcomm_handler_brsf_resp;
-					break;
-				case HFP_SLC_BRSF_SET:
-					conn.handler = &rfcomm_handler_resp_ok;
+					rfcomm_expect_resp(&conn, &rfcomm_handler_brsf_resp);
+					rfcomm_expect_resp(&conn, &rfcomm_handler_resp_ok);
 					break;
 				case HFP_SLC_BRSF_SET_OK:
 					if (t->rfcomm.hfp_features & HFP_AG_FEAT_CODEC) {
@@ -645,32 +791,33 @@ void *rfcomm_thread(void *arg) {
 						if (rfcomm_write_at(pfds[1].fd, AT_TYPE_CMD_SET, "+BAC", "1") == -1)
 #endif
 							goto ioerror;
-						conn.handler = &rfcomm_handler_resp_ok;
-						break;
+						rfcomm_expect_resp(&conn, &rfcomm_handler_resp_ok);
+						if (!conn.pipeline)
+							break;
 					}
 					/* fall-through */
 				case HFP_SLC_BAC_SET_OK:
 					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_CMD_TEST, "+CIND", NULL) == -1)
 						goto ioerror;
-					conn.handler = &rfcomm_handler_cind_resp_test;
-					break;
-				case HFP_SLC_CIND_TEST:
-					conn.handler = &rfcomm_handler_resp_ok;
-					break;
+					rfcomm_expect_resp(&conn, &rfcomm_handler_cind_resp_test);
+					rfcomm_expect_resp(&conn, &rfcomm_handler_resp_ok);
+					if (!conn.pipeline)
+						break;
+					/* fall-through */
 				case HFP_SLC_CIND_TEST_OK:
 					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_CMD_GET, "+CIND", NULL) == -1)
 						goto ioerror;
-					conn.handler = &rfcomm_handler_cind_resp_get;
-					break;
-				case HFP_SLC_CIND_GET:
-					conn.handler = &rfcomm_handler_resp_ok;
-					break;
+					rfcomm_expect_resp(&conn, &rfcomm_handler_cind_resp_get);
+					rfcomm_expect_resp(&conn, &rfcomm_handler_resp_ok);
+					if (!conn.pipeline)
+						break;
+					/* fall-through */
 				case HFP_SLC_CIND_GET_OK:
 					/* Activate indicator events reporting. The +CMER specification is
 					 * as follows: AT+CMER=[<mode>[,<keyp>[,<disp>[,<ind>[,<bfr>]]]]] */
 					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_CMD_SET, "+CMER", "3,0,0,1,0") == -1)
 						goto ioerror;
-					conn.handler = &rfcomm_handler_resp_ok;
+					rfcomm_expect_resp(&conn, &rfcomm_handler_resp_ok);
 					break;
 				case HFP_SLC_CMER_SET_OK:
 					rfcomm_set_hfp_state(&conn, HFP_SLC_CONNECTED);
@@ -689,7 +836,8 @@ void *rfcomm_thread(void *arg) {
 							BA_DBUS_TRANSPORT_UPDATE_SAMPLING | BA_DBUS_TRANSPORT_UPDATE_CODEC);
 				}
 
-			if (t->type.profile & BA_TRANSPORT_PROFILE_HFP_AG)
+			if (conn.handler == NULL &&
+					t->type.profile & BA_TRANSPORT_PROFILE_HFP_AG)
 				switch (conn.state) {
 				case HFP_DISCONNECTED:
 				case HFP_SLC_BRSF_SET:
@@ -710,7 +858,7 @@ void *rfcomm_thread(void *arg) {
 						if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, "+BCS", conn.msbc ? "2" : "1") == -1)
 							goto ioerror;
 						t->rfcomm.sco->type.codec = conn.msbc ? HFP_CODEC_MSBC : HFP_CODEC_CVSD;
-						conn.handler = &rfcomm_handler_bcs_set;
+						rfcomm_expect_resp(&conn, &rfcomm_handler_bcs_set);
 						break;
 					}
 #endif
@@ -725,10 +873,8 @@ void *rfcomm_thread(void *arg) {
 							BA_DBUS_TRANSPORT_UPDATE_SAMPLING | BA_DBUS_TRANSPORT_UPDATE_CODEC);
 				}
 
-			if (conn.handler != NULL) {
-				timeout = RFCOMM_SLC_TIMEOUT;
-				conn.retries++;
-			}
+			if (conn.handler != NULL)
+				timeout = rfcomm_resp_timeout(&conn);
 
 		}
 
@@ -736,8 +882,6 @@ void *rfcomm_thread(void *arg) {
 		if (reader.next != NULL)
 			goto read;
 
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-
 		pfds[2].fd = t->rfcomm.handler_fd;
 		switch (poll(pfds, ARRAYSIZE(pfds), timeout)) {
 		case 0:
@@ -750,30 +894,33 @@ void *rfcomm_thread(void *arg) {
 			goto fail;
 		}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
 		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			switch (ba_transport_recv_signal(t)) {
-			case TRANSPORT_SET_VOLUME:
-				if (conn.mic_gain != t->rfcomm.sco->sco.mic_gain) {
-					int gain = conn.mic_gain = t->rfcomm.sco->sco.mic_gain;
-					debug("Setting microphone gain: %d", gain);
-					sprintf(tmp, "+VGM=%d", gain);
-					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, NULL, tmp) == -1)
-						goto ioerror;
-				}
-				if (conn.spk_gain != t->rfcomm.sco->sco.spk_gain) {
-					int gain = conn.spk_gain = t->rfcomm.sco->sco.spk_gain;
-					debug("Setting speaker gain: %d", gain);
-					sprintf(tmp, "+VGS=%d", gain);
-					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, NULL, tmp) == -1)
-						goto ioerror;
+			/* dispatch all incoming events */
+			struct ba_transport_msg msg;
+			while (ba_transport_recv_signal(t, &msg))
+				switch (msg.sig) {
+				case TRANSPORT_SET_VOLUME:
+					/* volume burst is coalesced, so we will get the latest value */
+					if (conn.mic_gain != (int)(msg.arg & 0x7F)) {
+						int gain = conn.mic_gain = msg.arg & 0x7F;
+						debug("Setting microphone gain: %d", gain);
+						sprintf(tmp, "+VGM=%d", gain);
+						if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, NULL, tmp) == -1)
+							goto ioerror;
+					}
+					if (conn.spk_gain != (int)((msg.arg >> 8) & 0x7F)) {
+						int gain = conn.spk_gain = (msg.arg >> 8) & 0x7F;
+						debug("Setting speaker gain: %d", gain);
+						sprintf(tmp, "+VGS=%d", gain);
+						if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, NULL, tmp) == -1)
+							goto ioerror;
+					}
+					break;
+				case TRANSPORT_STOP:
+					goto fail;
+				default:
+					break;
 				}
-				break;
-			default:
-				break;
-			}
 		}
 
 		if (pfds[1].revents & POLLIN) {
@@ -782,6 +929,9 @@ void *rfcomm_thread(void *arg) {
 read:
 			if (rfcomm_read_at(pfds[1].fd, &reader) == -1)
 				switch (errno) {
+				case EAGAIN:
+					/* wait for the rest of the message */
+					continue;
 				case EBADMSG:
 					warn("Invalid AT message: %s", reader.next);
 					reader.next = NULL;
@@ -796,7 +946,7 @@ read:
 					strcmp(conn.handler->command, reader.at.command) == 0) {
 				callback = conn.handler->callback;
 				predefined_callback = true;
-				conn.handler = NULL;
+				rfcomm_next_resp(&conn);
 			}
 			else
 				callback = rfcomm_get_callback(&reader.at);
@@ -871,7 +1021,6 @@ ioerror:
 	}
 
 fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(1);
+	ba_transport_pthread_cleanup(t);
 	return NULL;
 }
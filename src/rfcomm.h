@@ -17,14 +17,17 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "at.h"
 #include "hfp.h"
 
 /* Number of retries during the SLC stage. */
-#define RFCOMM_SLC_RETRIES 10
-/* Timeout for the command acknowledgment. */
+#define RFCOMM_SLC_RETRIES 3
+/* Initial and maximal timeout for the command acknowledgment. */
 #define RFCOMM_SLC_TIMEOUT 1000
+/* Minimal timeout for the command acknowledgment. */
+#define RFCOMM_SLC_TIMEOUT_MIN 200
 
 /**
  * Structure used for RFCOMM state synchronization. */
@@ -36,10 +39,29 @@ struct rfcomm_conn {
 
 	/* handler used for sync response dispatching */
 	const struct rfcomm_handler *handler;
+	/* handlers for responses of pipelined AT commands */
+	const struct rfcomm_handler *handlers[8];
+	size_t handlers_len;
+	/* time of the last progress in the response dispatching */
+	struct timespec handler_ts;
+
+	/* if false, SLC commands are sent one at a time */
+	bool pipeline;
 
 	/* number of failed communication attempts */
 	int retries;
 
+	/* smoothed AT command round-trip time and its variation (ms) */
+	int rtt;
+	int rtt_var;
+	/* current response timeout (ms) */
+	int rto;
+	/* if true, next response will be used as a RTT sample */
+	bool rtt_sample;
+
+	/* time of the connection initialization */
+	struct timespec slc_ts;
+
 	/* 0-based indicators index */
 	enum hfp_ind hfp_ind_map[20];
 
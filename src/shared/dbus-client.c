@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 static int path2ba(const char *path, bdaddr_t *ba) {
@@ -290,7 +291,9 @@ success:
 	return rv;
 }
 
-dbus_bool_t bluealsa_dbus_get_pcm(
+/**
+ * Get PCM by enumerating all PCMs available in the BlueALSA service. */
+static dbus_bool_t bluealsa_dbus_get_pcm_enumerate(
 		struct ba_dbus_ctx *ctx,
 		const bdaddr_t *addr,
 		unsigned int flags,
@@ -320,6 +323,87 @@ final:
 	return rv;
 }
 
+dbus_bool_t bluealsa_dbus_get_pcm(
+		struct ba_dbus_ctx *ctx,
+		const bdaddr_t *addr,
+		unsigned int flags,
+		struct ba_pcm *pcm,
+		DBusError *error) {
+
+	const char *profile = NULL;
+	if (flags & BA_PCM_FLAG_PROFILE_A2DP)
+		profile = "a2dp";
+	else if (flags & BA_PCM_FLAG_PROFILE_SCO)
+		profile = "sco";
+
+	const char *mode = NULL;
+	if (flags & BA_PCM_FLAG_SOURCE)
+		mode = "source";
+	else if (flags & BA_PCM_FLAG_SINK)
+		mode = "sink";
+
+	/* The direct lookup requires both, the profile and the operation
+	 * mode. Otherwise, we have to check all available PCMs. */
+	if (profile == NULL || mode == NULL)
+		return bluealsa_dbus_get_pcm_enumerate(ctx, addr, flags, pcm, error);
+
+	char address[18];
+	const char *address_ = address;
+	ba2str(addr, address);
+
+	DBusMessage *msg;
+	if ((msg = dbus_message_new_method_call(ctx->ba_service, "/org/bluealsa",
+					BLUEALSA_INTERFACE_MANAGER, "GetPCM")) == NULL) {
+		dbus_set_error(error, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	if (!dbus_message_append_args(msg,
+				DBUS_TYPE_STRING, &address_,
+				DBUS_TYPE_STRING, &profile,
+				DBUS_TYPE_STRING, &mode,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error(error, DBUS_ERROR_NO_MEMORY, NULL);
+		dbus_message_unref(msg);
+		return FALSE;
+	}
+
+	DBusError err = DBUS_ERROR_INIT;
+	dbus_bool_t rv = FALSE;
+
+	DBusMessage *rep;
+	if ((rep = dbus_connection_send_with_reply_and_block(ctx->conn,
+					msg, DBUS_TIMEOUT_USE_DEFAULT, &err)) == NULL) {
+		dbus_message_unref(msg);
+		/* fall-back for BlueALSA service without direct PCM lookup */
+		if (dbus_error_has_name(&err, DBUS_ERROR_UNKNOWN_METHOD)) {
+			dbus_error_free(&err);
+			return bluealsa_dbus_get_pcm_enumerate(ctx, addr, flags, pcm, error);
+		}
+		dbus_move_error(&err, error);
+		return FALSE;
+	}
+
+	DBusMessageIter iter;
+	if (!dbus_message_iter_init(rep, &iter)) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE, "Empty response message");
+		goto final;
+	}
+
+	if (!bluealsa_dbus_message_iter_get_pcm(&iter, &err, pcm)) {
+		dbus_set_error(error, err.name, "Get PCM: %s", err.message);
+		dbus_error_free(&err);
+		goto final;
+	}
+
+	rv = TRUE;
+
+final:
+	dbus_message_unref(rep);
+	dbus_message_unref(msg);
+	return rv;
+}
+
 dbus_bool_t bluealsa_dbus_pcm_open(
 		struct ba_dbus_ctx *ctx,
 		const char *pcm_path,
@@ -395,29 +479,74 @@ dbus_bool_t bluealsa_dbus_rfcomm_open(
 	return rv;
 }
 
+/**
+ * Discard stale replies on the PCM controller socket.
+ *
+ * If the wait for the reply has timed out, the reply might arrive later.
+ * Such a reply has to be discarded before sending the next command, so it
+ * will not be taken as the reply for that command. */
+static void bluealsa_dbus_pcm_ctrl_flush(int fd_pcm_ctrl) {
+	char buffer[32];
+	while (recv(fd_pcm_ctrl, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+		continue;
+}
+
+/**
+ * Wait for the reply on the PCM controller socket.
+ *
+ * PCM controller socket is created in the non-blocking mode, so we have to
+ * poll for reading by ourself. In order not to hang forever in case when the
+ * server stalls, the wait is bounded by the given timeout. */
+static dbus_bool_t bluealsa_dbus_pcm_ctrl_wait(
+		int fd_pcm_ctrl,
+		int timeout,
+		DBusError *error) {
+
+	struct pollfd pfd = { fd_pcm_ctrl, POLLIN, 0 };
+	int rv;
+
+	while ((rv = poll(&pfd, 1, timeout)) == -1 && errno == EINTR)
+		continue;
+
+	if (rv == -1) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "Poll: %s", strerror(errno));
+		return FALSE;
+	}
+	if (rv == 0) {
+		dbus_set_error(error, DBUS_ERROR_TIMEOUT, "Timeout");
+		errno = ETIMEDOUT;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 dbus_bool_t bluealsa_dbus_pcm_ctrl_send(
 		int fd_pcm_ctrl,
 		const char *command,
 		DBusError *error) {
 
+	bluealsa_dbus_pcm_ctrl_flush(fd_pcm_ctrl);
+
 	ssize_t len = strlen(command);
 	if (write(fd_pcm_ctrl, command, len) == -1) {
 		dbus_set_error(error, DBUS_ERROR_FAILED, "Write: %s", strerror(errno));
 		return FALSE;
 	}
 
-	/* PCM controller socket is created in the non-blocking
-	 * mode, so we have to poll for reading by ourself. */
-	struct pollfd pfd = { fd_pcm_ctrl, POLLIN, 0 };
-	poll(&pfd, 1, -1);
+	/* The reply for the drain is sent when the playback has been drained,
+	 * which might take arbitrary long time, so do not time out this one. */
+	const int timeout = strcmp(command, "Drain") == 0 ? -1 : BA_PCM_CTRL_TIMEOUT;
+	if (!bluealsa_dbus_pcm_ctrl_wait(fd_pcm_ctrl, timeout, error))
+		return FALSE;
 
-	char rep[32];
-	if ((len = read(fd_pcm_ctrl, rep, sizeof(rep))) == -1) {
+	char rep[32] = { 0 };
+	if ((len = read(fd_pcm_ctrl, rep, sizeof(rep) - 1)) == -1) {
 		dbus_set_error(error, DBUS_ERROR_FAILED, "Read: %s", strerror(errno));
 		return FALSE;
 	}
 
-	if (strncmp(rep, "OK", len) != 0) {
+	if (len != 2 || strncmp(rep, "OK", 2) != 0) {
 		dbus_set_error(error, DBUS_ERROR_FAILED, "Response: %s", rep);
 		errno = ENOMSG;
 		return FALSE;
@@ -426,6 +555,58 @@ dbus_bool_t bluealsa_dbus_pcm_ctrl_send(
 	return TRUE;
 }
 
+/**
+ * Get PCM position shared memory.
+ *
+ * @param fd_pcm_ctrl PCM controller socket.
+ * @param fd_pos Address where the shared memory file descriptor will be
+ *   stored. The memory contains the ba_pcm_pos structure.
+ * @param error D-Bus error structure.
+ * @return Upon success this function returns TRUE. */
+dbus_bool_t bluealsa_dbus_pcm_ctrl_get_pos(
+		int fd_pcm_ctrl,
+		int *fd_pos,
+		DBusError *error) {
+
+	bluealsa_dbus_pcm_ctrl_flush(fd_pcm_ctrl);
+
+	static const char *command = "Position";
+	if (write(fd_pcm_ctrl, command, strlen(command)) == -1) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "Write: %s", strerror(errno));
+		return FALSE;
+	}
+
+	if (!bluealsa_dbus_pcm_ctrl_wait(fd_pcm_ctrl, BA_PCM_CTRL_TIMEOUT, error))
+		return FALSE;
+
+	char rep[32] = { 0 };
+	char buffer[CMSG_SPACE(sizeof(int))];
+	struct iovec io = { .iov_base = rep, .iov_len = sizeof(rep) - 1 };
+	struct msghdr msg = {
+		.msg_iov = &io,
+		.msg_iovlen = 1,
+		.msg_control = buffer,
+		.msg_controllen = sizeof(buffer),
+	};
+
+	ssize_t len;
+	if ((len = recvmsg(fd_pcm_ctrl, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "Read: %s", strerror(errno));
+		return FALSE;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (len != 2 || strncmp(rep, "OK", 2) != 0 || cmsg == NULL ||
+			cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		dbus_set_error(error, DBUS_ERROR_NOT_SUPPORTED, "Response: %s", rep);
+		errno = ENOTSUP;
+		return FALSE;
+	}
+
+	memcpy(fd_pos, CMSG_DATA(cmsg), sizeof(*fd_pos));
+	return TRUE;
+}
+
 /**
  * Call the given function for each key/value pairs. */
 dbus_bool_t bluealsa_dbus_message_iter_dict(
@@ -488,6 +669,7 @@ dbus_bool_t bluealsa_dbus_message_iter_get_pcm(
 		goto fail;
 
 	memset(pcm, 0, sizeof(*pcm));
+	pcm->battery_level = -1;
 
 	dbus_message_iter_get_basic(iter, &path);
 	strncpy(pcm->pcm_path, path, sizeof(pcm->pcm_path) - 1);
@@ -578,6 +760,13 @@ static dbus_bool_t bluealsa_dbus_message_iter_get_pcm_props_cb(const char *key,
 			goto fail;
 		dbus_message_iter_get_basic(variant, &pcm->volume.raw);
 	}
+	else if (strcmp(key, "Battery") == 0) {
+		unsigned char battery_level;
+		if (type != (type_expected = DBUS_TYPE_BYTE))
+			goto fail;
+		dbus_message_iter_get_basic(variant, &battery_level);
+		pcm->battery_level = (signed char)battery_level;
+	}
 
 	return TRUE;
 
@@ -62,6 +62,8 @@ struct ba_pcm {
 	dbus_uint16_t delay;
 	/* feature flags */
 	unsigned int flags;
+	/* device battery level (-1 if not available) */
+	int battery_level;
 
 	/* 16-bit packed PCM volume */
 	union {
@@ -132,6 +134,12 @@ dbus_bool_t bluealsa_dbus_rfcomm_open(
 		int *fd_rfcomm,
 		DBusError *error);
 
+/**
+ * Timeout (in milliseconds) for the reply on the PCM controller socket. Note,
+ * that the reply for the "Drain" command is sent when the playback has been
+ * drained, so the wait for that reply is not bounded. */
+#define BA_PCM_CTRL_TIMEOUT 5000
+
 dbus_bool_t bluealsa_dbus_pcm_ctrl_send(
 		int fd_pcm_ctrl,
 		const char *command,
@@ -149,6 +157,11 @@ dbus_bool_t bluealsa_dbus_pcm_ctrl_send(
 #define bluealsa_dbus_pcm_ctrl_send_resume(fd, err) \
 	bluealsa_dbus_pcm_ctrl_send(fd, "Resume", err)
 
+dbus_bool_t bluealsa_dbus_pcm_ctrl_get_pos(
+		int fd_pcm_ctrl,
+		int *fd_pos,
+		DBusError *error);
+
 dbus_bool_t bluealsa_dbus_message_iter_dict(
 		DBusMessageIter *iter,
 		DBusError *error,
@@ -0,0 +1,94 @@
+/*
+ * BlueALSA - pcm-pos.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_SHARED_PCMPOS_H_
+#define BLUEALSA_SHARED_PCMPOS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * PCM position published by the server via the shared memory.
+ *
+ * The server updates this structure every time it transfers PCM frames from
+ * or to the PCM FIFO. Since the client reads it without any locking, access
+ * is guarded by the sequence counter: it is incremented before and after
+ * every update, so an odd value indicates that the update is in progress.
+ * There shall be only one writer - the transport IO thread.
+ *
+ * This structure is shared between processes which might have been built
+ * with different time_t sizes (e.g. 32-bit ALSA client with 64-bit server),
+ * so it is composed of fixed-width fields only. */
+struct ba_pcm_pos {
+	/* update sequence counter */
+	uint32_t seq;
+	/* frames which are not audible yet - queued in the encoder or in
+	 * the BT socket; this part decays as the time goes by */
+	uint32_t delay;
+	/* constant delay in frames, e.g. the one reported by the device */
+	uint32_t delay_fixed;
+	uint32_t reserved;
+	/* frames transferred via the PCM FIFO since the PCM was opened */
+	uint64_t frames;
+	/* time-stamp (CLOCK_MONOTONIC) of the last update */
+	int64_t ts_sec;
+	int64_t ts_nsec;
+};
+
+/**
+ * Publish new PCM position.
+ *
+ * @param pos Address of the shared PCM position structure.
+ * @param frames Number of frames transferred via the PCM FIFO.
+ * @param delay Number of transferred frames which are not audible yet.
+ * @param delay_fixed Constant delay in frames. */
+#define ba_pcm_pos_update(pos, frames_, delay_, delay_fixed_) do { \
+		struct timespec ts_; \
+		clock_gettime(CLOCK_MONOTONIC, &ts_); \
+		__atomic_store_n(&(pos)->seq, (pos)->seq + 1, __ATOMIC_RELAXED); \
+		__atomic_thread_fence(__ATOMIC_RELEASE); \
+		(pos)->frames = frames_; \
+		(pos)->delay = delay_; \
+		(pos)->delay_fixed = delay_fixed_; \
+		(pos)->ts_sec = ts_.tv_sec; \
+		(pos)->ts_nsec = ts_.tv_nsec; \
+		__atomic_store_n(&(pos)->seq, (pos)->seq + 1, __ATOMIC_RELEASE); \
+	} while (0)
+
+/**
+ * Maximal number of attempts to get consistent PCM position snapshot. */
+#define BA_PCM_POS_READ_RETRIES 1000
+
+/**
+ * Get consistent snapshot of the PCM position.
+ *
+ * The number of attempts is limited, because the server might have died
+ * in the middle of the update, in which case the sequence counter will
+ * never become even again.
+ *
+ * @param pos Address of the shared PCM position structure.
+ * @param snapshot Address where the snapshot will be stored.
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+static inline int ba_pcm_pos_read(const struct ba_pcm_pos *pos,
+		struct ba_pcm_pos *snapshot) {
+	unsigned int i;
+	for (i = 0; i < BA_PCM_POS_READ_RETRIES; i++) {
+		const uint32_t seq = __atomic_load_n(&pos->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		*snapshot = *pos;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&pos->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -1;
+}
+
+#endif
@@ -10,8 +10,106 @@
 
 #include "shared/rt.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 
+static int rt_clock_monotonic_gettime(struct timespec *ts) {
+	return gettimestamp(ts);
+}
+
+static int rt_clock_monotonic_sleep(const struct timespec *ts) {
+	return nanosleep(ts, NULL);
+}
+
+/**
+ * System monotonic clock source. */
+const struct rt_clock rt_clock_monotonic = {
+	.gettime = rt_clock_monotonic_gettime,
+	.sleep = rt_clock_monotonic_sleep,
+};
+
+/* current time-stamp of the virtual clock */
+static pthread_mutex_t rt_vclock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec rt_vclock_ts = { 0 };
+
+static int rt_clock_virtual_gettime(struct timespec *ts) {
+	pthread_mutex_lock(&rt_vclock_mutex);
+	*ts = rt_vclock_ts;
+	pthread_mutex_unlock(&rt_vclock_mutex);
+	return 0;
+}
+
+static int rt_clock_virtual_sleep(const struct timespec *ts) {
+	rt_clock_virtual_advance(ts);
+	return 0;
+}
+
+/**
+ * Deterministic virtual clock source.
+ *
+ * The time of this clock moves forward only when one calls the sleep
+ * callback or the rt_clock_virtual_advance() function. Hence, the time
+ * synchronization based on this clock will never block. */
+const struct rt_clock rt_clock_virtual = {
+	.gettime = rt_clock_virtual_gettime,
+	.sleep = rt_clock_virtual_sleep,
+};
+
+/* clock source used by the time synchronization */
+static const struct rt_clock *rt_clock = &rt_clock_monotonic;
+
+/**
+ * Set clock source for the time synchronization.
+ *
+ * Note:
+ * This function is not thread-safe. The clock source should be set before
+ * any time synchronization has been initialized.
+ *
+ * @param clock Address of the clock source structure. If NULL is given,
+ *   the system monotonic clock will be used. */
+void rt_clock_set(const struct rt_clock *clock) {
+	rt_clock = clock != NULL ? clock : &rt_clock_monotonic;
+}
+
+/**
+ * Get clock source used for the time synchronization. */
+const struct rt_clock *rt_clock_get(void) {
+	return rt_clock;
+}
+
+/**
+ * Get time-stamp from the selected clock source.
+ *
+ * @param ts Address to the timespec structure where the time-stamp will
+ *   be stored.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int rt_clock_gettime(struct timespec *ts) {
+	return rt_clock->gettime(ts);
+}
+
+/**
+ * Reset the virtual clock to the zero time point. */
+void rt_clock_virtual_reset(void) {
+	pthread_mutex_lock(&rt_vclock_mutex);
+	rt_vclock_ts.tv_sec = 0;
+	rt_vclock_ts.tv_nsec = 0;
+	pthread_mutex_unlock(&rt_vclock_mutex);
+}
+
+/**
+ * Advance the virtual clock by the given time interval.
+ *
+ * @param ts Address to the timespec structure with the time interval. */
+void rt_clock_virtual_advance(const struct timespec *ts) {
+	pthread_mutex_lock(&rt_vclock_mutex);
+	rt_vclock_ts.tv_sec += ts->tv_sec;
+	rt_vclock_ts.tv_nsec += ts->tv_nsec;
+	rt_vclock_ts.tv_sec += rt_vclock_ts.tv_nsec / 1000000000;
+	rt_vclock_ts.tv_nsec %= 1000000000;
+	pthread_mutex_unlock(&rt_vclock_mutex);
+}
+
 
 /**
  * Synchronize time with the sampling rate.
@@ -30,10 +128,32 @@
  *   set to indicate the error. */
 int asrsync_sync(struct asrsync *asrs, unsigned int frames) {
 
+	int rv;
+
+	if ((rv = asrsync_update(asrs, frames)) == 1)
+		rt_clock->sleep(&asrs->ts_idle);
+
+	rt_clock->gettime(&asrs->ts);
+	return rv;
+}
+
+/**
+ * Update time synchronization without blocking.
+ *
+ * This function does the same calculations as the asrsync_sync(), but it
+ * is up to the caller to wait for the time stored in the ts_idle. Before
+ * calling this function again, the caller shall update the ts time-stamp
+ * with the time at which the wait has finished.
+ *
+ * @param asrs Pointer to the time synchronization structure.
+ * @param frames Number of frames since the last call to this function.
+ * @return This function returns 1 if the caller shall wait for the time
+ *   stored in the ts_idle, otherwise 0 is returned. */
+int asrsync_update(struct asrsync *asrs, unsigned int frames) {
+
 	const unsigned int rate = asrs->rate;
 	struct timespec ts_rate;
 	struct timespec ts;
-	int rv = 0;
 
 	asrs->frames += frames;
 	frames = asrs->frames;
@@ -41,19 +161,13 @@ int asrsync_sync(struct asrsync *asrs, unsigned int frames) {
 	ts_rate.tv_sec = frames / rate;
 	ts_rate.tv_nsec = 1000000000 / rate * (frames % rate);
 
-	gettimestamp(&ts);
+	rt_clock->gettime(&ts);
 	/* calculate delay since the last sync */
 	difftimespec(&asrs->ts, &ts, &asrs->ts_busy);
 
 	/* maintain constant rate */
 	difftimespec(&asrs->ts0, &ts, &ts);
-	if (difftimespec(&ts, &ts_rate, &asrs->ts_idle) > 0) {
-		nanosleep(&asrs->ts_idle, NULL);
-		rv = 1;
-	}
-
-	gettimestamp(&asrs->ts);
-	return rv;
+	return difftimespec(&ts, &ts_rate, &asrs->ts_idle) > 0 ? 1 : 0;
 }
 
 /**
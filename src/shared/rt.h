@@ -15,6 +15,29 @@
 #include <sys/time.h>
 #include <time.h>
 
+/**
+ * Clock source used for time synchronization.
+ *
+ * By default, the time synchronization uses system monotonic clock. However,
+ * for the testing purposes it might be useful to replace it with a virtual
+ * clock, which does not sleep but instead advances its internal time. */
+struct rt_clock {
+	/* get current time-stamp */
+	int (*gettime)(struct timespec *ts);
+	/* suspend execution for a given time interval */
+	int (*sleep)(const struct timespec *ts);
+};
+
+extern const struct rt_clock rt_clock_monotonic;
+extern const struct rt_clock rt_clock_virtual;
+
+void rt_clock_set(const struct rt_clock *clock);
+const struct rt_clock *rt_clock_get(void);
+int rt_clock_gettime(struct timespec *ts);
+
+void rt_clock_virtual_reset(void);
+void rt_clock_virtual_advance(const struct timespec *ts);
+
 /**
  * Structure used for time synchronization.
  *
@@ -50,12 +73,13 @@ struct asrsync {
  * @param sr Synchronization sampling rate. */
 #define asrsync_init(asrs, sr) do { \
 		(asrs)->rate = sr; \
-		gettimestamp(&(asrs)->ts0); \
+		rt_clock_gettime(&(asrs)->ts0); \
 		(asrs)->ts = (asrs)->ts0; \
 		(asrs)->frames = 0; \
 	} while (0)
 
 int asrsync_sync(struct asrsync *asrs, unsigned int frames);
+int asrsync_update(struct asrsync *asrs, unsigned int frames);
 
 /**
  * Get the number of microseconds spent outside of the sync function. */
@@ -0,0 +1,342 @@
+/*
+ * BlueALSA - storage.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "storage.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <glib.h>
+
+#include "ba-device.h"
+#include "hfp.h"
+#include "shared/log.h"
+
+/**
+ * Persistent storage of the per-device negotiation results.
+ *
+ * Every device has its own key file named after its Bluetooth address.
+ * Files are loaded on first use and kept in memory until the storage is
+ * destroyed. If the storage has not been initialized, all operations are
+ * no-op.
+ *
+ * Loading and saving is synchronous, so the caller (usually the main loop)
+ * is blocked for the time of the file IO. Files are small, though. However,
+ * the file IO is done without the storage mutex held, so other threads are
+ * not blocked by the disk. The mutex guards in-memory key files only. */
+static struct {
+	pthread_mutex_t mutex;
+	/* serialize writing files to the disk */
+	pthread_mutex_t write_mutex;
+	char *root;
+	/* device address -> GKeyFile */
+	GHashTable *files;
+} storage = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.write_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Initialize persistent storage.
+ *
+ * @param root Path to the directory where files will be stored. If this
+ *   directory does not exist, it will be created.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int storage_init(const char *root) {
+
+	if (g_mkdir_with_parents(root, 0755) == -1)
+		return -1;
+
+	pthread_mutex_lock(&storage.mutex);
+	g_free(storage.root);
+	storage.root = g_strdup(root);
+	if (storage.files == NULL)
+		storage.files = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, (GDestroyNotify)g_key_file_free);
+	pthread_mutex_unlock(&storage.mutex);
+
+	return 0;
+}
+
+/**
+ * Release resources allocated by the storage. */
+void storage_destroy(void) {
+	pthread_mutex_lock(&storage.mutex);
+	if (storage.files != NULL)
+		g_hash_table_destroy(storage.files);
+	storage.files = NULL;
+	g_free(storage.root);
+	storage.root = NULL;
+	pthread_mutex_unlock(&storage.mutex);
+}
+
+/**
+ * Get key file for the given device.
+ *
+ * This function shall be called with the storage mutex locked. However, if
+ * the key file has to be loaded from the disk, the mutex is released for
+ * the time of the file IO.
+ *
+ * @return This function returns the key file or NULL if the storage has
+ *   been destroyed in the meantime. */
+static GKeyFile *storage_lookup(const struct ba_device *d) {
+
+	char path[PATH_MAX];
+	char addr[18];
+	GKeyFile *kf, *tmp;
+
+	ba2str(&d->addr, addr);
+
+	if ((kf = g_hash_table_lookup(storage.files, addr)) != NULL)
+		return kf;
+
+	snprintf(path, sizeof(path), "%s/%s", storage.root, addr);
+	pthread_mutex_unlock(&storage.mutex);
+
+	GError *err = NULL;
+	kf = g_key_file_new();
+	if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, &err)) {
+		if (err->code != G_FILE_ERROR_NOENT)
+			warn("Couldn't load storage: %s", err->message);
+		g_error_free(err);
+	}
+
+	pthread_mutex_lock(&storage.mutex);
+
+	if (storage.files == NULL) {
+		g_key_file_free(kf);
+		return NULL;
+	}
+
+	/* someone else might have loaded it in the meantime */
+	if ((tmp = g_hash_table_lookup(storage.files, addr)) != NULL) {
+		g_key_file_free(kf);
+		return tmp;
+	}
+
+	g_hash_table_insert(storage.files, g_strdup(addr), kf);
+	return kf;
+}
+
+/**
+ * Write key file of the given device to the disk.
+ *
+ * The key file is serialized with the writing mutex held, so the content
+ * written by the last call reflects all modifications done before it. */
+static int storage_write(const struct ba_device *d) {
+
+	char path[PATH_MAX];
+	char addr[18];
+	GError *err = NULL;
+	GKeyFile *kf;
+	char *data = NULL;
+	gsize size = 0;
+	int ret = 0;
+
+	ba2str(&d->addr, addr);
+
+	pthread_mutex_lock(&storage.write_mutex);
+
+	pthread_mutex_lock(&storage.mutex);
+	if (storage.files != NULL &&
+			(kf = g_hash_table_lookup(storage.files, addr)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", storage.root, addr);
+		data = g_key_file_to_data(kf, &size, NULL);
+	}
+	pthread_mutex_unlock(&storage.mutex);
+
+	if (data != NULL &&
+			!g_file_set_contents(path, data, size, &err)) {
+		error("Couldn't save storage: %s", err->message);
+		g_error_free(err);
+		errno = EIO;
+		ret = -1;
+	}
+
+	pthread_mutex_unlock(&storage.write_mutex);
+
+	g_free(data);
+	return ret;
+}
+
+/**
+ * Convert binary data into the hex-string. */
+static char *storage_bin2hex(const uint8_t *data, size_t size) {
+	char *hex = g_malloc(size * 2 + 1);
+	size_t i;
+	for (i = 0; i < size; i++)
+		sprintf(&hex[i * 2], "%02x", data[i]);
+	hex[size * 2] = '\0';
+	return hex;
+}
+
+/**
+ * Get unsigned integer from the key file.
+ *
+ * @return This function returns true if the key exists and its value is
+ *   not negative. */
+static bool storage_get_uint(GKeyFile *kf, const char *group, const char *key,
+		unsigned int *value) {
+	GError *err = NULL;
+	int tmp = g_key_file_get_integer(kf, group, key, &err);
+	if (err != NULL) {
+		g_error_free(err);
+		return false;
+	}
+	/* treat negative value as a corrupted entry */
+	if (tmp < 0)
+		return false;
+	*value = tmp;
+	return true;
+}
+
+/**
+ * Load negotiation results for the transport.
+ *
+ * This function shall be called before the transport IO thread is created,
+ * so the stored values will be used as the initial ones.
+ *
+ * @param t Transport for which data shall be loaded.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int storage_transport_load(struct ba_transport *t) {
+
+	struct ba_device *d = t->d;
+	unsigned int value;
+	GKeyFile *kf;
+
+	pthread_mutex_lock(&storage.mutex);
+
+	if (storage.root == NULL ||
+			(kf = storage_lookup(d)) == NULL) {
+		pthread_mutex_unlock(&storage.mutex);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (storage_get_uint(kf, "Device", "Quirks", &value))
+		atomic_fetch_or(&d->quirks, value);
+
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP) {
+
+		gsize size = 0;
+		int *volume;
+
+		if ((volume = g_key_file_get_integer_list(kf, "A2DP", "Volume", &size, NULL)) != NULL) {
+			/* ignore out of range (corrupted) values */
+			if (size == 2 &&
+					volume[0] >= 0 && volume[0] <= 127 &&
+					volume[1] >= 0 && volume[1] <= 127) {
+				t->a2dp.ch1_volume = volume[0];
+				t->a2dp.ch2_volume = volume[1];
+			}
+			g_free(volume);
+		}
+
+		/* prime delay reported to clients with the last measured value */
+		if (storage_get_uint(kf, "A2DP", "Delay", &value))
+			t->delay = value;
+
+		char *hex;
+		if ((hex = g_key_file_get_string(kf, "A2DP", "Configuration", NULL)) != NULL) {
+			char *cconfig = storage_bin2hex(t->a2dp.cconfig, t->a2dp.cconfig_size);
+			if (storage_get_uint(kf, "A2DP", "Codec", &value) &&
+					(value != t->type.codec || strcmp(hex, cconfig) != 0))
+				debug("A2DP configuration changed: %s -> %s", hex, cconfig);
+			g_free(cconfig);
+			g_free(hex);
+		}
+
+	}
+
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_SCO) {
+
+		if (storage_get_uint(kf, "SCO", "SpeakerGain", &value) && value <= 15)
+			t->sco.spk_gain = value;
+		if (storage_get_uint(kf, "SCO", "MicrophoneGain", &value) && value <= 15)
+			t->sco.mic_gain = value;
+
+		/* Use the last selected codec until the codec negotiation is done,
+		 * so clients will see correct sampling rate from the very start. */
+		if (storage_get_uint(kf, "SCO", "Codec", &value) &&
+				t->type.codec == HFP_CODEC_UNDEFINED) {
+#if ENABLE_MSBC
+			if (value == HFP_CODEC_MSBC && BA_TEST_ESCO_SUPPORT(d->a))
+				t->type.codec = HFP_CODEC_MSBC;
+			else
+#endif
+			if (value == HFP_CODEC_CVSD)
+				t->type.codec = HFP_CODEC_CVSD;
+		}
+
+	}
+
+	pthread_mutex_unlock(&storage.mutex);
+	return 0;
+}
+
+/**
+ * Save negotiation results of the transport.
+ *
+ * @param t Transport for which data shall be saved.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int storage_transport_save(const struct ba_transport *t) {
+
+	struct ba_device *d = t->d;
+	GKeyFile *kf;
+
+	pthread_mutex_lock(&storage.mutex);
+
+	if (storage.root == NULL ||
+			(kf = storage_lookup(d)) == NULL) {
+		pthread_mutex_unlock(&storage.mutex);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	g_key_file_set_integer(kf, "Device", "Quirks", atomic_load(&d->quirks));
+	if (d->a2dp_audio_time != 0)
+		g_key_file_set_integer(kf, "Device", "A2DPAudioTime", d->a2dp_audio_time);
+	if (d->hfp_slc_time != 0)
+		g_key_file_set_integer(kf, "Device", "HFPConnectionTime", d->hfp_slc_time);
+
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP) {
+
+		const int volume[] = { t->a2dp.ch1_volume, t->a2dp.ch2_volume };
+		char *cconfig = storage_bin2hex(t->a2dp.cconfig, t->a2dp.cconfig_size);
+
+		g_key_file_set_integer(kf, "A2DP", "Codec", t->type.codec);
+		g_key_file_set_string(kf, "A2DP", "Configuration", cconfig);
+		g_key_file_set_integer_list(kf, "A2DP", "Volume", (int *)volume, 2);
+		if (t->delay != 0)
+			g_key_file_set_integer(kf, "A2DP", "Delay", t->delay);
+
+		g_free(cconfig);
+
+	}
+
+	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_SCO) {
+		if (t->type.codec != HFP_CODEC_UNDEFINED)
+			g_key_file_set_integer(kf, "SCO", "Codec", t->type.codec);
+		g_key_file_set_integer(kf, "SCO", "SpeakerGain", t->sco.spk_gain);
+		g_key_file_set_integer(kf, "SCO", "MicrophoneGain", t->sco.mic_gain);
+	}
+
+	pthread_mutex_unlock(&storage.mutex);
+
+	return storage_write(d);
+}
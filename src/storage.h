@@ -0,0 +1,26 @@
+/*
+ * BlueALSA - storage.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_STORAGE_H_
+#define BLUEALSA_STORAGE_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "ba-transport.h"
+
+int storage_init(const char *root);
+void storage_destroy(void);
+
+int storage_transport_load(struct ba_transport *t);
+int storage_transport_save(const struct ba_transport *t);
+
+#endif
@@ -22,6 +22,10 @@
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/sco.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+# include <arm_neon.h>
+#endif
+
 #if ENABLE_LDAC
 # include "ldacBT.h"
 #endif
@@ -415,6 +419,38 @@ void snd_pcm_scale_s16le(int16_t *buffer, size_t size, int channels,
 	}
 }
 
+/**
+ * Split stereo PCM signal into two widened channel buffers.
+ *
+ * On ARM with NEON support, eight frames are processed at once. Otherwise,
+ * the loop is simple enough to be vectorized by the compiler.
+ *
+ * @param buffer Address to the buffer with the interleaved PCM signal.
+ * @param frames The number of PCM frames in the buffer.
+ * @param ch1 Address to the buffer for the 1st channel.
+ * @param ch2 Address to the buffer for the 2nd channel. */
+void snd_pcm_deinterleave_s16le_s32(const int16_t *restrict buffer, size_t frames,
+		int32_t *restrict ch1, int32_t *restrict ch2) {
+
+	size_t i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (; i + 8 <= frames; i += 8) {
+		const int16x8x2_t v = vld2q_s16(&buffer[i * 2]);
+		vst1q_s32(&ch1[i], vmovl_s16(vget_low_s16(v.val[0])));
+		vst1q_s32(&ch1[i + 4], vmovl_s16(vget_high_s16(v.val[0])));
+		vst1q_s32(&ch2[i], vmovl_s16(vget_low_s16(v.val[1])));
+		vst1q_s32(&ch2[i + 4], vmovl_s16(vget_high_s16(v.val[1])));
+	}
+#endif
+
+	for (; i < frames; i++) {
+		ch1[i] = buffer[i * 2];
+		ch2[i] = buffer[i * 2 + 1];
+	}
+
+}
+
 /**
  * Convert Bluetooth A2DP codec into a human-readable string.
  *
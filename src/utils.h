@@ -48,6 +48,8 @@ char *g_variant_sanitize_object_path(char *path);
 
 void snd_pcm_scale_s16le(int16_t *buffer, size_t size, int channels,
 		double ch1_scale, double ch2_scale);
+void snd_pcm_deinterleave_s16le_s32(const int16_t *restrict buffer, size_t frames,
+		int32_t *restrict ch1, int32_t *restrict ch2);
 
 const char *bluetooth_a2dp_codec_to_string(uint16_t codec);
 const char *ba_transport_type_to_string(struct ba_transport_type type);
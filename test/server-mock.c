@@ -28,16 +28,20 @@
 #include "../src/bluealsa.c"
 #include "../src/bluealsa-dbus.c"
 #include "../src/bluealsa-iface.c"
+#include "../src/a2dp-policy.c"
 #include "../src/at.c"
 #include "../src/ba-adapter.c"
 #include "../src/ba-device.c"
 #include "../src/ba-transport.c"
+#include "../src/codec-lib.c"
 #include "../src/io.h"
-#define io_thread_a2dp_sink_sbc _io_thread_a2dp_sink_sbc
+#define io_thread_a2dp_sink _io_thread_a2dp_sink
 #include "../src/io.c"
-#undef io_thread_a2dp_sink_sbc
+#undef io_thread_a2dp_sink
 #include "../src/msbc.c"
+#include "../src/rcu.c"
 #include "../src/rfcomm.c"
+#include "../src/storage.c"
 #include "../src/utils.c"
 #include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
@@ -129,15 +133,14 @@ struct ba_transport *test_transport_new_sco(struct ba_device *d,
 	return t;
 }
 
-void *io_thread_a2dp_sink_sbc(void *arg) {
+void *io_thread_a2dp_sink(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
-	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pthread_cleanup), t);
 
 	struct asrsync asrs = { .frames = 0 };
 	int16_t buffer[1024 * 2];
 	int x = 0;
 
-	while (sigusr1_count == 0) {
+	while (sigusr1_count == 0 && !ba_transport_pthread_stopping(t)) {
 
 		if (t->a2dp.pcm.fd == -1) {
 			usleep(10000);
@@ -152,13 +155,14 @@ void *io_thread_a2dp_sink_sbc(void *arg) {
 		int samples = sizeof(buffer) / sizeof(int16_t);
 		x = snd_pcm_sine_s16le(buffer, samples, 2, x, 0.01);
 
-		if (io_thread_write_pcm(&t->a2dp.pcm, buffer, samples) == -1)
+		if (io_thread_write_pcm(t, &t->a2dp.pcm, buffer, samples) == -1 &&
+				errno != ECANCELED)
 			error("FIFO write error: %s", strerror(errno));
 
 		asrsync_sync(&asrs, samples / 2);
 	}
 
-	pthread_cleanup_pop(1);
+	ba_transport_pthread_cleanup(t);
 	return NULL;
 }
 
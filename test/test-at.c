@@ -8,11 +8,20 @@
  *
  */
 
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include <check.h>
 
 #include "../src/at.c"
 #include "../src/shared/log.c"
 
+static unsigned int benchmark = 0;
+
 START_TEST(test_at_build) {
 
 	char buffer[256];
@@ -123,6 +132,89 @@ START_TEST(test_at_parse_multiple_cmds) {
 	ck_assert_str_eq(at.value, "OK");
 } END_TEST
 
+START_TEST(test_at_tokenize) {
+
+	struct bt_at at;
+	char buffer[] = "\r\n+CIEV:2,1\r\n\r\nOK\r\n";
+	char *next;
+
+	/* tokenize response without copying it */
+	ck_assert_ptr_eq(next = at_tokenize(buffer, &at), &buffer[13]);
+	ck_assert_int_eq(at.type, AT_TYPE_RESP);
+	ck_assert_ptr_eq(at.command, &buffer[2]);
+	ck_assert_str_eq(at.command, "+CIEV");
+	ck_assert_ptr_eq(at.value, &buffer[8]);
+	ck_assert_str_eq(at.value, "2,1");
+
+	ck_assert_ptr_eq(next = at_tokenize(next, &at), &buffer[sizeof(buffer) - 1]);
+	ck_assert_str_eq(at.command, "");
+	ck_assert_str_eq(at.value, "OK");
+
+} END_TEST
+
+START_TEST(test_at_tokenize_partial) {
+
+	struct bt_at at;
+	char buffer[64];
+
+	/* message without the <CR> terminator is not complete */
+	strcpy(buffer, "AT+VGS=1");
+	ck_assert_ptr_eq(at_tokenize(buffer, &at), NULL);
+	ck_assert_int_eq(errno, EAGAIN);
+	ck_assert_str_eq(buffer, "AT+VGS=1");
+
+	/* complete message after appending the rest of it */
+	strcat(buffer, "2\r");
+	ck_assert_ptr_ne(at_tokenize(buffer, &at), NULL);
+	ck_assert_int_eq(at.type, AT_TYPE_CMD_SET);
+	ck_assert_str_eq(at.command, "+VGS");
+	ck_assert_str_eq(at.value, "12");
+
+	/* <LF> of the previous response received with the next read */
+	strcpy(buffer, "\n\r\nRING\r\n");
+	ck_assert_ptr_ne(at_tokenize(buffer, &at), NULL);
+	ck_assert_int_eq(at.type, AT_TYPE_RESP);
+	ck_assert_str_eq(at.value, "RING");
+
+	/* invalid message is not an incomplete one */
+	strcpy(buffer, "ABC\r");
+	ck_assert_ptr_eq(at_tokenize(buffer, &at), NULL);
+	ck_assert_int_eq(errno, EBADMSG);
+
+} END_TEST
+
+START_TEST(test_at_tokenize_benchmark) {
+
+	static const char ciev[] = "\r\n+CIEV:2,1\r\n";
+	char stream[256];
+	char buffer[sizeof(stream)];
+	size_t i, messages = 0;
+
+	/* RFCOMM read buffer filled with indicator updates */
+	const size_t count = (sizeof(stream) - 1) / (sizeof(ciev) - 1);
+	for (i = 0; i < count; i++)
+		memcpy(&stream[i * (sizeof(ciev) - 1)], ciev, sizeof(ciev) - 1);
+	stream[count * (sizeof(ciev) - 1)] = '\0';
+
+	struct timespec ts0, ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+	for (i = 0; i < benchmark; i++) {
+		struct bt_at at;
+		char *next = buffer;
+		memcpy(buffer, stream, sizeof(stream));
+		while (*next != '\0' && (next = at_tokenize(next, &at)) != NULL)
+			messages++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	const double elapsed = (ts.tv_sec - ts0.tv_sec) + (ts.tv_nsec - ts0.tv_nsec) * 1e-9;
+
+	ck_assert_uint_eq(messages, benchmark * count);
+	printf("AT tokenizer: %.0f messages/s\n", messages / elapsed);
+
+} END_TEST
+
 START_TEST(test_at_parse_cind) {
 
 	enum hfp_ind indmap[20];
@@ -148,7 +240,28 @@ START_TEST(test_at_type2str) {
 	ck_assert_str_eq(at_type2str(AT_TYPE_RESP), "RESP");
 } END_TEST
 
-int main(void) {
+int main(int argc, char *argv[]) {
+
+	int opt;
+	const char *opts = "h";
+	struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "benchmark", required_argument, NULL, 'b' },
+		{ 0, 0, 0, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h' /* --help */ :
+			printf("usage: %s [--benchmark=COUNT]\n", argv[0]);
+			return 0;
+		case 'b' /* --benchmark=COUNT */ :
+			benchmark = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return 1;
+		}
 
 	Suite *s = suite_create(__FILE__);
 	TCase *tc = tcase_create(__FILE__);
@@ -167,9 +280,14 @@ int main(void) {
 	tcase_add_test(tc, test_at_parse_resp_unsolicited);
 	tcase_add_test(tc, test_at_parse_case_sensitivity);
 	tcase_add_test(tc, test_at_parse_multiple_cmds);
+	tcase_add_test(tc, test_at_tokenize);
+	tcase_add_test(tc, test_at_tokenize_partial);
 	tcase_add_test(tc, test_at_parse_cind);
 	tcase_add_test(tc, test_at_type2str);
 
+	if (benchmark > 0)
+		tcase_add_test(tc, test_at_tokenize_benchmark);
+
 	srunner_run_all(sr, CK_ENV);
 	int nf = srunner_ntests_failed(sr);
 	srunner_free(sr);
@@ -12,16 +12,30 @@
 # include <config.h>
 #endif
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <check.h>
 
+#include "../src/a2dp-policy.c"
 #include "../src/ba-adapter.c"
 #include "../src/ba-device.c"
 #include "../src/ba-transport.c"
 #include "../src/bluealsa.c"
+#include "../src/bluez-a2dp.c"
+#include "../src/rcu.c"
+#include "../src/storage.c"
 #include "../src/utils.c"
 #include "../src/shared/log.c"
+#include "../src/shared/rt.c"
 
 int io_thread_create(struct ba_transport *t) { (void)t; return 0; }
+void io_arena_free(struct io_arena *arena) { (void)arena; }
 int bluealsa_dbus_transport_register(struct ba_transport *t, GError **error) {
 	debug("%s: %p", __func__, t); (void)error;
 	return 0; }
@@ -137,6 +151,280 @@ START_TEST(test_ba_transport_volume_packed) {
 
 } END_TEST
 
+START_TEST(test_a2dp_policy) {
+
+	const struct bluez_a2dp_codec *codec = &a2dp_codec_source_sbc;
+	const unsigned int chm = SBC_CHANNEL_MODE_MONO | SBC_CHANNEL_MODE_DUAL_CHANNEL |
+		SBC_CHANNEL_MODE_STEREO | SBC_CHANNEL_MODE_JOINT_STEREO;
+	const unsigned int freq = SBC_SAMPLING_FREQ_16000 | SBC_SAMPLING_FREQ_32000 |
+		SBC_SAMPLING_FREQ_44100 | SBC_SAMPLING_FREQ_48000;
+	struct a2dp_policy_load load = { 0 };
+	struct a2dp_policy_config selection;
+
+	/* SBC bit-rate of the high quality joint stereo stream */
+	a2dp_policy_estimate(A2DP_CODEC_SBC, 2, 44100, 53, &load);
+	ck_assert_uint_eq(load.bitrate, 328);
+	load.bitrate = 0;
+
+	/* without budget the best quality is selected */
+	ck_assert_int_eq(a2dp_policy_select(codec, chm, freq, &load, &selection), 0);
+	ck_assert_uint_eq(selection.channel_mode, SBC_CHANNEL_MODE_JOINT_STEREO);
+	ck_assert_uint_eq(selection.sampling, SBC_SAMPLING_FREQ_48000);
+	ck_assert_uint_eq(selection.bitpool, 51);
+
+	/* stereo with reduced bitpool is preferred over mono */
+	config.a2dp.bitrate_budget = 250;
+	ck_assert_int_eq(a2dp_policy_select(codec, chm, freq, &load, &selection), 0);
+	ck_assert_uint_eq(selection.channel_mode, SBC_CHANNEL_MODE_JOINT_STEREO);
+	ck_assert_uint_eq(selection.sampling, SBC_SAMPLING_FREQ_48000);
+	ck_assert_uint_eq(selection.bitpool, 34);
+	ck_assert_int_le(selection.cost.bitrate, 250);
+
+	/* other streams reduce available budget */
+	load.bitrate = 50;
+	ck_assert_int_eq(a2dp_policy_select(codec, chm, freq, &load, &selection), 0);
+	ck_assert_uint_eq(selection.channels, 1);
+	ck_assert_int_le(selection.cost.bitrate, 200);
+
+	/* the cheapest configuration if nothing fits */
+	config.a2dp.bitrate_budget = 10;
+	ck_assert_int_eq(a2dp_policy_select(codec, chm, freq, &load, &selection), 0);
+	ck_assert_uint_eq(selection.channel_mode, SBC_CHANNEL_MODE_MONO);
+	ck_assert_uint_eq(selection.sampling, SBC_SAMPLING_FREQ_16000);
+
+	/* forced mono takes precedence over the policy */
+	config.a2dp.bitrate_budget = 0;
+	config.a2dp.force_mono = true;
+	ck_assert_int_eq(a2dp_policy_select(codec, chm, freq, &load, &selection), 0);
+	ck_assert_uint_eq(selection.channel_mode, SBC_CHANNEL_MODE_MONO);
+	config.a2dp.force_mono = false;
+
+	/* no common configuration */
+	ck_assert_int_eq(a2dp_policy_select(codec, 0, freq, &load, &selection), -1);
+
+} END_TEST
+
+START_TEST(test_a2dp_policy_admit) {
+
+	struct ba_adapter *a;
+	struct ba_device *d1, *d2;
+	struct ba_transport *t1, *t2, *t3;
+	struct ba_transport_msg msg;
+	bdaddr_t addr1 = {{ 1, 2, 3, 4, 5, 6 }};
+	bdaddr_t addr2 = {{ 6, 5, 4, 3, 2, 1 }};
+	struct ba_transport_type type = {
+		.profile = BA_TRANSPORT_PROFILE_A2DP_SOURCE,
+		.codec = A2DP_CODEC_SBC };
+	const a2dp_sbc_t cconfig = {
+		.frequency = SBC_SAMPLING_FREQ_44100,
+		.channel_mode = SBC_CHANNEL_MODE_JOINT_STEREO,
+		.block_length = SBC_BLOCK_LENGTH_16,
+		.subbands = SBC_SUBBANDS_8,
+		.allocation_method = SBC_ALLOCATION_LOUDNESS,
+		.min_bitpool = SBC_MIN_BITPOOL,
+		.max_bitpool = 53,
+	};
+
+	ck_assert_ptr_ne(a = ba_adapter_new(0), NULL);
+	ck_assert_ptr_ne(d1 = ba_device_new(a, &addr1), NULL);
+	ck_assert_ptr_ne(d2 = ba_device_new(a, &addr2), NULL);
+	ck_assert_ptr_ne(t1 = ba_transport_new_a2dp(d1, type, "/owner", "/path1",
+				&cconfig, sizeof(cconfig)), NULL);
+	ck_assert_ptr_ne(t2 = ba_transport_new_a2dp(d2, type, "/owner", "/path2",
+				&cconfig, sizeof(cconfig)), NULL);
+	type.profile = BA_TRANSPORT_PROFILE_A2DP_SINK;
+	ck_assert_ptr_ne(t3 = ba_transport_new_a2dp(d2, type, "/owner", "/path3",
+				&cconfig, sizeof(cconfig)), NULL);
+
+	/* without budget every transport is admitted */
+	ck_assert_int_eq(a2dp_policy_admit(t2), 0);
+	ck_assert_int_eq(t2->a2dp.bitpool_limit, 0);
+
+	/* the first transport is streaming */
+	t1->state = TRANSPORT_ACTIVE;
+
+	struct a2dp_policy_load load;
+	a2dp_policy_adapter_load(a, NULL, &load);
+	ck_assert_int_eq(load.streams, 1);
+	ck_assert_int_eq(load.bitrate, 328);
+
+	/* downgrade bitpool to fit in the remaining budget */
+	config.a2dp.bitrate_budget = 600;
+	ck_assert_int_eq(a2dp_policy_admit(t2), 0);
+	ck_assert_int_eq(t2->a2dp.bitpool_limit, 43);
+	/* running encoder shall be notified about the new limit */
+	ck_assert_int_eq(ba_transport_recv_signal(t2, &msg), true);
+	ck_assert_int_eq(msg.sig, TRANSPORT_SET_CODEC_LIMITS);
+	ck_assert_int_eq(ba_transport_recv_signal(t2, &msg), false);
+
+	/* unchanged limit shall not be signaled */
+	ck_assert_int_eq(a2dp_policy_admit(t2), 0);
+	ck_assert_int_eq(ba_transport_recv_signal(t2, &msg), false);
+
+	/* reject transport if there is no budget left */
+	config.a2dp.bitrate_budget = 300;
+	ck_assert_int_eq(a2dp_policy_admit(t2), -1);
+	ck_assert_int_eq(errno, EBUSY);
+	ck_assert_int_eq(t2->a2dp.bitpool_limit, 0);
+	ck_assert_int_eq(ba_transport_recv_signal(t2, &msg), true);
+	ck_assert_int_eq(msg.sig, TRANSPORT_SET_CODEC_LIMITS);
+
+	/* sink is admitted over budget, because it can not be downgraded */
+	ck_assert_int_eq(a2dp_policy_admit(t3), 0);
+	ck_assert_int_eq(t3->a2dp.bitpool_limit, 0);
+	ck_assert_int_eq(ba_transport_recv_signal(t3, &msg), false);
+
+	/* saturated controller does not accept new streams */
+	config.a2dp.bitrate_budget = 1000;
+	t1->a2dp.coutq_fill = 90;
+	ck_assert_int_eq(a2dp_policy_admit(t2), -1);
+	t1->a2dp.coutq_fill = 0;
+	ck_assert_int_eq(a2dp_policy_admit(t2), 0);
+
+	config.a2dp.bitrate_budget = 0;
+	t1->state = TRANSPORT_IDLE;
+	ba_transport_unref(t1);
+	ba_transport_unref(t2);
+	ba_transport_unref(t3);
+	ba_device_unref(d1);
+	ba_device_unref(d2);
+	ba_adapter_unref(a);
+
+} END_TEST
+
+START_TEST(test_storage) {
+
+	struct ba_adapter *a;
+	struct ba_device *d;
+	struct ba_transport *t;
+	bdaddr_t addr = {{ 1, 2, 3, 4, 5, 6 }};
+	struct ba_transport_type type = {
+		.profile = BA_TRANSPORT_PROFILE_A2DP_SINK };
+	char *root;
+
+	ck_assert_ptr_ne(root = g_dir_make_tmp("bluealsa-XXXXXX", NULL), NULL);
+	ck_assert_int_eq(storage_init(root), 0);
+
+	ck_assert_ptr_ne(a = ba_adapter_new(0), NULL);
+	ck_assert_ptr_ne(d = ba_device_new(a, &addr), NULL);
+	ck_assert_ptr_ne(t = ba_transport_new(d, type, "/owner", "/path"), NULL);
+
+	t->a2dp.ch1_volume = 64;
+	t->a2dp.ch2_volume = 32;
+	t->delay = 150;
+	d->quirks = BA_DEVICE_QUIRK_AAC_MARKBIT;
+	ck_assert_int_eq(storage_transport_save(t), 0);
+
+	ba_transport_unref(t);
+	ba_device_unref(d);
+
+	/* drop cached data, so it will be loaded from the file */
+	storage_destroy();
+	ck_assert_int_eq(storage_init(root), 0);
+
+	ck_assert_ptr_ne(d = ba_device_new(a, &addr), NULL);
+	ck_assert_ptr_ne(t = ba_transport_new(d, type, "/owner", "/path"), NULL);
+
+	ck_assert_int_eq(storage_transport_load(t), 0);
+	ck_assert_int_eq(t->a2dp.ch1_volume, 64);
+	ck_assert_int_eq(t->a2dp.ch2_volume, 32);
+	ck_assert_int_eq(t->delay, 150);
+	ck_assert_uint_eq(d->quirks, BA_DEVICE_QUIRK_AAC_MARKBIT);
+
+	ba_transport_unref(t);
+	ba_device_unref(d);
+
+	/* negative and out of range values shall be ignored */
+	storage_destroy();
+	ck_assert_int_eq(storage_init(root), 0);
+	char *path = g_strdup_printf("%s/06:05:04:03:02:01", root);
+	ck_assert_int_eq(g_file_set_contents(path,
+				"[A2DP]\nDelay=-1\nVolume=-1;200;\n", -1, NULL), TRUE);
+
+	ck_assert_ptr_ne(d = ba_device_new(a, &addr), NULL);
+	ck_assert_ptr_ne(t = ba_transport_new(d, type, "/owner", "/path"), NULL);
+	ck_assert_int_eq(storage_transport_load(t), 0);
+	ck_assert_int_eq(t->delay, 0);
+	ck_assert_int_eq(t->a2dp.ch1_volume, 0);
+	ck_assert_int_eq(t->a2dp.ch2_volume, 0);
+
+	ba_transport_unref(t);
+	ba_device_unref(d);
+	ba_adapter_unref(a);
+
+	storage_destroy();
+	ck_assert_int_eq(unlink(path), 0);
+	ck_assert_int_eq(rmdir(root), 0);
+	g_free(path);
+	g_free(root);
+
+	/* without initialization storage is not used */
+	ck_assert_ptr_ne(a = ba_adapter_new(0), NULL);
+	ck_assert_ptr_ne(d = ba_device_new(a, &addr), NULL);
+	ck_assert_ptr_ne(t = ba_transport_new(d, type, "/owner", "/path"), NULL);
+	ck_assert_int_eq(storage_transport_load(t), -1);
+	ck_assert_int_eq(errno, ENOTSUP);
+	ba_transport_unref(t);
+	ba_device_unref(d);
+	ba_adapter_unref(a);
+
+} END_TEST
+
+START_TEST(test_ba_transport_sigq) {
+
+	struct ba_adapter *a;
+	struct ba_device *d;
+	struct ba_transport *t;
+	struct ba_transport_msg msg;
+	bdaddr_t addr = { 0 };
+	struct ba_transport_type type = { 0 };
+	uint64_t doorbell;
+	size_t i;
+
+	ck_assert_ptr_ne(a = ba_adapter_new(0), NULL);
+	ck_assert_ptr_ne(d = ba_device_new(a, &addr), NULL);
+	ck_assert_ptr_ne(t = ba_transport_new(d, type, "/owner", "/path"), NULL);
+
+	ba_adapter_unref(a);
+	ba_device_unref(d);
+
+	/* idempotent signals shall be coalesced with the latest payload */
+	for (i = 0; i < 100; i++) {
+		ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_PING), 0);
+		ck_assert_int_eq(ba_transport_send_signal_arg(t, TRANSPORT_SET_VOLUME, i), 0);
+	}
+
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_PCM_PAUSE), 0);
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_PCM_RESUME), 0);
+
+	/* doorbell shall be rung only once */
+	ck_assert_int_eq(read(t->sigq.fd, &doorbell, sizeof(doorbell)), sizeof(doorbell));
+	ck_assert_int_eq(doorbell, 1);
+
+	ck_assert_int_eq(ba_transport_recv_signal(t, &msg), true);
+	ck_assert_int_eq(msg.sig, TRANSPORT_PING);
+	ck_assert_int_eq(ba_transport_recv_signal(t, &msg), true);
+	ck_assert_int_eq(msg.sig, TRANSPORT_SET_VOLUME);
+	ck_assert_uint_eq(msg.arg, 99);
+	/* ordered signals shall be delivered in order */
+	ck_assert_int_eq(ba_transport_recv_signal(t, &msg), true);
+	ck_assert_int_eq(msg.sig, TRANSPORT_PCM_PAUSE);
+	ck_assert_int_eq(ba_transport_recv_signal(t, &msg), true);
+	ck_assert_int_eq(msg.sig, TRANSPORT_PCM_RESUME);
+	ck_assert_int_eq(ba_transport_recv_signal(t, &msg), false);
+
+	/* queue overflow shall be reported */
+	for (i = 0; i < BA_TRANSPORT_SIGQ_SIZE; i++)
+		ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_PCM_SYNC), 0);
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_PCM_SYNC), -1);
+	for (i = 0; i < BA_TRANSPORT_SIGQ_SIZE; i++)
+		ck_assert_int_eq(ba_transport_recv_signal(t, &msg), true);
+	ck_assert_int_eq(ba_transport_recv_signal(t, &msg), false);
+
+	ba_transport_unref(t);
+
+} END_TEST
+
 static int test_cascade_free_transport_unref(struct ba_transport *t) {
 	return ba_transport_unref(t), 0;
 }
@@ -159,6 +447,97 @@ START_TEST(test_cascade_free) {
 
 } END_TEST
 
+struct test_lookup_race_data {
+	atomic_bool stop;
+	atomic_ulong hits;
+	atomic_ulong errors;
+};
+
+static void *test_lookup_race_reader(void *userdata) {
+
+	struct test_lookup_race_data *data = userdata;
+	bdaddr_t addr = {{ 0x12, 0x34, 0x56, 0x78, 0x90, 0xAB }};
+
+	while (!atomic_load(&data->stop)) {
+
+		struct ba_adapter *a;
+		struct ba_device *d;
+		struct ba_transport *t;
+
+		if ((a = ba_adapter_lookup(0)) == NULL)
+			continue;
+
+		if ((d = ba_device_lookup(a, &addr)) != NULL) {
+			if ((t = ba_transport_lookup(d, "/path")) != NULL) {
+				/* looked-up objects shall be fully initialized */
+				if (t->d != d || strcmp(t->bluez_dbus_owner, "/owner") != 0)
+					atomic_fetch_add(&data->errors, 1);
+				atomic_fetch_add(&data->hits, 1);
+				ba_transport_unref(t);
+			}
+			if (d->a != a || bacmp(&d->addr, &addr) != 0)
+				atomic_fetch_add(&data->errors, 1);
+			ba_device_unref(d);
+		}
+
+		ba_adapter_unref(a);
+
+	}
+
+	return NULL;
+}
+
+START_TEST(test_lookup_race) {
+
+	struct test_lookup_race_data data = { 0 };
+	bdaddr_t addr = {{ 0x12, 0x34, 0x56, 0x78, 0x90, 0xAB }};
+	struct ba_transport_type type = { 0 };
+	pthread_t readers[4];
+	size_t i, ii, iii;
+
+	for (i = 0; i < ARRAYSIZE(readers); i++)
+		ck_assert_int_eq(pthread_create(&readers[i], NULL, test_lookup_race_reader, &data), 0);
+
+	/* Race creation and destruction of the whole adapter-device-transport
+	 * chain against lock-free lookups done by the reader threads. */
+	for (i = 0; i < 25; i++) {
+
+		struct ba_adapter *a;
+		ck_assert_ptr_ne(a = ba_adapter_new(0), NULL);
+
+		for (ii = 0; ii < 200; ii++) {
+
+			struct ba_device *d;
+			struct ba_transport *t;
+
+			ck_assert_ptr_ne(d = ba_device_new(a, &addr), NULL);
+			ck_assert_ptr_ne(t = ba_transport_new(d, type, "/owner", "/path"), NULL);
+
+			/* give readers a chance to find the transport */
+			for (iii = 0; iii < 10; iii++)
+				sched_yield();
+
+			ba_device_unref(d);
+			if (ii % 2)
+				ba_device_destroy(ba_device_ref(d));
+			else
+				ba_transport_unref(t);
+
+		}
+
+		ba_adapter_destroy(a);
+
+	}
+
+	atomic_store(&data.stop, true);
+	for (i = 0; i < ARRAYSIZE(readers); i++)
+		pthread_join(readers[i], NULL);
+
+	debug("Lock-free lookup hits: %lu", atomic_load(&data.hits));
+	ck_assert_uint_eq(atomic_load(&data.errors), 0);
+
+} END_TEST
+
 int main(void) {
 
 	Suite *s = suite_create(__FILE__);
@@ -171,7 +550,12 @@ int main(void) {
 	tcase_add_test(tc, test_ba_device);
 	tcase_add_test(tc, test_ba_transport);
 	tcase_add_test(tc, test_ba_transport_volume_packed);
+	tcase_add_test(tc, test_a2dp_policy);
+	tcase_add_test(tc, test_a2dp_policy_admit);
+	tcase_add_test(tc, test_storage);
+	tcase_add_test(tc, test_ba_transport_sigq);
 	tcase_add_test(tc, test_cascade_free);
+	tcase_add_test(tc, test_lookup_race);
 
 	srunner_run_all(sr, CK_ENV);
 	int nf = srunner_ntests_failed(sr);
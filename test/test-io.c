@@ -17,14 +17,18 @@
 #include <check.h>
 
 #include "inc/sine.inc"
+#include "../src/a2dp-policy.c"
 #include "../src/at.c"
 #include "../src/ba-adapter.c"
 #include "../src/ba-device.c"
 #include "../src/ba-transport.c"
 #include "../src/bluealsa.c"
+#include "../src/codec-lib.c"
 #include "../src/io.c"
 #include "../src/msbc.c"
+#include "../src/rcu.c"
 #include "../src/rfcomm.c"
+#include "../src/storage.c"
 #include "../src/utils.c"
 #include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
@@ -33,8 +37,10 @@
 int bluealsa_dbus_transport_register(struct ba_transport *t, GError **error) {
 	debug("%s: %p", __func__, (void *)t); (void)error;
 	return 0; }
+static unsigned int dbus_update_mask = 0;
 void bluealsa_dbus_transport_update(struct ba_transport *t, unsigned int mask) {
-	debug("%s: %p %#x", __func__, (void *)t, mask); }
+	debug("%s: %p %#x", __func__, (void *)t, mask);
+	dbus_update_mask |= mask; }
 void bluealsa_dbus_transport_unregister(struct ba_transport *t) {
 	debug("%s: %p", __func__, (void *)t); }
 
@@ -148,7 +154,7 @@ static void test_a2dp_encoding(struct ba_transport *t, void *(*cb)(void *)) {
 
 	}
 
-	ck_assert_int_eq(pthread_cancel(thread), 0);
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_STOP), 0);
 	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
 
 	close(pcm_fds[0]);
@@ -189,7 +195,7 @@ static void test_a2dp_decoding(struct ba_transport *t, void *(*cb)(void *)) {
 
 	}
 
-	ck_assert_int_eq(pthread_cancel(thread), 0);
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_STOP), 0);
 	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
 
 	close(pcm_fds[0]);
@@ -225,12 +231,17 @@ static void test_a2dp_aging(struct ba_transport *t1, struct ba_transport *t2,
 
 	sleep(aging);
 
-	ck_assert_int_eq(pthread_cancel(thread1), 0);
-	ck_assert_int_eq(pthread_cancel(thread2), 0);
+	ck_assert_int_eq(ba_transport_send_signal(t1, TRANSPORT_STOP), 0);
+	ck_assert_int_eq(ba_transport_send_signal(t2, TRANSPORT_STOP), 0);
 
 	ck_assert_int_eq(pthread_timedjoin(thread1, NULL, 1e6), 0);
 	ck_assert_int_eq(pthread_timedjoin(thread2, NULL, 1e6), 0);
 
+	/* report IO efficiency of the encoder for the benchmark */
+	printf("%s [%s]: packets: %u/s, syscalls: %u/s\n",
+			ba_transport_type_to_string(t1->type), t1->a2dp.io_uring ? "io_uring" : "poll",
+			t1->a2dp.packet_rate, t1->a2dp.syscall_rate);
+
 }
 
 static void test_sco(struct ba_transport *t, void *(*cb)(void *)) {
@@ -260,6 +271,11 @@ static void test_sco(struct ba_transport *t, void *(*cb)(void *)) {
 	snd_pcm_sine_s16le(buffer, ARRAYSIZE(buffer), 2, 0, 0.01);
 	ck_assert_int_eq(write(pcm_spk_fds[0], buffer, sizeof(buffer)), sizeof(buffer));
 
+	/* SCO packets are clocked by the incoming traffic, so act like the
+	 * controller and send the first packet, the rest will be echoed */
+	memset(buffer, 0, t->mtu_read);
+	ck_assert_int_gt(write(sco_fds[0], buffer, t->mtu_read), 0);
+
 	memset(test_bt_data, 0, sizeof(test_bt_data));
 	while (poll(pfds, ARRAYSIZE(pfds), 500) > 0) {
 
@@ -289,7 +305,7 @@ static void test_sco(struct ba_transport *t, void *(*cb)(void *)) {
 
 	}
 
-	ck_assert_int_eq(pthread_cancel(thread), 0);
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_STOP), 0);
 	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
 
 	close(pcm_spk_fds[0]);
@@ -307,6 +323,117 @@ static int test_transport_release_bt_a2dp(struct ba_transport *t) {
 	return transport_release_bt_a2dp(t);
 }
 
+START_TEST(test_io_thread_coutq_estimate) {
+
+	struct io_thread_data io = { .coutq.i = 0 };
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(io.coutq.v); i++)
+		io.coutq.v[i] = 1000;
+	ck_assert_int_eq(io_thread_coutq_estimate(&io), 1000);
+
+	/* single outlier shall not dominate the estimation */
+	memset(io.coutq.v, 0, sizeof(io.coutq.v));
+	io.coutq.i = 5;
+	io.coutq.v[io.coutq.i] = 16000;
+	ck_assert_int_eq(io_thread_coutq_estimate(&io), 16000 * 16 / 136);
+
+	/* the oldest sample has the lowest weight */
+	io.coutq.i = 4;
+	ck_assert_int_eq(io_thread_coutq_estimate(&io), 16000 * 1 / 136);
+
+} END_TEST
+
+static void *test_io_pool_routine(void *arg) {
+	pthread_t self = pthread_self();
+	if (write(*(int *)arg, &self, sizeof(self)) != sizeof(self))
+		error("Couldn't write thread ID: %s", strerror(errno));
+	return NULL;
+}
+
+static unsigned int test_io_pool_idle_count(void) {
+	pthread_mutex_lock(&io_pool.mutex);
+	unsigned int count = io_pool.idle_count;
+	pthread_mutex_unlock(&io_pool.mutex);
+	return count;
+}
+
+START_TEST(test_io_pool) {
+
+	int fds[2];
+	ck_assert_int_eq(pipe(fds), 0);
+
+	ck_assert_int_eq(io_pool_init(1), 0);
+	ck_assert_int_eq(test_io_pool_idle_count(), 1);
+
+	pthread_t thread1, thread2;
+	pthread_t worker1, worker2;
+
+	ck_assert_int_eq(io_pool_submit(test_io_pool_routine, &fds[1], "test", &thread1), 0);
+	ck_assert_int_eq(read(fds[0], &worker1, sizeof(worker1)), sizeof(worker1));
+	ck_assert_int_ne(pthread_equal(thread1, worker1), 0);
+
+	/* wait for the worker to get back to the pool */
+	while (test_io_pool_idle_count() == 0)
+		usleep(1000);
+
+	/* idle worker shall be reused */
+	ck_assert_int_eq(io_pool_submit(test_io_pool_routine, &fds[1], "test", &thread2), 0);
+	ck_assert_int_eq(read(fds[0], &worker2, sizeof(worker2)), sizeof(worker2));
+	ck_assert_int_ne(pthread_equal(thread2, worker1), 0);
+	ck_assert_int_ne(pthread_equal(worker2, worker1), 0);
+
+	close(fds[0]);
+	close(fds[1]);
+
+} END_TEST
+
+START_TEST(test_codec_lib) {
+
+	static const char * const sonames_libc[] = { "libc.so.6", NULL };
+	static const char * const sonames_missing[] = { "libbluealsa-missing.so", NULL };
+	struct { size_t (*len)(const char *); } table = { 0 };
+	const struct codec_lib_sym syms[] = { { "strlen", 0 } };
+	const struct codec_lib_sym syms_missing[] = { { "bluealsa_missing_symbol", 0 } };
+	const enum codec_lib_id id = CODEC_LIB_MPG123;
+	const struct codec_lib lib = codec_libs[id];
+
+	/* library which was not enabled during the build */
+	codec_libs[id] = (struct codec_lib){ 0 };
+	ck_assert_int_eq(codec_lib_probe(id), false);
+	ck_assert_int_eq(codec_lib_load(id), -1);
+	ck_assert_int_eq(errno, ENOENT);
+
+	/* library which is not present in the system */
+	codec_libs[id] = (struct codec_lib){ .name = "missing", .sonames = sonames_missing,
+		.table = &table, .syms = syms, .syms_len = ARRAYSIZE(syms) };
+	ck_assert_int_eq(codec_lib_probe(id), false);
+	ck_assert_int_eq(codec_lib_load(id), -1);
+	ck_assert_int_eq(errno, ENOENT);
+	ck_assert_ptr_eq(table.len, NULL);
+
+	/* library without required symbol */
+	codec_libs[id] = (struct codec_lib){ .name = "libc", .sonames = sonames_libc,
+		.table = &table, .syms = syms_missing, .syms_len = ARRAYSIZE(syms_missing) };
+	ck_assert_int_eq(codec_lib_probe(id), true);
+	ck_assert_int_eq(codec_lib_load(id), -1);
+	ck_assert_int_eq(errno, ENOENT);
+	ck_assert_int_eq(codec_lib_probe(id), false);
+
+	codec_libs[id] = (struct codec_lib){ .name = "libc", .sonames = sonames_libc,
+		.table = &table, .syms = syms, .syms_len = ARRAYSIZE(syms) };
+	ck_assert_int_eq(codec_lib_probe(id), true);
+	ck_assert_int_eq(codec_lib_load(id), 0);
+	ck_assert_ptr_ne(table.len, NULL);
+	ck_assert_int_eq(table.len("BlueALSA"), 8);
+	/* once loaded, the library is not loaded again */
+	ck_assert_int_eq(codec_lib_load(id), 0);
+	ck_assert_int_eq(codec_lib_probe(id), true);
+
+	codec_libs[id] = lib;
+
+} END_TEST
+
 START_TEST(test_a2dp_sbc) {
 
 	struct ba_transport_type ttype = { .codec = A2DP_CODEC_SBC };
@@ -317,13 +444,43 @@ START_TEST(test_a2dp_sbc) {
 	t->release = test_transport_release_bt_a2dp;
 
 	t->mtu_write = 153 * 3;
-	test_a2dp_encoding(t, io_thread_a2dp_source_sbc);
+	test_a2dp_encoding(t, io_thread_a2dp_source);
 
 	t->mtu_read = t->mtu_write;
-	test_a2dp_decoding(t, io_thread_a2dp_sink_sbc);
+	test_a2dp_decoding(t, io_thread_a2dp_sink);
 
 } END_TEST
 
+#if ENABLE_LIBURING
+START_TEST(test_a2dp_sbc_io_uring) {
+
+	struct ba_transport_type ttype = { .codec = A2DP_CODEC_SBC };
+	struct ba_transport *t = ba_transport_new_a2dp(device1, ttype, ":test", "/path/sbc",
+			&config_sbc_44100_stereo, sizeof(config_sbc_44100_stereo));
+
+	t->acquire = test_transport_acquire;
+	t->release = test_transport_release_bt_a2dp;
+
+	/* io_uring backend paces the transfer with the system clock */
+	const struct rt_clock *clock = rt_clock_get();
+	const bool io_uring = config.io_uring;
+	rt_clock_set(&rt_clock_monotonic);
+	config.io_uring = true;
+
+	t->mtu_write = 153 * 3;
+	test_a2dp_encoding(t, io_thread_a2dp_source);
+
+	config.io_uring = io_uring;
+	rt_clock_set(clock);
+
+	/* make sure that there was no fallback to poll() */
+	ck_assert_int_eq(t->a2dp.io_uring, true);
+	/* encoder shall not stall while sleeping with in-flight writes */
+	ck_assert_uint_gt(test_bt_data[ARRAYSIZE(test_bt_data) - 1].len, 0);
+
+} END_TEST
+#endif
+
 START_TEST(test_a2dp_aging_sbc) {
 
 	struct ba_transport_type ttype = { .codec = A2DP_CODEC_SBC };
@@ -335,11 +492,40 @@ START_TEST(test_a2dp_aging_sbc) {
 	t1->acquire = t2->acquire = test_transport_acquire;
 	t1->release = t2->release = test_transport_release_bt_a2dp;
 
+	const bool io_uring = config.io_uring;
+	config.io_uring = false;
+
 	t1->mtu_write = t2->mtu_read = 153 * 3;
-	test_a2dp_aging(t1, t2, io_thread_a2dp_source_sbc, io_thread_a2dp_sink_sbc);
+	test_a2dp_aging(t1, t2, io_thread_a2dp_source, io_thread_a2dp_sink);
+
+	config.io_uring = io_uring;
 
 } END_TEST
 
+#if ENABLE_LIBURING
+START_TEST(test_a2dp_aging_sbc_io_uring) {
+
+	struct ba_transport_type ttype = { .codec = A2DP_CODEC_SBC };
+	struct ba_transport *t1 = ba_transport_new_a2dp(device1, ttype, ":test", "/path/sbc",
+			&config_sbc_44100_stereo, sizeof(config_sbc_44100_stereo));
+	struct ba_transport *t2 = ba_transport_new_a2dp(device2, ttype, ":test", "/path/sbc",
+			&config_sbc_44100_stereo, sizeof(config_sbc_44100_stereo));
+
+	t1->acquire = t2->acquire = test_transport_acquire;
+	t1->release = t2->release = test_transport_release_bt_a2dp;
+
+	const bool io_uring = config.io_uring;
+	config.io_uring = true;
+
+	t1->mtu_write = t2->mtu_read = 153 * 3;
+	test_a2dp_aging(t1, t2, io_thread_a2dp_source, io_thread_a2dp_sink);
+
+	config.io_uring = io_uring;
+	ck_assert_int_eq(t1->a2dp.io_uring, true);
+
+} END_TEST
+#endif
+
 #if ENABLE_MP3LAME
 START_TEST(test_a2dp_mp3) {
 
@@ -351,10 +537,10 @@ START_TEST(test_a2dp_mp3) {
 	t->release = test_transport_release_bt_a2dp;
 
 	t->mtu_write = 250,
-	test_a2dp_encoding(t, io_thread_a2dp_source_mp3);
+	test_a2dp_encoding(t, io_thread_a2dp_source);
 
 	t->mtu_read = t->mtu_write;
-	test_a2dp_decoding(t, io_thread_a2dp_sink_mpeg);
+	test_a2dp_decoding(t, io_thread_a2dp_sink);
 
 } END_TEST
 #endif
@@ -372,7 +558,7 @@ START_TEST(test_a2dp_aging_mp3) {
 	t1->release = t2->release = test_transport_release_bt_a2dp;
 
 	t1->mtu_write = t2->mtu_read = 800;
-	test_a2dp_aging(t1, t2, io_thread_a2dp_source_mp3, io_thread_a2dp_sink_mpeg);
+	test_a2dp_aging(t1, t2, io_thread_a2dp_source, io_thread_a2dp_sink);
 
 } END_TEST
 #endif
@@ -388,10 +574,10 @@ START_TEST(test_a2dp_aac) {
 	t->release = test_transport_release_bt_a2dp;
 
 	t->mtu_write = 64;
-	test_a2dp_encoding(t, io_thread_a2dp_source_aac);
+	test_a2dp_encoding(t, io_thread_a2dp_source);
 
 	t->mtu_read = t->mtu_write;
-	test_a2dp_decoding(t, io_thread_a2dp_sink_aac);
+	test_a2dp_decoding(t, io_thread_a2dp_sink);
 
 } END_TEST
 #endif
@@ -409,7 +595,7 @@ START_TEST(test_a2dp_aging_aac) {
 	t1->release = t2->release = test_transport_release_bt_a2dp;
 
 	t1->mtu_write = t2->mtu_read = 450;
-	test_a2dp_aging(t1, t2, io_thread_a2dp_source_aac, io_thread_a2dp_sink_aac);
+	test_a2dp_aging(t1, t2, io_thread_a2dp_source, io_thread_a2dp_sink);
 
 } END_TEST
 #endif
@@ -425,7 +611,7 @@ START_TEST(test_a2dp_aptx) {
 	t->release = test_transport_release_bt_a2dp;
 
 	t->mtu_write = 40;
-	test_a2dp_encoding(t, io_thread_a2dp_source_aptx);
+	test_a2dp_encoding(t, io_thread_a2dp_source);
 
 } END_TEST
 #endif
@@ -441,7 +627,95 @@ START_TEST(test_a2dp_ldac) {
 	t->release = test_transport_release_bt_a2dp;
 
 	t->mtu_write = RTP_HEADER_LEN + sizeof(rtp_media_header_t) + 679;
-	test_a2dp_encoding(t, io_thread_a2dp_source_ldac);
+	test_a2dp_encoding(t, io_thread_a2dp_source);
+
+} END_TEST
+#endif
+
+START_TEST(test_sco_sched) {
+
+	struct ba_transport_type ttype = { .profile = BA_TRANSPORT_PROFILE_HSP_AG };
+	struct ba_transport *t = ba_transport_new_sco(device1, ttype, ":test", "/path/sco/cvsd", NULL);
+	struct io_arena *arena = io_arena_get(t);
+	struct io_sco_sched sched = { .batch = 5 };
+	const unsigned int latency = config.sco.latency;
+
+	config.sco.latency = 4;
+	t->mtu_read = t->mtu_write = 48;
+
+	/* buffers shall hold data for the latency plus one packet */
+	ck_assert_int_eq(io_sco_buffers_init(t, arena), 0);
+	ck_assert_int_eq(arena->bt.size, 5 * 48);
+	ck_assert_int_eq(arena->bt_out.size, 5 * 48);
+
+	/* buffers shall follow the MTU of the SCO link */
+	t->mtu_read = t->mtu_write = 60;
+	ck_assert_int_eq(io_sco_buffers_init(t, arena), 0);
+	ck_assert_int_eq(arena->bt.size, 5 * 60);
+	ck_assert_int_eq(arena->bt_out.size, 5 * 60);
+
+	/* credits shall not exceed the latency */
+	io_sco_sched_tick(&sched, 10);
+	ck_assert_int_eq(sched.credits, 4);
+
+	/* SCO socket shall not be polled until the next batch is due,
+	 * which is 4 packets of 30 samples at 8 kHz */
+	io_sco_sched_defer(&sched, t);
+	ck_assert_int_gt(io_sco_sched_deferred(&sched), 0);
+	ck_assert_int_le(io_sco_sched_deferred(&sched), 15);
+	/* without batching SCO socket shall be polled right away */
+	sched.batch = 1;
+	ck_assert_int_eq(io_sco_sched_deferred(&sched), 0);
+
+	/* wake-up rate shall be updated not earlier than after one second */
+	dbus_update_mask = 0;
+	gettimestamp(&sched.wakeups_ts);
+	sched.wakeups = 10;
+	io_sco_update_stats(t, arena, &sched);
+	ck_assert_int_eq(t->sco.wakeup_rate, 0);
+	ck_assert_int_eq(sched.wakeups, 11);
+
+	sched.wakeups_ts.tv_sec -= 1;
+	sched.wakeups = 99;
+	io_sco_update_stats(t, arena, &sched);
+	ck_assert_int_ge(t->sco.wakeup_rate, 99);
+	ck_assert_int_le(t->sco.wakeup_rate, 100);
+	ck_assert_int_eq(sched.wakeups, 0);
+	ck_assert_int_ne(dbus_update_mask & BA_DBUS_TRANSPORT_UPDATE_WAKEUP_RATE, 0);
+
+	config.sco.latency = latency;
+	ba_transport_unref(t);
+
+} END_TEST
+
+#if ENABLE_MSBC
+START_TEST(test_sco_sched_msbc) {
+
+	struct ba_transport_type ttype = {
+		.profile = BA_TRANSPORT_PROFILE_HFP_AG,
+		.codec = HFP_CODEC_MSBC };
+	struct ba_transport *t = ba_transport_new_sco(device1, ttype, ":test", "/path/sco/msbc", NULL);
+	struct io_arena *arena = io_arena_get(t);
+	const unsigned int latency = config.sco.latency;
+
+	config.sco.latency = 4;
+	t->mtu_read = t->mtu_write = 60;
+
+	/* codec buffers shall hold eSCO frames for the latency plus one packet */
+	ck_assert_int_eq(io_sco_buffers_init(t, arena), 0);
+	ck_assert_int_eq(msbc_init(&arena->msbc), 0);
+	ck_assert_int_eq(arena->msbc.dec_data.size, 5 * sizeof(esco_msbc_frame_t));
+	ck_assert_int_eq(arena->msbc.enc_data.size, 5 * sizeof(esco_msbc_frame_t));
+	ck_assert_int_eq(arena->msbc.dec_pcm.size, 4 * MSBC_CODESAMPLES);
+	ck_assert_int_eq(arena->msbc.enc_pcm.size, 4 * MSBC_CODESAMPLES);
+
+	/* small MTU shall not shrink buffers below the codec minimum */
+	t->mtu_read = t->mtu_write = 24;
+	ck_assert_int_eq(io_sco_buffers_init(t, arena), 0);
+	ck_assert_int_eq(arena->msbc.dec_data.size, MSBC_MIN_FRAMES * sizeof(esco_msbc_frame_t));
+
+	config.sco.latency = latency;
+	ba_transport_unref(t);
 
 } END_TEST
 #endif
@@ -459,6 +733,124 @@ START_TEST(test_sco_cvsd) {
 
 } END_TEST
 
+START_TEST(test_sco_cvsd_timer) {
+
+	struct ba_transport_type ttype = { .profile = BA_TRANSPORT_PROFILE_HSP_AG };
+	struct ba_transport *t = ba_transport_new_sco(device1, ttype, ":test", "/path/sco/cvsd", NULL);
+
+	t->mtu_read = t->mtu_write = 48;
+	t->acquire = test_transport_acquire;
+
+	int sco_fds[2];
+	int pcm_spk_fds[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sco_fds), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_spk_fds), 0);
+
+	/* without microphone, speaker shall be clocked by the timer */
+	t->state = TRANSPORT_ACTIVE;
+	t->bt_fd = sco_fds[1];
+	t->sco.spk_pcm.fd = pcm_spk_fds[1];
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, io_thread_sco, ba_transport_ref(t));
+
+	int16_t buffer[8000 / 10];
+	snd_pcm_sine_s16le(buffer, ARRAYSIZE(buffer), 1, 0, 0.01);
+	ck_assert_int_eq(write(pcm_spk_fds[0], buffer, sizeof(buffer)), sizeof(buffer));
+
+	struct timespec ts0, ts;
+	size_t packets = 0;
+	gettimestamp(&ts0);
+	ts = ts0;
+
+	struct pollfd pfd = { sco_fds[0], POLLIN, 0 };
+	while (poll(&pfd, 1, 500) > 0) {
+		ck_assert_int_eq(read(sco_fds[0], buffer, t->mtu_write), t->mtu_write);
+		/* do not count the trailing poll timeout */
+		gettimestamp(&ts);
+		packets++;
+	}
+
+	difftimespec(&ts0, &ts, &ts);
+
+	/* 100 ms of audio split into 3 ms packets */
+	ck_assert_int_eq(packets, ARRAYSIZE(buffer) * sizeof(int16_t) / t->mtu_write);
+	/* data shall not be sent faster than the real time, however, the
+	 * scheduler is allowed to send up to the latency budget in a burst */
+	const long period = io_sco_packet_period(t);
+	ck_assert_int_ge(ts.tv_sec * 1000000000L + ts.tv_nsec,
+			(long)(packets - config.sco.latency) * period);
+
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_STOP), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	close(pcm_spk_fds[0]);
+	close(sco_fds[0]);
+
+} END_TEST
+
+static void test_sco_drained(void *userdata) {
+	*(bool *)userdata = true;
+}
+
+START_TEST(test_sco_cvsd_drain) {
+
+	struct ba_transport_type ttype = { .profile = BA_TRANSPORT_PROFILE_HSP_AG };
+	struct ba_transport *t = ba_transport_new_sco(device1, ttype, ":test", "/path/sco/cvsd", NULL);
+
+	t->mtu_read = t->mtu_write = 48;
+	t->acquire = test_transport_acquire;
+
+	int sco_fds[2];
+	int pcm_spk_fds[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sco_fds), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_spk_fds), 0);
+
+	t->state = TRANSPORT_ACTIVE;
+	t->bt_fd = sco_fds[1];
+	t->sco.spk_pcm.fd = pcm_spk_fds[1];
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, io_thread_sco, ba_transport_ref(t));
+
+	/* data which does not fill the last SCO packet */
+	int16_t buffer[8000 / 10];
+	snd_pcm_sine_s16le(buffer, ARRAYSIZE(buffer), 1, 0, 0.01);
+	ck_assert_int_eq(write(pcm_spk_fds[0], buffer, sizeof(buffer)), sizeof(buffer));
+
+	bool drained = false;
+	ck_assert_int_eq(ba_transport_drain_pcm(t, test_sco_drained, &drained), 0);
+	/* drain request shall not block */
+	ck_assert_int_eq(drained, false);
+
+	size_t packets = 0;
+	struct pollfd pfd = { sco_fds[0], POLLIN, 0 };
+	for (;;) {
+		g_main_context_iteration(NULL, FALSE);
+		if (poll(&pfd, 1, drained ? 0 : 500) <= 0)
+			break;
+		ck_assert_int_eq(read(sco_fds[0], buffer, t->mtu_write), t->mtu_write);
+		packets++;
+	}
+
+	/* dispatch drain completion (if not dispatched yet) */
+	while (g_main_context_iteration(NULL, FALSE))
+		continue;
+
+	ck_assert_int_eq(drained, true);
+	/* last packet shall be padded with silence */
+	ck_assert_int_eq(packets, (sizeof(buffer) + t->mtu_write - 1) / t->mtu_write);
+
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_STOP), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	close(pcm_spk_fds[0]);
+	close(sco_fds[0]);
+
+} END_TEST
+
 #if ENABLE_MSBC
 START_TEST(test_sco_msbc) {
 
@@ -476,6 +868,158 @@ START_TEST(test_sco_msbc) {
 } END_TEST
 #endif
 
+START_TEST(test_rfcomm_handlers) {
+
+	size_t i;
+	for (i = 0; i < ARRAYSIZE(rfcomm_handlers); i++) {
+		/* handlers table shall be sorted for the binary search */
+		if (i > 0)
+			ck_assert_int_lt(rfcomm_handler_cmp(&rfcomm_handlers[i - 1], &rfcomm_handlers[i]), 0);
+		struct bt_at at = { .type = rfcomm_handlers[i]->type, .command = rfcomm_handlers[i]->command };
+		ck_assert_ptr_eq(rfcomm_get_callback(&at), rfcomm_handlers[i]->callback);
+	}
+
+} END_TEST
+
+START_TEST(test_rfcomm_hfp_hf_slc) {
+
+	struct ba_transport_type ttype = { .profile = BA_TRANSPORT_PROFILE_HFP_HF };
+	struct ba_transport *t = ba_transport_new_rfcomm(device1, ttype, ":test", "/path/rfcomm");
+
+	int rfcomm_fds[2];
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, rfcomm_fds), 0);
+	t->bt_fd = rfcomm_fds[1];
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, rfcomm_thread, ba_transport_ref(t));
+
+	struct pollfd pfd = { rfcomm_fds[0], POLLIN, 0 };
+	char buffer[256];
+	size_t len = 0;
+	ssize_t ret;
+
+	ck_assert_int_gt(ret = read(rfcomm_fds[0], buffer, sizeof(buffer) - 1), 0);
+	buffer[ret] = '\0';
+	ck_assert_int_eq(strncmp(buffer, "AT+BRSF=", 8), 0);
+
+	/* AG without the codec negotiation support */
+	const char *resp_brsf = "\r\n+BRSF:0\r\n\r\nOK\r\n";
+	ck_assert_int_eq(write(rfcomm_fds[0], resp_brsf, strlen(resp_brsf)), strlen(resp_brsf));
+
+	/* all remaining SLC commands shall be sent without waiting for OK */
+	const char *cmds = "AT+CIND=?\rAT+CIND?\rAT+CMER=3,0,0,1,0\r";
+	while (len < strlen(cmds) && poll(&pfd, 1, 500) > 0) {
+		ck_assert_int_gt(ret = read(rfcomm_fds[0], &buffer[len], sizeof(buffer) - 1 - len), 0);
+		len += ret;
+	}
+	buffer[len] = '\0';
+	ck_assert_str_eq(buffer, cmds);
+
+	const char *resp_cind =
+		"\r\n+CIND:(\"call\",(0,1)),(\"battchg\",(0-5))\r\n\r\nOK\r\n"
+		"\r\n+CIND:0,4\r\n\r\nOK\r\n"
+		"\r\nOK\r\n";
+	ck_assert_int_eq(write(rfcomm_fds[0], resp_cind, strlen(resp_cind)), strlen(resp_cind));
+
+	/* connection established, nothing shall be retransmitted */
+	ck_assert_int_eq(poll(&pfd, 1, 2 * RFCOMM_SLC_TIMEOUT_MIN), 0);
+	ck_assert_int_eq(device1->battery_level, 80);
+
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_STOP), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	close(rfcomm_fds[0]);
+	ba_transport_unref(t);
+
+} END_TEST
+
+/**
+ * Read data from the RFCOMM socket until the expected length is reached.
+ *
+ * @return This function returns the time (in milliseconds) it took to
+ *   receive the data. */
+static int test_rfcomm_read(int fd, const char *expected) {
+
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	struct timespec ts0, ts;
+	char buffer[256];
+	size_t len = 0;
+	ssize_t ret;
+
+	gettimestamp(&ts0);
+	while (len < strlen(expected) && poll(&pfd, 1, 2 * RFCOMM_SLC_TIMEOUT) > 0) {
+		ck_assert_int_gt(ret = read(fd, &buffer[len], sizeof(buffer) - 1 - len), 0);
+		len += ret;
+	}
+	gettimestamp(&ts);
+
+	buffer[len] = '\0';
+	ck_assert_str_eq(buffer, expected);
+
+	difftimespec(&ts0, &ts, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+START_TEST(test_rfcomm_hfp_hf_slc_timeout) {
+
+	struct ba_transport_type ttype = { .profile = BA_TRANSPORT_PROFILE_HFP_HF };
+	struct ba_transport *t = ba_transport_new_rfcomm(device1, ttype, ":test", "/path/rfcomm");
+
+	int rfcomm_fds[2];
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, rfcomm_fds), 0);
+	t->bt_fd = rfcomm_fds[1];
+	device1->hfp_slc_time = 0;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, rfcomm_thread, ba_transport_ref(t));
+
+	struct pollfd pfd = { rfcomm_fds[0], POLLIN, 0 };
+	char buffer[32];
+	int elapsed;
+
+	ck_assert_int_gt(read(rfcomm_fds[0], buffer, sizeof(buffer)), 0);
+	ck_assert_int_eq(strncmp(buffer, "AT+BRSF=", 8), 0);
+
+	/* immediate response, so the RTT is close to zero */
+	const char *resp_brsf = "\r\n+BRSF:0\r\n\r\nOK\r\n";
+	ck_assert_int_eq(write(rfcomm_fds[0], resp_brsf, strlen(resp_brsf)), strlen(resp_brsf));
+	test_rfcomm_read(rfcomm_fds[0], "AT+CIND=?\rAT+CIND?\rAT+CMER=3,0,0,1,0\r");
+
+	/* Drop responses for pipelined commands. The first command shall be
+	 * retransmitted after the timeout estimated from the measured RTT,
+	 * which is shorter than the initial one. */
+	elapsed = test_rfcomm_read(rfcomm_fds[0], "AT+CIND=?\r");
+	ck_assert_int_ge(elapsed, RFCOMM_SLC_TIMEOUT_MIN / 2);
+	ck_assert_int_lt(elapsed, RFCOMM_SLC_TIMEOUT);
+
+	/* after the timeout, commands shall be sent one at a time */
+	ck_assert_int_eq(poll(&pfd, 1, RFCOMM_SLC_TIMEOUT_MIN / 2), 0);
+	const char *resp_cind_test = "\r\n+CIND:(\"call\",(0,1)),(\"battchg\",(0-5))\r\n\r\nOK\r\n";
+	ck_assert_int_eq(write(rfcomm_fds[0], resp_cind_test, strlen(resp_cind_test)), strlen(resp_cind_test));
+	test_rfcomm_read(rfcomm_fds[0], "AT+CIND?\r");
+
+	ck_assert_int_eq(poll(&pfd, 1, RFCOMM_SLC_TIMEOUT_MIN / 2), 0);
+	const char *resp_cind_get = "\r\n+CIND:0,4\r\n\r\nOK\r\n";
+	ck_assert_int_eq(write(rfcomm_fds[0], resp_cind_get, strlen(resp_cind_get)), strlen(resp_cind_get));
+	test_rfcomm_read(rfcomm_fds[0], "AT+CMER=3,0,0,1,0\r");
+
+	const char *resp_ok = "\r\nOK\r\n";
+	ck_assert_int_eq(write(rfcomm_fds[0], resp_ok, strlen(resp_ok)), strlen(resp_ok));
+
+	/* connection established, nothing shall be retransmitted */
+	ck_assert_int_eq(poll(&pfd, 1, 2 * RFCOMM_SLC_TIMEOUT_MIN), 0);
+	ck_assert_int_eq(device1->battery_level, 80);
+	/* connection time includes the response timeout */
+	ck_assert_uint_gt(device1->hfp_slc_time, 0);
+
+	ck_assert_int_eq(ba_transport_send_signal(t, TRANSPORT_STOP), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	close(rfcomm_fds[0]);
+	ba_transport_unref(t);
+
+} END_TEST
+
 int main(int argc, char *argv[]) {
 
 	int opt;
@@ -542,8 +1086,24 @@ int main(int argc, char *argv[]) {
 	suite_add_tcase(s, tc);
 	tcase_set_timeout(tc, aging + 5);
 
+	/* Unless aging was requested, run IO threads with the virtual clock, so
+	 * the transfer will not be paced at the real-time rate. */
+	if (aging == 0)
+		rt_clock_set(&rt_clock_virtual);
+
+	tcase_add_test(tc, test_io_thread_coutq_estimate);
+	tcase_add_test(tc, test_io_pool);
+	tcase_add_test(tc, test_codec_lib);
+	tcase_add_test(tc, test_rfcomm_handlers);
+	tcase_add_test(tc, test_rfcomm_hfp_hf_slc);
+	tcase_add_test(tc, test_rfcomm_hfp_hf_slc_timeout);
+
 	if (enabled_codecs & TEST_CODEC_SBC)
 		tcase_add_test(tc, test_a2dp_sbc);
+#if ENABLE_LIBURING
+	if (enabled_codecs & TEST_CODEC_SBC)
+		tcase_add_test(tc, test_a2dp_sbc_io_uring);
+#endif
 #if ENABLE_MP3LAME
 	if (enabled_codecs & TEST_CODEC_MP3)
 		tcase_add_test(tc, test_a2dp_mp3);
@@ -563,16 +1123,26 @@ int main(int argc, char *argv[]) {
 	if (enabled_codecs & TEST_CODEC_LDAC)
 		tcase_add_test(tc, test_a2dp_ldac);
 #endif
-	if (enabled_codecs & TEST_CODEC_CVSD)
+	if (enabled_codecs & TEST_CODEC_CVSD) {
+		tcase_add_test(tc, test_sco_sched);
 		tcase_add_test(tc, test_sco_cvsd);
+		tcase_add_test(tc, test_sco_cvsd_timer);
+		tcase_add_test(tc, test_sco_cvsd_drain);
+	}
 #if ENABLE_MSBC
-	if (enabled_codecs & TEST_CODEC_MSBC)
+	if (enabled_codecs & TEST_CODEC_MSBC) {
+		tcase_add_test(tc, test_sco_sched_msbc);
 		tcase_add_test(tc, test_sco_msbc);
+	}
 #endif
 
 	if (aging > 0) {
 		if (enabled_codecs & TEST_CODEC_SBC)
 			tcase_add_test(tc, test_a2dp_aging_sbc);
+#if ENABLE_LIBURING
+		if (enabled_codecs & TEST_CODEC_SBC)
+			tcase_add_test(tc, test_a2dp_aging_sbc_io_uring);
+#endif
 #if ENABLE_MP3LAME
 		if (enabled_codecs & TEST_CODEC_MP3)
 			tcase_add_test(tc, test_a2dp_aging_mp3);
@@ -116,6 +116,64 @@ START_TEST(test_msbc_encode_decode) {
 
 } END_TEST
 
+START_TEST(test_msbc_decode_sync) {
+
+	struct esco_msbc msbc = { .init = false };
+	int16_t sine[MSBC_CODESAMPLES * 8];
+	size_t i;
+
+	ck_assert_int_eq(msbc_init(&msbc), 0);
+	snd_pcm_sine_s16le(sine, ARRAYSIZE(sine), 1, 0, 0.01);
+
+	uint8_t data[sizeof(esco_msbc_frame_t) * 8 + 3];
+	uint8_t *data_tail = data;
+
+	/* garbage before the first frame */
+	*data_tail++ = 0x01;
+	*data_tail++ = 0xAD;
+	*data_tail++ = 0x01;
+
+	for (i = 0; i < ARRAYSIZE(sine); i += MSBC_CODESAMPLES) {
+		memcpy(msbc.enc_pcm.tail, &sine[i], MSBC_CODESIZE);
+		ffb_seek(&msbc.enc_pcm, MSBC_CODESAMPLES);
+		msbc_encode(&msbc);
+		memcpy(data_tail, msbc.enc_data.data, ffb_blen_out(&msbc.enc_data));
+		data_tail += ffb_blen_out(&msbc.enc_data);
+		ffb_rewind(&msbc.enc_data);
+	}
+
+	ck_assert_int_eq(data_tail - data, sizeof(data));
+
+	/* corrupt H2 header of the 4th frame */
+	data[3 + sizeof(esco_msbc_frame_t) * 3] = 0xFF;
+
+	size_t samples = 0;
+	for (i = 0; i < sizeof(data); ) {
+
+		/* feed data in chunks of typical eSCO MTU */
+		size_t len = MIN(sizeof(data) - i, 24);
+		memcpy(msbc.dec_data.tail, &data[i], len);
+		ffb_seek(&msbc.dec_data, len);
+		i += len;
+
+		msbc_decode(&msbc);
+
+		samples += ffb_len_out(&msbc.dec_pcm);
+		ffb_rewind(&msbc.dec_pcm);
+
+	}
+
+	ck_assert_int_eq(msbc.dec_sync_losses, 1);
+	ck_assert_int_eq(samples, MSBC_CODESAMPLES * 7);
+
+	/* re-initialization shall not reset the sync losses counter */
+	ck_assert_int_eq(msbc_init(&msbc), 0);
+	ck_assert_int_eq(msbc.dec_sync_losses, 1);
+
+	msbc_finish(&msbc);
+
+} END_TEST
+
 int main(void) {
 
 	Suite *s = suite_create(__FILE__);
@@ -126,6 +184,7 @@ int main(void) {
 
 	tcase_add_test(tc, test_msbc_find_h2_header);
 	tcase_add_test(tc, test_msbc_encode_decode);
+	tcase_add_test(tc, test_msbc_decode_sync);
 
 	srunner_run_all(sr, CK_ENV);
 	int nf = srunner_ntests_failed(sr);
@@ -142,6 +142,26 @@ START_TEST(test_snd_pcm_scale_s16le) {
 
 } END_TEST
 
+START_TEST(test_snd_pcm_deinterleave_s16le_s32) {
+
+	int16_t in[11 * 2];
+	int32_t ch1[11];
+	int32_t ch2[11];
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(in); i++)
+		/* alternating sign, magnitude up to 21 * 1501 = 31521 */
+		in[i] = (i % 2 == 0 ? 1 : -1) * (int16_t)(1500 * i + i);
+
+	snd_pcm_deinterleave_s16le_s32(in, ARRAYSIZE(ch1), ch1, ch2);
+
+	for (i = 0; i < ARRAYSIZE(ch1); i++) {
+		ck_assert_int_eq(ch1[i], in[i * 2]);
+		ck_assert_int_eq(ch2[i], in[i * 2 + 1]);
+	}
+
+} END_TEST
+
 START_TEST(test_difftimespec) {
 
 	struct timespec ts1, ts2, ts;
@@ -202,6 +222,80 @@ START_TEST(test_difftimespec) {
 
 } END_TEST
 
+START_TEST(test_asrsync_virtual_clock) {
+
+	struct asrsync asrs;
+	struct timespec ts;
+
+	rt_clock_set(&rt_clock_virtual);
+	rt_clock_virtual_reset();
+
+	asrsync_init(&asrs, 1000);
+	ck_assert_int_eq(asrs.ts0.tv_sec, 0);
+	ck_assert_int_eq(asrs.ts0.tv_nsec, 0);
+
+	/* synchronization shall advance virtual clock */
+	ck_assert_int_eq(asrsync_sync(&asrs, 500), 1);
+	ck_assert_int_eq(asrs.ts_idle.tv_sec, 0);
+	ck_assert_int_eq(asrs.ts_idle.tv_nsec, 500000000);
+	ck_assert_int_eq(rt_clock_gettime(&ts), 0);
+	ck_assert_int_eq(ts.tv_sec, 0);
+	ck_assert_int_eq(ts.tv_nsec, 500000000);
+
+	/* simulate overdue caused by the busy time */
+	ts.tv_sec = 1;
+	ts.tv_nsec = 0;
+	rt_clock_virtual_advance(&ts);
+	ck_assert_int_eq(asrsync_sync(&asrs, 500), 0);
+	ck_assert_int_eq(asrs.ts_busy.tv_sec, 1);
+	ck_assert_int_eq(asrs.ts_busy.tv_nsec, 0);
+	ck_assert_int_eq(asrs.ts_idle.tv_sec, 0);
+	ck_assert_int_eq(asrs.ts_idle.tv_nsec, 500000000);
+	ck_assert_int_eq(rt_clock_gettime(&ts), 0);
+	ck_assert_int_eq(ts.tv_sec, 1);
+	ck_assert_int_eq(ts.tv_nsec, 500000000);
+
+	rt_clock_set(NULL);
+
+} END_TEST
+
+START_TEST(test_asrsync_update) {
+
+	struct asrsync asrs;
+	struct timespec ts;
+
+	rt_clock_set(&rt_clock_virtual);
+	rt_clock_virtual_reset();
+	ck_assert_ptr_eq(rt_clock_get(), &rt_clock_virtual);
+
+	asrsync_init(&asrs, 1000);
+
+	/* update shall not advance virtual clock */
+	ck_assert_int_eq(asrsync_update(&asrs, 500), 1);
+	ck_assert_int_eq(asrs.ts_idle.tv_sec, 0);
+	ck_assert_int_eq(asrs.ts_idle.tv_nsec, 500000000);
+	ck_assert_int_eq(rt_clock_gettime(&ts), 0);
+	ck_assert_int_eq(ts.tv_sec, 0);
+	ck_assert_int_eq(ts.tv_nsec, 0);
+
+	/* wait done by the caller */
+	rt_clock_virtual_advance(&asrs.ts_idle);
+	rt_clock_gettime(&asrs.ts);
+
+	ts.tv_sec = 1;
+	ts.tv_nsec = 0;
+	rt_clock_virtual_advance(&ts);
+	ck_assert_int_eq(asrsync_update(&asrs, 500), 0);
+	ck_assert_int_eq(asrs.ts_busy.tv_sec, 1);
+	ck_assert_int_eq(asrs.ts_busy.tv_nsec, 0);
+	ck_assert_int_eq(asrs.ts_idle.tv_sec, 0);
+	ck_assert_int_eq(asrs.ts_idle.tv_nsec, 500000000);
+
+	rt_clock_set(NULL);
+	ck_assert_ptr_eq(rt_clock_get(), &rt_clock_monotonic);
+
+} END_TEST
+
 START_TEST(test_fifo_buffer) {
 
 	ffb_uint8_t ffb_u8 = { 0 };
@@ -268,7 +362,10 @@ int main(void) {
 	tcase_add_test(tc, test_g_variant_sanitize_object_path);
 	tcase_add_test(tc, test_batostr_);
 	tcase_add_test(tc, test_snd_pcm_scale_s16le);
+	tcase_add_test(tc, test_snd_pcm_deinterleave_s16le_s32);
 	tcase_add_test(tc, test_difftimespec);
+	tcase_add_test(tc, test_asrsync_virtual_clock);
+	tcase_add_test(tc, test_asrsync_update);
 	tcase_add_test(tc, test_fifo_buffer);
 
 	srunner_run_all(sr, CK_ENV);
@@ -768,8 +768,29 @@ usage:
 		return EXIT_FAILURE;
 	}
 
-	if (!bluealsa_dbus_get_pcms(&dbus_ctx, &ba_pcms, &ba_pcms_count, &err))
-		warn("Couldn't get BlueALSA PCM list: %s", err.message);
+	if (ba_addr_any) {
+		if (!bluealsa_dbus_get_pcms(&dbus_ctx, &ba_pcms, &ba_pcms_count, &err))
+			warn("Couldn't get BlueALSA PCM list: %s", err.message);
+	}
+	else {
+		/* Look up PCMs of given devices directly, there is no need
+		 * to enumerate all PCMs available in the BlueALSA service. */
+		const unsigned int flags = BA_PCM_FLAG_SINK | (ba_profile_a2dp ?
+				BA_PCM_FLAG_PROFILE_A2DP : BA_PCM_FLAG_PROFILE_SCO);
+		if ((ba_pcms = calloc(ba_addrs_count, sizeof(*ba_pcms))) == NULL) {
+			error("Couldn't allocate PCM list: %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < ba_addrs_count; i++) {
+			if (!bluealsa_dbus_get_pcm(&dbus_ctx, &ba_addrs[i], flags,
+						&ba_pcms[ba_pcms_count], &err)) {
+				debug("Couldn't get BlueALSA PCM: %s", err.message);
+				dbus_error_free(&err);
+				continue;
+			}
+			ba_pcms_count++;
+		}
+	}
 
 	for (i = 0; i < ba_pcms_count; i++)
 		supervise_pcm_worker(&ba_pcms[i]);